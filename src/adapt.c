@@ -0,0 +1,261 @@
+#include "pixz.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+/* Adaptive worker scaling, so pixz gives way when the machine gets busy.
+ *
+ * A monitor thread samples pressure stall information for CPU, memory and
+ * I/O, and the load average, every ADAPT_INTERVAL_MS. Pressure is taken from
+ * the growth of each "some" total since the last sample, so it reflects now,
+ * not the last ten seconds. The load average counts as busy once it's more
+ * than one above the CPU count, and as having room while another worker
+ * would still fit.
+ *
+ * When the machine is busy for ADAPT_DOWN_SAMPLES in a row we park a quarter
+ * of the active workers, and when it has room for ADAPT_UP_SAMPLES in a row
+ * we unpark one; busy and room have separate thresholds, with a neutral band
+ * between. After any change we hold for ADAPT_HOLD_SAMPLES, since the load
+ * average lags. Workers park only between blocks, as they take the next,
+ * so the count never drops below the floor or rises above the ceiling set
+ * with -p MIN:MAX.
+ *
+ * Without /proc/pressure we go by the load average alone, and without that
+ * we never park anyone. PIXZ_PROC names another directory to read them
+ * from, for testing. */
+
+#define ADAPT_INTERVAL_MS 1000
+#define ADAPT_DOWN_SAMPLES 2
+#define ADAPT_UP_SAMPLES 5
+#define ADAPT_HOLD_SAMPLES 3
+
+// Percent of time some task stalled, to count as busy and as having room
+#define ADAPT_CPU_BUSY 25.0
+#define ADAPT_CPU_ROOM 10.0
+#define ADAPT_MEMORY_BUSY 10.0
+#define ADAPT_MEMORY_ROOM 2.0
+#define ADAPT_IO_BUSY 30.0
+#define ADAPT_IO_ROOM 10.0
+
+
+#pragma mark TYPES
+
+typedef enum {
+    PRESSURE_CPU,
+    PRESSURE_MEMORY,
+    PRESSURE_IO,
+    PRESSURE_COUNT
+} pressure_kind_t;
+
+typedef enum {
+    ADAPT_NEUTRAL,
+    ADAPT_BUSY,
+    ADAPT_ROOM
+} adapt_state_t;
+
+typedef struct {
+    bool have; // whether the kernel reports it
+    uint64_t total; // usecs stalled, at the last sample
+} pressure_t;
+
+
+#pragma mark GLOBALS
+
+bool gAdaptive = false;
+size_t gPipelineProcessMin = 0;
+
+
+#pragma mark DECLARATIONS
+
+static uint64_t adapt_now(void);
+static void *adapt_thread(void *data);
+static adapt_state_t adapt_sample(pipeline_t *pl, pressure_t *pressure,
+    uint64_t elapsed);
+static bool adapt_read_pressure(const char *kind, uint64_t *totalp);
+static bool adapt_read_load(double *loadp);
+static void adapt_change(pipeline_t *pl, size_t active);
+
+
+#pragma mark MONITOR
+
+void adapt_start(pipeline_t *pl) {
+    pl->active = pl->process_count;
+    pl->floor = gPipelineProcessMin ? gPipelineProcessMin : 1;
+    if (pl->floor > pl->process_count)
+        pl->floor = pl->process_count;
+    if (!gAdaptive || pl->floor == pl->process_count)
+        return; // nothing to adapt
+
+    if (pthread_create(&pl->adapt_thread, NULL, adapt_thread, pl))
+        die("Error starting adaptive scaling thread");
+    pl->adapt_started = true;
+}
+
+void adapt_stop(pipeline_t *pl) {
+    pthread_mutex_lock(&pl->park_mutex);
+    pl->stopping = true;
+    pthread_cond_broadcast(&pl->park_cond); // everyone back to work
+    pthread_mutex_unlock(&pl->park_mutex);
+    if (pl->adapt_started && pthread_join(pl->adapt_thread, NULL))
+        die("Error joining adaptive scaling thread");
+}
+
+void adapt_park(pipeline_t *pl, size_t thnum) {
+    if (!pl->adapt_started)
+        return;
+    pthread_mutex_lock(&pl->park_mutex);
+    if (thnum >= pl->active && !pl->stopping) {
+        uint64_t start = stats_now();
+        while (thnum >= pl->active && !pl->stopping)
+            pthread_cond_wait(&pl->park_cond, &pl->park_mutex);
+        trace_span("parked", start, -1);
+    }
+    pthread_mutex_unlock(&pl->park_mutex);
+}
+
+static void *adapt_thread(void *data) {
+    pipeline_t *pl = (pipeline_t*)data;
+    trace_thread("adapt");
+    pressure_t pressure[PRESSURE_COUNT] = { { 0 } };
+    uint64_t last = adapt_now();
+    adapt_sample(pl, pressure, 0); // to know where the totals start
+
+    size_t busy = 0, room = 0, hold = 0;
+    pthread_mutex_lock(&pl->park_mutex);
+    while (!pl->stopping) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t ns = ts.tv_nsec + ADAPT_INTERVAL_MS * 1000000ull;
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        if (pthread_cond_timedwait(&pl->park_cond, &pl->park_mutex, &ts)
+                != ETIMEDOUT)
+            continue; // we're stopping, or woke spuriously
+        pthread_mutex_unlock(&pl->park_mutex);
+
+        uint64_t now = adapt_now();
+        adapt_state_t state = adapt_sample(pl, pressure, now - last);
+        last = now;
+        busy = state == ADAPT_BUSY ? busy + 1 : 0;
+        room = state == ADAPT_ROOM ? room + 1 : 0;
+
+        pthread_mutex_lock(&pl->park_mutex);
+        size_t active = pl->active;
+        if (hold) {
+            --hold;
+        } else if (busy >= ADAPT_DOWN_SAMPLES && active > pl->floor) {
+            size_t step = active / 4 ? active / 4 : 1;
+            active = active - pl->floor > step ? active - step : pl->floor;
+        } else if (room >= ADAPT_UP_SAMPLES && active < pl->process_count) {
+            ++active;
+        }
+        if (active != pl->active) {
+            adapt_change(pl, active);
+            busy = room = 0;
+            hold = ADAPT_HOLD_SAMPLES;
+        }
+    }
+    pthread_mutex_unlock(&pl->park_mutex);
+    return NULL;
+}
+
+static uint64_t adapt_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// How the machine looks since the last sample, elapsed nsecs ago
+static adapt_state_t adapt_sample(pipeline_t *pl, pressure_t *pressure,
+        uint64_t elapsed) {
+    static const char *kinds[PRESSURE_COUNT] = { "cpu", "memory", "io" };
+    static const double busy_at[PRESSURE_COUNT] = { ADAPT_CPU_BUSY,
+        ADAPT_MEMORY_BUSY, ADAPT_IO_BUSY };
+    static const double room_at[PRESSURE_COUNT] = { ADAPT_CPU_ROOM,
+        ADAPT_MEMORY_ROOM, ADAPT_IO_ROOM };
+
+    bool busy = false, room = true, known = false;
+    for (size_t i = 0; i < PRESSURE_COUNT; ++i) {
+        uint64_t total;
+        bool have = adapt_read_pressure(kinds[i], &total);
+        if (have && pressure[i].have && elapsed && total >= pressure[i].total) {
+            double pct = (total - pressure[i].total) * 1e5 / elapsed;
+            busy |= pct >= busy_at[i];
+            room &= pct <= room_at[i];
+            known = true;
+        }
+        pressure[i].have = have;
+        if (have)
+            pressure[i].total = total;
+    }
+
+    double load;
+    if (adapt_read_load(&load)) {
+        pthread_mutex_lock(&pl->park_mutex);
+        double active = pl->active;
+        pthread_mutex_unlock(&pl->park_mutex);
+        double cpus = num_threads();
+        if (load < active) // we're running at least that many
+            load = active;
+        busy |= load > cpus + 1;
+        room &= load + 1 <= cpus + 0.5;
+        known = true;
+    }
+
+    if (!known)
+        return ADAPT_NEUTRAL;
+    return busy ? ADAPT_BUSY : room ? ADAPT_ROOM : ADAPT_NEUTRAL;
+}
+
+// Called with the park lock held
+static void adapt_change(pipeline_t *pl, size_t active) {
+    if (active < pl->active)
+        pl->parks += pl->active - active;
+    else
+        pl->unparks += active - pl->active;
+    trace_span(active < pl->active ? "park" : "unpark", stats_now(), -1);
+    pl->active = active;
+    pthread_cond_broadcast(&pl->park_cond);
+}
+
+
+#pragma mark PROC FILES
+
+static FILE *adapt_open(const char *name) {
+    const char *root = getenv("PIXZ_PROC");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", root ? root : "/proc", name);
+    return fopen(path, "r");
+}
+
+// The "some" line looks like: some avg10=0.00 avg60=0.00 avg300=0.00 total=N
+static bool adapt_read_pressure(const char *kind, uint64_t *totalp) {
+    char name[32];
+    snprintf(name, sizeof(name), "pressure/%s", kind);
+    FILE *f = adapt_open(name);
+    if (!f)
+        return false;
+    char line[256];
+    bool ok = false;
+    while (!ok && fgets(line, sizeof(line), f)) {
+        uintmax_t total;
+        char *p = strstr(line, "total=");
+        if (strncmp(line, "some ", 5) == 0 && p
+                && sscanf(p, "total=%ju", &total) == 1) {
+            *totalp = total;
+            ok = true;
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+static bool adapt_read_load(double *loadp) {
+    FILE *f = adapt_open("loadavg");
+    if (!f)
+        return false;
+    bool ok = fscanf(f, "%lf", loadp) == 1;
+    fclose(f);
+    return ok;
+}
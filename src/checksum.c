@@ -0,0 +1,433 @@
+#include "pixz.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define CHECKSUM_X86 1
+    #include <cpuid.h>
+    #include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__AARCH64EL__) \
+        && defined(__linux__)
+    #define CHECKSUM_ARM 1
+    #include <arm_acle.h>
+    #include <sys/auxv.h>
+    #ifndef HWCAP_CRC32
+        #define HWCAP_CRC32 (1 << 7)
+    #endif
+#endif
+
+/* Checksums pixz computes itself: CRC32 and CRC64 as xz defines them, and
+ * SHA-256. Each has a portable kernel, and kernels for instructions some
+ * CPUs have, chosen when first used:
+ *
+ *   CRC32    PCLMULQDQ on x86, the CRC32 instructions on ARMv8
+ *   CRC64    PCLMULQDQ on x86
+ *   SHA-256  the SHA extensions on x86
+ *
+ * The portable CRCs are liblzma's. The PCLMULQDQ kernels fold 64 bytes at a
+ * time into four 128-bit accumulators, then those into one, and leave the
+ * last 16 bytes and any tail to liblzma, which saves a Barrett reduction for
+ * a few dozen bytes of table lookups. The folding constants are powers of x
+ * modulo each polynomial, worked out when the kernels are chosen. */
+
+#define CRC32_POLY 0x04C11DB7ULL // the usual bit order, without x^32
+#define CRC64_POLY 0x42F0E1EBA9EA3693ULL // ECMA-182, without x^64
+#define CRC_FOLD_MIN 64 // anything shorter goes to liblzma
+
+
+#pragma mark TYPES
+
+typedef uint32_t (*crc32_kernel_t)(const uint8_t *buf, size_t size,
+    uint32_t crc);
+typedef uint64_t (*crc64_kernel_t)(const uint8_t *buf, size_t size,
+    uint64_t crc);
+typedef void (*sha256_kernel_t)(uint32_t state[8], const uint8_t *data,
+    size_t blocks);
+
+typedef struct {
+    uint64_t fold4[2], fold1[2]; // over 512 and 128 bits, low and high halves
+} crc_fold_t;
+
+
+#pragma mark GLOBALS
+
+static pthread_once_t gChecksumOnce = PTHREAD_ONCE_INIT;
+static bool gChecksumHardware = true;
+static crc32_kernel_t gCRC32Kernel;
+static crc64_kernel_t gCRC64Kernel;
+static sha256_kernel_t gSHA256Kernel;
+static const char *gKernelNames[3];
+
+static const uint32_t gSHA256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#if CHECKSUM_X86
+static crc_fold_t gCRC32Fold, gCRC64Fold;
+#endif
+
+
+#pragma mark DECLARATIONS
+
+static void checksum_choose(void);
+static uint32_t crc32_generic(const uint8_t *buf, size_t size, uint32_t crc);
+static uint64_t crc64_generic(const uint8_t *buf, size_t size, uint64_t crc);
+static void sha256_generic(uint32_t state[8], const uint8_t *data,
+    size_t blocks);
+
+#if CHECKSUM_X86
+static void crc_fold_init(crc_fold_t *fold, uint64_t poly, unsigned width);
+static uint32_t crc32_pclmul(const uint8_t *buf, size_t size, uint32_t crc);
+static uint64_t crc64_pclmul(const uint8_t *buf, size_t size, uint64_t crc);
+static void sha256_shani(uint32_t state[8], const uint8_t *data,
+    size_t blocks);
+#endif
+#if CHECKSUM_ARM
+static uint32_t crc32_armv8(const uint8_t *buf, size_t size, uint32_t crc);
+#endif
+
+
+#pragma mark DISPATCH
+
+void checksum_hardware(bool use) {
+    pthread_once(&gChecksumOnce, checksum_choose);
+    gChecksumHardware = use;
+    checksum_choose();
+}
+
+const char *checksum_kernel(checksum_kind_t kind) {
+    pthread_once(&gChecksumOnce, checksum_choose);
+    return gKernelNames[kind];
+}
+
+uint32_t checksum_crc32(const uint8_t *buf, size_t size, uint32_t crc) {
+    pthread_once(&gChecksumOnce, checksum_choose);
+    return gCRC32Kernel(buf, size, crc);
+}
+
+uint64_t checksum_crc64(const uint8_t *buf, size_t size, uint64_t crc) {
+    pthread_once(&gChecksumOnce, checksum_choose);
+    return gCRC64Kernel(buf, size, crc);
+}
+
+static void checksum_choose(void) {
+    gCRC32Kernel = crc32_generic;
+    gCRC64Kernel = crc64_generic;
+    gSHA256Kernel = sha256_generic;
+    gKernelNames[CHECKSUM_CRC32] = "generic";
+    gKernelNames[CHECKSUM_CRC64] = "generic";
+    gKernelNames[CHECKSUM_SHA256] = "generic";
+    if (!gChecksumHardware)
+        return;
+
+#if CHECKSUM_X86
+    unsigned a, b, c, d;
+    bool sse41 = false, pclmul = false, sha = false;
+    if (__get_cpuid(1, &a, &b, &c, &d)) {
+        sse41 = c & bit_SSE4_1;
+        pclmul = sse41 && (c & bit_PCLMUL) && (c & bit_SSSE3);
+    }
+    if (sse41 && __get_cpuid_count(7, 0, &a, &b, &c, &d))
+        sha = b & (1 << 29);
+    if (pclmul) {
+        crc_fold_init(&gCRC32Fold, CRC32_POLY, 32);
+        crc_fold_init(&gCRC64Fold, CRC64_POLY, 64);
+        gCRC32Kernel = crc32_pclmul;
+        gCRC64Kernel = crc64_pclmul;
+        gKernelNames[CHECKSUM_CRC32] = "pclmul";
+        gKernelNames[CHECKSUM_CRC64] = "pclmul";
+    }
+    if (sha) {
+        gSHA256Kernel = sha256_shani;
+        gKernelNames[CHECKSUM_SHA256] = "sha-ni";
+    }
+#elif CHECKSUM_ARM
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        gCRC32Kernel = crc32_armv8;
+        gKernelNames[CHECKSUM_CRC32] = "armv8-crc";
+    }
+#endif
+}
+
+
+#pragma mark PORTABLE
+
+static uint32_t crc32_generic(const uint8_t *buf, size_t size, uint32_t crc) {
+    return lzma_crc32(buf, size, crc);
+}
+
+static uint64_t crc64_generic(const uint8_t *buf, size_t size, uint64_t crc) {
+    return lzma_crc64(buf, size, crc);
+}
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_generic(uint32_t state[8], const uint8_t *data,
+        size_t blocks) {
+    for (; blocks; --blocks, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            const uint8_t *p = data + i * 4;
+            w[i] = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18)
+                ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19)
+                ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+            e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t s1 = ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + gSHA256K[i] + w[i];
+            uint32_t s0 = ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+
+#pragma mark SHA256
+
+void sha256_init(sha256_ctx *c) {
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    pthread_once(&gChecksumOnce, checksum_choose);
+    memcpy(c->state, init, sizeof(init));
+    c->length = 0;
+    c->buflen = 0;
+}
+
+void sha256_update(sha256_ctx *c, const uint8_t *data, size_t size) {
+    c->length += size;
+    if (c->buflen) {
+        size_t take = 64 - c->buflen;
+        if (take > size)
+            take = size;
+        memcpy(c->buf + c->buflen, data, take);
+        c->buflen += take;
+        data += take;
+        size -= take;
+        if (c->buflen < 64)
+            return;
+        gSHA256Kernel(c->state, c->buf, 1);
+        c->buflen = 0;
+    }
+    gSHA256Kernel(c->state, data, size / 64);
+    data += size & ~(size_t)63;
+    size &= 63;
+    memcpy(c->buf, data, size);
+    c->buflen = size;
+}
+
+void sha256_final(sha256_ctx *c, uint8_t out[32]) {
+    uint64_t bits = c->length * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t padlen = (c->buflen < 56) ? 56 - c->buflen : 120 - c->buflen;
+    for (int i = 0; i < 8; ++i)
+        pad[padlen + i] = (bits >> (8 * (7 - i))) & 0xFF;
+    sha256_update(c, pad, padlen + 8);
+
+    for (int i = 0; i < 8; ++i) {
+        out[i * 4] = c->state[i] >> 24;
+        out[i * 4 + 1] = (c->state[i] >> 16) & 0xFF;
+        out[i * 4 + 2] = (c->state[i] >> 8) & 0xFF;
+        out[i * 4 + 3] = c->state[i] & 0xFF;
+    }
+}
+
+
+#pragma mark X86
+
+#if CHECKSUM_X86
+
+// x^n modulo a polynomial of the given width, bit-reversed into 64 bits as
+// PCLMULQDQ wants for a reflected CRC
+static uint64_t crc_xpow(uint64_t poly, unsigned width, unsigned n) {
+    uint64_t top = 1ULL << (width - 1), r = 1;
+    for (unsigned i = 0; i < n; ++i) {
+        bool carry = r & top;
+        r <<= 1;
+        if (width < 64)
+            r &= (top << 1) - 1;
+        if (carry)
+            r ^= poly;
+    }
+    uint64_t rev = 0;
+    for (unsigned i = 0; i < 64; ++i)
+        rev |= ((r >> i) & 1) << (63 - i);
+    return rev;
+}
+
+// A 128-bit accumulator carried d bits further is its low half times
+// x^(d+63) plus its high half times x^(d-1), the extra x coming from the
+// product's bit order.
+static void crc_fold_init(crc_fold_t *fold, uint64_t poly, unsigned width) {
+    fold->fold4[0] = crc_xpow(poly, width, 512 + 63);
+    fold->fold4[1] = crc_xpow(poly, width, 512 - 1);
+    fold->fold1[0] = crc_xpow(poly, width, 128 + 63);
+    fold->fold1[1] = crc_xpow(poly, width, 128 - 1);
+}
+
+__attribute__((target("pclmul,sse4.1")))
+static inline __m128i crc_fold(__m128i acc, __m128i k, __m128i next) {
+    __m128i lo = _mm_clmulepi64_si128(acc, k, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(acc, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+}
+
+// Folds all but the last 16 to 31 bytes, and returns the accumulator. The
+// state, already inverted, goes into the first bytes.
+__attribute__((target("pclmul,sse4.1")))
+static __m128i crc_fold_buf(const crc_fold_t *fold, const uint8_t **bufp,
+        size_t *sizep, uint64_t state) {
+    const uint8_t *buf = *bufp;
+    size_t size = *sizep;
+    __m128i k4 = _mm_loadu_si128((const __m128i*)fold->fold4);
+    __m128i k1 = _mm_loadu_si128((const __m128i*)fold->fold1);
+
+    __m128i x0 = _mm_loadu_si128((const __m128i*)buf);
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(buf + 16));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(buf + 32));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(buf + 48));
+    x0 = _mm_xor_si128(x0, _mm_set_epi64x(0, state));
+    buf += 64;
+    size -= 64;
+
+    for (; size >= 64; buf += 64, size -= 64) {
+        x0 = crc_fold(x0, k4, _mm_loadu_si128((const __m128i*)buf));
+        x1 = crc_fold(x1, k4, _mm_loadu_si128((const __m128i*)(buf + 16)));
+        x2 = crc_fold(x2, k4, _mm_loadu_si128((const __m128i*)(buf + 32)));
+        x3 = crc_fold(x3, k4, _mm_loadu_si128((const __m128i*)(buf + 48)));
+    }
+    x1 = crc_fold(x0, k1, x1);
+    x2 = crc_fold(x1, k1, x2);
+    x3 = crc_fold(x2, k1, x3);
+    for (; size >= 16; buf += 16, size -= 16)
+        x3 = crc_fold(x3, k1, _mm_loadu_si128((const __m128i*)buf));
+
+    *bufp = buf;
+    *sizep = size;
+    return x3;
+}
+
+// The accumulator is the data so far, modulo the polynomial, so its CRC from
+// a zero state is the data's
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(const uint8_t *buf, size_t size, uint32_t crc) {
+    if (size < CRC_FOLD_MIN)
+        return lzma_crc32(buf, size, crc);
+    uint8_t acc[16];
+    _mm_storeu_si128((__m128i*)acc,
+        crc_fold_buf(&gCRC32Fold, &buf, &size, ~crc));
+    crc = lzma_crc32(acc, sizeof(acc), UINT32_MAX);
+    return lzma_crc32(buf, size, crc);
+}
+
+__attribute__((target("pclmul,sse4.1")))
+static uint64_t crc64_pclmul(const uint8_t *buf, size_t size, uint64_t crc) {
+    if (size < CRC_FOLD_MIN)
+        return lzma_crc64(buf, size, crc);
+    uint8_t acc[16];
+    _mm_storeu_si128((__m128i*)acc,
+        crc_fold_buf(&gCRC64Fold, &buf, &size, ~crc));
+    crc = lzma_crc64(acc, sizeof(acc), UINT64_MAX);
+    return lzma_crc64(buf, size, crc);
+}
+
+// Four rounds at a time, with the message schedule in four registers of
+// four words each
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_shani(uint32_t state[8], const uint8_t *data,
+        size_t blocks) {
+    const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+        0x0405060700010203ULL);
+    __m128i tmp = _mm_loadu_si128((const __m128i*)state);
+    __m128i cdgh = _mm_loadu_si128((const __m128i*)(state + 4));
+    tmp = _mm_shuffle_epi32(tmp, 0xB1); // CDAB
+    cdgh = _mm_shuffle_epi32(cdgh, 0x1B); // EFGH
+    __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+
+    for (; blocks; --blocks, data += 64) {
+        __m128i abef_save = abef, cdgh_save = cdgh, m[4];
+        for (int g = 0; g < 16; ++g) {
+            if (g < 4) {
+                m[g] = _mm_shuffle_epi8(_mm_loadu_si128(
+                    (const __m128i*)(data + g * 16)), swap);
+            } else {
+                __m128i w = _mm_sha256msg1_epu32(m[g % 4], m[(g + 1) % 4]);
+                w = _mm_add_epi32(w,
+                    _mm_alignr_epi8(m[(g + 3) % 4], m[(g + 2) % 4], 4));
+                m[g % 4] = _mm_sha256msg2_epu32(w, m[(g + 3) % 4]);
+            }
+            __m128i msg = _mm_add_epi32(m[g % 4],
+                _mm_loadu_si128((const __m128i*)(gSHA256K + g * 4)));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh,
+                _mm_shuffle_epi32(msg, 0x0E));
+        }
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(abef, 0x1B); // FEBA
+    cdgh = _mm_shuffle_epi32(cdgh, 0xB1); // DCHG
+    _mm_storeu_si128((__m128i*)state, _mm_blend_epi16(tmp, cdgh, 0xF0));
+    _mm_storeu_si128((__m128i*)(state + 4), _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+#endif
+
+
+#pragma mark ARM
+
+#if CHECKSUM_ARM
+
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(const uint8_t *buf, size_t size, uint32_t crc) {
+    crc = ~crc;
+    for (; size && ((uintptr_t)buf & 7); ++buf, --size)
+        crc = __crc32b(crc, *buf);
+    for (; size >= 8; buf += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, buf, sizeof(word));
+        crc = __crc32d(crc, word);
+    }
+    for (; size; ++buf, --size)
+        crc = __crc32b(crc, *buf);
+    return ~crc;
+}
+
+#endif
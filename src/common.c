@@ -2,12 +2,16 @@
 
 #include <errno.h>
 #include <stdarg.h>
+#include <fcntl.h>
 #include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 
 #pragma mark UTILS
 
-FILE *gInFile = NULL;
+FILE *gInFile = NULL, *gOutFile = NULL;
+io_t *gInIO = NULL;
 lzma_stream gStream = LZMA_STREAM_INIT;
 
 
@@ -31,6 +35,61 @@ char *xstrdup(const char *s) {
     return memcpy(r, s, len + 1); 
 }
 
+bool parse_size(const char *str, uint64_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(str, &end, 10);
+    if (errno || end == str || *str == '-')
+        return false;
+    
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; ++end; break;
+        case 'm': case 'M': shift = 20; ++end; break;
+        case 'g': case 'G': shift = 30; ++end; break;
+    }
+    if (*end || (n << shift) >> shift != n)
+        return false;
+    *size = n << shift;
+    return true;
+}
+
+void file_open_input(pixz_file_t *f) {
+    if (f->in)
+        return;
+    if (!f->ipath)
+        f->in = stdin;
+    else if (!(f->in = fopen(f->ipath, "r")))
+        die("can not open input file: %s: %s", f->ipath, strerror(errno));
+}
+
+void file_open_output(pixz_file_t *f) {
+    if (f->out)
+        return;
+    if (!f->opath) {
+        f->out = stdout;
+        return;
+    }
+    
+    // use the permissions of the original file, if we know it
+    mode_t mode = 0666;
+    struct stat input_stat;
+    if (f->ipath && stat(f->ipath, &input_stat) == 0)
+        mode = input_stat.st_mode;
+    
+    int output_fd = open(f->opath, O_CREAT | O_WRONLY | O_TRUNC, mode);
+    if (output_fd == -1 || !(f->out = fdopen(output_fd, "w")))
+        die("can not open output file: %s: %s", f->opath, strerror(errno));
+}
+
+void file_finish(pixz_file_t *f) {
+    if (f->out && fclose(f->out) != 0)
+        die("Error closing output file");
+    f->out = NULL;
+    if (f->remove)
+        unlink(f->ipath);
+}
+
 bool is_multi_header(const char *name) {
     size_t i = strlen(name);
     while (i != 0 && name[i - 1] != '/')
@@ -42,21 +101,46 @@ bool is_multi_header(const char *name) {
 
 #pragma mark INDEX
 
+// Footer, index and file index are usually in this much at the end
+#define INDEX_TAIL (256 * 1024)
+// Read big indices this much at a time
+#define INDEX_CHUNK (16 * 1024 * 1024)
+
 lzma_index *gIndex = NULL;
 file_index_t *gFileIndex = NULL, *gLastFile = NULL;
 
-static uint8_t *gFileIndexBuf = NULL;
-static size_t gFIBSize = CHUNKSIZE, gFIBPos = 0;
-static lzma_ret gFIBErr = LZMA_OK;
-static uint8_t gFIBInputBuf[CHUNKSIZE];
-static size_t gMoved = 0;
+typedef struct {
+    io_t *io;
+    off_t inpos, inend;
+    lzma_stream strm;
+    lzma_ret err;
+    
+    // The block decoder refers to this until it's done
+    lzma_block block;
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    
+    uint8_t *buf;
+    size_t size, pos, moved;
+    uint8_t *inbuf;
+} file_index_reader_t;
 
-static void *decode_file_index_start(off_t block_seek, lzma_check check);
-static lzma_vli find_file_index(void **bdatap);
+typedef struct {
+    lzma_stream strm;
+    uint8_t buf[CHUNKSIZE]; // names and offsets, waiting to be encoded
+    size_t pos;
+    file_index_out_t out;
+    void *ctx;
+} file_index_writer_t;
 
-static char *read_file_index_name(void);
-static void read_file_index_make_space(void);
-static void read_file_index_data(void);
+static const char *file_index_start(file_index_reader_t *r, off_t block_seek,
+    lzma_vli block_size, lzma_check check);
+static const char *file_index_name(file_index_reader_t *r, char **namep);
+static const char *file_index_make_space(file_index_reader_t *r);
+static const char *file_index_data(file_index_reader_t *r);
+static const char *file_index_bytes(file_index_writer_t *w,
+    const uint8_t *buf, size_t size);
+static const char *file_index_encode(file_index_writer_t *w,
+    lzma_action action);
 
 
 void dump_file_index(FILE *out, bool verbose) {
@@ -71,184 +155,275 @@ void dump_file_index(FILE *out, bool verbose) {
     }    
 }
 
-void free_file_index(void) {
-    for (file_index_t *f = gFileIndex; f != NULL; ) {
+void file_index_free(file_index_t *files) {
+    for (file_index_t *f = files; f != NULL; ) {
         file_index_t *next = f->next;
         free(f->name);
         free(f);
         f = next;
     }
-    gFileIndex = gLastFile = NULL;
 }
 
-typedef struct {
-    lzma_block block;
-    lzma_filter filters[LZMA_FILTERS_MAX + 1];
-} block_wrapper_t;
+void free_file_index(void) {
+    file_index_free(gFileIndex);
+    gFileIndex = gLastFile = NULL;
+}
 
-static void *decode_file_index_start(off_t block_seek, lzma_check check) {
-    if (fseeko(gInFile, block_seek, SEEK_SET) == -1)
-        die("Error seeking to block");
+static const char *file_index_start(file_index_reader_t *r, off_t block_seek,
+        lzma_vli block_size, lzma_check check) {
+    r->block = (lzma_block){ .check = check, .filters = r->filters,
+        .version = 0 };
     
-    // Some memory in which to keep the discovered filters safe
-    block_wrapper_t *bw = malloc(sizeof(block_wrapper_t));
-    bw->block = (lzma_block){ .check = check, .filters = bw->filters,
-	 	.version = 0 };
+    // One read for the whole header, we don't know its size yet
+    uint8_t hdrbuf[LZMA_BLOCK_HEADER_SIZE_MAX];
+    ssize_t rd = io_pread(r->io, hdrbuf, sizeof(hdrbuf), block_seek);
+    if (rd < 1 || hdrbuf[0] == 0)
+        return "Error reading block size";
+    r->block.header_size = lzma_block_header_size_decode(hdrbuf[0]);
+    if (rd < r->block.header_size)
+        return "Error reading block header";
+    if (lzma_block_header_decode(&r->block, NULL, hdrbuf) != LZMA_OK)
+        return "Error decoding file index block header";
     
-    int b = fgetc(gInFile);
-    if (b == EOF || b == 0)
-        die("Error reading block size");
-    bw->block.header_size = lzma_block_header_size_decode(b);
-    uint8_t hdrbuf[bw->block.header_size];
-    hdrbuf[0] = (uint8_t)b;
-    if (fread(hdrbuf + 1, bw->block.header_size - 1, 1, gInFile) != 1)
-        die("Error reading block header");
-    if (lzma_block_header_decode(&bw->block, NULL, hdrbuf) != LZMA_OK)
-        die("Error decoding file index block header");
+    lzma_ret err = lzma_block_decoder(&r->strm, &r->block);
+    for (lzma_filter *f = r->filters; f->id != LZMA_VLI_UNKNOWN; ++f)
+        free(f->options);
+    if (err != LZMA_OK)
+        return "Error initializing file index stream";
     
-    if (lzma_block_decoder(&gStream, &bw->block) != LZMA_OK)
-        die("Error initializing file index stream");
-    
-    return bw;
+    r->inpos = block_seek + r->block.header_size;
+    r->inend = block_seek + block_size;
+    if (!(r->inbuf = malloc(block_size < INDEX_CHUNK ? block_size
+            : INDEX_CHUNK)))
+        return "Error allocating file index buffer";
+    return NULL;
 }
 
-static lzma_vli find_file_index(void **bdatap) {
-    if (!gIndex)
-        decode_index();
-        
+const char *file_index_read(io_t *io, lzma_index *index,
+        file_index_t **filesp, lzma_vli *offsetp) {
+    *filesp = NULL;
+    *offsetp = 0;
+    if (lzma_index_uncompressed_size(index) == 0)
+        return NULL;
+    
     // find the last block
     lzma_index_iter iter;
-	lzma_index_iter_init(&iter, gIndex);
-    lzma_vli loc = lzma_index_uncompressed_size(gIndex) - 1;
+    lzma_index_iter_init(&iter, index);
+    lzma_vli loc = lzma_index_uncompressed_size(index) - 1;
     if (lzma_index_iter_locate(&iter, loc))
-        die("Can't locate file index block");
-	if (iter.stream.number != 1)
-		return 0; // Too many streams for one file index
-	
-    void *bdata = decode_file_index_start(iter.block.compressed_file_offset,
-		iter.stream.flags->check);
+        return "Can't locate file index block";
+    if (iter.stream.number != 1)
+        return NULL; // Too many streams for one file index
     
-    gFileIndexBuf = malloc(gFIBSize);
-    gStream.avail_out = gFIBSize;
-    gStream.avail_in = 0;
+    probe(file__index__start);
+    uint64_t start = stats_now();
+    file_index_reader_t r = { .io = io, .strm = LZMA_STREAM_INIT,
+        .err = LZMA_OK, .size = CHUNKSIZE };
+    file_index_t *first = NULL, *last = NULL;
+    size_t entries = 0;
+    const char *err = file_index_start(&r, iter.block.compressed_file_offset,
+        iter.block.total_size, iter.stream.flags->check);
+    if (!err && !(r.buf = malloc(r.size)))
+        err = "Error allocating file index buffer";
+    if (!err) {
+        r.strm.avail_out = r.size;
+        r.strm.avail_in = 0;
+        err = file_index_data(&r);
+    }
     
     // Check if this is really an index
-    read_file_index_data();
-    lzma_vli ret = iter.block.compressed_file_offset;
-    if (xle64dec(gFileIndexBuf + gFIBPos) != PIXZ_INDEX_MAGIC)
-        ret = 0;
-    gFIBPos += sizeof(uint64_t);
+    if (!err && r.size - r.strm.avail_out >= sizeof(uint64_t)
+            && xle64dec(r.buf) == PIXZ_INDEX_MAGIC) {
+        *offsetp = iter.block.compressed_file_offset;
+        r.pos = sizeof(uint64_t);
+        
+        char *name;
+        while (!(err = file_index_name(&r, &name)) && name) {
+            file_index_t *f = malloc(sizeof(file_index_t));
+            if (f)
+                f->name = strlen(name) ? xstrdup(name) : NULL;
+            if (!f || (strlen(name) && !f->name)) {
+                free(f);
+                err = "Error allocating file index entry";
+                break;
+            }
+            f->offset = xle64dec(r.buf + r.pos);
+            f->next = NULL;
+            r.pos += sizeof(uint64_t);
+            
+            if (last) {
+                last->next = f;
+            } else {
+                first = f;
+            }
+            last = f;
+            ++entries;
+        }
+    }
+    probe1(file__index__done, entries);
+    stats_coded(r.strm.total_in, r.strm.total_out, start);
+    free(r.buf);
+    free(r.inbuf);
+    lzma_end(&r.strm);
     
-    if (bdatap && ret) {
-        *bdatap = bdata;
-    } else {
-        // Just looking, don't keep things around
-        if (bdatap)
-            *bdatap = NULL;
-        free(bdata);
-        free(gFileIndexBuf);
-        gLastFile = gFileIndex = NULL;
-        lzma_end(&gStream);
+    if (err) {
+        file_index_free(first);
+        *offsetp = 0;
+        return err;
     }
-    return ret; 
-}  
+    *filesp = first;
+    return NULL;
+}
 
-lzma_vli read_file_index() {
-    void *bdata = NULL;
-	lzma_vli offset = find_file_index(&bdata);
-    if (!offset)
+lzma_vli read_file_index(void) {
+    if (!gIndex && !decode_index())
         return 0;
     
-    while (true) {
-        char *name = read_file_index_name();
-        if (!name)
-            break;
-        
-        file_index_t *f = malloc(sizeof(file_index_t));
-        f->name = strlen(name) ? xstrdup(name) : NULL;
-        f->offset = xle64dec(gFileIndexBuf + gFIBPos);
-        gFIBPos += sizeof(uint64_t);
-        
-        if (gLastFile) {
-            gLastFile->next = f;
-        } else {
-            gFileIndex = f;
-        }
-        gLastFile = f;
-    }
-    free(gFileIndexBuf);
-    lzma_end(&gStream);
-    free(bdata);
-    
+    lzma_vli offset;
+    const char *err = file_index_read(gInIO, gIndex, &gFileIndex, &offset);
+    if (err)
+        die("%s", err);
+    for (gLastFile = gFileIndex; gLastFile && gLastFile->next; )
+        gLastFile = gLastFile->next;
     return offset;
 }
 
-static char *read_file_index_name(void) {
+static const char *file_index_name(file_index_reader_t *r, char **namep) {
     while (true) {
         // find a nul that ends a name
-        uint8_t *eos, *haystack = gFileIndexBuf + gFIBPos;
-        ssize_t len = gFIBSize - gStream.avail_out - gFIBPos - sizeof(uint64_t);
+        uint8_t *eos, *haystack = r->buf + r->pos;
+        ssize_t len = r->size - r->strm.avail_out - r->pos - sizeof(uint64_t);
         if (len > 0 && (eos = memchr(haystack, '\0', len))) { // found it
-            gFIBPos += eos - haystack + 1;
-            return (char*)haystack;
-        } else if (gFIBErr == LZMA_STREAM_END) { // nothing left
+            r->pos += eos - haystack + 1;
+            *namep = (char*)haystack;
+            return NULL;
+        } else if (r->err == LZMA_STREAM_END) { // nothing left
+            *namep = NULL;
             return NULL;
         } else { // need more data
-            if (gStream.avail_out == 0)
-                read_file_index_make_space();
-            read_file_index_data();            
+            const char *err;
+            if (r->strm.avail_out == 0 && (err = file_index_make_space(r)))
+                return err;
+            if ((err = file_index_data(r)))
+                return err;
         }
     }
 }
 
-static void read_file_index_make_space(void) {
-    bool expand = (gFIBPos == 0);
-    if (gFIBPos != 0) { // clear more space
-        size_t move = gFIBSize - gStream.avail_out - gFIBPos;        
-        memmove(gFileIndexBuf, gFileIndexBuf + gFIBPos, move);
-        gMoved += move;
-        gStream.avail_out += gFIBPos;
-        gFIBPos = 0;
+static const char *file_index_make_space(file_index_reader_t *r) {
+    bool expand = (r->pos == 0);
+    if (r->pos != 0) { // clear more space
+        size_t move = r->size - r->strm.avail_out - r->pos;
+        memmove(r->buf, r->buf + r->pos, move);
+        r->moved += move;
+        r->strm.avail_out += r->pos;
+        r->pos = 0;
     }
     // Try to reduce number of moves by expanding proactively
-    if (expand || gMoved >= gFIBSize) { // malloc more space
-        gStream.avail_out += gFIBSize;
-        gFIBSize *= 2;
-
-        uint8_t *new_gFileIndexBuf = realloc(gFileIndexBuf, gFIBSize);
+    if (expand || r->moved >= r->size) { // malloc more space
+        uint8_t *buf = realloc(r->buf, r->size * 2);
+        if (!buf)
+            return "Error allocating file index buffer";
+        r->buf = buf;
+        r->strm.avail_out += r->size;
+        r->size *= 2;
+    }
+    return NULL;
+}
 
-        if (new_gFileIndexBuf == NULL) {
-          // TODO is recovery possible? does it even make sense?
-          // @see https://github.com/vasi/pixz/issues/8#issuecomment-134113347
-          die("memory re-allocation failure: %s", strerror(errno));
-        } else {
-          gFileIndexBuf = new_gFileIndexBuf;
+static const char *file_index_data(file_index_reader_t *r) {
+    r->strm.next_out = r->buf + r->size - r->strm.avail_out;
+    while (r->err != LZMA_STREAM_END && r->strm.avail_out) {
+        if (r->strm.avail_in == 0) {
+            // Few big reads, in case the input is slow
+            if (r->inpos >= r->inend)
+                return "Error reading file index data";
+            size_t size = r->inend - r->inpos;
+            if (size > INDEX_CHUNK)
+                size = INDEX_CHUNK;
+            ssize_t rd = io_pread(r->io, r->inbuf, size, r->inpos);
+            if (rd <= 0)
+                return "Error reading file index data";
+            r->inpos += rd;
+            r->strm.avail_in = rd;
+            r->strm.next_in = r->inbuf;
         }
+        
+        r->err = lzma_code(&r->strm, LZMA_RUN);
+        if (r->err != LZMA_OK && r->err != LZMA_STREAM_END)
+            return "Error decoding file index data";
     }
+    return NULL;
 }
 
-static void read_file_index_data(void) {
-    gStream.next_out = gFileIndexBuf + gFIBSize - gStream.avail_out;
-    while (gFIBErr != LZMA_STREAM_END && gStream.avail_out) {
-        if (gStream.avail_in == 0) {
-            // It's ok to read past the end of the block, we'll still
-            // get LZMA_STREAM_END at the right place
-            gStream.avail_in = fread(gFIBInputBuf, 1, CHUNKSIZE, gInFile);
-            if (ferror(gInFile))
-                die("Error reading file index data");
-            gStream.next_in = gFIBInputBuf;
-        }
+const char *file_index_write(file_index_t *files, lzma_block *block,
+        file_index_out_t out, void *ctx) {
+    file_index_writer_t w = { .strm = LZMA_STREAM_INIT, .out = out,
+        .ctx = ctx };
+    if (lzma_block_encoder(&w.strm, block) != LZMA_OK)
+        return "Error creating file index encoder";
+    
+    uint8_t offbuf[sizeof(uint64_t)];
+    xle64enc(offbuf, PIXZ_INDEX_MAGIC);
+    const char *err = file_index_bytes(&w, offbuf, sizeof(offbuf));
+    for (file_index_t *f = files; !err && f != NULL; f = f->next) {
+        char *name = f->name ? f->name : "";
+        size_t len = strlen(name);
+        if ((err = file_index_bytes(&w, (uint8_t*)name, len + 1)))
+            break;
+        xle64enc(offbuf, f->offset);
+        err = file_index_bytes(&w, offbuf, sizeof(offbuf));
+    }
+    if (!err)
+        err = file_index_encode(&w, LZMA_FINISH);
+    lzma_end(&w.strm);
+    return err;
+}
+
+static const char *file_index_bytes(file_index_writer_t *w,
+        const uint8_t *buf, size_t size) {
+    size_t bufpos = 0;
+    while (bufpos < size) {
+        size_t len = size - bufpos;
+        size_t space = CHUNKSIZE - w->pos;
+        if (len > space)
+            len = space;
+        memcpy(w->buf + w->pos, buf + bufpos, len);
+        w->pos += len;
+        bufpos += len;
         
-        gFIBErr = lzma_code(&gStream, LZMA_RUN);
-        if (gFIBErr != LZMA_OK && gFIBErr != LZMA_STREAM_END)
-            die("Error decoding file index data");
+        const char *err;
+        if (w->pos == CHUNKSIZE && (err = file_index_encode(w, LZMA_RUN)))
+            return err;
+    }
+    return NULL;
+}
+
+static const char *file_index_encode(file_index_writer_t *w,
+        lzma_action action) {
+    uint8_t obuf[CHUNKSIZE];
+    w->strm.avail_in = w->pos;
+    w->strm.next_in = w->buf;
+    lzma_ret err = LZMA_OK;
+    while (err != LZMA_STREAM_END
+            && (action == LZMA_FINISH || w->strm.avail_in)) {
+        w->strm.avail_out = CHUNKSIZE;
+        w->strm.next_out = obuf;
+        err = lzma_code(&w->strm, action);
+        if (err != LZMA_OK && err != LZMA_STREAM_END)
+            return "Error encoding file index";
+        if (w->strm.avail_out != CHUNKSIZE)
+            w->out(w->ctx, obuf, CHUNKSIZE - w->strm.avail_out);
     }
+    w->pos = 0;
+    return NULL;
 }
 
 
 #define BWCHUNK 512
 
 typedef struct {
+	io_t *io;
 	uint8_t buf[BWCHUNK];
 	off_t pos;
 	size_t size;
@@ -261,9 +436,7 @@ static uint32_t *bw_read(bw *b) {
 			return NULL; // EOF
 		b->size = (b->pos > BWCHUNK) ? BWCHUNK : b->pos;
 		b->pos -= b->size;
-		if (fseeko(gInFile, b->pos, SEEK_SET) == -1)
-			return NULL;
-		if (fread(b->buf, b->size, 1, gInFile) != 1)
+		if (io_pread(b->io, b->buf, b->size, b->pos) != (ssize_t)b->size)
 			return NULL;
 	}
 	
@@ -271,76 +444,145 @@ static uint32_t *bw_read(bw *b) {
 	return &((uint32_t*)b->buf)[b->size / sz];
 }
 
-static off_t stream_padding(bw *b, off_t pos) {
+static bool stream_padding(bw *b, off_t pos, off_t *padp) {
 	b->pos = pos;
 	b->size = 0;
 	
 	for (off_t pad = 0; true; pad += sizeof(uint32_t)) {
 		uint32_t *i = bw_read(b);
 		if (!i)
-			die("Error reading stream padding");
+			return false;
 		if (*i != 0) {
 			b->size += sizeof(uint32_t);
-			return pad;
+			*padp = pad;
+			return true;
 		}
 	}
 }
 
-static void stream_footer(bw *b, lzma_stream_flags *flags) {
+static const char *stream_footer(bw *b, lzma_stream_flags *flags) {
 	uint8_t ftr[LZMA_STREAM_HEADER_SIZE];
 	for (int i = sizeof(ftr) / sizeof(uint32_t) - 1; i >= 0; --i) {
 		uint32_t *p = bw_read(b);
 		if (!p)
-			die("Error reading stream footer");
+			return "Error reading stream footer";
 		*((uint32_t*)ftr + i) = *p;
 	}
 	
-    if (lzma_stream_footer_decode(flags, ftr) != LZMA_OK)
-        die("Error decoding stream footer");
+    switch (lzma_stream_footer_decode(flags, ftr)) {
+        case LZMA_OK: return NULL;
+        case LZMA_FORMAT_ERROR: return "Stream footer has the wrong magic bytes";
+        case LZMA_DATA_ERROR: return "Stream footer CRC32 is wrong";
+        case LZMA_OPTIONS_ERROR:
+            return "Stream footer has reserved or unsupported flags";
+        default: return "Error decoding stream footer";
+    }
 }
 
-static lzma_index *next_index(off_t *pos) {
-	bw b;
-	off_t pad = stream_padding(&b, *pos);
+static const char *next_index(io_t *io, off_t *pos, lzma_index **indexp) {
+	bw b = { .io = io };
+	off_t pad;
+	if (!stream_padding(&b, *pos, &pad))
+		return "Error reading stream padding";
 	off_t eos = *pos - pad;
 	
 	lzma_stream_flags flags;
-	stream_footer(&b, &flags);
-	*pos = eos - LZMA_STREAM_HEADER_SIZE - flags.backward_size;
-    if (fseeko(gInFile, *pos, SEEK_SET) == -1)
-        die("Error seeking to index");
+	const char *msg = stream_footer(&b, &flags);
+	if (msg)
+		return msg;
+	off_t ipos = eos - LZMA_STREAM_HEADER_SIZE - flags.backward_size;
+	if (ipos < 0)
+		return "Error seeking to index";
 	
 	lzma_stream strm = LZMA_STREAM_INIT;
 	lzma_index *index;
     if (lzma_index_decoder(&strm, &index, MEMLIMIT) != LZMA_OK)
-        die("Error creating index decoder");
+        return "Error creating index decoder";
     
-    uint8_t ibuf[CHUNKSIZE];
+    // We know exactly how big it is, so read it in as few requests as we can
+    size_t isize = flags.backward_size;
+    size_t bufsize = isize < INDEX_CHUNK ? isize : INDEX_CHUNK;
+    uint8_t *ibuf = malloc(bufsize);
+    if (!ibuf) {
+        lzma_end(&strm);
+        return "Error allocating index buffer";
+    }
     strm.avail_in = 0;
     lzma_ret err = LZMA_OK;
-    while (err != LZMA_STREAM_END) {
+    while (!msg && err != LZMA_STREAM_END) {
         if (strm.avail_in == 0) {
-            strm.avail_in = fread(ibuf, 1, CHUNKSIZE, gInFile);
-            if (ferror(gInFile))
-                die("Error reading index");
+            size_t size = isize < bufsize ? isize : bufsize;
+            ssize_t rd = size ? io_pread(io, ibuf, size, ipos) : 0;
+            if (rd <= 0) {
+                msg = size ? "Error reading index"
+                    : "Index is longer than the stream footer says";
+                break;
+            }
+            ipos += rd;
+            isize -= rd;
+            strm.avail_in = rd;
             strm.next_in = ibuf;
         }
         
         err = lzma_code(&strm, LZMA_RUN);
         if (err != LZMA_OK && err != LZMA_STREAM_END)
-            die("Error decoding index");
+            msg = "Error decoding index";
+    }
+    if (!msg && (isize || strm.avail_in))
+        msg = "Index is shorter than the stream footer says";
+    lzma_end(&strm);
+    free(ibuf);
+    if (msg) {
+        return msg;
     }
 	
 	*pos = eos - lzma_index_stream_size(index);
-	if (fseeko(gInFile, *pos, SEEK_SET) == -1)
-		die("Error seeking to beginning of stream");
+	if (*pos < 0)
+		msg = "Error seeking to beginning of stream";
+	else if (lzma_index_stream_flags(index, &flags) != LZMA_OK)
+		msg = "Error setting stream flags";
+	else if (lzma_index_stream_padding(index, pad) != LZMA_OK)
+		msg = "Error setting stream padding";
+	if (msg) {
+		lzma_index_end(index, NULL);
+		return msg;
+	}
+	*indexp = index;
+	return NULL;
+}
+
+const char *index_read(io_t *io, lzma_index **indexp) {
+	*indexp = NULL;
+	probe(index__start);
+	off_t pos = io_size(io);
+	if (pos == -1)
+		return "Can't seek in input";
+	
+	// Fetch the end in one go, it usually has everything we need
+	off_t tail = pos < INDEX_TAIL ? pos : INDEX_TAIL;
+	if (tail)
+		io_window(io, pos - tail, tail);
 	
+	lzma_index *all = NULL;
+	while (pos > 0) {
+		lzma_index *index;
+		const char *err = next_index(io, &pos, &index);
+		if (!err && all && lzma_index_cat(index, all, NULL) != LZMA_OK) {
+			lzma_index_end(index, NULL);
+			err = "Error concatenating indices";
+		}
+		if (err) {
+			if (all)
+				lzma_index_end(all, NULL);
+			return err;
+		}
+		all = index;
+	}
 	
-	if (lzma_index_stream_flags(index, &flags) != LZMA_OK)
-		die("Error setting stream flags");
-	if (lzma_index_stream_padding(index, pad) != LZMA_OK)
-		die("Error setting stream padding");
-	return index;
+	probe2(index__done, all ? lzma_index_block_count(all) : 0,
+		all ? lzma_index_stream_count(all) : 0);
+	*indexp = all;
+	return NULL;
 }
 
 bool decode_index(void) {
@@ -348,49 +590,87 @@ bool decode_index(void) {
 		fprintf(stderr, "can not seek in input: %s\n", strerror(errno));
 		return false; // not seekable
 	}
-
-	off_t pos = ftello(gInFile);
-
-	gIndex = NULL;
-	while (pos > 0) {
-		lzma_index *index = next_index(&pos);
-		if (gIndex && lzma_index_cat(index, gIndex, NULL) != LZMA_OK)
-			die("Error concatenating indices");
-		gIndex = index;
-	}
-
+	
+	io_free(gInIO);
+	if (!(gInIO = io_open(fileno(gInFile))))
+		die("Out of memory");
+	const char *err = index_read(gInIO, &gIndex);
+	if (err)
+		die("%s", err);
+	if (fseeko(gInFile, 0, SEEK_SET) == -1)
+		die("Error seeking to beginning of stream");
 	return (gIndex != NULL);
 }
 
 
 #pragma mark QUEUE
 
+static uint64_t queue_wait_locked(queue_t *q, uint64_t *endp);
+static void queue_wait_trace(queue_t *q, uint64_t start, uint64_t end);
+static int queue_pop_locked(queue_t *q, void **datap);
+static int queue_pop_newest_locked(queue_t *q, void **datap);
+
 queue_t *queue_new(queue_free_t freer) {
+    return queue_new_ctx(freer, NULL);
+}
+
+queue_t *queue_new_ctx(queue_free_t freer, void *ctx) {
     queue_t *q = malloc(sizeof(queue_t));
-    q->first = q->last = NULL;
-    q->freer = freer;
+    if (!q)
+        return NULL;
+    *q = (queue_t){ .freer = freer, .ctx = ctx };
     pthread_mutex_init(&q->mutex, NULL);
     pthread_cond_init(&q->pop_cond, NULL);
+    pthread_cond_init(&q->claim_cond, NULL);
     return q;
 }
 
 void queue_free(queue_t *q) {
+    if (!q)
+        return;
     for (queue_item_t *i = q->first; i; ) {
         queue_item_t *tmp = i->next;
         if (q->freer)
-            q->freer(i->type, i->data);
+            q->freer(q->ctx, i->type, i->data);
+        free(i);
+        i = tmp;
+    }
+    for (queue_item_t *i = q->spare; i; ) {
+        queue_item_t *tmp = i->next;
         free(i);
         i = tmp;
     }
     pthread_mutex_destroy(&q->mutex);
     pthread_cond_destroy(&q->pop_cond);
+    pthread_cond_destroy(&q->claim_cond);
     free(q);
 }
 
-void queue_push(queue_t *q, int type, void *data) {
+bool queue_reserve(queue_t *q, size_t count) {
+    pthread_mutex_lock(&q->mutex);
+    bool ok = true;
+    for (; q->spares + q->depth < count; ++q->spares) {
+        queue_item_t *i = malloc(sizeof(queue_item_t));
+        if (!(ok = i))
+            break;
+        i->next = q->spare;
+        q->spare = i;
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return ok;
+}
+
+bool queue_push(queue_t *q, int type, void *data) {
     pthread_mutex_lock(&q->mutex);
     
-    queue_item_t *i = malloc(sizeof(queue_item_t));
+    queue_item_t *i = q->spare;
+    if (i) {
+        q->spare = i->next;
+        --q->spares;
+    } else if (!(i = malloc(sizeof(queue_item_t)))) {
+        pthread_mutex_unlock(&q->mutex);
+        return false;
+    }
     i->type = type;
     i->data = data;
     i->next = NULL;
@@ -401,166 +681,349 @@ void queue_push(queue_t *q, int type, void *data) {
         q->first = i;
     }
     q->last = i;
+    ++q->pushes;
+    if (++q->depth > q->max_depth)
+        q->max_depth = q->depth;
     
     pthread_cond_signal(&q->pop_cond);
+    pthread_cond_broadcast(&q->claim_cond);
     pthread_mutex_unlock(&q->mutex);
+    return true;
 }
 
 int queue_pop(queue_t *q, void **datap) {
+    uint64_t end;
+    pthread_mutex_lock(&q->mutex);
+    uint64_t start = queue_wait_locked(q, &end);
+    int type = queue_pop_locked(q, datap);
+    pthread_mutex_unlock(&q->mutex);
+    queue_wait_trace(q, start, end);
+    return type;
+}
+
+int queue_pop_newest(queue_t *q, void **datap) {
+    uint64_t end;
     pthread_mutex_lock(&q->mutex);
+    uint64_t start = queue_wait_locked(q, &end);
+    int type = queue_pop_newest_locked(q, datap);
+    pthread_mutex_unlock(&q->mutex);
+    queue_wait_trace(q, start, end);
+    return type;
+}
+
+bool queue_trypop(queue_t *q, int *typep, void **datap) {
+    pthread_mutex_lock(&q->mutex);
+    bool ok = (q->first != NULL);
+    if (ok)
+        *typep = queue_pop_locked(q, datap);
+    pthread_mutex_unlock(&q->mutex);
+    return ok;
+}
+
+bool queue_trypop_newest(queue_t *q, int *typep, void **datap) {
+    pthread_mutex_lock(&q->mutex);
+    bool ok = (q->first != NULL);
+    if (ok)
+        *typep = queue_pop_newest_locked(q, datap);
+    pthread_mutex_unlock(&q->mutex);
+    return ok;
+}
+
+int queue_claim(queue_t *q) {
+    pthread_mutex_lock(&q->mutex);
+    while (q->depth <= q->claims)
+        pthread_cond_wait(&q->claim_cond, &q->mutex);
+    ++q->claims;
+    int type = q->first->type;
+    pthread_mutex_unlock(&q->mutex);
+    return type;
+}
+
+void queue_unclaim(queue_t *q) {
+    pthread_mutex_lock(&q->mutex);
+    --q->claims;
+    pthread_cond_broadcast(&q->claim_cond); // one more is free to claim
+    pthread_mutex_unlock(&q->mutex);
+}
+
+// Returns when we started waiting, or zero if we didn't or aren't timing
+static uint64_t queue_wait_locked(queue_t *q, uint64_t *endp) {
+    if (q->first)
+        return 0;
+    uint64_t start = stats_now();
     while (!q->first)
         pthread_cond_wait(&q->pop_cond, &q->mutex);
-    
+    ++q->waits;
+    if (start) {
+        *endp = stats_now();
+        q->wait_ns += *endp - start;
+    }
+    return start;
+}
+
+// Tracing can allocate, so it waits until the queue is unlocked
+static void queue_wait_trace(queue_t *q, uint64_t start, uint64_t end) {
+    if (start && q->wait_span)
+        trace_span_at(q->wait_span, start, end, -1);
+}
+
+static int queue_pop_locked(queue_t *q, void **datap) {
     queue_item_t *i = q->first;
     q->first = i->next;
     if (!q->first)
         q->last = NULL;
+    --q->depth;
     
     *datap = i->data;
     int type = i->type;
-    free(i);
+    i->next = q->spare; // for the next push
+    q->spare = i;
+    ++q->spares;
+    return type;
+}
+
+// The newest of the oldest's type, so a stop pushed after items waits for
+// them all to go
+static int queue_pop_newest_locked(queue_t *q, void **datap) {
+    queue_item_t *i = q->first, *before = NULL;
+    for (queue_item_t *p = i; p->next; p = p->next) { // queues are short
+        if (p->next->type == q->first->type) {
+            before = p;
+            i = p->next;
+        }
+    }
+    if (before)
+        before->next = i->next;
+    else
+        q->first = i->next;
+    if (q->last == i)
+        q->last = before;
+    --q->depth;
     
-    pthread_mutex_unlock(&q->mutex);
+    *datap = i->data;
+    int type = i->type;
+    i->next = q->spare; // for the next push
+    q->spare = i;
+    ++q->spares;
     return type;
 }
 
 
 #pragma mark PIPELINE
 
-queue_t *gPipelineStartQ = NULL,
-    *gPipelineSplitQ = NULL,
-    *gPipelineMergeQ = NULL;
-
 size_t gPipelineProcessMax = 0;
 size_t gPipelineQSize = 0;
 
-pipeline_data_free_t gPLFreer = NULL;
-pipeline_split_t gPLSplit = NULL;
-pipeline_process_t gPLProcess = NULL;
-
-size_t gPLProcessCount = 0;
-pthread_t *gPLProcessThreads = NULL;
-pthread_t gPLSplitThread;
-
-ssize_t gPLSplitSeq = 0;
-ssize_t gPLMergeSeq = 0;
-pipeline_item_t *gPLMergedItems = NULL;
-
-static void pipeline_qfree(int type, void *p);
-static void *pipeline_thread_split(void *);
+static void pipeline_qfree(void *ctx, int type, void *p);
+static void *pipeline_thread_split(void *arg);
 static void *pipeline_thread_process(void *arg);
+static pipeline_item_t *pipeline_merged_next(pipeline_t *pl, bool wait);
 
-void pipeline_create(
+pipeline_t *pipeline_create(
         pipeline_data_create_t create,
         pipeline_data_free_t destroy,
-        pipeline_split_t split,
-        pipeline_process_t process) {
-    gPLFreer = destroy;
-    gPLSplit = split;
-    gPLProcess = process;
-    
-    gPipelineStartQ = queue_new(pipeline_qfree);
-    gPipelineSplitQ = queue_new(pipeline_qfree);
-    gPipelineMergeQ = queue_new(pipeline_qfree);
+        void *ctx, size_t threads, size_t qsize) {
+    pipeline_t *pl = malloc(sizeof(pipeline_t));
+    if (!pl)
+        return NULL;
+    *pl = (pipeline_t){ .ctx = ctx, .freer = destroy };
+    pthread_mutex_init(&pl->park_mutex, NULL);
+    pthread_cond_init(&pl->park_cond, NULL);
     
-    gPLSplitSeq = 0;
-    gPLMergeSeq = 0;
-    gPLMergedItems = NULL;
+    pl->startq = queue_new_ctx(pipeline_qfree, pl);
+    pl->splitq = queue_new_ctx(pipeline_qfree, pl);
+    pl->mergeq = queue_new_ctx(pipeline_qfree, pl);
+    if (!pl->startq || !pl->splitq || !pl->mergeq)
+        goto error;
+    pl->startq->wait_span = "block wait"; // for a free block
+    pl->splitq->wait_span = "queue wait";
+    // The merge queue is traced by pipeline_merged, which knows more
     
-    gPLProcessCount = num_threads();
-	if (gPipelineProcessMax > 0 && gPipelineProcessMax < gPLProcessCount)
-		gPLProcessCount = gPipelineProcessMax;
+    pl->process_count = num_threads();
+	if (threads > 0 && threads < pl->process_count)
+		pl->process_count = threads;
+	// Fast cores get the first workers, and slow cores any more
+	size_t fast = cpu_fast_count();
+	if (fast && pl->process_count > fast)
+		pl->slow_count = pl->process_count - fast;
 	
-    gPLProcessThreads = malloc(gPLProcessCount * sizeof(pthread_t));
-    int qsize = gPipelineQSize ? gPipelineQSize
-        : ceil(gPLProcessCount * 1.3 + 1);
-    if (qsize < gPLProcessCount) {
-        fprintf(stderr, "Warning: queue size is less than thread count, "
-            "performance will suffer!\n");
-    }
-    for (size_t i = 0; i < qsize; ++i) {
+    pl->process_threads = calloc(pl->process_count, sizeof(pipeline_thread_t));
+    if (!pl->process_threads)
+        goto error;
+    // Slow workers hold their items for longer, so they need extra
+    pl->qsize = qsize ? qsize
+        : ceil(pl->process_count * 1.3 + 1) + pl->slow_count;
+    for (size_t i = 0; i < pl->qsize; ++i) {
         // create blocks, including a margin of error
         pipeline_item_t *item = malloc(sizeof(pipeline_item_t));
-        item->data = create();
+        if (!item || !(item->data = create(ctx))) {
+            free(item);
+            goto error;
+        }
         // seq and next are garbage
-        queue_push(gPipelineStartQ, PIPELINE_ITEM, item);
+        if (!queue_push(pl->startq, PIPELINE_ITEM, item)) {
+            pipeline_qfree(pl, PIPELINE_ITEM, item);
+            goto error;
+        }
     }
-    for (size_t i = 0; i < gPLProcessCount; ++i) {
-        if (pthread_create(&gPLProcessThreads[i], NULL,
-                &pipeline_thread_process, (void*)(uintptr_t)i))
-            die("Error creating encode thread");
+    // Every item, and each worker's stop, fits without another allocation
+    if (!queue_reserve(pl->startq, pl->qsize)
+            || !queue_reserve(pl->splitq, pl->qsize + pl->process_count)
+            || !queue_reserve(pl->mergeq, pl->qsize + 1))
+        goto error;
+    return pl;
+
+error: // nothing's started, so it all comes apart
+    pipeline_destroy(pl);
+    return NULL;
+}
+
+bool pipeline_start(pipeline_t *pl, pipeline_split_t split,
+        pipeline_process_t process) {
+    pl->split = split;
+    pl->process = process;
+    if (pl->hooks && pl->hooks->start)
+        pl->hooks->start(pl);
+    size_t count = pl->process_count;
+    pl->process_count = 0;
+    for (size_t i = 0; i < count; ++i) {
+        pipeline_thread_t *th = &pl->process_threads[i];
+        th->pl = pl;
+        th->num = i;
+        th->slow = i >= count - pl->slow_count;
+        if (pthread_create(&th->thread, NULL, &pipeline_thread_process, th))
+            return false;
+        ++pl->process_count;
+    }
+    if (split) {
+        if (pthread_create(&pl->split_thread, NULL, &pipeline_thread_split, pl))
+            return false;
+        pl->split_started = true;
     }
-    if (pthread_create(&gPLSplitThread, NULL, &pipeline_thread_split, NULL))
-        die("Error creating read thread");
+    return true;
 }
 
-static void pipeline_qfree(int type, void *p) {
+static void pipeline_qfree(void *ctx, int type, void *p) {
+    pipeline_t *pl = (pipeline_t*)ctx;
     switch (type) {
         case PIPELINE_ITEM: {
             pipeline_item_t *item = (pipeline_item_t*)p;
-            gPLFreer(item->data);
+            pl->freer(item->data);
             free(item);
             break;
         }
         case PIPELINE_STOP:
             break;
-        default:
-            die("Unknown msg type %d", type);
     }
 }
 
-static void *pipeline_thread_split(void *ignore) {
-    gPLSplit();
+static void *pipeline_thread_split(void *arg) {
+    pipeline_t *pl = (pipeline_t*)arg;
+    if (pl->hooks && pl->hooks->thread_start)
+        pl->hooks->thread_start(pl, NULL);
+    pl->split(pl);
     return NULL;
 }
 
 static void *pipeline_thread_process(void *arg) {
-    size_t thnum = (uintptr_t)arg;
-    gPLProcess(thnum);
+    pipeline_thread_t *th = (pipeline_thread_t*)arg;
+    pipeline_t *pl = th->pl;
+    if (pl->slow_count)
+        cpu_bind(th->slow);
+    if (pl->hooks && pl->hooks->thread_start)
+        pl->hooks->thread_start(pl, th);
+    pl->process(pl, th->num);
+    if (pl->hooks && pl->hooks->thread_stop)
+        pl->hooks->thread_stop(pl, th);
     return NULL;
 }
 
-void pipeline_stop(void) {
+bool pipeline_stop(pipeline_t *pl) {
+    if (pl->hooks && pl->hooks->stop)
+        pl->hooks->stop(pl);
     // ask the other threads to stop
-    for (size_t i = 0; i < gPLProcessCount; ++i)
-        queue_push(gPipelineSplitQ, PIPELINE_STOP, NULL);
-    for (size_t i = 0; i < gPLProcessCount; ++i) {
-        if (pthread_join(gPLProcessThreads[i], NULL))
-            die("Error joining processing thread");
-    }
-    queue_push(gPipelineMergeQ, PIPELINE_STOP, NULL);
+    for (size_t i = 0; i < pl->process_count; ++i)
+        queue_push(pl->splitq, PIPELINE_STOP, NULL);
+    bool ok = true;
+    for (size_t i = 0; i < pl->process_count; ++i)
+        ok &= pthread_join(pl->process_threads[i].thread, NULL) == 0;
+    queue_push(pl->mergeq, PIPELINE_STOP, NULL);
+    return ok;
 }
 
-void pipeline_destroy(void) {
-    if (pthread_join(gPLSplitThread, NULL))
-        die("Error joining splitter thread");
+bool pipeline_destroy(pipeline_t *pl) {
+    bool ok = !pl->split_started || pthread_join(pl->split_thread, NULL) == 0;
     
-    queue_free(gPipelineStartQ);
-    queue_free(gPipelineSplitQ);
-    queue_free(gPipelineMergeQ);
-    free(gPLProcessThreads);
+    while (pl->merged_items) {
+        pipeline_item_t *item = pl->merged_items;
+        pl->merged_items = item->next;
+        pipeline_qfree(pl, PIPELINE_ITEM, item);
+    }
+    queue_free(pl->startq);
+    queue_free(pl->splitq);
+    queue_free(pl->mergeq);
+    free(pl->process_threads);
+    pthread_mutex_destroy(&pl->park_mutex);
+    pthread_cond_destroy(&pl->park_cond);
+    free(pl);
+    return ok;
 }
 
-void pipeline_dispatch(pipeline_item_t *item, queue_t *q) {
-    item->seq = gPLSplitSeq++;
+void pipeline_dispatch(pipeline_t *pl, pipeline_item_t *item, queue_t *q) {
+    item->seq = pl->split_seq++;
     item->next = NULL;
+    probe2(block__dispatch, item->seq, q == pl->mergeq);
     queue_push(q, PIPELINE_ITEM, item);
 }
 
-void pipeline_split(pipeline_item_t *item) {
-	pipeline_dispatch(item, gPipelineSplitQ);
+void pipeline_split(pipeline_t *pl, pipeline_item_t *item) {
+	pipeline_dispatch(pl, item, pl->splitq);
 }
 
-pipeline_item_t *pipeline_merged() {
+pipeline_item_t *pipeline_take(pipeline_t *pl, size_t thnum) {
+    pipeline_thread_t *th = &pl->process_threads[thnum];
     pipeline_item_t *item;
-    while (!gPLMergedItems || gPLMergedItems->seq != gPLMergeSeq) {
+    int tag = pl->hooks && pl->hooks->take
+        ? pl->hooks->take(pl, th, &item)
+        : pipeline_pop(pl, th, &item);
+    return tag == PIPELINE_STOP ? NULL : item;
+}
+
+int pipeline_pop(pipeline_t *pl, pipeline_thread_t *th,
+        pipeline_item_t **itemp) {
+    // Slow workers take the newest item, so the writer waits on it last
+    return th->slow ? queue_pop_newest(pl->splitq, (void**)itemp)
+        : queue_pop(pl->splitq, (void**)itemp);
+}
+
+pipeline_item_t *pipeline_merged(pipeline_t *pl) {
+    return pipeline_merged_next(pl, true);
+}
+
+pipeline_item_t *pipeline_merged_ready(pipeline_t *pl) {
+    return pipeline_merged_next(pl, false);
+}
+
+static pipeline_item_t *pipeline_merged_next(pipeline_t *pl, bool wait) {
+    pipeline_item_t *item;
+    while (!pl->merged_items || pl->merged_items->seq != pl->merge_seq) {
         // We don't have the next item, wait for a new one
-        pipeline_tag_t tag = queue_pop(gPipelineMergeQ, (void**)&item);
+        pipeline_tag_t tag;
+        if (wait) {
+            // If we have later items, the next one is holding us up
+            uint64_t start = stats_now();
+            probe2(merge__wait, pl->merge_seq, pl->merged_items != NULL);
+            tag = queue_pop(pl->mergeq, (void**)&item);
+            if (pl->hooks && pl->hooks->merge_wait)
+                pl->hooks->merge_wait(pl, start);
+        } else if (!queue_trypop(pl->mergeq, (int*)&tag, (void**)&item)) {
+            return NULL; // Not yet
+        }
         if (tag == PIPELINE_STOP)
             return NULL; // Done processing items
         
         // Insert the item into the queue
-        pipeline_item_t **prev = &gPLMergedItems;
+        pipeline_item_t **prev = &pl->merged_items;
         while (*prev && (*prev)->seq < item->seq) {
             prev = &(*prev)->next;
         }
@@ -569,8 +1032,9 @@ pipeline_item_t *pipeline_merged() {
     }
     
     // Got the next item
-    item = gPLMergedItems;
-    gPLMergedItems = item->next;
-    ++gPLMergeSeq;
+    item = pl->merged_items;
+    pl->merged_items = item->next;
+    probe1(merge, item->seq);
+    ++pl->merge_seq;
     return item;
 }
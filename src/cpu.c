@@ -1,5 +1,123 @@
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#if HAVE_PTHREAD_SETAFFINITY_NP && HAVE_SCHED_GETAFFINITY
+    #define _GNU_SOURCE 1 // for CPU sets
+    #define CPU_AFFINITY 1
+    #include <sched.h>
+#endif
+
+#include "pixz.h"
+
 #include <unistd.h>
 
+/* Hybrid CPUs have fast and slow cores. A block on a slow core can hold up
+ * the writer while the fast cores finish the blocks after it, so we keep
+ * workers to one class of core or the other, and slow workers take the
+ * newest blocks, furthest from the writer.
+ *
+ * Each core's speed is its cpu_capacity in sysfs, or failing that its
+ * highest frequency. Cores within CPU_FAST_SHARE of the fastest are fast,
+ * so small differences between the cores of one class don't count. If any
+ * core's speed is unknown, or they're all fast, every core is treated
+ * alike. PIXZ_SYS names another directory to read them from, for testing. */
+
+#define CPU_FAST_SHARE 0.9
+
+
+#pragma mark GLOBALS
+
+static pthread_once_t gCpuOnce = PTHREAD_ONCE_INIT;
+static size_t gCpuFast = 0, gCpuSlow = 0; // zero if all alike
+#if CPU_AFFINITY
+static cpu_set_t gCpuSets[2]; // fast, then slow
+#endif
+
+
+#pragma mark DECLARATIONS
+
+static void cpu_detect(void);
+#if CPU_AFFINITY
+static bool cpu_speed(int cpu, unsigned long *speedp);
+#endif
+
+
+#pragma mark CPUS
+
 size_t num_threads(void) {
     return sysconf(_SC_NPROCESSORS_ONLN);
 }
+
+size_t cpu_fast_count(void) {
+    pthread_once(&gCpuOnce, cpu_detect);
+    return gCpuFast;
+}
+
+size_t cpu_slow_count(void) {
+    pthread_once(&gCpuOnce, cpu_detect);
+    return gCpuSlow;
+}
+
+void cpu_bind(bool slow) {
+    pthread_once(&gCpuOnce, cpu_detect);
+#if CPU_AFFINITY
+    if (gCpuSlow) // the scheduler knows best, if it can't be kept elsewhere
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+            &gCpuSets[slow]);
+#else
+    (void)slow;
+#endif
+}
+
+static void cpu_detect(void) {
+#if CPU_AFFINITY
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return;
+
+    unsigned long speeds[CPU_SETSIZE], fastest = 0;
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+        if (!CPU_ISSET(i, &allowed))
+            continue;
+        if (!cpu_speed(i, &speeds[i]))
+            return; // can't tell
+        if (speeds[i] > fastest)
+            fastest = speeds[i];
+    }
+
+    CPU_ZERO(&gCpuSets[0]);
+    CPU_ZERO(&gCpuSets[1]);
+    size_t fast = 0, slow = 0;
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+        if (!CPU_ISSET(i, &allowed))
+            continue;
+        bool is_slow = speeds[i] < fastest * CPU_FAST_SHARE;
+        CPU_SET(i, &gCpuSets[is_slow]);
+        ++*(is_slow ? &slow : &fast);
+    }
+    if (slow) {
+        gCpuFast = fast;
+        gCpuSlow = slow;
+    }
+#endif
+}
+
+#if CPU_AFFINITY
+static bool cpu_speed(int cpu, unsigned long *speedp) {
+    static const char *files[] = { "cpu_capacity", "cpufreq/cpuinfo_max_freq" };
+    const char *root = getenv("PIXZ_SYS");
+    for (size_t i = 0; i < sizeof(files) / sizeof(*files); ++i) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/devices/system/cpu/cpu%d/%s",
+            root ? root : "/sys", cpu, files[i]);
+        FILE *f = fopen(path, "r");
+        if (!f)
+            continue;
+        bool ok = fscanf(f, "%lu", speedp) == 1 && *speedp;
+        fclose(f);
+        if (ok)
+            return true;
+    }
+    return false;
+}
+#endif
@@ -0,0 +1,468 @@
+#include "pixz.h"
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <search.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Make a tarball from paths on disk, instead of having tar make one.
+ *
+ * One thread walks the paths in order, splitting each file into chunks. A
+ * pool of threads reads the chunks, and builds each member's entry from its
+ * metadata. The caller's thread takes the chunks in order, writing headers
+ * and data through libarchive, so the caller sees exactly where each member
+ * starts.
+ *
+ * At most CREATE_SLOTS chunks are in flight, so memory stays bounded. */
+
+#define CREATE_THREADS 8
+#define CREATE_CHUNK (1024 * 1024)
+#define CREATE_SLOTS 64
+
+
+#pragma mark TYPES
+
+typedef enum {
+    CREATE_JOB,
+    CREATE_STOP
+} create_msg_t;
+
+// Something on disk
+typedef struct {
+    char *path, *name; // on disk, and in the tarball
+    struct stat st;
+    bool link; // a hard link we've already seen, so no data
+    struct archive_entry *entry;
+
+    size_t chunks;
+    bool shrank; // warned that it changed as we read it
+
+    pthread_mutex_t mutex;
+    int fd; // opened by whichever chunk needs it first
+    size_t unread; // chunks
+} create_path_t;
+
+typedef struct {
+    create_path_t *path; // NULL at the end
+    size_t index; // of the chunk in its file
+    off_t offset;
+    size_t size;
+    uint8_t *data;
+    bool shrank; // the file was shorter than expected
+    bool ready;
+} create_chunk_t;
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+} dev_ino_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t ready, space;
+    create_chunk_t *slots[CREATE_SLOTS];
+    size_t walked, written; // chunks
+
+    size_t npaths;
+    char **paths;
+    void *seen; // tsearch tree of hard-linked files
+
+    queue_t *jobs;
+    pthread_t walker;
+    pthread_t threads[CREATE_THREADS];
+    size_t thread_count;
+
+    void (*member)(const char *name);
+    void (*write)(const void *buf, size_t size);
+} create_t;
+
+
+#pragma mark DECLARATIONS
+
+static void *create_walk(void *data);
+static void walk_path(create_t *c, char *path);
+static void walk_dir(create_t *c, const char *path);
+static bool walk_link(create_t *c, const struct stat *st);
+static void walk_chunk(create_t *c, create_chunk_t *chunk);
+static char *member_name(const char *path, bool dir);
+static int dev_ino_cmp(const void *a, const void *b);
+static int name_cmp(const struct dirent **a, const struct dirent **b);
+
+static void *create_thread(void *data);
+static void read_chunk(create_t *c, struct archive *disk,
+    create_chunk_t *chunk);
+static int path_open(create_path_t *p);
+static void path_release(create_path_t *p);
+static void path_free(create_path_t *p);
+
+static void write_chunk(create_t *c, struct archive *ar,
+    struct archive_entry_linkresolver *links, create_chunk_t *chunk);
+static la_ssize_t create_write(struct archive *ar, void *ref,
+    const void *buf, size_t size);
+
+
+#pragma mark CREATE
+
+void create_tar(size_t npaths, char **paths, void (*member)(const char *name),
+        void (*write)(const void *buf, size_t size)) {
+    create_t c = { .npaths = npaths, .paths = paths, .member = member,
+        .write = write };
+    pthread_mutex_init(&c.mutex, NULL);
+    pthread_cond_init(&c.ready, NULL);
+    pthread_cond_init(&c.space, NULL);
+    // Only so many chunks are in flight, and then each thread's stop
+    if (!(c.jobs = queue_new(NULL))
+            || !queue_reserve(c.jobs, CREATE_SLOTS + CREATE_THREADS))
+        die("Out of memory");
+    for ( ; c.thread_count < CREATE_THREADS; ++c.thread_count) {
+        if (pthread_create(&c.threads[c.thread_count], NULL, create_thread,
+                &c))
+            die("Error creating read thread");
+    }
+    if (pthread_create(&c.walker, NULL, create_walk, &c))
+        die("Error creating walk thread");
+
+    struct archive *ar = archive_write_new();
+    struct archive_entry_linkresolver *links
+        = archive_entry_linkresolver_new();
+    if (!ar || !links)
+        die("Out of memory");
+    archive_write_set_format_pax_restricted(ar);
+    archive_entry_linkresolver_set_strategy(links, archive_format(ar));
+    // Unblocked, so data reaches us as soon as libarchive has it
+    archive_write_set_bytes_per_block(ar, 0);
+    if (archive_write_open(ar, &c, NULL, create_write, NULL) != ARCHIVE_OK)
+        die("Error starting tarball: %s", archive_error_string(ar));
+
+    while (true) {
+        pthread_mutex_lock(&c.mutex);
+        create_chunk_t *chunk;
+        while (!(chunk = c.slots[c.written % CREATE_SLOTS]) || !chunk->ready)
+            pthread_cond_wait(&c.ready, &c.mutex);
+        pthread_mutex_unlock(&c.mutex);
+
+        if (chunk->path)
+            write_chunk(&c, ar, links, chunk);
+
+        pthread_mutex_lock(&c.mutex);
+        c.slots[c.written++ % CREATE_SLOTS] = NULL;
+        pthread_cond_signal(&c.space);
+        pthread_mutex_unlock(&c.mutex);
+        if (!chunk->path) {
+            free(chunk);
+            break;
+        }
+        free(chunk->data);
+        free(chunk);
+    }
+
+    if (archive_write_close(ar) != ARCHIVE_OK)
+        die("Error finishing tarball: %s", archive_error_string(ar));
+    archive_write_free(ar);
+    archive_entry_linkresolver_free(links);
+
+    pthread_join(c.walker, NULL);
+    for (size_t i = 0; i < c.thread_count; ++i)
+        queue_push(c.jobs, CREATE_STOP, NULL);
+    for (size_t i = 0; i < c.thread_count; ++i)
+        pthread_join(c.threads[i], NULL);
+    queue_free(c.jobs);
+    while (c.seen) {
+        void *key = *(void**)c.seen;
+        tdelete(key, &c.seen, dev_ino_cmp);
+        free(key);
+    }
+    pthread_cond_destroy(&c.space);
+    pthread_cond_destroy(&c.ready);
+    pthread_mutex_destroy(&c.mutex);
+}
+
+
+#pragma mark WALK
+
+static void *create_walk(void *data) {
+    create_t *c = (create_t*)data;
+    for (size_t i = 0; i < c->npaths; ++i)
+        walk_path(c, xstrdup(c->paths[i]));
+
+    create_chunk_t *end = calloc(1, sizeof(create_chunk_t));
+    if (!end)
+        die("Out of memory");
+    end->ready = true;
+    walk_chunk(c, end);
+    return NULL;
+}
+
+// Add path and everything under it, like tar would. Takes ownership of path.
+static void walk_path(create_t *c, char *path) {
+    create_path_t *p = calloc(1, sizeof(create_path_t));
+    if (!p)
+        die("Out of memory");
+    p->path = path;
+    p->fd = -1;
+    if (lstat(path, &p->st) == -1)
+        die("Can't stat %s: %s", path, strerror(errno));
+    p->name = member_name(path, S_ISDIR(p->st.st_mode));
+    if (S_ISSOCK(p->st.st_mode)) { // tar can't hold these
+        fprintf(stderr, "%s: socket ignored\n", path);
+        free(p->name);
+        free(p->path);
+        free(p);
+        return;
+    }
+    pthread_mutex_init(&p->mutex, NULL);
+
+    // The first chunk always exists, it gets the entry
+    size_t size = 0;
+    if (S_ISREG(p->st.st_mode)) {
+        p->link = walk_link(c, &p->st);
+        if (!p->link)
+            size = p->st.st_size;
+    }
+    p->chunks = p->unread = size ? (size + CREATE_CHUNK - 1) / CREATE_CHUNK
+        : 1;
+    // The writer frees p once it has every chunk, keep what we need
+    char *dir = S_ISDIR(p->st.st_mode) ? xstrdup(path) : NULL;
+    for (size_t i = 0, n = p->chunks; i < n; ++i) {
+        create_chunk_t *chunk = calloc(1, sizeof(create_chunk_t));
+        if (!chunk)
+            die("Out of memory");
+        chunk->path = p;
+        chunk->index = i;
+        chunk->offset = (off_t)i * CREATE_CHUNK;
+        chunk->size = size - chunk->offset < CREATE_CHUNK
+            ? size - chunk->offset : CREATE_CHUNK;
+        walk_chunk(c, chunk);
+    }
+
+    if (dir) {
+        walk_dir(c, dir);
+        free(dir);
+    }
+}
+
+static void walk_dir(create_t *c, const char *path) {
+    struct dirent **ents;
+    int count = scandir(path, &ents, NULL, name_cmp);
+    if (count == -1)
+        die("Can't read directory %s: %s", path, strerror(errno));
+
+    size_t len = strlen(path);
+    bool slash = len && path[len - 1] == '/';
+    for (int i = 0; i < count; ++i) {
+        const char *name = ents[i]->d_name;
+        if (strcmp(name, ".") && strcmp(name, "..")) {
+            char *child = malloc(len + strlen(name) + 2);
+            if (!child)
+                die("Out of memory");
+            sprintf(child, slash ? "%s%s" : "%s/%s", path, name);
+            walk_path(c, child);
+        }
+        free(ents[i]);
+    }
+    free(ents);
+}
+
+// Is this a hard link to a file we already have?
+static bool walk_link(create_t *c, const struct stat *st) {
+    if (st->st_nlink < 2)
+        return false;
+    dev_ino_t *key = malloc(sizeof(dev_ino_t));
+    if (!key)
+        die("Out of memory");
+    *key = (dev_ino_t){ .dev = st->st_dev, .ino = st->st_ino };
+    void **found = tsearch(key, &c->seen, dev_ino_cmp);
+    if (!found)
+        die("Out of memory");
+    if (*found == key)
+        return false;
+    free(key);
+    return true;
+}
+
+// Hand a chunk to the readers, and to the writer in order
+static void walk_chunk(create_t *c, create_chunk_t *chunk) {
+    bool ready = chunk->ready; // nothing to read
+    pthread_mutex_lock(&c->mutex);
+    while (c->walked - c->written >= CREATE_SLOTS)
+        pthread_cond_wait(&c->space, &c->mutex);
+    c->slots[c->walked++ % CREATE_SLOTS] = chunk;
+    if (ready)
+        pthread_cond_signal(&c->ready);
+    pthread_mutex_unlock(&c->mutex);
+    if (!ready)
+        queue_push(c->jobs, CREATE_JOB, chunk);
+}
+
+// Like tar, don't let members escape the directory they're extracted in.
+// Directories end in a slash, as libarchive writes them.
+static char *member_name(const char *path, bool dir) {
+    while (true) {
+        if (*path == '/')
+            ++path;
+        else if (strncmp(path, "../", 3) == 0)
+            path += 3;
+        else
+            break;
+    }
+    if (!*path)
+        path = ".";
+
+    size_t len = strlen(path);
+    bool slash = dir && path[len - 1] != '/';
+    char *name = malloc(len + slash + 1);
+    if (!name)
+        die("Out of memory");
+    memcpy(name, path, len);
+    strcpy(name + len, slash ? "/" : "");
+    return name;
+}
+
+static int dev_ino_cmp(const void *a, const void *b) {
+    const dev_ino_t *da = (const dev_ino_t*)a, *db = (const dev_ino_t*)b;
+    if (da->dev != db->dev)
+        return da->dev < db->dev ? -1 : 1;
+    return da->ino < db->ino ? -1 : da->ino > db->ino;
+}
+
+static int name_cmp(const struct dirent **a, const struct dirent **b) {
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+
+#pragma mark READ
+
+static void *create_thread(void *data) {
+    create_t *c = (create_t*)data;
+    struct archive *disk = archive_read_disk_new();
+    if (!disk)
+        die("Out of memory");
+    archive_read_disk_set_standard_lookup(disk);
+
+    create_chunk_t *chunk;
+    while (queue_pop(c->jobs, (void**)&chunk) == CREATE_JOB)
+        read_chunk(c, disk, chunk);
+    archive_read_free(disk);
+    return NULL;
+}
+
+static void read_chunk(create_t *c, struct archive *disk,
+        create_chunk_t *chunk) {
+    create_path_t *p = chunk->path;
+    int fd = -1;
+    if (chunk->size || (chunk->index == 0 && S_ISREG(p->st.st_mode)
+            && !p->link))
+        fd = path_open(p);
+
+    if (chunk->size) {
+        if (!(chunk->data = malloc(chunk->size)))
+            die("Out of memory");
+        size_t pos = 0;
+        while (pos < chunk->size) {
+            ssize_t rd = pread(fd, chunk->data + pos, chunk->size - pos,
+                chunk->offset + pos);
+            if (rd == -1 && errno == EINTR)
+                continue;
+            if (rd == -1)
+                die("Error reading %s: %s", p->path, strerror(errno));
+            if (rd == 0)
+                break;
+            pos += rd;
+        }
+        if (pos < chunk->size) { // keep the size we promised in the header
+            memset(chunk->data + pos, 0, chunk->size - pos);
+            chunk->shrank = true;
+        }
+    }
+
+    if (chunk->index == 0) {
+        struct archive_entry *entry = archive_entry_new();
+        if (!entry)
+            die("Out of memory");
+        archive_entry_copy_pathname(entry, p->name);
+        archive_entry_copy_sourcepath(entry, p->path);
+        if (archive_read_disk_entry_from_file(disk, entry, fd, &p->st)
+                < ARCHIVE_WARN)
+            die("Error reading %s: %s", p->path, archive_error_string(disk));
+        p->entry = entry;
+    }
+    path_release(p);
+
+    pthread_mutex_lock(&c->mutex);
+    chunk->ready = true;
+    pthread_cond_signal(&c->ready);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+static int path_open(create_path_t *p) {
+    pthread_mutex_lock(&p->mutex);
+    if (p->fd == -1 && (p->fd = open(p->path, O_RDONLY)) == -1)
+        die("Can't open %s: %s", p->path, strerror(errno));
+    int fd = p->fd;
+    pthread_mutex_unlock(&p->mutex);
+    return fd;
+}
+
+// A chunk is read, close the file after the last one
+static void path_release(create_path_t *p) {
+    pthread_mutex_lock(&p->mutex);
+    bool done = --p->unread == 0;
+    pthread_mutex_unlock(&p->mutex);
+    if (done && p->fd != -1) {
+        close(p->fd);
+        p->fd = -1;
+    }
+}
+
+
+#pragma mark WRITE
+
+static void write_chunk(create_t *c, struct archive *ar,
+        struct archive_entry_linkresolver *links, create_chunk_t *chunk) {
+    create_path_t *p = chunk->path;
+    if (chunk->index == 0) {
+        // The last member's padding goes before this one
+        if (archive_write_finish_entry(ar) != ARCHIVE_OK)
+            die("Error writing tarball: %s", archive_error_string(ar));
+
+        struct archive_entry *entry = p->entry, *spare;
+        archive_entry_linkify(links, &entry, &spare);
+        c->member(p->name);
+        int err = archive_write_header(ar, entry);
+        if (err == ARCHIVE_WARN)
+            fprintf(stderr, "%s: %s\n", p->path, archive_error_string(ar));
+        else if (err != ARCHIVE_OK)
+            die("Error writing header for %s: %s", p->path,
+                archive_error_string(ar));
+        archive_entry_free(entry);
+        archive_entry_free(spare);
+    }
+
+    if (chunk->shrank && !p->shrank) {
+        fprintf(stderr, "%s: file shrank, padding with zeros\n", p->path);
+        p->shrank = true;
+    }
+    if (chunk->size && archive_write_data(ar, chunk->data, chunk->size)
+            != (la_ssize_t)chunk->size)
+        die("Error writing tarball: %s", archive_error_string(ar));
+    if (chunk->index == p->chunks - 1)
+        path_free(p);
+}
+
+static void path_free(create_path_t *p) {
+    pthread_mutex_destroy(&p->mutex);
+    free(p->path);
+    free(p->name);
+    free(p);
+}
+
+static la_ssize_t create_write(struct archive *ar, void *ref,
+        const void *buf, size_t size) {
+    create_t *c = (create_t*)ref;
+    c->write(buf, size);
+    return size;
+}
@@ -0,0 +1,900 @@
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#ifdef __linux__
+    #define _GNU_SOURCE 1 // for struct ucred
+#endif
+
+#include "pixz.h"
+#include "libpixz.h"
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/* A daemon keeps archives open, with their indexes parsed and a shared
+ * cache of decoded blocks. Clients connect to its Unix socket and pass their
+ * input and output descriptors, followed by a request: NUL-terminated
+ * strings, the first naming the operation. The daemon writes the result
+ * straight to the client's output, then replies "ok", "local" if the
+ * client should do the work itself, or "error: " and a message.
+ *
+ * Since clients hand over their files, both ends insist the other is the
+ * same user, and the socket must be in a directory only we can use. Without
+ * $XDG_RUNTIME_DIR that's a private directory under /tmp, never /tmp itself,
+ * where anyone could have put a socket first. */
+
+#define DAEMON_ARCHIVES 64
+#define DAEMON_REQUEST_MAX (16 * 1024 * 1024)
+#define DAEMON_REPLY_MAX 4096
+#define SERVE_CHUNK (1024 * 1024)
+
+
+#pragma mark TYPES
+
+typedef enum {
+    DAEMON_CONN,
+    DAEMON_STOP
+} daemon_msg_t;
+
+typedef struct daemon_archive_t daemon_archive_t;
+struct daemon_archive_t {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+
+    int fd;
+    pixz_reader *reader;
+    size_t refs;
+    bool opening; // reader is being opened, without the lock
+    daemon_archive_t *next; // most recently used first
+};
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t opened; // an archive is done opening, or failed to
+    daemon_archive_t *archives;
+    size_t count;
+    pixz_cache *cache;
+    queue_t *connq;
+    bool verbose; // log each request
+} daemon_t;
+
+typedef enum {
+    SERVE_OK,
+    SERVE_ERROR,
+    SERVE_LOCAL
+} serve_status_t;
+
+typedef struct {
+    serve_status_t status;
+    char msg[DAEMON_REPLY_MAX];
+} serve_result_t;
+
+// Members being extracted, read through libarchive to check them against
+// the index as pixz_read does. Each chunk is written once libarchive asks
+// for the next, so nothing goes out past a member that doesn't match.
+typedef struct {
+    pixz_reader *r;
+    int out;
+    const bool *wanted; // for each entry, NULL for the whole archive
+    size_t count, next; // entries, and the first not yet read
+    uint64_t pos, end; // the run of members being read
+    uint8_t *buf;
+    size_t pending; // in buf, and not yet written
+    serve_result_t *res;
+} serve_tar_t;
+
+
+#pragma mark FUNCTION DECLARATIONS
+
+static serve_status_t serve(pixz_reader *r, int out, size_t nargs,
+    char **args, serve_result_t *res);
+static serve_status_t serve_error(serve_result_t *res, const char *fmt, ...);
+static serve_status_t serve_copy(pixz_reader *r, int out, uint64_t start,
+    uint64_t end, serve_result_t *res);
+static serve_status_t serve_list(pixz_reader *r, int out,
+    serve_result_t *res);
+static serve_status_t serve_extract(pixz_reader *r, int out, size_t nspecs,
+    char **specs, serve_result_t *res);
+static serve_status_t serve_verified(pixz_reader *r, int out,
+    const bool *wanted, serve_result_t *res);
+static ssize_t serve_tar_read(struct archive *ar, void *ref,
+    const void **bufp);
+static bool serve_tar_flush(serve_tar_t *t);
+static int serve_tar_ok(struct archive *ar, void *ref);
+static serve_status_t serve_range(pixz_reader *r, int out, size_t nargs,
+    char **args, serve_result_t *res);
+static serve_status_t serve_member(pixz_reader *r, int out, const char *path,
+    serve_result_t *res);
+static bool write_all(int fd, const void *buf, size_t size);
+
+static bool socket_address(const char *path, struct sockaddr_un *addr);
+static bool socket_dir_private(const char *path);
+static bool socket_peer_ours(int sock);
+static void *daemon_thread(void *data);
+static void daemon_connection(daemon_t *d, int conn);
+static size_t daemon_receive(int conn, int *fds, char **bufp);
+static daemon_archive_t *daemon_archive(daemon_t *d, int fd);
+static void daemon_release(daemon_t *d, daemon_archive_t *a);
+static void daemon_signal(int sig);
+
+
+#pragma mark SERVE
+
+// Runs a request against a reader. On error, res describes it.
+static serve_status_t serve(pixz_reader *r, int out, size_t nargs,
+        char **args, serve_result_t *res) {
+    const char *op = args[0];
+    if (strcmp(op, "list") == 0)
+        return serve_list(r, out, res);
+    if (strcmp(op, "extract") == 0)
+        return serve_extract(r, out, nargs - 1, args + 1, res);
+    if (strcmp(op, "range") == 0)
+        return serve_range(r, out, nargs - 1, args + 1, res);
+    if (strcmp(op, "member") == 0 && nargs == 2)
+        return serve_member(r, out, args[1], res);
+    return serve_error(res, "Unknown request: %s", op);
+}
+
+static serve_status_t serve_error(serve_result_t *res, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(res->msg, sizeof(res->msg), fmt, args);
+    va_end(args);
+    return res->status = SERVE_ERROR;
+}
+
+static bool write_all(int fd, const void *buf, size_t size) {
+    const uint8_t *p = buf;
+    while (size) {
+        ssize_t wr = write(fd, p, size);
+        if (wr == -1 && errno == EINTR)
+            continue;
+        if (wr <= 0)
+            return false;
+        stats_output(wr, false);
+        p += wr;
+        size -= wr;
+    }
+    return true;
+}
+
+static serve_status_t serve_copy(pixz_reader *r, int out, uint64_t start,
+        uint64_t end, serve_result_t *res) {
+    uint8_t *buf = malloc(SERVE_CHUNK);
+    if (!buf)
+        return serve_error(res, "Out of memory");
+    serve_status_t status = SERVE_OK;
+    while (start < end) {
+        size_t len = end - start < SERVE_CHUNK ? end - start : SERVE_CHUNK;
+        size_t rd;
+        if (pixz_reader_read(r, start, buf, len, &rd) != LZMA_OK || rd == 0) {
+            status = serve_error(res, "Error reading archive");
+            break;
+        }
+        if (!write_all(out, buf, rd)) {
+            status = serve_error(res, "Error writing output: %s",
+                strerror(errno));
+            break;
+        }
+        start += rd;
+    }
+    free(buf);
+    return status;
+}
+
+static serve_status_t serve_list(pixz_reader *r, int out,
+        serve_result_t *res) {
+    size_t count = pixz_reader_entries(r);
+    if (!count)
+        return SERVE_LOCAL; // list blocks instead
+
+    size_t cap = SERVE_CHUNK, used = 0;
+    char *buf = malloc(cap);
+    if (!buf)
+        return serve_error(res, "Out of memory");
+    for (size_t i = 0; i <= count; ++i) {
+        uint64_t start, end;
+        const char *name = i < count
+            ? pixz_reader_entry(r, i, &start, &end) : NULL;
+        size_t len = name ? strlen(name) + 1 : 0;
+        if (!name || used + len > cap) {
+            if (!write_all(out, buf, used)) {
+                free(buf);
+                return serve_error(res, "Error writing output: %s",
+                    strerror(errno));
+            }
+            used = 0;
+        }
+        if (name && len > cap) { // huge name, just write it
+            if (!write_all(out, name, len - 1) || !write_all(out, "\n", 1)) {
+                free(buf);
+                return serve_error(res, "Error writing output: %s",
+                    strerror(errno));
+            }
+        } else if (name) {
+            memcpy(buf + used, name, len - 1);
+            buf[used + len - 1] = '\n';
+            used += len;
+        }
+    }
+    free(buf);
+    return SERVE_OK;
+}
+
+// Same selection as pixz_read: each member matching a spec, in order
+static serve_status_t serve_extract(pixz_reader *r, int out, size_t nspecs,
+        char **specs, serve_result_t *res) {
+    size_t count = pixz_reader_entries(r);
+    if (!nspecs && !count)
+        return serve_copy(r, out, 0, pixz_reader_size(r), res);
+    if (!count)
+        return serve_error(res, "Can't filter non-tarball");
+
+    // Remove trailing slashes from specs
+    for (size_t i = 0; i < nspecs; ++i) {
+        char *c = specs[i] + strlen(specs[i]);
+        while (--c >= specs[i] && *c == '/')
+            *c = '\0';
+    }
+
+    bool *matched = calloc(nspecs, sizeof(bool));
+    bool *wanted = calloc(count, sizeof(bool));
+    if (!matched || !wanted) {
+        free(matched);
+        free(wanted);
+        return serve_error(res, "Out of memory");
+    }
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t start, end;
+        const char *name = pixz_reader_entry(r, i, &start, &end);
+        for (size_t s = 0; s < nspecs; ++s) {
+            if (spec_match(specs[s], name)) {
+                wanted[i] = matched[s] = true;
+                break;
+            }
+        }
+    }
+
+    serve_status_t status = SERVE_OK;
+    for (size_t s = 0; s < nspecs; ++s) {
+        if (!matched[s]) {
+            status = serve_error(res, "\"%s\" not found in archive", specs[s]);
+            break;
+        }
+    }
+
+    if (status == SERVE_OK)
+        status = serve_verified(r, out, nspecs ? wanted : NULL, res);
+    free(matched);
+    free(wanted);
+    return status;
+}
+
+// Write the wanted members, or the whole archive if wanted is NULL, checking
+// each tar header names the member the index says comes next, and that each
+// has the size the index gives it
+static serve_status_t serve_verified(pixz_reader *r, int out,
+        const bool *wanted, serve_result_t *res) {
+    serve_tar_t t = { .r = r, .out = out, .wanted = wanted,
+        .count = pixz_reader_entries(r), .res = res };
+    if (!(t.buf = malloc(SERVE_CHUNK)))
+        return serve_error(res, "Out of memory");
+
+    struct archive *ar = archive_read_new();
+    prevent_compression(ar);
+    archive_read_support_format_tar(ar);
+    archive_read_open(ar, &t, serve_tar_ok, serve_tar_read, serve_tar_ok);
+    size_t w = 0; // the next wanted entry
+    uint64_t lastsize = 0;
+    off_t lastoff = 0;
+    bool first = true, lastmulti = false;
+    struct archive_entry *entry;
+    while (res->status == SERVE_OK) {
+        int aerr = archive_read_next_header(ar, &entry);
+        if (aerr == ARCHIVE_EOF)
+            break;
+        if (aerr != ARCHIVE_OK && aerr != ARCHIVE_WARN) {
+            if (res->status == SERVE_OK)
+                serve_error(res, "Error reading archive entry: %s",
+                    archive_error_string(ar));
+            break;
+        }
+
+        off_t off = archive_read_header_position(ar);
+        const char *path = archive_entry_pathname(entry);
+        if (!lastmulti) {
+            if (!first && lastsize != (uint64_t)(off - lastoff)) {
+                serve_error(res, "Index and archive show differing sizes");
+                break;
+            }
+            lastoff = off;
+        }
+        lastmulti = is_multi_header(path);
+        if (lastmulti)
+            continue;
+
+        while (w < t.count && wanted && !wanted[w])
+            ++w;
+        uint64_t start, end;
+        const char *name = pixz_reader_entry(r, w, &start, &end);
+        if (!name) {
+            serve_error(res, "File %s missing in index", path);
+            break;
+        }
+        if (strcmp(path, name) != 0) {
+            serve_error(res, "Index and archive differ as to next file: "
+                "%s vs %s", name, path);
+            break;
+        }
+        lastsize = end - start;
+        first = false;
+        ++w;
+    }
+    finish_reading(ar);
+    while (w < t.count && wanted && !wanted[w])
+        ++w;
+    if (res->status == SERVE_OK && w < t.count) {
+        uint64_t start, end;
+        serve_error(res, "File %s missing in archive",
+            pixz_reader_entry(r, w, &start, &end));
+    }
+    if (res->status == SERVE_OK)
+        serve_tar_flush(&t); // whatever's left
+    free(t.buf);
+    return res->status;
+}
+
+static ssize_t serve_tar_read(struct archive *ar, void *ref,
+        const void **bufp) {
+    serve_tar_t *t = (serve_tar_t*)ref;
+    // If we got here, the last chunk is ok to write
+    if (!serve_tar_flush(t))
+        return -1;
+
+    // Read runs of adjacent members at once
+    if (!t->wanted && !t->next) {
+        t->end = pixz_reader_size(t->r);
+        t->next = t->count;
+    }
+    while (t->pos == t->end) {
+        while (t->next < t->count && !t->wanted[t->next])
+            ++t->next;
+        if (t->next == t->count)
+            return 0;
+        uint64_t s, e;
+        pixz_reader_entry(t->r, t->next, &t->pos, &t->end);
+        for (++t->next; t->next < t->count && t->wanted[t->next]; ++t->next) {
+            pixz_reader_entry(t->r, t->next, &s, &e);
+            t->end = e;
+        }
+    }
+
+    size_t len = t->end - t->pos < SERVE_CHUNK ? t->end - t->pos : SERVE_CHUNK;
+    size_t rd;
+    if (pixz_reader_read(t->r, t->pos, t->buf, len, &rd) != LZMA_OK
+            || rd == 0) {
+        serve_error(t->res, "Error reading archive");
+        return -1;
+    }
+    t->pos += rd;
+    t->pending = rd;
+    *bufp = t->buf;
+    return rd;
+}
+
+static bool serve_tar_flush(serve_tar_t *t) {
+    if (t->res->status != SERVE_OK)
+        return false;
+    if (t->pending && !write_all(t->out, t->buf, t->pending)) {
+        serve_error(t->res, "Error writing output: %s", strerror(errno));
+        return false;
+    }
+    t->pending = 0;
+    return true;
+}
+
+static int serve_tar_ok(struct archive *ar, void *ref) {
+    return ARCHIVE_OK;
+}
+
+static serve_status_t serve_range(pixz_reader *r, int out, size_t nargs,
+        char **args, serve_result_t *res) {
+    uint64_t size = pixz_reader_size(r), offset, length = UINT64_MAX;
+    char *end;
+    if (nargs < 1 || nargs > 2)
+        return serve_error(res, "Bad range request");
+    errno = 0;
+    offset = strtoull(args[0], &end, 10);
+    if (errno || *end)
+        return serve_error(res, "Bad range offset: %s", args[0]);
+    if (nargs == 2) {
+        length = strtoull(args[1], &end, 10);
+        if (errno || *end)
+            return serve_error(res, "Bad range length: %s", args[1]);
+    }
+
+    if (offset >= size)
+        return SERVE_OK;
+    if (length > size - offset)
+        length = size - offset;
+    return serve_copy(r, out, offset, offset + length, res);
+}
+
+static serve_status_t serve_member(pixz_reader *r, int out, const char *path,
+        serve_result_t *res) {
+    pixz_member *m;
+    lzma_ret ret = pixz_member_open(r, path, &m);
+    if (ret == LZMA_FORMAT_ERROR)
+        return serve_error(res, "Can't find members of non-tarball");
+    if (ret == LZMA_OPTIONS_ERROR)
+        return serve_error(res, "Can't read sparse file %s", path);
+    if (ret != LZMA_OK)
+        return serve_error(res, "Error reading archive");
+    if (!m)
+        return serve_error(res, "\"%s\" not found in archive", path);
+
+    uint64_t start = pixz_member_offset(m);
+    serve_status_t status = serve_copy(r, out, start,
+        start + pixz_member_size(m), res);
+    pixz_member_close(m);
+    return status;
+}
+
+void pixz_serve(size_t nargs, char **args) {
+    pixz_options opts;
+    pixz_options_default(&opts);
+    opts.threads = gPipelineProcessMax;
+
+    stats_start(NULL, args[0]);
+    pixz_reader *r;
+    if (pixz_reader_open(&r, fileno(gInFile), &opts) != LZMA_OK)
+        die("Can't read index, input must be a seekable .xz file");
+    serve_result_t res = { .status = SERVE_OK };
+    if (serve(r, fileno(gOutFile), nargs, args, &res) == SERVE_ERROR)
+        die("%s", res.msg);
+    pixz_reader_close(r);
+    stats_finish();
+}
+
+
+#pragma mark CLIENT
+
+const char *daemon_socket(void) {
+    static char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    const char *env = getenv("PIXZ_SOCKET");
+    if (env && *env)
+        return env;
+    env = getenv("XDG_RUNTIME_DIR");
+    if (env && *env)
+        snprintf(path, sizeof(path), "%s/pixz.sock", env);
+    else
+        snprintf(path, sizeof(path), "/tmp/pixz-%u/pixz.sock",
+            (unsigned)getuid());
+    return path;
+}
+
+// Only we can put a socket in the directory, so nobody can pose as our daemon
+static bool socket_dir_private(const char *path) {
+    char dir[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    const char *slash = strrchr(path, '/');
+    if (!slash)
+        strcpy(dir, ".");
+    else if (slash == path)
+        strcpy(dir, "/");
+    else if ((size_t)(slash - path) < sizeof(dir))
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    else
+        return false;
+
+    struct stat st;
+    return lstat(dir, &st) == 0 && S_ISDIR(st.st_mode)
+        && st.st_uid == getuid() && (st.st_mode & 0777) == 0700;
+}
+
+static bool socket_peer_ours(int sock) {
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0
+        && len == sizeof(cred) && cred.uid == getuid();
+#elif HAVE_GETPEEREID
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(sock, &uid, &gid) == 0 && uid == getuid();
+#else
+    return false; // we can't tell, so don't trust anyone
+#endif
+}
+
+static bool socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return false;
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+bool daemon_request(const char *path, size_t nargs, char **args) {
+    // The daemon needs something it can read for itself
+    struct stat st;
+    if (fstat(fileno(gInFile), &st) == -1 || !S_ISREG(st.st_mode))
+        return false;
+
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr) || !socket_dir_private(path))
+        return false;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1)
+        return false;
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1
+            || !socket_peer_ours(sock)) {
+        close(sock);
+        return false;
+    }
+
+    size_t size = 0;
+    for (size_t i = 0; i < nargs; ++i)
+        size += strlen(args[i]) + 1;
+    char *req = malloc(size), *p = req;
+    if (!req)
+        die("Out of memory");
+    for (size_t i = 0; i < nargs; ++i)
+        p = stpcpy(p, args[i]) + 1;
+
+    // Our descriptors go with the first byte
+    fflush(gOutFile);
+    int fds[2] = { fileno(gInFile), fileno(gOutFile) };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctl;
+    struct iovec iov = { .iov_base = req, .iov_len = 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    bool sent = sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+    for (size_t off = 1; sent && off < size; ) {
+        ssize_t wr = send(sock, req + off, size - off, MSG_NOSIGNAL);
+        if (wr == -1 && errno == EINTR)
+            continue;
+        if (wr <= 0)
+            sent = false;
+        else
+            off += wr;
+    }
+    free(req);
+    if (!sent) { // nothing's been done yet
+        close(sock);
+        return false;
+    }
+    shutdown(sock, SHUT_WR);
+
+    char reply[DAEMON_REPLY_MAX + 16];
+    size_t got = 0;
+    while (got < sizeof(reply) - 1) {
+        ssize_t rd = read(sock, reply + got, sizeof(reply) - 1 - got);
+        if (rd == -1 && errno == EINTR)
+            continue;
+        if (rd <= 0)
+            break;
+        got += rd;
+    }
+    close(sock);
+    reply[got] = '\0';
+
+    if (strcmp(reply, "ok") == 0)
+        return true;
+    if (strcmp(reply, "local") == 0)
+        return false;
+    if (strncmp(reply, "error: ", 7) == 0)
+        die("%s", reply + 7);
+    die("Lost connection to pixz daemon");
+    return false;
+}
+
+
+#pragma mark DAEMON
+
+static const char *gDaemonSocket = NULL;
+
+static void daemon_signal(int sig) {
+    if (gDaemonSocket)
+        unlink(gDaemonSocket);
+    _exit(0);
+}
+
+void pixz_daemon(const char *path, uint64_t cache_size, bool verbose) {
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr))
+        die("Socket path too long: %s", path);
+    char dir[sizeof(addr.sun_path)];
+    size_t len = snprintf(dir, sizeof(dir), "/tmp/pixz-%u",
+        (unsigned)getuid());
+    if (strncmp(path, dir, len) == 0 && path[len] == '/'
+            && mkdir(dir, 0700) == -1 && errno != EEXIST)
+        die("Can't create %s: %s", dir, strerror(errno)); // the default's
+
+    if (!socket_dir_private(path))
+        die("The socket's directory must be ours alone, with mode 0700: %s",
+            path);
+
+    // Don't take over from a live daemon
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1)
+        die("Can't create socket: %s", strerror(errno));
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+        die("A pixz daemon is already listening on %s", path);
+    close(sock);
+    unlink(path);
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        die("Can't create socket: %s", strerror(errno));
+    mode_t mask = umask(077); // only for our own user
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+        die("Can't bind to %s: %s", path, strerror(errno));
+    umask(mask);
+    if (listen(sock, SOMAXCONN) == -1)
+        die("Can't listen on %s: %s", path, strerror(errno));
+
+    gDaemonSocket = path;
+    signal(SIGINT, daemon_signal);
+    signal(SIGTERM, daemon_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    daemon_t d = { .archives = NULL, .count = 0, .verbose = verbose };
+    pthread_mutex_init(&d.mutex, NULL);
+    pthread_cond_init(&d.opened, NULL);
+    pixz_options opts;
+    pixz_options_default(&opts);
+    opts.threads = gPipelineProcessMax;
+    opts.cache_size = cache_size;
+    if (!(d.cache = pixz_cache_new(&opts)))
+        die("Can't create block cache");
+    if (!(d.connq = queue_new(NULL)))
+        die("Out of memory");
+
+    // A bounded pool of workers handles connections in turn
+    size_t threads = num_threads();
+    if (gPipelineProcessMax && gPipelineProcessMax < threads)
+        threads = gPipelineProcessMax;
+    for (size_t i = 0; i < threads; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, daemon_thread, &d))
+            die("Can't start daemon threads");
+        pthread_detach(thread);
+    }
+
+    while (true) {
+        int conn = accept(sock, NULL, NULL);
+        if (conn == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            die("Error accepting connection: %s", strerror(errno));
+        }
+        if (!queue_push(d.connq, DAEMON_CONN, (void*)(intptr_t)conn))
+            close(conn); // out of memory, the client will see it closed
+    }
+}
+
+static void *daemon_thread(void *data) {
+    daemon_t *d = (daemon_t*)data;
+    void *conn;
+    while (queue_pop(d->connq, &conn) == DAEMON_CONN)
+        daemon_connection(d, (int)(intptr_t)conn);
+    return NULL;
+}
+
+static void daemon_connection(daemon_t *d, int conn) {
+    int fds[2] = { -1, -1 };
+    char *req = NULL;
+    if (!socket_peer_ours(conn)) { // it'd be handing us its files
+        close(conn);
+        return;
+    }
+    size_t size = daemon_receive(conn, fds, &req);
+    if (!size && fds[0] == -1) { // just checking we're here
+        free(req);
+        close(conn);
+        return;
+    }
+
+    // Split the request into its strings
+    size_t nargs = 0;
+    for (size_t i = 0; i < size; ++i)
+        nargs += (req[i] == '\0');
+    char **args = calloc(nargs + 1, sizeof(char*));
+
+    serve_result_t res = { .status = SERVE_OK };
+    if (!size || fds[0] == -1 || !nargs || req[size - 1] != '\0' || !args) {
+        serve_error(&res, "Bad request");
+    } else {
+        for (size_t i = 0, pos = 0; i < nargs; ++i) {
+            args[i] = req + pos;
+            pos += strlen(args[i]) + 1;
+        }
+        daemon_archive_t *a = daemon_archive(d, fds[0]);
+        if (!a) {
+            res.status = SERVE_LOCAL;
+        } else {
+            res.status = serve(a->reader, fds[1], nargs, args, &res);
+            daemon_release(d, a);
+        }
+    }
+
+    char reply[DAEMON_REPLY_MAX + 16];
+    if (res.status == SERVE_OK)
+        strcpy(reply, "ok");
+    else if (res.status == SERVE_LOCAL)
+        strcpy(reply, "local");
+    else
+        snprintf(reply, sizeof(reply), "error: %s", res.msg);
+    if (d->verbose) // before the client hears, so it can look for this
+        fprintf(stderr, "pixz: %s %s\n", nargs ? args[0] : "?", reply);
+    write_all(conn, reply, strlen(reply));
+
+    for (int i = 0; i < 2; ++i) {
+        if (fds[i] != -1)
+            close(fds[i]);
+    }
+    free(args);
+    free(req);
+    close(conn);
+}
+
+// Returns the request's size, with the client's descriptors in fds
+static size_t daemon_receive(int conn, int *fds, char **bufp) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } ctl;
+    size_t cap = CHUNKSIZE, size = 0;
+    char *buf = malloc(cap);
+    *bufp = buf;
+    if (!buf)
+        return 0;
+
+    struct iovec iov = { .iov_base = buf, .iov_len = cap };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf) };
+    ssize_t rd = recvmsg(conn, &msg, 0);
+    if (rd <= 0)
+        return 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+                && cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int)))
+            memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+    }
+    size = rd;
+
+    // The rest of the request, until the client's done
+    while (true) {
+        if (size == cap) {
+            if (cap >= DAEMON_REQUEST_MAX)
+                return 0;
+            char *grown = realloc(buf, cap *= 2);
+            if (!grown)
+                return 0;
+            *bufp = buf = grown;
+        }
+        rd = read(conn, buf + size, cap - size);
+        if (rd == -1 && errno == EINTR)
+            continue;
+        if (rd < 0)
+            return 0;
+        if (rd == 0)
+            return size;
+        size += rd;
+    }
+}
+
+// Find the archive open on this file, or open it, with a reference held.
+// Opening reads the whole index, so it happens outside the lock: a
+// placeholder marks the archive as opening, and anyone else wanting it waits.
+static daemon_archive_t *daemon_archive(daemon_t *d, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+        return NULL;
+
+    pthread_mutex_lock(&d->mutex);
+    daemon_archive_t **p, *a;
+    while (true) {
+        for (p = &d->archives, a = *p; a; p = &a->next, a = *p) {
+            if (a->dev == st.st_dev && a->ino == st.st_ino
+                    && a->size == st.st_size
+                    && a->mtime.tv_sec == st.st_mtim.tv_sec
+                    && a->mtime.tv_nsec == st.st_mtim.tv_nsec)
+                break;
+        }
+        if (!a || !a->opening)
+            break;
+        pthread_cond_wait(&d->opened, &d->mutex); // then look again
+    }
+    if (a) {
+        *p = a->next; // move to the front
+    } else {
+        // Keep our own descriptor, the client's goes away
+        if (!(a = calloc(1, sizeof(daemon_archive_t)))
+                || (a->fd = dup(fd)) == -1) {
+            free(a);
+            pthread_mutex_unlock(&d->mutex);
+            return NULL;
+        }
+        a->dev = st.st_dev;
+        a->ino = st.st_ino;
+        a->size = st.st_size;
+        a->mtime = st.st_mtim;
+        a->opening = true;
+        ++d->count;
+    }
+    a->next = d->archives;
+    d->archives = a;
+    ++a->refs;
+
+    if (a->opening) {
+        pthread_mutex_unlock(&d->mutex);
+        lzma_ret err = pixz_reader_open_cache(&a->reader, a->fd, d->cache);
+        pthread_mutex_lock(&d->mutex);
+        a->opening = false;
+        pthread_cond_broadcast(&d->opened);
+        if (err != LZMA_OK) {
+            for (p = &d->archives; *p != a; p = &(*p)->next)
+                ; // it may have moved
+            *p = a->next;
+            --d->count;
+            pthread_mutex_unlock(&d->mutex);
+            close(a->fd);
+            free(a);
+            return NULL;
+        }
+    }
+
+    // Forget the least recently used archives that nobody is reading, and
+    // close them once we've let go of the lock
+    daemon_archive_t *evicted = NULL;
+    if (d->count > DAEMON_ARCHIVES) {
+        size_t kept = 0;
+        for (p = &d->archives; *p; ) {
+            daemon_archive_t *old = *p;
+            if (++kept > DAEMON_ARCHIVES && !old->refs) {
+                *p = old->next;
+                old->next = evicted;
+                evicted = old;
+                --d->count;
+            } else {
+                p = &old->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&d->mutex);
+
+    while (evicted) {
+        daemon_archive_t *old = evicted;
+        evicted = old->next;
+        pixz_reader_close(old->reader);
+        close(old->fd);
+        free(old);
+    }
+    return a;
+}
+
+static void daemon_release(daemon_t *d, daemon_archive_t *a) {
+    pthread_mutex_lock(&d->mutex);
+    --a->refs;
+    pthread_mutex_unlock(&d->mutex);
+}
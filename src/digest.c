@@ -0,0 +1,248 @@
+#include "pixz.h"
+
+#include <errno.h>
+#include <strings.h>
+
+
+#pragma mark TYPES
+
+typedef struct {
+    uint32_t state[4];
+    uint64_t length;
+    uint8_t buf[64];
+    size_t buflen;
+} md5_ctx;
+
+
+
+#pragma mark GLOBALS
+
+unsigned gDigests = 0;
+char *gDigestFile = NULL;
+
+static uint32_t gCRC32 = 0;
+static uint64_t gCRC64 = 0;
+static md5_ctx gMD5;
+static sha256_ctx gSHA256;
+
+static const struct {
+    const char *name, *tag;
+    digest_type type;
+} gDigestNames[] = {
+    { "crc32", "CRC32", DIGEST_CRC32 },
+    { "crc64", "CRC64", DIGEST_CRC64 },
+    { "md5", "MD5", DIGEST_MD5 },
+    { "sha256", "SHA256", DIGEST_SHA256 },
+};
+#define DIGEST_COUNT (sizeof(gDigestNames) / sizeof(gDigestNames[0]))
+
+
+#pragma mark FUNCTION DECLARATIONS
+
+static void md5_init(md5_ctx *c);
+static void md5_update(md5_ctx *c, const uint8_t *data, size_t size);
+static void md5_final(md5_ctx *c, uint8_t out[16]);
+static void md5_compress(uint32_t state[4], const uint8_t block[64]);
+
+static void hex(char *out, const uint8_t *in, size_t size);
+
+
+#pragma mark DIGESTS
+
+bool digest_parse(const char *spec) {
+    char *copy = xstrdup(spec), *save = NULL;
+    bool ok = true;
+    for (char *tok = strtok_r(copy, ",", &save); tok;
+            tok = strtok_r(NULL, ",", &save)) {
+        size_t i;
+        for (i = 0; i < DIGEST_COUNT; ++i) {
+            if (strcasecmp(tok, gDigestNames[i].name) == 0)
+                break;
+        }
+        if (i == DIGEST_COUNT) {
+            ok = false;
+            break;
+        }
+        gDigests |= gDigestNames[i].type;
+    }
+    free(copy);
+    return ok && gDigests;
+}
+
+void digest_init(void) {
+    gCRC32 = 0;
+    gCRC64 = 0;
+    md5_init(&gMD5);
+    sha256_init(&gSHA256);
+}
+
+void digest_update(const uint8_t *buf, size_t size) {
+    if (gDigests & DIGEST_CRC32)
+        gCRC32 = checksum_crc32(buf, size, gCRC32);
+    if (gDigests & DIGEST_CRC64)
+        gCRC64 = checksum_crc64(buf, size, gCRC64);
+    if (gDigests & DIGEST_MD5)
+        md5_update(&gMD5, buf, size);
+    if (gDigests & DIGEST_SHA256)
+        sha256_update(&gSHA256, buf, size);
+}
+
+void digest_report(const char *name) {
+    if (!gDigests)
+        return;
+
+    // Batches report each file in turn
+    static bool reported = false;
+    FILE *out = stderr;
+    if (gDigestFile && !(out = fopen(gDigestFile, reported ? "a" : "w")))
+        die("can not open digest file: %s: %s", gDigestFile, strerror(errno));
+
+    uint8_t raw[32];
+    char str[2 * sizeof(raw) + 1];
+    for (size_t i = 0; i < DIGEST_COUNT; ++i) {
+        digest_type type = gDigestNames[i].type;
+        if (!(gDigests & type))
+            continue;
+
+        switch (type) {
+            case DIGEST_CRC32:
+                snprintf(str, sizeof(str), "%08"PRIx32, gCRC32);
+                break;
+            case DIGEST_CRC64:
+                snprintf(str, sizeof(str), "%016"PRIx64, gCRC64);
+                break;
+            case DIGEST_MD5:
+                md5_final(&gMD5, raw);
+                hex(str, raw, 16);
+                break;
+            case DIGEST_SHA256:
+                sha256_final(&gSHA256, raw);
+                hex(str, raw, 32);
+                break;
+        }
+        // BSD-style tagged lines, which sha256sum -c and friends accept
+        fprintf(out, "%s (%s) = %s\n", gDigestNames[i].tag, name, str);
+    }
+
+    if (out != stderr && fclose(out) != 0)
+        die("Error writing digest file");
+    reported = true;
+}
+
+static void hex(char *out, const uint8_t *in, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < size; ++i) {
+        *out++ = digits[in[i] >> 4];
+        *out++ = digits[in[i] & 0xF];
+    }
+    *out = '\0';
+}
+
+
+#pragma mark MD5
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static const uint32_t gMD5K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+    0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+    0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+    0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+    0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+    0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t gMD5R[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_init(md5_ctx *c) {
+    c->state[0] = 0x67452301;
+    c->state[1] = 0xefcdab89;
+    c->state[2] = 0x98badcfe;
+    c->state[3] = 0x10325476;
+    c->length = 0;
+    c->buflen = 0;
+}
+
+static void md5_compress(uint32_t state[4], const uint8_t block[64]) {
+    uint32_t m[16];
+    for (int i = 0; i < 16; ++i) {
+        const uint8_t *p = block + i * 4;
+        m[i] = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t f;
+        int g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        uint32_t tmp = d;
+        d = c;
+        c = b;
+        b = b + ROTL32(a + f + gMD5K[i] + m[g], gMD5R[i]);
+        a = tmp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+static void md5_update(md5_ctx *c, const uint8_t *data, size_t size) {
+    c->length += size;
+    if (c->buflen) {
+        size_t take = 64 - c->buflen;
+        if (take > size)
+            take = size;
+        memcpy(c->buf + c->buflen, data, take);
+        c->buflen += take;
+        data += take;
+        size -= take;
+        if (c->buflen < 64)
+            return;
+        md5_compress(c->state, c->buf);
+        c->buflen = 0;
+    }
+    for (; size >= 64; data += 64, size -= 64)
+        md5_compress(c->state, data);
+    memcpy(c->buf, data, size);
+    c->buflen = size;
+}
+
+static void md5_final(md5_ctx *c, uint8_t out[16]) {
+    uint64_t bits = c->length * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t padlen = (c->buflen < 56) ? 56 - c->buflen : 120 - c->buflen;
+    for (int i = 0; i < 8; ++i)
+        pad[padlen + i] = (bits >> (8 * i)) & 0xFF;
+    md5_update(c, pad, padlen + 8);
+
+    for (int i = 0; i < 4; ++i) {
+        out[i * 4] = c->state[i] & 0xFF;
+        out[i * 4 + 1] = (c->state[i] >> 8) & 0xFF;
+        out[i * 4 + 2] = (c->state[i] >> 16) & 0xFF;
+        out[i * 4 + 3] = c->state[i] >> 24;
+    }
+}
+
@@ -0,0 +1,416 @@
+#include "pixz.h"
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Positional reads of an input, through a backend. Local files are read
+ * directly. Slower backends, like network storage, are best given few large
+ * requests, several at a time: so nearby requests are coalesced, large ones
+ * are split into parts, and the parts are read concurrently by a small pool
+ * of threads.
+ *
+ * Setting PIXZ_IO_LATENCY to a number of milliseconds makes every request
+ * to a local file wait that long first, for testing. */
+
+#define IO_THREADS 8
+#define IO_PART (1024 * 1024)
+#define IO_GAP (64 * 1024)
+#define IO_COALESCE_MAX (8 * 1024 * 1024)
+
+
+#pragma mark TYPES
+
+typedef struct {
+    // Fill buf, returning fewer bytes only at EOF, or -1 on error
+    ssize_t (*pread)(void *ctx, void *buf, size_t size, off_t offset);
+    off_t (*size)(void *ctx);
+    void (*free)(void *ctx);
+    bool remote; // worth coalescing and parallelizing
+} io_backend_t;
+
+typedef enum {
+    IO_JOB,
+    IO_STOP
+} io_msg_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+    size_t pending;
+} io_batch_t;
+
+typedef struct {
+    io_req_t *req;
+    io_batch_t *batch;
+} io_job_t;
+
+struct io_t {
+    const io_backend_t *backend;
+    void *ctx;
+
+    pthread_mutex_t mutex;
+    uint8_t *window;
+    off_t window_start;
+    size_t window_size;
+
+    queue_t *jobq;
+    pthread_t threads[IO_THREADS];
+    size_t thread_count;
+};
+
+typedef struct {
+    int fd;
+    unsigned latency; // msec
+} io_fd_t;
+
+
+#pragma mark FUNCTION DECLARATIONS
+
+static ssize_t fd_pread(void *ctx, void *buf, size_t size, off_t offset);
+static off_t fd_size(void *ctx);
+static void fd_free(void *ctx);
+static ssize_t latency_pread(void *ctx, void *buf, size_t size,
+    off_t offset);
+
+static bool io_window_get(io_t *io, io_req_t *req);
+static bool io_coalesce(io_t *io, io_req_t **sorted, size_t count);
+static void io_run(io_t *io, io_req_t *reqs, size_t count);
+static void io_fetch(io_t *io, io_req_t *req);
+static void *io_thread(void *data);
+static void io_job(io_t *io, io_job_t *job);
+static int io_req_cmp(const void *a, const void *b);
+
+
+#pragma mark BACKENDS
+
+static const io_backend_t gFdBackend = {
+    .pread = fd_pread, .size = fd_size, .free = fd_free, .remote = false };
+static const io_backend_t gLatencyBackend = {
+    .pread = latency_pread, .size = fd_size, .free = fd_free, .remote = true };
+
+static ssize_t fd_pread(void *ctx, void *buf, size_t size, off_t offset) {
+    io_fd_t *f = (io_fd_t*)ctx;
+    size_t pos = 0;
+    while (pos < size) {
+        ssize_t rd = pread(f->fd, (uint8_t*)buf + pos, size - pos,
+            offset + pos);
+        if (rd == -1 && errno == EINTR)
+            continue;
+        if (rd == -1)
+            return -1;
+        if (rd == 0)
+            break;
+        pos += rd;
+    }
+    return pos;
+}
+
+static off_t fd_size(void *ctx) {
+    return lseek(((io_fd_t*)ctx)->fd, 0, SEEK_END);
+}
+
+static void fd_free(void *ctx) {
+    free(ctx);
+}
+
+static ssize_t latency_pread(void *ctx, void *buf, size_t size,
+        off_t offset) {
+    io_fd_t *f = (io_fd_t*)ctx;
+    struct timespec ts = { .tv_sec = f->latency / 1000,
+        .tv_nsec = (f->latency % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+    return fd_pread(ctx, buf, size, offset);
+}
+
+
+#pragma mark IO
+
+io_t *io_open(int fd) {
+    io_fd_t *f = malloc(sizeof(io_fd_t));
+    io_t *io = calloc(1, sizeof(io_t));
+    if (!f || !io) {
+        free(f);
+        free(io);
+        return NULL;
+    }
+    *f = (io_fd_t){ .fd = fd };
+    io->backend = &gFdBackend;
+    io->ctx = f;
+
+    const char *latency = getenv("PIXZ_IO_LATENCY");
+    if (latency && (f->latency = strtoul(latency, NULL, 10)))
+        io->backend = &gLatencyBackend;
+    pthread_mutex_init(&io->mutex, NULL);
+    return io;
+}
+
+void io_free(io_t *io) {
+    if (!io)
+        return;
+    for (size_t i = 0; i < io->thread_count; ++i)
+        queue_push(io->jobq, IO_STOP, NULL);
+    for (size_t i = 0; i < io->thread_count; ++i)
+        pthread_join(io->threads[i], NULL);
+    if (io->jobq)
+        queue_free(io->jobq);
+    pthread_mutex_destroy(&io->mutex);
+    free(io->window);
+    io->backend->free(io->ctx);
+    free(io);
+}
+
+off_t io_size(io_t *io) {
+    return io->backend->size(io->ctx);
+}
+
+ssize_t io_pread(io_t *io, void *buf, size_t size, off_t offset) {
+    io_req_t req = { .buf = buf, .size = size, .offset = offset };
+    io_pread_many(io, &req, 1);
+    return req.rd;
+}
+
+bool io_window(io_t *io, off_t offset, size_t size) {
+    if (!io->backend->remote)
+        return true; // reads are cheap enough already
+
+    uint8_t *buf = malloc(size);
+    if (!buf)
+        return false;
+    ssize_t rd = io_pread(io, buf, size, offset);
+    if (rd < 0) {
+        free(buf);
+        return false;
+    }
+
+    pthread_mutex_lock(&io->mutex);
+    free(io->window);
+    io->window = buf;
+    io->window_start = offset;
+    io->window_size = rd;
+    pthread_mutex_unlock(&io->mutex);
+    return true;
+}
+
+void io_window_drop(io_t *io) {
+    pthread_mutex_lock(&io->mutex);
+    free(io->window);
+    io->window = NULL;
+    io->window_size = 0;
+    pthread_mutex_unlock(&io->mutex);
+}
+
+// Satisfy a request from the window, if it's all there
+static bool io_window_get(io_t *io, io_req_t *req) {
+    bool found = false;
+    pthread_mutex_lock(&io->mutex);
+    if (io->window && req->offset >= io->window_start
+            && req->offset + req->size
+                <= io->window_start + io->window_size) {
+        memcpy(req->buf, io->window + (req->offset - io->window_start),
+            req->size);
+        req->rd = req->size;
+        found = true;
+    }
+    pthread_mutex_unlock(&io->mutex);
+    return found;
+}
+
+bool io_pread_many(io_t *io, io_req_t *reqs, size_t count) {
+    io_req_t **sorted = malloc(count * sizeof(io_req_t*));
+    if (!sorted && count)
+        return false;
+    size_t nsorted = 0;
+    for (size_t i = 0; i < count; ++i) {
+        reqs[i].rd = 0;
+        if (!io_window_get(io, &reqs[i]))
+            sorted[nsorted++] = &reqs[i];
+    }
+
+    if (!io->backend->remote) { // no point being clever
+        for (size_t i = 0; i < nsorted; ++i) {
+            io_fetch(io, sorted[i]);
+        }
+    } else if (nsorted && !io_coalesce(io, sorted, nsorted)) {
+        for (size_t i = 0; i < nsorted; ++i)
+            sorted[i]->rd = -1;
+    }
+    free(sorted);
+
+    for (size_t i = 0; i < count; ++i) {
+        if (reqs[i].rd < 0)
+            return false;
+    }
+    return true;
+}
+
+// Read runs of nearby requests together, splitting big runs into parts.
+// Returns false if we couldn't allocate what we need.
+static bool io_coalesce(io_t *io, io_req_t **sorted, size_t count) {
+    qsort(sorted, count, sizeof(io_req_t*), io_req_cmp);
+    size_t nparts = 0, cap = 0, nruns = 0;
+    io_req_t *parts = NULL;
+    uint8_t **bufs = calloc(count, sizeof(uint8_t*)); // for each run
+    off_t *run_start = malloc(count * sizeof(off_t));
+    size_t *run_of = malloc(count * sizeof(size_t)); // for each request
+    bool ok = bufs && run_start && run_of;
+
+    for (size_t i = 0; ok && i < count; ) {
+        off_t start = sorted[i]->offset, end = start + sorted[i]->size;
+        size_t j = i + 1;
+        for (; j < count; ++j) {
+            off_t next = sorted[j]->offset;
+            off_t next_end = next + sorted[j]->size;
+            if (next > end + IO_GAP
+                    || (next_end > end ? next_end : end) - start
+                        > IO_COALESCE_MAX)
+                break;
+            if (next_end > end)
+                end = next_end;
+        }
+
+        // A lone request is read in place, a run through a buffer
+        uint8_t *buf = (uint8_t*)sorted[i]->buf;
+        if (j - i > 1 && !(buf = bufs[nruns] = malloc(end - start)))
+            ok = false;
+        for (size_t k = i; k < j; ++k)
+            run_of[k] = nruns;
+        run_start[nruns++] = start;
+
+        for (off_t pos = start; ok && pos < end; pos += IO_PART) {
+            if (nparts == cap) {
+                cap = cap ? cap * 2 : 16;
+                io_req_t *grown = realloc(parts, cap * sizeof(io_req_t));
+                if (!grown) {
+                    ok = false;
+                    break;
+                }
+                parts = grown;
+            }
+            size_t size = end - pos < IO_PART ? end - pos : IO_PART;
+            parts[nparts++] = (io_req_t){ .buf = buf + (pos - start),
+                .size = size, .offset = pos };
+        }
+        i = j;
+    }
+
+    if (ok) {
+        io_run(io, parts, nparts);
+
+        // Each request gets what was read contiguously from its run's start
+        for (size_t i = 0; i < count; ++i) {
+            io_req_t *r = sorted[i];
+            off_t start = run_start[run_of[i]], avail = 0;
+            for (size_t p = 0; p < nparts; ++p) {
+                if (parts[p].offset < start)
+                    continue;
+                if (parts[p].rd < 0) {
+                    avail = -1;
+                    break;
+                }
+                if (parts[p].offset != start + avail)
+                    break;
+                avail += parts[p].rd;
+                if (parts[p].rd < (ssize_t)parts[p].size)
+                    break;
+            }
+            off_t skip = r->offset - start;
+            if (avail < 0)
+                r->rd = -1;
+            else if (avail <= skip)
+                r->rd = 0;
+            else
+                r->rd = avail - skip < (off_t)r->size ? avail - skip : r->size;
+            if (bufs[run_of[i]] && r->rd > 0)
+                memcpy(r->buf, bufs[run_of[i]] + skip, r->rd);
+        }
+    }
+
+    for (size_t i = 0; bufs && i < nruns; ++i)
+        free(bufs[i]);
+    free(bufs);
+    free(run_start);
+    free(run_of);
+    free(parts);
+    return ok;
+}
+
+static int io_req_cmp(const void *a, const void *b) {
+    off_t oa = (*(io_req_t**)a)->offset, ob = (*(io_req_t**)b)->offset;
+    return oa < ob ? -1 : oa > ob;
+}
+
+// Issue the requests concurrently, and wait for them all
+static void io_run(io_t *io, io_req_t *reqs, size_t count) {
+    if (count == 1) {
+        io_fetch(io, &reqs[0]);
+        return;
+    }
+
+    pthread_mutex_lock(&io->mutex);
+    if (!io->jobq && (io->jobq = queue_new(NULL))
+            && !queue_reserve(io->jobq, IO_THREADS)) { // for io_free's stops
+        queue_free(io->jobq);
+        io->jobq = NULL;
+    }
+    while (io->jobq && io->thread_count < IO_THREADS
+            && io->thread_count < count) {
+        if (pthread_create(&io->threads[io->thread_count], NULL, io_thread,
+                io))
+            break;
+        ++io->thread_count;
+    }
+    bool threaded = io->thread_count;
+    pthread_mutex_unlock(&io->mutex);
+
+    io_job_t *jobs = threaded ? malloc(count * sizeof(io_job_t)) : NULL;
+    if (!jobs) {
+        for (size_t i = 0; i < count; ++i)
+            io_fetch(io, &reqs[i]);
+        return;
+    }
+
+    io_batch_t batch = { .pending = count };
+    pthread_mutex_init(&batch.mutex, NULL);
+    pthread_cond_init(&batch.done, NULL);
+    for (size_t i = 0; i < count; ++i) {
+        jobs[i] = (io_job_t){ .req = &reqs[i], .batch = &batch };
+        if (!queue_push(io->jobq, IO_JOB, &jobs[i]))
+            io_job(io, &jobs[i]); // out of memory, so do it ourselves
+    }
+
+    pthread_mutex_lock(&batch.mutex);
+    while (batch.pending)
+        pthread_cond_wait(&batch.done, &batch.mutex);
+    pthread_mutex_unlock(&batch.mutex);
+    pthread_mutex_destroy(&batch.mutex);
+    pthread_cond_destroy(&batch.done);
+    free(jobs);
+}
+
+// Every read that reaches the backend goes through here
+static void io_fetch(io_t *io, io_req_t *req) {
+    req->rd = io->backend->pread(io->ctx, req->buf, req->size, req->offset);
+    stats_input(req->rd);
+    if (req->rd > 0)
+        limit_take(LIMIT_READ, req->rd);
+}
+
+static void *io_thread(void *data) {
+    io_t *io = (io_t*)data;
+    io_job_t *job;
+    while (queue_pop(io->jobq, (void**)&job) == IO_JOB)
+        io_job(io, job);
+    return NULL;
+}
+
+static void io_job(io_t *io, io_job_t *job) {
+    io_fetch(io, job->req);
+
+    io_batch_t *batch = job->batch;
+    pthread_mutex_lock(&batch->mutex);
+    if (--batch->pending == 0)
+        pthread_cond_signal(&batch->done);
+    pthread_mutex_unlock(&batch->mutex);
+}
@@ -0,0 +1,218 @@
+#include "pixz.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* A client for GNU make's jobserver, so pixz under make -jN shares the N
+ * job slots with everything else make runs.
+ *
+ * Make hands each job one implicit slot, and keeps a token in a pipe for
+ * each of the others. MAKEFLAGS says where: --jobserver-auth=fifo:PATH for a
+ * named pipe, as make 4.4 uses, or --jobserver-auth=R,W (--jobserver-fds on
+ * make before 4.2) for descriptors we inherited. Descriptors that weren't
+ * passed down, because the rule wasn't marked recursive, are ignored; we
+ * look before opening anything, so their numbers can't be our own files yet,
+ * and only take pipes.
+ *
+ * Our first worker uses the implicit slot. Any other worker reads a token
+ * before it takes a block, but only for a block no other worker is already
+ * waiting on a token for, and writes it back as soon as it finds nothing to
+ * do, so idle workers hold none. Waiting for a token times out every
+ * JOBSERVER_POLL_MS so the worker can notice the work went elsewhere.
+ * Tokens still held when we exit, even through die(), are given back. */
+
+#define JOBSERVER_POLL_MS 50
+
+
+#pragma mark GLOBALS
+
+bool gJobserver = true;
+
+static pthread_mutex_t gJobserverMutex = PTHREAD_MUTEX_INITIALIZER;
+static bool gJobserverActive = false; // read by workers without the lock
+static int gReadFd = -1, gWriteFd = -1;
+static int gOpenedFd = -1; // one of those we opened, rather than inherited
+static char *gHeld = NULL; // the tokens we hold, to write back as they were
+static size_t gHeldCount = 0, gHeldCap = 0;
+static uint64_t gAcquired = 0, gWaitNs = 0;
+
+
+#pragma mark DECLARATIONS
+
+static bool jobserver_parse(const char *flags, char *path, int *rfd, int *wfd);
+static bool jobserver_open(const char *path, int rfd, int wfd);
+static bool jobserver_is_pipe(int fd);
+static void jobserver_exit(void);
+
+
+#pragma mark SETUP
+
+bool jobserver_start(void) {
+    char path[PATH_MAX];
+    int rfd, wfd;
+    const char *flags = getenv("MAKEFLAGS");
+    if (!flags || !jobserver_parse(flags, path, &rfd, &wfd))
+        return false;
+    if (!jobserver_open(path, rfd, wfd))
+        return false;
+    __atomic_store_n(&gJobserverActive, true, __ATOMIC_RELEASE);
+    atexit(jobserver_exit);
+    return true;
+}
+
+void jobserver_close(void) {
+    if (!jobserver_active())
+        return;
+    jobserver_finish();
+    __atomic_store_n(&gJobserverActive, false, __ATOMIC_RELEASE);
+    if (gOpenedFd != -1)
+        close(gOpenedFd);
+    gReadFd = gWriteFd = gOpenedFd = -1;
+}
+
+bool jobserver_active(void) {
+    return __atomic_load_n(&gJobserverActive, __ATOMIC_ACQUIRE);
+}
+
+// The last auth option wins, as in make; variable settings follow " -- "
+static bool jobserver_parse(const char *flags, char *path, int *rfd,
+        int *wfd) {
+    const char *end = strstr(flags, " -- ");
+    if (!end)
+        end = flags + strlen(flags);
+
+    const char *auth = NULL;
+    static const char *opts[] = { "--jobserver-auth=", "--jobserver-fds=" };
+    for (size_t i = 0; i < sizeof(opts) / sizeof(*opts) && !auth; ++i) {
+        for (const char *p = flags; (p = strstr(p, opts[i])) && p < end;
+                p += strlen(opts[i]))
+            auth = p + strlen(opts[i]);
+    }
+    if (!auth)
+        return false;
+
+    size_t len = strcspn(auth, " ");
+    if (strncmp(auth, "fifo:", 5) == 0) {
+        if (len - 5 >= PATH_MAX)
+            return false;
+        memcpy(path, auth + 5, len - 5);
+        path[len - 5] = '\0';
+        *rfd = *wfd = -1;
+        return true;
+    }
+    *path = '\0';
+    return sscanf(auth, "%d,%d", rfd, wfd) == 2 && *rfd >= 0 && *wfd >= 0;
+}
+
+// Reads are non-blocking, so a token another process took first just means
+// we wait some more
+static bool jobserver_open(const char *path, int rfd, int wfd) {
+    if (*path) {
+        gReadFd = gWriteFd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (gReadFd != -1 && !jobserver_is_pipe(gReadFd)) {
+            close(gReadFd);
+            gReadFd = gWriteFd = -1;
+        }
+        gOpenedFd = gReadFd;
+        return gReadFd != -1;
+    }
+    if (!jobserver_is_pipe(rfd) || !jobserver_is_pipe(wfd))
+        return false;
+
+    // Reopening a pipe gives us our own flags, without changing make's
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", rfd);
+    gReadFd = gOpenedFd = open(proc, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (gReadFd == -1)
+        gReadFd = rfd;
+    gWriteFd = wfd;
+    return true;
+}
+
+static bool jobserver_is_pipe(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+void jobserver_finish(void) {
+    pthread_mutex_lock(&gJobserverMutex);
+    while (gHeldCount) {
+        char c = gHeld[--gHeldCount];
+        while (write(gWriteFd, &c, 1) == -1 && errno == EINTR)
+            ;
+    }
+    pthread_mutex_unlock(&gJobserverMutex);
+}
+
+static void jobserver_exit(void) {
+    jobserver_finish();
+    free(gHeld);
+    gHeld = NULL;
+    gHeldCap = 0;
+}
+
+
+#pragma mark TOKENS
+
+bool jobserver_acquire(void) {
+    uint64_t start = stats_now();
+    char c;
+    ssize_t rd = read(gReadFd, &c, 1);
+    bool none = rd == -1 && (errno == EAGAIN || errno == EINTR);
+    if (none) {
+        struct pollfd pfd = { .fd = gReadFd, .events = POLLIN };
+        if (poll(&pfd, 1, JOBSERVER_POLL_MS) > 0) {
+            rd = read(gReadFd, &c, 1);
+            none = rd == -1 && (errno == EAGAIN || errno == EINTR);
+        }
+        trace_span("token wait", start, -1);
+    }
+    if (none)
+        return false;
+
+    if (rd != 1) {
+        // Make went away, so nobody's left to share with
+        __atomic_store_n(&gJobserverActive, false, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    pthread_mutex_lock(&gJobserverMutex);
+    if (gHeldCount == gHeldCap) {
+        char *held = realloc(gHeld, gHeldCap ? gHeldCap * 2 : 16);
+        if (!held) {
+            pthread_mutex_unlock(&gJobserverMutex); // exiting gives them back
+            die("Out of memory");
+        }
+        gHeld = held;
+        gHeldCap = gHeldCap ? gHeldCap * 2 : 16;
+    }
+    gHeld[gHeldCount++] = c;
+    ++gAcquired;
+    if (start)
+        gWaitNs += stats_now() - start;
+    pthread_mutex_unlock(&gJobserverMutex);
+    return true;
+}
+
+void jobserver_release(void) {
+    pthread_mutex_lock(&gJobserverMutex);
+    if (gHeldCount) {
+        char c = gHeld[--gHeldCount];
+        while (write(gWriteFd, &c, 1) == -1 && errno == EINTR)
+            ;
+    }
+    pthread_mutex_unlock(&gJobserverMutex);
+}
+
+bool jobserver_stats(uint64_t *acquiredp, uint64_t *wait_nsp) {
+    pthread_mutex_lock(&gJobserverMutex);
+    bool have = jobserver_active() || gAcquired;
+    *acquiredp = gAcquired;
+    *wait_nsp = gWaitNs;
+    pthread_mutex_unlock(&gJobserverMutex);
+    return have;
+}
@@ -0,0 +1,857 @@
+#include "pixz.h"
+#include "libpixz.h"
+
+#include <math.h>
+
+
+#pragma mark TYPES
+
+typedef struct {
+    lzma_block block;
+    lzma_check check;
+    lzma_ret ret; // result of encoding or decoding
+
+    uint8_t *input, *output;
+    size_t incap, outcap;
+    size_t insize, outsize;
+} lib_block_t;
+
+typedef enum {
+    ENC_RUN,
+    ENC_INDEX,
+    ENC_DONE,
+
+    DEC_STREAM_HEADER,
+    DEC_BLOCK_HEADER,
+    DEC_BLOCK_START,
+    DEC_BLOCK,
+    DEC_STREAMING,
+    DEC_INDEX,
+    DEC_FOOTER,
+    DEC_PADDING
+} lib_state;
+
+struct pixz_internal {
+    lib_state state;
+    lzma_ret error; // sticky
+
+    pipeline_t *pl;
+    size_t in_flight; // items sent to the pipeline, but not yet merged
+    pipeline_item_t *fill; // block receiving input, or decoded output
+    pipeline_item_t *drain; // block being copied out
+    size_t drain_pos;
+
+    // Small structures: stream header and footer, block headers
+    uint8_t buf[LZMA_BLOCK_HEADER_SIZE_MAX];
+    size_t buf_pos, buf_size;
+
+    // Encoder
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_options_lzma lzma_opts;
+    size_t block_in, block_out;
+    lzma_index *index;
+
+    // Decoder
+    uint64_t block_limit; // largest block to decode in parallel
+    lzma_stream_flags flags;
+    lzma_index_hash *hash;
+    lzma_block block;
+    lzma_filter block_filters[LZMA_FILTERS_MAX + 1];
+    size_t padding;
+
+    lzma_stream strm; // index encoder, or streaming block decoder
+};
+
+
+#pragma mark FUNCTION DECLARATIONS
+
+static void *lib_block_create(void *ctx);
+static void lib_block_free(void *data);
+static bool lib_block_capacity(lib_block_t *b, size_t incap, size_t outcap);
+
+static lzma_ret lib_init(pixz_stream *strm, const pixz_options *opts,
+    lib_state state, size_t item_size, pipeline_process_t process);
+static lzma_ret lib_drain(pixz_stream *strm, bool wait);
+static bool lib_copy_buf(pixz_stream *strm);
+static bool lib_gather(pixz_stream *strm, size_t size);
+static pipeline_item_t *lib_free_item(pixz_stream *strm);
+static void lib_free_filters(lzma_filter *filters);
+
+static void encode_worker(pipeline_t *pl, size_t thnum);
+static lzma_ret encoder_code(pixz_stream *strm, lzma_action action);
+static void encoder_fill(pixz_stream *strm);
+
+static void decode_worker(pipeline_t *pl, size_t thnum);
+static lzma_ret decoder_code(pixz_stream *strm, lzma_action action);
+static lzma_ret decoder_block_header(pixz_stream *strm);
+static lzma_ret decoder_streaming(pixz_stream *strm);
+
+static size_t size_uncompressible(size_t insize);
+static lzma_ret encode_uncompressible(lzma_block *block, const uint8_t *in,
+    size_t insize, uint8_t *out);
+
+
+#pragma mark BLOCKS
+
+lzma_ret encode_block(lzma_stream *strm, lzma_block *block,
+        const uint8_t *in, size_t insize, uint8_t *out, size_t *outsize) {
+    // Size the header for the largest possible block
+    block->uncompressed_size = insize;
+    block->compressed_size = lzma_block_buffer_bound(insize);
+    lzma_ret err = lzma_block_header_size(block);
+    if (err != LZMA_OK)
+        return err;
+    size_t header_size = block->header_size;
+    size_t uncompressible_size = size_uncompressible(insize) +
+        lzma_check_size(block->check);
+
+    if ((err = lzma_block_encoder(strm, block)) != LZMA_OK)
+        return err;
+    strm->next_in = in;
+    strm->avail_in = insize;
+    strm->next_out = out + header_size;
+    strm->avail_out = uncompressible_size;
+
+    block->uncompressed_size = LZMA_VLI_UNKNOWN; // for encoder to change
+    while ((err = lzma_code(strm, LZMA_FINISH)) == LZMA_OK)
+        ; // pass
+    if (err == LZMA_BUF_ERROR) {
+        if ((err = encode_uncompressible(block, in, insize, out)) != LZMA_OK)
+            return err;
+        *outsize = header_size + uncompressible_size;
+    } else if (err == LZMA_STREAM_END) {
+        *outsize = strm->next_out - out;
+    } else {
+        return err;
+    }
+
+    return lzma_block_header_encode(block, out);
+}
+
+lzma_ret decode_block(lzma_stream *strm, lzma_check check,
+        const uint8_t *in, size_t insize,
+        uint8_t *out, size_t outcap, size_t *outsize) {
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block = { .filters = filters, .check = check, .version = 0 };
+
+    block.header_size = lzma_block_header_size_decode(*in);
+    if (block.header_size > insize)
+        return LZMA_DATA_ERROR;
+    lzma_ret err = lzma_block_header_decode(&block, NULL, in);
+    if (err != LZMA_OK)
+        return err;
+    err = lzma_block_decoder(strm, &block);
+    lib_free_filters(filters);
+    if (err != LZMA_OK)
+        return err;
+
+    strm->next_in = in + block.header_size;
+    strm->avail_in = insize - block.header_size;
+    strm->next_out = out;
+    strm->avail_out = outcap;
+    while ((err = lzma_code(strm, LZMA_FINISH)) == LZMA_OK)
+        ; // pass
+    if (err != LZMA_STREAM_END)
+        return err;
+
+    *outsize = strm->next_out - out;
+    return LZMA_OK;
+}
+
+static size_t size_uncompressible(size_t insize) {
+    size_t chunks = insize / LZMA_CHUNK_MAX;
+    if (insize % LZMA_CHUNK_MAX)
+        ++chunks;
+    // Per chunk (control code + 2-byte size), one byte for EOF
+    size_t data_size = insize + chunks * 3 + 1;
+    if (data_size % 4)
+        data_size += 4 - data_size % 4; // Padding
+    return data_size;
+}
+
+static lzma_ret encode_uncompressible(lzma_block *block, const uint8_t *in,
+        size_t insize, uint8_t *out) {
+    if (block->check != LZMA_CHECK_CRC32)
+        return LZMA_OPTIONS_ERROR; // we only know how to write CRC-32
+
+    // See http://en.wikipedia.org/wiki/Lzma#LZMA2_format
+    const uint8_t control_uncomp = 1;
+    const uint8_t control_end = 0;
+
+    uint8_t *output_start = out + block->header_size;
+    uint8_t *output = output_start;
+    const uint8_t *input = in;
+    size_t remain = insize;
+
+    while (remain) {
+        size_t size = remain;
+        if (size > LZMA_CHUNK_MAX)
+            size = LZMA_CHUNK_MAX;
+
+        // control byte for uncompressed block
+        *output++ = control_uncomp;
+
+        // 16-bit big endian (size - 1)
+        uint16_t size_write = size - 1;
+        *output++ = (size_write >> 8);
+        *output++ = (size_write & 0xFF);
+
+        // actual chunk data
+        memcpy(output, input, size);
+
+        remain -= size;
+        output += size;
+        input += size;
+    }
+    // control byte for end of block
+    *output++ = control_end;
+
+    block->compressed_size = output - output_start;
+    block->uncompressed_size = insize;
+
+    // padding
+    while ((output - output_start) % 4)
+        *output++ = 0;
+
+    // checksum (little endian)
+    uint32_t check = checksum_crc32(in, insize, 0);
+    *output++ = check & 0xFF;
+    *output++ = (check >> 8) & 0xFF;
+    *output++ = (check >> 16) & 0xFF;
+    *output++ = (check >> 24);
+    return LZMA_OK;
+}
+
+static void lib_free_filters(lzma_filter *filters) {
+    for (lzma_filter *f = filters; f->id != LZMA_VLI_UNKNOWN; ++f) {
+        free(f->options);
+        f->options = NULL;
+    }
+}
+
+
+#pragma mark COMMON
+
+void pixz_options_default(pixz_options *opts) {
+    *opts = (pixz_options){ .threads = 0, .queue_size = 0,
+        .preset = LZMA_PRESET_DEFAULT, .block_fraction = 2.0,
+        .memlimit = 0, .cache_size = 0 };
+}
+
+static void *lib_block_create(void *ctx) {
+    return calloc(1, sizeof(lib_block_t)); // pipeline_create copes with NULL
+}
+
+static void lib_block_free(void *data) {
+    lib_block_t *b = (lib_block_t*)data;
+    free(b->input);
+    free(b->output);
+    free(b);
+}
+
+static bool lib_block_capacity(lib_block_t *b, size_t incap, size_t outcap) {
+    if (incap > b->incap) {
+        uint8_t *input = realloc(b->input, incap);
+        if (!input)
+            return false;
+        b->input = input;
+        b->incap = incap;
+    }
+    if (outcap > b->outcap) {
+        uint8_t *output = realloc(b->output, outcap);
+        if (!output)
+            return false;
+        b->output = output;
+        b->outcap = outcap;
+    }
+    return true;
+}
+
+static lzma_ret lib_init(pixz_stream *strm, const pixz_options *opts,
+        lib_state state, size_t item_size, pipeline_process_t process) {
+    pixz_internal *p = strm->internal;
+    p->state = state;
+    p->error = LZMA_OK;
+    p->strm = (lzma_stream)LZMA_STREAM_INIT;
+
+    // Fit the queue into the memory limit, and the threads into the queue
+    size_t threads = num_threads();
+    if (opts->threads && opts->threads < threads)
+        threads = opts->threads;
+    size_t qsize = opts->queue_size ? opts->queue_size
+        : ceil(threads * 1.3 + 1);
+    if (opts->memlimit && item_size) {
+        if (opts->memlimit / item_size < 1)
+            return LZMA_MEMLIMIT_ERROR;
+        if (qsize > opts->memlimit / item_size)
+            qsize = opts->memlimit / item_size;
+    }
+    if (threads > qsize)
+        threads = qsize;
+
+    p->pl = pipeline_create(lib_block_create, lib_block_free, p, threads,
+        qsize);
+    if (!p->pl)
+        return LZMA_MEM_ERROR;
+    if (!pipeline_start(p->pl, NULL, process))
+        return LZMA_MEM_ERROR;
+
+    strm->total_in = strm->total_out = 0;
+    return LZMA_OK;
+}
+
+void pixz_end(pixz_stream *strm) {
+    pixz_internal *p = strm->internal;
+    if (!p)
+        return;
+
+    if (p->pl) {
+        pipeline_stop(p->pl);
+        pipeline_item_t *held[] = { p->fill, p->drain };
+        for (size_t i = 0; i < sizeof(held) / sizeof(held[0]); ++i) {
+            if (held[i])
+                queue_push(p->pl->startq, PIPELINE_ITEM, held[i]);
+        }
+        pipeline_destroy(p->pl);
+    }
+    lzma_end(&p->strm);
+    if (p->index)
+        lzma_index_end(p->index, NULL);
+    if (p->hash)
+        lzma_index_hash_end(p->hash, NULL);
+    lib_free_filters(p->block_filters);
+    free(p);
+    strm->internal = NULL;
+}
+
+lzma_ret pixz_code(pixz_stream *strm, lzma_action action) {
+    pixz_internal *p = strm->internal;
+    if (!p)
+        return LZMA_PROG_ERROR;
+    if (p->error != LZMA_OK)
+        return p->error;
+
+    lzma_ret ret = p->state < DEC_STREAM_HEADER
+        ? encoder_code(strm, action)
+        : decoder_code(strm, action);
+    if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+        p->error = ret;
+    return ret;
+}
+
+// Copy finished blocks to the output. With wait, block until one is ready.
+static lzma_ret lib_drain(pixz_stream *strm, bool wait) {
+    pixz_internal *p = strm->internal;
+    while (true) {
+        if (!p->drain) {
+            if (!p->in_flight)
+                return LZMA_OK;
+            p->drain = wait ? pipeline_merged(p->pl)
+                : pipeline_merged_ready(p->pl);
+            if (!p->drain)
+                return LZMA_OK;
+            wait = false;
+            --p->in_flight;
+            p->drain_pos = 0;
+
+            lib_block_t *b = (lib_block_t*)p->drain->data;
+            if (b->ret != LZMA_OK)
+                return b->ret;
+            if (p->index && lzma_index_append(p->index, NULL,
+                    lzma_block_unpadded_size(&b->block),
+                    b->block.uncompressed_size) != LZMA_OK)
+                return LZMA_PROG_ERROR;
+        }
+
+        lib_block_t *b = (lib_block_t*)p->drain->data;
+        size_t size = b->outsize - p->drain_pos;
+        if (size > strm->avail_out)
+            size = strm->avail_out;
+        if (size)
+            memcpy(strm->next_out, b->output + p->drain_pos, size);
+        strm->next_out += size;
+        strm->avail_out -= size;
+        strm->total_out += size;
+        p->drain_pos += size;
+
+        if (p->drain_pos < b->outsize)
+            return LZMA_OK; // out of space
+        queue_push(p->pl->startq, PIPELINE_ITEM, p->drain);
+        p->drain = NULL;
+    }
+}
+
+// Copy small pending structures to the output, true if all are done
+static bool lib_copy_buf(pixz_stream *strm) {
+    pixz_internal *p = strm->internal;
+    size_t size = p->buf_size - p->buf_pos;
+    if (size > strm->avail_out)
+        size = strm->avail_out;
+    memcpy(strm->next_out, p->buf + p->buf_pos, size);
+    strm->next_out += size;
+    strm->avail_out -= size;
+    strm->total_out += size;
+    p->buf_pos += size;
+
+    if (p->buf_pos < p->buf_size)
+        return false;
+    p->buf_pos = p->buf_size = 0;
+    return true;
+}
+
+// Collect size bytes of input into buf, true once they're all there
+static bool lib_gather(pixz_stream *strm, size_t size) {
+    pixz_internal *p = strm->internal;
+    size_t take = size - p->buf_size;
+    if (take > strm->avail_in)
+        take = strm->avail_in;
+    memcpy(p->buf + p->buf_size, strm->next_in, take);
+    strm->next_in += take;
+    strm->avail_in -= take;
+    strm->total_in += take;
+    p->buf_size += take;
+    return p->buf_size == size;
+}
+
+// A block from the pool, making room by writing output if necessary.
+// NULL means the output is full, or an error occurred.
+static pipeline_item_t *lib_free_item(pixz_stream *strm) {
+    pixz_internal *p = strm->internal;
+    while (true) {
+        pipeline_item_t *pi;
+        int type;
+        if (queue_trypop(p->pl->startq, &type, (void**)&pi))
+            return pi;
+
+        // Everything's busy, wait for the oldest block to finish
+        if (strm->avail_out == 0)
+            return NULL;
+        if ((p->error = lib_drain(strm, true)) != LZMA_OK)
+            return NULL;
+    }
+}
+
+
+#pragma mark ENCODER
+
+lzma_ret pixz_encoder(pixz_stream *strm, const pixz_options *opts) {
+    pixz_end(strm);
+    pixz_internal *p = calloc(1, sizeof(pixz_internal));
+    if (!p)
+        return LZMA_MEM_ERROR;
+    p->block_filters[0].id = LZMA_VLI_UNKNOWN;
+    strm->internal = p;
+
+    lzma_ret ret = LZMA_OPTIONS_ERROR;
+    if (lzma_lzma_preset(&p->lzma_opts, opts->preset))
+        goto error;
+    p->filters[0] = (lzma_filter){ .id = LZMA_FILTER_LZMA2,
+        .options = &p->lzma_opts };
+    p->filters[1] = (lzma_filter){ .id = LZMA_VLI_UNKNOWN, .options = NULL };
+
+    double fraction = opts->block_fraction > 0 ? opts->block_fraction : 2.0;
+    p->block_in = p->lzma_opts.dict_size * fraction;
+    if (p->block_in == 0)
+        goto error;
+    p->block_out = lzma_block_buffer_bound(p->block_in);
+
+    ret = LZMA_MEM_ERROR;
+    if (!(p->index = lzma_index_init(NULL)))
+        goto error;
+
+    lzma_stream_flags flags = { .version = 0, .check = CHECK };
+    if ((ret = lzma_stream_header_encode(&flags, p->buf)) != LZMA_OK)
+        goto error;
+    p->buf_size = LZMA_STREAM_HEADER_SIZE;
+
+    ret = lib_init(strm, opts, ENC_RUN, p->block_in + p->block_out,
+        encode_worker);
+    if (ret == LZMA_OK)
+        return ret;
+
+error:
+    pixz_end(strm);
+    return ret;
+}
+
+static void encode_worker(pipeline_t *pl, size_t thnum) {
+    pixz_internal *p = (pixz_internal*)pl->ctx;
+    lzma_stream stream = LZMA_STREAM_INIT;
+    pipeline_item_t *pi;
+    while (PIPELINE_STOP != queue_pop(pl->splitq, (void**)&pi)) {
+        lib_block_t *b = (lib_block_t*)pi->data;
+        b->block = (lzma_block){ .version = 0, .check = CHECK,
+            .filters = p->filters };
+        if (!lib_block_capacity(b, 0, p->block_out))
+            b->ret = LZMA_MEM_ERROR;
+        else
+            b->ret = encode_block(&stream, &b->block, b->input, b->insize,
+                b->output, &b->outsize);
+        queue_push(pl->mergeq, PIPELINE_ITEM, pi);
+    }
+    lzma_end(&stream);
+}
+
+static void encoder_fill(pixz_stream *strm) {
+    pixz_internal *p = strm->internal;
+    lib_block_t *b = (lib_block_t*)p->fill->data;
+    size_t size = p->block_in - b->insize;
+    if (size > strm->avail_in)
+        size = strm->avail_in;
+    memcpy(b->input + b->insize, strm->next_in, size);
+    strm->next_in += size;
+    strm->avail_in -= size;
+    strm->total_in += size;
+    b->insize += size;
+
+    if (b->insize == p->block_in) {
+        pipeline_split(p->pl, p->fill);
+        ++p->in_flight;
+        p->fill = NULL;
+    }
+}
+
+static lzma_ret encoder_code(pixz_stream *strm, lzma_action action) {
+    pixz_internal *p = strm->internal;
+    lzma_ret ret;
+    if (action != LZMA_RUN && action != LZMA_FULL_FLUSH
+            && action != LZMA_FINISH)
+        return LZMA_OPTIONS_ERROR;
+
+    while (true) {
+        if (!lib_copy_buf(strm))
+            return LZMA_OK;
+
+        switch (p->state) {
+            case ENC_RUN:
+                if ((ret = lib_drain(strm, false)) != LZMA_OK)
+                    return ret;
+
+                if (strm->avail_in) {
+                    if (!p->fill) {
+                        if (!(p->fill = lib_free_item(strm)))
+                            return p->error;
+                        lib_block_t *b = (lib_block_t*)p->fill->data;
+                        b->insize = 0;
+                        if (!lib_block_capacity(b, p->block_in, 0))
+                            return LZMA_MEM_ERROR;
+                    }
+                    encoder_fill(strm);
+                    continue;
+                }
+                if (action == LZMA_RUN)
+                    return LZMA_OK;
+
+                // Flushing, send off what we have and wait for it all
+                if (p->fill) {
+                    lib_block_t *b = (lib_block_t*)p->fill->data;
+                    if (b->insize) {
+                        pipeline_split(p->pl, p->fill);
+                        ++p->in_flight;
+                    } else {
+                        queue_push(p->pl->startq, PIPELINE_ITEM, p->fill);
+                    }
+                    p->fill = NULL;
+                }
+                if (p->in_flight || p->drain) {
+                    if (strm->avail_out == 0)
+                        return LZMA_OK;
+                    if ((ret = lib_drain(strm, true)) != LZMA_OK)
+                        return ret;
+                    continue;
+                }
+                if (action == LZMA_FULL_FLUSH)
+                    return LZMA_STREAM_END;
+
+                if ((ret = lzma_index_encoder(&p->strm, p->index)) != LZMA_OK)
+                    return ret;
+                p->state = ENC_INDEX;
+                break;
+
+            case ENC_INDEX: {
+                if (strm->avail_out == 0)
+                    return LZMA_OK;
+                p->strm.next_out = strm->next_out;
+                p->strm.avail_out = strm->avail_out;
+                ret = lzma_code(&p->strm, LZMA_RUN);
+                strm->total_out += strm->avail_out - p->strm.avail_out;
+                strm->next_out = p->strm.next_out;
+                strm->avail_out = p->strm.avail_out;
+                if (ret == LZMA_OK)
+                    break;
+                if (ret != LZMA_STREAM_END)
+                    return ret;
+
+                lzma_stream_flags flags = { .version = 0, .check = CHECK,
+                    .backward_size = lzma_index_size(p->index) };
+                if ((ret = lzma_stream_footer_encode(&flags, p->buf))
+                        != LZMA_OK)
+                    return ret;
+                p->buf_size = LZMA_STREAM_HEADER_SIZE;
+                p->state = ENC_DONE;
+                break;
+            }
+
+            default: // ENC_DONE
+                return LZMA_STREAM_END;
+        }
+    }
+}
+
+
+#pragma mark DECODER
+
+lzma_ret pixz_decoder(pixz_stream *strm, const pixz_options *opts) {
+    pixz_end(strm);
+    pixz_internal *p = calloc(1, sizeof(pixz_internal));
+    if (!p)
+        return LZMA_MEM_ERROR;
+    p->block_filters[0].id = LZMA_VLI_UNKNOWN;
+    strm->internal = p;
+
+    // Each block needs room for at least one piece of streamed output
+    lzma_ret ret = lib_init(strm, opts, DEC_STREAM_HEADER, STREAMSIZE,
+        decode_worker);
+    if (ret != LZMA_OK) {
+        pixz_end(strm);
+        return ret;
+    }
+
+    // Bigger blocks are decoded in this thread, in bounded pieces
+    p->block_limit = opts->memlimit ? opts->memlimit / p->pl->qsize
+        : MAXSPLITSIZE;
+    return LZMA_OK;
+}
+
+static void decode_worker(pipeline_t *pl, size_t thnum) {
+    lzma_stream stream = LZMA_STREAM_INIT;
+    pipeline_item_t *pi;
+    while (PIPELINE_STOP != queue_pop(pl->splitq, (void**)&pi)) {
+        lib_block_t *b = (lib_block_t*)pi->data;
+        size_t outcap = b->block.uncompressed_size;
+        b->ret = decode_block(&stream, b->check, b->input, b->insize,
+            b->output, outcap, &b->outsize);
+        if (b->ret == LZMA_OK && b->outsize != outcap)
+            b->ret = LZMA_DATA_ERROR;
+        queue_push(pl->mergeq, PIPELINE_ITEM, pi);
+    }
+    lzma_end(&stream);
+}
+
+static lzma_ret decoder_code(pixz_stream *strm, lzma_action action) {
+    pixz_internal *p = strm->internal;
+    lzma_ret ret;
+    if (action != LZMA_RUN && action != LZMA_FINISH)
+        return LZMA_OPTIONS_ERROR;
+
+    while (true) {
+        if ((ret = lib_drain(strm, false)) != LZMA_OK)
+            return ret;
+
+        if (strm->avail_in == 0 && p->state != DEC_BLOCK_START) {
+            if (action == LZMA_RUN)
+                return LZMA_OK;
+            if (p->state != DEC_PADDING)
+                return LZMA_DATA_ERROR; // truncated
+            if (p->padding % 4)
+                return LZMA_DATA_ERROR;
+            if (p->in_flight || p->drain) {
+                if (strm->avail_out == 0)
+                    return LZMA_OK;
+                if ((ret = lib_drain(strm, true)) != LZMA_OK)
+                    return ret;
+                continue;
+            }
+            return LZMA_STREAM_END;
+        }
+
+        switch (p->state) {
+            case DEC_STREAM_HEADER:
+                if (!lib_gather(strm, LZMA_STREAM_HEADER_SIZE))
+                    break;
+                if ((ret = lzma_stream_header_decode(&p->flags, p->buf))
+                        != LZMA_OK)
+                    return ret;
+                if (!(p->hash = lzma_index_hash_init(p->hash, NULL)))
+                    return LZMA_MEM_ERROR;
+                p->buf_size = 0;
+                p->state = DEC_BLOCK_HEADER;
+                break;
+
+            case DEC_BLOCK_HEADER:
+                if (p->buf_size == 0 && strm->next_in[0] == 0) {
+                    p->state = DEC_INDEX; // index indicator
+                    break;
+                }
+                if (!lib_gather(strm, 1) || !lib_gather(strm,
+                        lzma_block_header_size_decode(p->buf[0])))
+                    break;
+                if ((ret = decoder_block_header(strm)) != LZMA_OK)
+                    return ret;
+                break;
+
+            case DEC_BLOCK_START: {
+                // Room for a sized block, which the workers will decode
+                if (!(p->fill = lib_free_item(strm)))
+                    return p->error;
+                lib_block_t *b = (lib_block_t*)p->fill->data;
+                if (!lib_block_capacity(b, lzma_block_total_size(&p->block),
+                        p->block.uncompressed_size))
+                    return LZMA_MEM_ERROR;
+                b->block = p->block;
+                b->check = p->flags.check;
+                memcpy(b->input, p->buf, p->buf_size);
+                b->insize = p->buf_size;
+                p->buf_size = 0;
+                p->state = DEC_BLOCK;
+                break;
+            }
+
+            case DEC_BLOCK: {
+                lib_block_t *b = (lib_block_t*)p->fill->data;
+                size_t total = lzma_block_total_size(&b->block);
+                size_t size = total - b->insize;
+                if (size > strm->avail_in)
+                    size = strm->avail_in;
+                memcpy(b->input + b->insize, strm->next_in, size);
+                strm->next_in += size;
+                strm->avail_in -= size;
+                strm->total_in += size;
+                b->insize += size;
+                if (b->insize < total)
+                    break;
+
+                if (lzma_index_hash_append(p->hash,
+                        lzma_block_unpadded_size(&b->block),
+                        b->block.uncompressed_size) != LZMA_OK)
+                    return LZMA_DATA_ERROR;
+                pipeline_split(p->pl, p->fill);
+                ++p->in_flight;
+                p->fill = NULL;
+                p->state = DEC_BLOCK_HEADER;
+                break;
+            }
+
+            case DEC_STREAMING:
+                if (!p->fill) {
+                    if (!(p->fill = lib_free_item(strm)))
+                        return p->error;
+                    lib_block_t *b = (lib_block_t*)p->fill->data;
+                    if (!lib_block_capacity(b, 0, STREAMSIZE))
+                        return LZMA_MEM_ERROR;
+                    b->outsize = 0;
+                    b->ret = LZMA_OK;
+                }
+                if ((ret = decoder_streaming(strm)) != LZMA_OK)
+                    return ret;
+                break;
+
+            case DEC_INDEX: {
+                size_t pos = 0;
+                ret = lzma_index_hash_decode(p->hash, strm->next_in, &pos,
+                    strm->avail_in);
+                strm->next_in += pos;
+                strm->avail_in -= pos;
+                strm->total_in += pos;
+                if (ret == LZMA_STREAM_END)
+                    p->state = DEC_FOOTER;
+                else if (ret != LZMA_OK)
+                    return ret;
+                break;
+            }
+
+            case DEC_FOOTER: {
+                if (!lib_gather(strm, LZMA_STREAM_HEADER_SIZE))
+                    break;
+                lzma_stream_flags footer;
+                if ((ret = lzma_stream_footer_decode(&footer, p->buf))
+                        != LZMA_OK)
+                    return ret;
+                if (lzma_stream_flags_compare(&p->flags, &footer) != LZMA_OK
+                        || footer.backward_size
+                            != lzma_index_hash_size(p->hash))
+                    return LZMA_DATA_ERROR;
+                p->buf_size = 0;
+                p->padding = 0;
+                p->state = DEC_PADDING;
+                break;
+            }
+
+            case DEC_PADDING:
+                while (strm->avail_in && strm->next_in[0] == 0) {
+                    ++strm->next_in;
+                    --strm->avail_in;
+                    ++strm->total_in;
+                    ++p->padding;
+                }
+                if (strm->avail_in) { // another stream follows
+                    if (p->padding % 4)
+                        return LZMA_DATA_ERROR;
+                    p->state = DEC_STREAM_HEADER;
+                }
+                break;
+
+            default:
+                return LZMA_PROG_ERROR;
+        }
+    }
+}
+
+static lzma_ret decoder_block_header(pixz_stream *strm) {
+    pixz_internal *p = strm->internal;
+    lib_free_filters(p->block_filters);
+    p->block = (lzma_block){ .version = 0, .check = p->flags.check,
+        .filters = p->block_filters, .header_size = p->buf_size };
+    lzma_ret ret = lzma_block_header_decode(&p->block, NULL, p->buf);
+    if (ret != LZMA_OK)
+        return ret;
+
+    bool sized = p->block.compressed_size != LZMA_VLI_UNKNOWN
+        && p->block.uncompressed_size != LZMA_VLI_UNKNOWN;
+    if (sized && lzma_block_total_size(&p->block)
+            + p->block.uncompressed_size <= p->block_limit) {
+        p->state = DEC_BLOCK_START;
+        return LZMA_OK;
+    }
+
+    if ((ret = lzma_block_decoder(&p->strm, &p->block)) != LZMA_OK)
+        return ret;
+    p->buf_size = 0;
+    p->state = DEC_STREAMING;
+    return LZMA_OK;
+}
+
+// Decode a block in this thread, sending output through the pipeline so it
+// stays in order with the blocks the workers are decoding
+static lzma_ret decoder_streaming(pixz_stream *strm) {
+    pixz_internal *p = strm->internal;
+    lib_block_t *b = (lib_block_t*)p->fill->data;
+    p->strm.next_in = strm->next_in;
+    p->strm.avail_in = strm->avail_in;
+    p->strm.next_out = b->output + b->outsize;
+    p->strm.avail_out = STREAMSIZE - b->outsize;
+    lzma_ret ret = lzma_code(&p->strm, LZMA_RUN);
+    strm->total_in += strm->avail_in - p->strm.avail_in;
+    strm->next_in = p->strm.next_in;
+    strm->avail_in = p->strm.avail_in;
+    b->outsize = STREAMSIZE - p->strm.avail_out;
+
+    if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+        return ret;
+    if (ret == LZMA_STREAM_END) {
+        if (lzma_index_hash_append(p->hash,
+                lzma_block_unpadded_size(&p->block),
+                p->block.uncompressed_size) != LZMA_OK)
+            return LZMA_DATA_ERROR;
+        p->state = DEC_BLOCK_HEADER;
+    }
+    if (b->outsize == STREAMSIZE || (ret == LZMA_STREAM_END && b->outsize)) {
+        pipeline_dispatch(p->pl, p->fill, p->pl->mergeq);
+        ++p->in_flight;
+        p->fill = NULL;
+    } else if (ret == LZMA_STREAM_END) {
+        queue_push(p->pl->startq, PIPELINE_ITEM, p->fill);
+        p->fill = NULL;
+    }
+    return LZMA_OK;
+}
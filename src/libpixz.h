@@ -0,0 +1,122 @@
+#ifndef LIBPIXZ_H
+#define LIBPIXZ_H
+
+/* Parallel xz compression and decompression, with an API modelled on
+ * liblzma's lzma_stream. Each pixz_stream owns its worker threads and
+ * buffers, so independent streams may be used concurrently. A single
+ * pixz_stream must only be used by one thread at a time.
+ *
+ *     pixz_stream strm = PIXZ_STREAM_INIT;
+ *     pixz_options opts;
+ *     pixz_options_default(&opts);
+ *     if (pixz_encoder(&strm, &opts) != LZMA_OK) ...
+ *     // fill next_in/avail_in and next_out/avail_out, then
+ *     ret = pixz_code(&strm, LZMA_RUN);    // or LZMA_FINISH at the end
+ *     ...
+ *     pixz_end(&strm);
+ *
+ * pixz_code() returns LZMA_OK when it needs more input or more output
+ * space, and LZMA_STREAM_END once LZMA_FINISH (or a flush) is complete.
+ * Any other value is an error, and the stream can only be ended.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lzma.h>
+
+typedef struct pixz_internal pixz_internal;
+
+typedef struct {
+    uint32_t threads;       // maximum worker threads, zero for one per CPU
+    uint32_t queue_size;    // blocks allocated, zero for automatic
+    uint32_t preset;        // encoder: xz preset, may include PRESET_EXTREME
+    double block_fraction;  // encoder: block size relative to the dictionary
+    uint64_t memlimit;      // bytes of block buffers, zero for no limit
+    uint64_t cache_size;    // reader: bytes of decoded blocks, zero for auto
+} pixz_options;
+
+typedef struct {
+    const uint8_t *next_in;
+    size_t avail_in;
+    uint64_t total_in;
+
+    uint8_t *next_out;
+    size_t avail_out;
+    uint64_t total_out;
+
+    pixz_internal *internal;
+} pixz_stream;
+
+#define PIXZ_STREAM_INIT { NULL, 0, 0, NULL, 0, 0, NULL }
+
+void pixz_options_default(pixz_options *opts);
+
+// Produce a single-stream .xz file of independently compressed blocks
+lzma_ret pixz_encoder(pixz_stream *strm, const pixz_options *opts);
+
+// Decode .xz input, including concatenated streams. Blocks that record
+// their sizes are decoded in parallel, others in the calling thread.
+lzma_ret pixz_decoder(pixz_stream *strm, const pixz_options *opts);
+
+// The encoder accepts LZMA_RUN, LZMA_FULL_FLUSH (ends the current block)
+// and LZMA_FINISH. The decoder accepts LZMA_RUN and LZMA_FINISH.
+lzma_ret pixz_code(pixz_stream *strm, lzma_action action);
+
+void pixz_end(pixz_stream *strm);
+
+
+/* Random access to the uncompressed data of an indexed .xz file, such as
+ * pixz writes, and to the members of a tarball with a pixz file index.
+ * Blocks are decoded on demand and kept in an LRU cache of cache_size
+ * bytes (never less than the biggest block). When reads are sequential,
+ * the next blocks are decoded in the background, one per thread.
+ *
+ * A pixz_reader may be used by several threads at once. Readers can also
+ * share one pixz_cache, with its memory budget and decoding threads. */
+
+typedef struct pixz_cache pixz_cache;
+typedef struct pixz_reader pixz_reader;
+typedef struct pixz_member pixz_member;
+
+// Uses opts' threads and cache_size, zero cache_size is 256 MiB
+pixz_cache *pixz_cache_new(const pixz_options *opts);
+// Close its readers first
+void pixz_cache_free(pixz_cache *cache);
+
+// The file must stay open, and seekable, until the reader is closed.
+// Returns LZMA_FORMAT_ERROR if it has no valid .xz index.
+lzma_ret pixz_reader_open(pixz_reader **readerp, int fd,
+    const pixz_options *opts);
+lzma_ret pixz_reader_open_cache(pixz_reader **readerp, int fd,
+    pixz_cache *cache);
+void pixz_reader_close(pixz_reader *reader);
+
+// Uncompressed size, not including any file index
+uint64_t pixz_reader_size(pixz_reader *reader);
+
+// Like pread(), *readp is only short at the end of the data
+lzma_ret pixz_reader_read(pixz_reader *reader, uint64_t offset, uint8_t *buf,
+    size_t len, size_t *readp);
+
+// The tar members in the file index, in archive order. Each spans from
+// *startp to *endp, headers and padding included. NULL past the end.
+size_t pixz_reader_entries(pixz_reader *reader);
+const char *pixz_reader_entry(pixz_reader *reader, size_t i,
+    uint64_t *startp, uint64_t *endp);
+
+// Find a tar member by its name in the archive. Sets *memberp to NULL if
+// there's no such member, returns LZMA_FORMAT_ERROR if there's no file
+// index, or LZMA_OPTIONS_ERROR for sparse files. Close members before
+// their reader.
+lzma_ret pixz_member_open(pixz_reader *reader, const char *path,
+    pixz_member **memberp);
+void pixz_member_close(pixz_member *member);
+
+uint64_t pixz_member_size(pixz_member *member);
+// Where the member's data starts, within the reader's data
+uint64_t pixz_member_offset(pixz_member *member);
+lzma_ret pixz_member_read(pixz_member *member, uint64_t offset, uint8_t *buf,
+    size_t len, size_t *readp);
+
+#endif
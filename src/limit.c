@@ -0,0 +1,273 @@
+#include "pixz.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Limits on how fast we read, write and use the CPU, so pixz can share a
+ * busy machine.
+ *
+ * Each limit is a token bucket, refilled at its rate. Taking more than is
+ * there leaves the bucket in debt, and the taker sleeps until its part of
+ * the debt is paid off, so a saturated stage runs at the rate exactly. A
+ * bucket only holds LIMIT_BURST_MS worth of tokens, so a stage that was
+ * idle can't then burst for long.
+ *
+ * Reads and writes are charged in bytes, as they happen. Workers are charged
+ * the CPU time they used since their last block, when they ask for the next,
+ * so a CPU limit paces dispatch to them.
+ *
+ * Limits can change while we run: a control file is read at the start, and
+ * again whenever it changes or we get SIGHUP. */
+
+#define LIMIT_BURST_MS 100
+#define LIMIT_POLL_MS 1000 // between checks of the control file
+
+
+#pragma mark TYPES
+
+typedef struct {
+    double rate; // per second, zero for no limit
+    double tokens; // below zero when in debt
+    uint64_t last; // nsec, when tokens was last brought up to date
+} bucket_t;
+
+
+#pragma mark GLOBALS
+
+bool gLimited = false;
+
+static pthread_mutex_t gLimitMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gLimitCond = PTHREAD_COND_INITIALIZER; // rates changed
+static bucket_t gBuckets[LIMIT_COUNT];
+
+static const char *gControlPath = NULL;
+static struct stat gControlStat; // to tell when it changes
+static int gWakeFds[2] = { -1, -1 };
+static pthread_t gControlThread;
+static bool gControlStarted = false;
+static struct sigaction gOldAction;
+
+static __thread uint64_t tCpuLast = 0; // thread CPU time at the last charge
+
+
+#pragma mark DECLARATIONS
+
+static uint64_t limit_now(void);
+static void limit_refill(bucket_t *b, uint64_t now);
+static void limit_signal(int sig);
+static void *limit_thread(void *data);
+static void limit_read_control(bool force);
+
+
+#pragma mark SETTINGS
+
+bool limit_parse(limit_kind_t kind, const char *str, double *ratep) {
+    if (kind == LIMIT_CPU) { // cores
+        char *end;
+        errno = 0;
+        double cores = strtod(str, &end);
+        if (errno || end == str || *end || !(cores >= 0) || isinf(cores))
+            return false;
+        *ratep = cores;
+        return true;
+    }
+    uint64_t size;
+    if (!parse_size(str, &size))
+        return false;
+    *ratep = size;
+    return true;
+}
+
+void limit_set(limit_kind_t kind, double rate) {
+    pthread_mutex_lock(&gLimitMutex);
+    bucket_t *b = &gBuckets[kind];
+    uint64_t now = limit_now();
+    limit_refill(b, now);
+    if (b->rate == 0) // start with a full bucket
+        b->tokens = rate * LIMIT_BURST_MS / 1000;
+    b->rate = rate;
+    b->last = now;
+    if (rate && !gLimited) // only before there are other threads
+        gLimited = true;
+    pthread_cond_broadcast(&gLimitCond); // sleepers may go sooner
+    pthread_mutex_unlock(&gLimitMutex);
+}
+
+void limit_start(const char *control) {
+    if (!control)
+        return;
+    gControlPath = control;
+    gLimited = true; // the file may add limits later
+    limit_read_control(true);
+
+    if (pipe(gWakeFds) == -1)
+        die("Can't create limit pipe");
+    fcntl(gWakeFds[1], F_SETFL, O_NONBLOCK); // never block in the handler
+    if (pthread_create(&gControlThread, NULL, limit_thread, NULL))
+        die("Error starting limit thread");
+    gControlStarted = true;
+
+    struct sigaction sa = { .sa_handler = limit_signal,
+        .sa_flags = SA_RESTART };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, &gOldAction);
+}
+
+void limit_finish(void) {
+    if (!gControlStarted)
+        return;
+    sigaction(SIGHUP, &gOldAction, NULL);
+    char quit = 'q';
+    if (write(gWakeFds[1], &quit, 1) != 1)
+        die("Can't stop limit thread");
+    pthread_join(gControlThread, NULL);
+    close(gWakeFds[0]);
+    close(gWakeFds[1]);
+    gWakeFds[0] = gWakeFds[1] = -1;
+    gControlStarted = false;
+}
+
+
+#pragma mark PACING
+
+void limit_take(limit_kind_t kind, double amount) {
+    if (!gLimited)
+        return;
+    pthread_mutex_lock(&gLimitMutex);
+    bucket_t *b = &gBuckets[kind];
+    double rate = b->rate;
+    uint64_t now = limit_now(), until = now;
+    if (rate) {
+        limit_refill(b, now);
+        b->tokens -= amount;
+        if (b->tokens < 0) // when our share of the debt is paid
+            until += -b->tokens / rate * 1e9;
+    }
+
+    // Wait for that, unless the limit changes or goes away
+    while (b->rate && now < until) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t ns = ts.tv_nsec + (until - now);
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        pthread_cond_timedwait(&gLimitCond, &gLimitMutex, &ts);
+
+        now = limit_now();
+        if (b->rate && b->rate != rate && now < until) {
+            until = now + (until - now) * (rate / b->rate);
+            rate = b->rate;
+        }
+    }
+    pthread_mutex_unlock(&gLimitMutex);
+}
+
+void limit_cpu(void) {
+    if (!gLimited)
+        return;
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return;
+    uint64_t cpu = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    uint64_t used = tCpuLast ? cpu - tCpuLast : 0;
+    tCpuLast = cpu;
+    limit_take(LIMIT_CPU, used / 1e9);
+}
+
+static uint64_t limit_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Called with the lock held
+static void limit_refill(bucket_t *b, uint64_t now) {
+    double cap = b->rate * LIMIT_BURST_MS / 1000;
+    b->tokens += b->rate * (now - b->last) / 1e9;
+    if (b->tokens > cap)
+        b->tokens = cap;
+    b->last = now;
+}
+
+
+#pragma mark CONTROL FILE
+
+static void limit_signal(int sig) {
+    int err = errno;
+    char c = 'r';
+    ssize_t wr = write(gWakeFds[1], &c, 1); // if the pipe is full, fine
+    (void)wr;
+    errno = err;
+}
+
+static void *limit_thread(void *data) {
+    while (true) {
+        struct pollfd pfd = { .fd = gWakeFds[0], .events = POLLIN };
+        int ready = poll(&pfd, 1, LIMIT_POLL_MS);
+        if (ready == -1 && errno != EINTR)
+            die("Error waiting for limit changes");
+        bool force = false;
+        if (ready > 0) {
+            char c;
+            if (read(gWakeFds[0], &c, 1) == 1 && c == 'q')
+                break;
+            force = true; // asked for, even if it seems unchanged
+        }
+        limit_read_control(force);
+    }
+    return NULL;
+}
+
+// Lines of "read-rate RATE", "write-rate RATE" or "cpu CORES", where zero
+// means no limit. Blank lines and those starting with # are ignored. A
+// limit the file doesn't mention is left as it was.
+static void limit_read_control(bool force) {
+    struct stat st;
+    if (stat(gControlPath, &st) == -1) {
+        if (!gControlStarted) // a typo, most likely
+            die("Can't read limits from %s: %s", gControlPath,
+                strerror(errno));
+        if (force)
+            fprintf(stderr, "pixz: can't read limits from %s: %s\n",
+                gControlPath, strerror(errno));
+        return;
+    }
+    if (!force && st.st_mtime == gControlStat.st_mtime
+            && st.st_size == gControlStat.st_size
+            && st.st_ino == gControlStat.st_ino)
+        return;
+    gControlStat = st;
+
+    FILE *f = fopen(gControlPath, "r");
+    if (!f) {
+        fprintf(stderr, "pixz: can't read limits from %s: %s\n",
+            gControlPath, strerror(errno));
+        return;
+    }
+    static const char *names[LIMIT_COUNT] = { "read-rate", "write-rate",
+        "cpu" };
+    char line[256], key[32], value[64];
+    for (size_t n = 1; fgets(line, sizeof(line), f); ++n) {
+        int fields = sscanf(line, " %31s %63s", key, value);
+        if (fields <= 0 || key[0] == '#')
+            continue;
+        size_t kind = 0;
+        while (kind < LIMIT_COUNT && strcmp(key, names[kind]) != 0)
+            ++kind;
+        double rate;
+        if (fields != 2 || kind == LIMIT_COUNT
+                || !limit_parse(kind, value, &rate)) {
+            fprintf(stderr, "pixz: %s:%zu: expected read-rate, write-rate "
+                "or cpu, and a value\n", gControlPath, n);
+            continue;
+        }
+        limit_set(kind, rate);
+    }
+    fclose(f);
+}
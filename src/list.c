@@ -3,6 +3,7 @@
 #pragma mark FUNCTION DEFINITIONS
 
 void pixz_list(bool tar) {
+    stats_start(NULL, "list");
     if (!decode_index())
 		die("Can't list non-seekable input");
 	
@@ -19,6 +20,7 @@ void pixz_list(bool tar) {
                 (uintmax_t)iter.block.uncompressed_size);
         }
     }
+    stats_finish();
     
     lzma_index_end(gIndex, NULL);
     lzma_end(&gStream);
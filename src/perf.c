@@ -0,0 +1,211 @@
+#include "pixz.h"
+
+#include <errno.h>
+
+#if HAVE_LINUX_PERF_EVENT_H
+    #include <linux/perf_event.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+/* Hardware event counts for each stage, to tell whether it's waiting on
+ * memory, reported with the other statistics.
+ *
+ * Each thread counts only itself, from when it starts working for a stage
+ * until it's done, and adds its counts to its stage's totals once at the
+ * end. So periodic reports only include threads that have finished.
+ * Events the kernel won't let us count are reported as null. */
+
+typedef enum {
+    PERF_TASK_CLOCK,
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_EVENTS
+} perf_event_t;
+
+
+#pragma mark GLOBALS
+
+bool gPerf = false;
+
+static pthread_mutex_t gPerfMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t gPerfCounts[STAGE_COUNT][PERF_EVENTS];
+static bool gPerfCounted[STAGE_COUNT][PERF_EVENTS]; // by any thread
+static const char *gPerfError = NULL; // why an event couldn't be counted
+
+static __thread int tPerfFds[PERF_EVENTS];
+static __thread stats_stage_t tPerfStage;
+static __thread bool tPerfActive = false;
+
+
+#pragma mark DECLARATIONS
+
+static int perf_open(perf_event_t event);
+static bool perf_read(int fd, uint64_t *countp);
+static void report_field(FILE *out, const char *sep, const char *name,
+    bool ok, double value, int decimals);
+
+
+#pragma mark COUNTING
+
+void perf_thread_start(stats_stage_t stage) {
+    if (!gPerf || tPerfActive)
+        return;
+    for (size_t i = 0; i < PERF_EVENTS; ++i)
+        tPerfFds[i] = perf_open(i);
+    tPerfStage = stage;
+    tPerfActive = true;
+}
+
+void perf_thread_stop(void) {
+    if (!tPerfActive)
+        return;
+    tPerfActive = false;
+
+    uint64_t counts[PERF_EVENTS];
+    bool ok[PERF_EVENTS];
+    for (size_t i = 0; i < PERF_EVENTS; ++i) {
+        ok[i] = tPerfFds[i] != -1 && perf_read(tPerfFds[i], &counts[i]);
+#if HAVE_LINUX_PERF_EVENT_H
+        if (tPerfFds[i] != -1)
+            close(tPerfFds[i]);
+#endif
+    }
+
+    pthread_mutex_lock(&gPerfMutex);
+    for (size_t i = 0; i < PERF_EVENTS; ++i) {
+        if (ok[i]) {
+            gPerfCounts[tPerfStage][i] += counts[i];
+            gPerfCounted[tPerfStage][i] = true;
+        }
+    }
+    pthread_mutex_unlock(&gPerfMutex);
+}
+
+#if HAVE_LINUX_PERF_EVENT_H
+
+static int perf_open(perf_event_t event) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.exclude_kernel = 1; // allowed with a stricter perf_event_paranoid
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+        | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    switch (event) {
+        case PERF_TASK_CLOCK:
+            attr.type = PERF_TYPE_SOFTWARE;
+            attr.config = PERF_COUNT_SW_TASK_CLOCK;
+            break;
+        case PERF_CYCLES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PERF_INSTRUCTIONS:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PERF_LLC_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_LL
+                | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PERF_DTLB_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_DTLB
+                | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        default:
+            return -1;
+    }
+
+    // This thread, on any CPU
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd == -1) {
+        const char *why = errno == EACCES || errno == EPERM
+            ? "not permitted, see /proc/sys/kernel/perf_event_paranoid"
+            : errno == ENOENT || errno == EOPNOTSUPP
+            ? "not supported by this CPU or virtual machine"
+            : "perf_event_open failed";
+        pthread_mutex_lock(&gPerfMutex);
+        if (!gPerfError)
+            gPerfError = why;
+        pthread_mutex_unlock(&gPerfMutex);
+    }
+    return fd;
+}
+
+static bool perf_read(int fd, uint64_t *countp) {
+    uint64_t values[3]; // count, time enabled, time running
+    if (read(fd, values, sizeof(values)) != sizeof(values))
+        return false;
+    // Scale up if the event was multiplexed with others
+    if (values[2] && values[2] < values[1])
+        values[0] = (double)values[0] * values[1] / values[2];
+    *countp = values[0];
+    return true;
+}
+
+#else
+
+static int perf_open(perf_event_t event) {
+    gPerfError = "not supported on this platform";
+    return -1;
+}
+
+static bool perf_read(int fd, uint64_t *countp) {
+    return false;
+}
+
+#endif
+
+
+#pragma mark REPORT
+
+void perf_report(FILE *out) {
+    static const char *stages[STAGE_COUNT] = { "read", "code", "write" };
+    pthread_mutex_lock(&gPerfMutex);
+    fprintf(out, "{");
+    for (size_t s = 0; s < STAGE_COUNT; ++s) {
+        uint64_t *n = gPerfCounts[s];
+        bool *ok = gPerfCounted[s];
+        fprintf(out, "%s\"%s\":{", s ? "," : "", stages[s]);
+        report_field(out, "", "cpu_time", ok[PERF_TASK_CLOCK],
+            n[PERF_TASK_CLOCK] / 1e9, 6);
+        report_field(out, ",", "cycles", ok[PERF_CYCLES], n[PERF_CYCLES], 0);
+        report_field(out, ",", "instructions", ok[PERF_INSTRUCTIONS],
+            n[PERF_INSTRUCTIONS], 0);
+        report_field(out, ",", "llc_misses", ok[PERF_LLC_MISSES],
+            n[PERF_LLC_MISSES], 0);
+        report_field(out, ",", "dtlb_misses", ok[PERF_DTLB_MISSES],
+            n[PERF_DTLB_MISSES], 0);
+
+        // Rates, with misses per thousand instructions
+        double insns = n[PERF_INSTRUCTIONS];
+        bool iok = ok[PERF_INSTRUCTIONS] && insns;
+        bool cok = ok[PERF_CYCLES] && n[PERF_CYCLES];
+        report_field(out, ",", "ipc", iok && cok, insns / n[PERF_CYCLES], 3);
+        report_field(out, ",", "llc_mpki", iok && ok[PERF_LLC_MISSES],
+            n[PERF_LLC_MISSES] * 1000 / insns, 3);
+        report_field(out, ",", "dtlb_mpki", iok && ok[PERF_DTLB_MISSES],
+            n[PERF_DTLB_MISSES] * 1000 / insns, 3);
+        fprintf(out, "}");
+    }
+    if (gPerfError)
+        fprintf(out, ",\"error\":\"%s\"", gPerfError);
+    fprintf(out, "}");
+    pthread_mutex_unlock(&gPerfMutex);
+}
+
+static void report_field(FILE *out, const char *sep, const char *name,
+        bool ok, double value, int decimals) {
+    if (ok)
+        fprintf(out, "%s\"%s\":%.*f", sep, name, decimals, value);
+    else
+        fprintf(out, "%s\"%s\":null", sep, name);
+}
@@ -8,12 +8,72 @@ typedef enum {
     OP_WRITE,
     OP_READ,
     OP_EXTRACT,
-    OP_LIST
+    OP_LIST,
+    OP_TEST,
+    OP_RANGE,
+    OP_MEMBER,
+    OP_DAEMON
 } pixz_op_t;
 
+enum {
+    OPT_DIGEST = 256,
+    OPT_DIGEST_FILE,
+    OPT_ALIGN,
+    OPT_DAEMON,
+    OPT_SOCKET,
+    OPT_NO_DAEMON,
+    OPT_RANGE,
+    OPT_MEMBER,
+    OPT_CACHE,
+    OPT_BATCH,
+    OPT_CREATE,
+    OPT_STATS,
+    OPT_STATS_INTERVAL,
+    OPT_TRACE,
+    OPT_PROGRESS,
+    OPT_COUNTERS,
+    OPT_MAX_READ_RATE,
+    OPT_MAX_WRITE_RATE,
+    OPT_MAX_CPU,
+    OPT_LIMITS,
+    OPT_ADAPTIVE,
+    OPT_NO_SPLICE,
+    OPT_NO_JOBSERVER
+};
+
+static const struct option gLongOpts[] = {
+    { "digest", required_argument, NULL, OPT_DIGEST },
+    { "digest-file", required_argument, NULL, OPT_DIGEST_FILE },
+    { "align", required_argument, NULL, OPT_ALIGN },
+    { "daemon", no_argument, NULL, OPT_DAEMON },
+    { "socket", required_argument, NULL, OPT_SOCKET },
+    { "no-daemon", no_argument, NULL, OPT_NO_DAEMON },
+    { "range", required_argument, NULL, OPT_RANGE },
+    { "member", required_argument, NULL, OPT_MEMBER },
+    { "cache", required_argument, NULL, OPT_CACHE },
+    { "batch", no_argument, NULL, OPT_BATCH },
+    { "create", no_argument, NULL, OPT_CREATE },
+    { "stats", no_argument, NULL, OPT_STATS },
+    { "stats-interval", required_argument, NULL, OPT_STATS_INTERVAL },
+    { "trace", required_argument, NULL, OPT_TRACE },
+    { "progress", no_argument, NULL, OPT_PROGRESS },
+    { "counters", no_argument, NULL, OPT_COUNTERS },
+    { "max-read-rate", required_argument, NULL, OPT_MAX_READ_RATE },
+    { "max-write-rate", required_argument, NULL, OPT_MAX_WRITE_RATE },
+    { "max-cpu", required_argument, NULL, OPT_MAX_CPU },
+    { "limits", required_argument, NULL, OPT_LIMITS },
+    { "adaptive", no_argument, NULL, OPT_ADAPTIVE },
+    { "no-splice", no_argument, NULL, OPT_NO_SPLICE },
+    { "no-jobserver", no_argument, NULL, OPT_NO_JOBSERVER },
+    { NULL, 0, NULL, 0 }
+};
+
 static bool strsuf(char *big, char *small);
 static char *subsuf(char *in, char *suf1, char *suf2);
 static char *auto_output(pixz_op_t op, char *in);
+static bool parse_range(const char *str, char *offset, char *length);
+static pixz_file_t *batch_files(pixz_op_t op, int argc, char **argv,
+    bool remove, size_t *countp);
 
 static void usage(const char *msg) {
 	if (msg)
@@ -30,21 +90,56 @@ static void usage(const char *msg) {
 "  pixz input.tar output.tpxz      # Compress and index a tarball\n"
 "  pixz -d input.tpxz output.tar   # Decompress\n"
 "  pixz -l input.tpxz              # List tarball contents very fast\n"
+"  pixz -T input.tpxz              # Test it, decoding in parallel\n"
 "  pixz -x path/to/file < input.tpxz | tar x  # Extract one file very fast\n"
 "  tar -Ipixz -cf output.tpxz dir  # Make tar use pixz automatically\n"
+"  pixz --create dir -o out.tpxz   # Make the tarball too, reading in parallel\n"
 "\n"
 "Input and output:\n"
 "  pixz < input > output.pxz       # Same as `pixz input output.pxz`\n"
 "  pixz -i input -o output.pxz     # Ditto\n"
 "  pixz [-d] input                 # Automatically choose output filename\n"
+"  pixz [-d] --batch input...      # Many files, sharing one set of threads\n"
+"  find ... | pixz [-d] --batch    # Ditto, with one input per line\n"
 "\n"
 "Other flags:\n"
 "  -0, -1 ... -9      Set compression level, from fastest to strongest\n"
 "  -p NUM             Use a maximum of NUM CPU-intensive threads\n"
+"  -p MIN:MAX         Use between MIN and MAX, as with --adaptive\n"
 "  -t                 Don't assume input is in tar format\n"
 "  -k                 Keep original input (do not remove it)\n"
 "  -c                 ignored\n"
 "  -h                 Print this help\n"
+"  --digest LIST      Print digests of the compressed output to stderr,\n"
+"                     LIST is a comma-separated subset of\n"
+"                     crc32,crc64,md5,sha256\n"
+"  --digest-file FILE Write the digests to FILE instead of stderr\n"
+"  --align SIZE       Start each compressed block on a SIZE boundary\n"
+"  --stats            Print performance statistics as JSON to stderr\n"
+"  --stats-interval N Ditto, every N seconds as well as at the end\n"
+"  --counters         Add hardware counters for each stage to --stats\n"
+"  --trace FILE       Write a timeline of each thread's work to FILE\n"
+"  --progress         Show progress, throughput and time left on stderr;\n"
+"                     SIGUSR1 prints a one-line report in any case\n"
+"  --max-read-rate R  Read at most R bytes per second, with a K, M or G\n"
+"  --max-write-rate R Write at most R bytes per second\n"
+"  --max-cpu CORES    Use at most CORES worth of CPU time for coding\n"
+"  --limits FILE      Read the above from FILE, and again when it changes\n"
+"                     or on SIGHUP\n"
+"  --adaptive         Park threads while the system is under pressure,\n"
+"                     down to the -p floor\n"
+"  --no-splice        Always write() decompressed output, never vmsplice\n"
+"  --no-jobserver     Ignore make's jobserver, using -p threads regardless\n"
+"\n"
+"Random access:\n"
+"  --range OFF[:LEN]  Output LEN bytes of uncompressed data from OFF\n"
+"  --member PATH      Output the contents of one file in a tarball\n"
+"  --daemon           Serve -l, -x, --range and --member requests,\n"
+"                     keeping indexes and decoded blocks cached\n"
+"  --socket PATH      Use PATH as the daemon's socket\n"
+"  --cache SIZE       Cache up to SIZE bytes of decoded blocks\n"
+"  --no-daemon        Never ask a daemon to do the work\n"
+"  -v                 With --daemon, log each request to stderr\n"
 "\n"
 "pixz %s\n"
 "(C) 2009-2012 Dave Vasilevsky <dave@vasilevsky.ca>\n"
@@ -59,23 +154,34 @@ int main(int argc, char **argv) {
     bool tar = true;
     bool keep_input = false;
     bool extreme = false;
+    bool batch = false;
+    bool create = false;
     pixz_op_t op = OP_WRITE;
     char *ipath = NULL, *opath = NULL;
+    const char *sock_path = NULL, *trace_path = NULL, *limits_path = NULL;
+    bool use_daemon = true, verbose = false;
+    uint64_t cache_size = 0;
+    char range_offset[24], range_length[24] = "", *member = NULL;
     
     int ch;
 	char *optend;
 	long optint;
     double optdbl;
-    while ((ch = getopt(argc, argv, "dcxli:o:tkvhp:0123456789f:q:e")) != -1) {
+    uint64_t optsize;
+    jobserver_start(); // while the descriptors make names can only be its own
+    while ((ch = getopt_long(argc, argv, "dcxlTi:o:tkvhp:0123456789f:q:e",
+            gLongOpts, NULL)) != -1) {
         switch (ch) {
             case 'c': break;
             case 'd': op = OP_READ; break;
             case 'x': op = OP_EXTRACT; break;
             case 'l': op = OP_LIST; break;
+            case 'T': op = OP_TEST; break;
             case 'i': ipath = optarg; break;
             case 'o': opath = optarg; break;
             case 't': tar = false; break;
             case 'k': keep_input = true; break;
+            case 'v': verbose = true; break;
 			case 'h': usage(NULL); break;
             case 'e': extreme = true; break;
 			case 'f':
@@ -86,8 +192,16 @@ int main(int argc, char **argv) {
                 break;
 			case 'p':
 				optint = strtol(optarg, &optend, 10);
+				if (*optend == ':' && optint > 0) { // a floor, and the ceiling
+					gPipelineProcessMin = optint;
+					gAdaptive = true;
+					optint = strtol(optend + 1, &optend, 10);
+					if (optint > 0 && (size_t)optint < gPipelineProcessMin)
+						usage("The -p floor can't be above the ceiling");
+				}
 				if (optint < 0 || *optend)
-					usage("Need a non-negative integer argument to -p");
+					usage("Need a non-negative integer argument to -p, "
+						"or MIN:MAX");
 				gPipelineProcessMax = optint;
 				break;
             case 'q':
@@ -96,6 +210,61 @@ int main(int argc, char **argv) {
     				usage("Need a positive integer argument to -q");
     			gPipelineQSize = optint;
     			break;
+            case OPT_DIGEST:
+                if (!digest_parse(optarg))
+                    usage("Need a list of crc32, crc64, md5 or sha256 for --digest");
+                break;
+            case OPT_DIGEST_FILE: gDigestFile = optarg; break;
+            case OPT_ALIGN:
+                if (!parse_size(optarg, &optsize) || optsize < 4
+                        || (optsize & (optsize - 1)))
+                    usage("Need a power of two, at least 4, for --align");
+                gBlockAlign = optsize;
+                break;
+            case OPT_DAEMON: op = OP_DAEMON; break;
+            case OPT_SOCKET: sock_path = optarg; break;
+            case OPT_NO_DAEMON: use_daemon = false; break;
+            case OPT_RANGE:
+                if (!parse_range(optarg, range_offset, range_length))
+                    usage("Need OFFSET or OFFSET:LENGTH for --range");
+                op = OP_RANGE;
+                break;
+            case OPT_MEMBER: op = OP_MEMBER; member = optarg; break;
+            case OPT_BATCH: batch = true; break;
+            case OPT_CREATE: create = true; break;
+            case OPT_STATS: gStats = true; break;
+            case OPT_STATS_INTERVAL:
+				optint = strtol(optarg, &optend, 10);
+				if (optint <= 0 || *optend)
+					usage("Need a positive number of seconds for --stats-interval");
+                gStats = true;
+                gStatsInterval = optint;
+                break;
+            case OPT_TRACE: trace_path = optarg; break;
+            case OPT_PROGRESS: gProgress = true; break;
+            case OPT_COUNTERS: gStats = gPerf = true; break;
+            case OPT_MAX_READ_RATE:
+            case OPT_MAX_WRITE_RATE:
+            case OPT_MAX_CPU: {
+                limit_kind_t kind = ch == OPT_MAX_READ_RATE ? LIMIT_READ
+                    : ch == OPT_MAX_WRITE_RATE ? LIMIT_WRITE : LIMIT_CPU;
+                double rate;
+                if (!limit_parse(kind, optarg, &rate))
+                    usage(kind == LIMIT_CPU
+                        ? "Need a number of cores for --max-cpu"
+                        : "Need a size per second for --max-read-rate "
+                            "or --max-write-rate");
+                limit_set(kind, rate);
+                break;
+            }
+            case OPT_LIMITS: limits_path = optarg; break;
+            case OPT_ADAPTIVE: gAdaptive = true; break;
+            case OPT_NO_SPLICE: gSplice = false; break;
+            case OPT_NO_JOBSERVER: gJobserver = false; break;
+            case OPT_CACHE:
+                if (!parse_size(optarg, &cache_size) || !cache_size)
+                    usage("Need a positive size for --cache");
+                break;
             default:
                 if (ch >= '0' && ch <= '9') {
                     level = ch - '0';
@@ -106,70 +275,129 @@ int main(int argc, char **argv) {
     }
     argc -= optind;
     argv += optind;
+    if (!gJobserver)
+        jobserver_close();
+    
+    if (gDigestFile && !gDigests)
+        gDigests = DIGEST_SHA256;
+    if (gDigests && op != OP_WRITE)
+        usage("Digests are only computed when compressing");
+    if (gAdaptive && op != OP_WRITE && op != OP_READ && op != OP_EXTRACT
+            && op != OP_TEST)
+        usage("Only compressing or decompressing can scale adaptively");
+    if (gStats && op == OP_DAEMON)
+        usage("Statistics aren't kept by the daemon");
+    if (gStats)
+        use_daemon = false; // they'd describe the daemon, not us
+    if (gLimited || limits_path)
+        use_daemon = false; // it wouldn't know our limits
+    if (gProgress && op != OP_WRITE && op != OP_READ && op != OP_EXTRACT)
+        usage("Progress is only shown when compressing or decompressing");
+    if (trace_path && op != OP_WRITE && op != OP_READ && op != OP_EXTRACT
+            && op != OP_TEST)
+        usage("Only compressing or decompressing can be traced");
+    if (!sock_path)
+        sock_path = daemon_socket();
+    if (op == OP_DAEMON) {
+        if (argc || ipath || opath)
+            usage("The daemon doesn't take files");
+        pixz_daemon(sock_path, cache_size, verbose);
+    }
         
-    gInFile = stdin;
-    gOutFile = stdout;
-    bool iremove = false;    
-    if (op != OP_EXTRACT && argc >= 1) {
-        if (argc > 2 || (op == OP_LIST && argc == 2))
-            usage("Too many arguments");
-        if (ipath)
-            usage("Multiple input files specified");
-        ipath = argv[0];
-        
-        if (argc == 2) {
-            if (opath)
-                usage("Multiple output files specified");
-            opath = argv[1];
-        } else if (op != OP_LIST) {
-            iremove = true;
-            opath = auto_output(op, argv[0]);
-			if (!opath)
-				usage("Unknown suffix");
+    pixz_file_t *files, single = { .ipath = ipath, .opath = opath };
+    size_t nfiles = 1;
+    if (batch) {
+        if (op != OP_WRITE && op != OP_READ)
+            usage("A batch can only be compressed or decompressed");
+        if (create)
+            usage("--create makes just one tarball");
+        if (ipath || opath)
+            usage("Batch outputs are named automatically");
+        files = batch_files(op, argc, argv, !keep_input, &nfiles);
+    } else if (create) {
+        if (op != OP_WRITE || ipath || !tar)
+            usage("--create only makes a compressed tarball");
+        if (!argc)
+            usage("Nothing to put in the tarball");
+        files = &single;
+        single.paths = argv;
+        single.npaths = argc;
+        file_open_output(&single);
+        gOutFile = single.out;
+    } else {
+        files = &single;
+        if (op != OP_EXTRACT && argc >= 1) {
+            bool one = op == OP_LIST || op == OP_TEST || op == OP_RANGE
+                || op == OP_MEMBER;
+            if (argc > 2 || (one && argc == 2))
+                usage("Too many arguments");
+            if (ipath)
+                usage("Multiple input files specified");
+            single.ipath = argv[0];
+            
+            if (argc == 2) {
+                if (opath)
+                    usage("Multiple output files specified");
+                single.opath = argv[1];
+            } else if (!one) {
+                single.remove = !keep_input;
+                single.opath = auto_output(op, argv[0]);
+                if (!single.opath)
+                    usage("Unknown suffix");
+            }
         }
+        
+        file_open_input(&single);
+        file_open_output(&single);
+        gInFile = single.in;
+        gOutFile = single.out;
     }
 
-    if (ipath && !(gInFile = fopen(ipath, "r")))
-      die("can not open input file: %s: %s", ipath, strerror(errno));
-
-    if (opath) {
-      if (gInFile == stdin) {
-        // can't read permissions of original file, because we read from stdin,
-        // using umask permissions
-        if (!(gOutFile = fopen(opath, "w")))
-          die("can not open output file: %s: %s", opath, strerror(errno));
-
-      } else {
-        // read permissions of original file,
-        // use them to create / open output file
-        struct stat input_stat;
-        int output_fd;
-
-        stat(ipath, &input_stat);
-
-        if ((output_fd = open(opath, O_CREAT | O_WRONLY, input_stat.st_mode)) == -1)
-          die("can not open output file: %s: %s", opath, strerror(errno));
-
-        if (!(gOutFile = fdopen(output_fd, "w")))
-          die("can not open output file: %s: %s", opath, strerror(errno));
-      }
-    }
-
+    if (trace_path)
+        trace_start(trace_path);
+    limit_start(limits_path);
     switch (op) {
         case OP_WRITE:
-			if (isatty(fileno(gOutFile)) == 1)
+			if (!batch && isatty(fileno(gOutFile)) == 1)
 				usage("Refusing to output to a TTY");
 			if (extreme)
 				level |= LZMA_PRESET_EXTREME;
-			pixz_write(tar, level);
+			pixz_write(tar, level, nfiles, files);
 			break;
-        case OP_READ: pixz_read(tar, 0, NULL); break;
-        case OP_EXTRACT: pixz_read(tar, argc, argv); break;
-        case OP_LIST: pixz_list(tar);
+        case OP_READ: pixz_read(tar, nfiles, files, 0, NULL); break;
+        case OP_EXTRACT: {
+            char *args[argc + 1];
+            args[0] = "extract";
+            memcpy(args + 1, argv, argc * sizeof(char*));
+            if (!(use_daemon && tar && daemon_request(sock_path, argc + 1, args)))
+                pixz_read(tar, 1, files, argc, argv);
+            break;
+        }
+        case OP_LIST: {
+            char *args[] = { "list" };
+            if (!(use_daemon && tar && daemon_request(sock_path, 1, args)))
+                pixz_list(tar);
+            break;
+        }
+        case OP_TEST: pixz_test(tar); break;
+        case OP_RANGE: {
+            char *args[] = { "range", range_offset, range_length };
+            size_t nargs = *range_length ? 3 : 2;
+            if (!(use_daemon && daemon_request(sock_path, nargs, args)))
+                pixz_serve(nargs, args);
+            break;
+        }
+        case OP_MEMBER: {
+            char *args[] = { "member", member };
+            if (!(use_daemon && daemon_request(sock_path, 2, args)))
+                pixz_serve(2, args);
+            break;
+        }
+        case OP_DAEMON: break;
     }
-    
-    if (iremove && !keep_input)
-        unlink(ipath);
+    jobserver_finish();
+    limit_finish();
+    trace_finish();
     
     return 0;
 }
@@ -191,6 +419,68 @@ static char *auto_output(pixz_op_t op, char *in) {
     return NULL;
 }
 
+// Inputs for a batch, from the arguments or one per line of stdin
+static pixz_file_t *batch_files(pixz_op_t op, int argc, char **argv,
+        bool remove, size_t *countp) {
+    size_t count = 0, cap = 16;
+    pixz_file_t *files = malloc(cap * sizeof(pixz_file_t));
+    char *line = NULL;
+    size_t linecap = 0;
+    for (int i = 0; !argc || i < argc; ++i) {
+        char *path;
+        if (argc) {
+            path = argv[i];
+        } else {
+            ssize_t len = getline(&line, &linecap, stdin);
+            if (len == -1)
+                break;
+            if (len && line[len - 1] == '\n')
+                line[--len] = '\0';
+            if (!len)
+                continue;
+            path = xstrdup(line);
+        }
+        
+        char *opath = auto_output(op, path);
+        if (!opath)
+            die("Unknown suffix: %s", path);
+        if (count == cap)
+            files = realloc(files, (cap *= 2) * sizeof(pixz_file_t));
+        if (!files || !path)
+            die("Out of memory");
+        files[count++] = (pixz_file_t){ .ipath = path, .opath = opath,
+            .remove = remove };
+    }
+    free(line);
+    
+    if (!count)
+        usage("No input files");
+    *countp = count;
+    return files;
+}
+
+// OFFSET[:LENGTH], as decimal strings for a request
+static bool parse_range(const char *str, char *offset, char *length) {
+    char buf[64];
+    const char *colon = strchr(str, ':');
+    size_t len = colon ? (size_t)(colon - str) : strlen(str);
+    if (len >= sizeof(buf))
+        return false;
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+
+    uint64_t n;
+    if (!parse_size(buf, &n))
+        return false;
+    sprintf(offset, "%ju", (uintmax_t)n);
+    if (colon) {
+        if (!parse_size(colon + 1, &n))
+            return false;
+        sprintf(length, "%ju", (uintmax_t)n);
+    }
+    return true;
+}
+
 static bool strsuf(char *big, char *small) {
     size_t bl = strlen(big), sl = strlen(small);
     return strcmp(big + bl - sl, small) == 0;
@@ -23,6 +23,9 @@
 #define MEMLIMIT (64ULL * 1024 * 1024 * 1024) // crazy high
 
 #define CHUNKSIZE 4096
+#define STREAMSIZE (1024 * 1024)
+#define MAXSPLITSIZE ((64 * 1024 * 1024) * 2) // xz -9 blocksize * 2
+#define LZMA_CHUNK_MAX (1 << 16)
 
 #ifndef DEBUG
 	#define DEBUG 0
@@ -34,6 +37,35 @@
 #endif
 
 
+// USDT probes in provider "pixz", for bpftrace or SystemTap. Unattached,
+// each is a nop, but its arguments are still computed, so keep them to
+// values already at hand. Probes come in start and done pairs where a
+// duration is interesting, the tracer times them.
+//   block__read(seq, size)          a block's input is ready
+//   block__dispatch(seq, merge)     sent to the workers, or straight to merge
+//   encode__start(seq, size)        encode__done(seq, insize, outsize)
+//   decode__start(seq, size)        decode__done(seq, insize, outsize)
+//   merge__wait(seq, stalled)       writer waits for block seq, maybe
+//                                   behind a later one that's ready
+//   merge(seq)                      block seq is next to write
+//   write__start(seq)               write__done(seq, size)
+//   index__start()                  index__done(blocks, streams)
+//   file__index__start()            file__index__done(entries)
+//   file__index__lookup(path, found)
+#if PIXZ_PROBES
+    #include <sys/sdt.h>
+    #define probe(name) DTRACE_PROBE(pixz, name)
+    #define probe1(name, a) DTRACE_PROBE1(pixz, name, a)
+    #define probe2(name, a, b) DTRACE_PROBE2(pixz, name, a, b)
+    #define probe3(name, a, b, c) DTRACE_PROBE3(pixz, name, a, b, c)
+#else
+    #define probe(name)
+    #define probe1(name, a)
+    #define probe2(name, a, b)
+    #define probe3(name, a, b, c)
+#endif
+
+
 #pragma mark LIBARCHIVE CHANGES
 
 #include <archive.h>
@@ -47,27 +79,139 @@
 
 #pragma mark OPERATIONS
 
+// An input and the output made from it. Files without paths are stdin and
+// stdout, and files already open are used as they are.
+typedef struct {
+    char *ipath, *opath;
+    FILE *in, *out;
+    bool remove; // the input, once the output is complete
+    char **paths; // if set, make a tarball of these instead of reading in
+    size_t npaths;
+} pixz_file_t;
+
 void pixz_list(bool tar);
-void pixz_write(bool tar, uint32_t level);
-void pixz_read(bool verify, size_t nspecs, char **specs);
+void pixz_test(bool tar); // decode everything, and check it all adds up
+void pixz_write(bool tar, uint32_t level, size_t nfiles, pixz_file_t *files);
+// Specs are only allowed for a single file
+void pixz_read(bool verify, size_t nfiles, pixz_file_t *files,
+    size_t nspecs, char **specs);
+bool spec_match(const char *spec, const char *name); // for -x
+extern bool gSplice; // vmsplice decoded output into pipes, when we can
+
+// Run a daemon that serves list, extract, range and member requests
+void pixz_daemon(const char *socket, uint64_t cache_size, bool verbose);
+const char *daemon_socket(void); // the default
+// Send a request to a daemon, using gInFile and gOutFile. Returns false if
+// no daemon will handle it, so the caller should.
+bool daemon_request(const char *socket, size_t nargs, char **args);
+// Handle range and member requests in this process
+void pixz_serve(size_t nargs, char **args);
 
 
 #pragma mark UTILS
 
-FILE *gInFile, *gOutFile;
-lzma_stream gStream;
+extern FILE *gInFile, *gOutFile;
+extern lzma_stream gStream;
 
 extern lzma_index *gIndex;
 
 
 void die(const char *fmt, ...);
 char *xstrdup(const char *s);
+bool parse_size(const char *str, uint64_t *size); // with a K, M or G suffix
+
+void file_open_input(pixz_file_t *f);
+void file_open_output(pixz_file_t *f);
+void file_finish(pixz_file_t *f); // close the output, maybe remove the input
 
 uint64_t xle64dec(const uint8_t *d);
 void xle64enc(uint8_t *d, uint64_t n);
 size_t num_threads(void);
+// On hybrid CPUs, how many cores are fast and slow; both zero if all alike
+size_t cpu_fast_count(void);
+size_t cpu_slow_count(void);
+void cpu_bind(bool slow); // keep the calling thread to one class of core
 
 extern double gBlockFraction;
+extern size_t gBlockAlign;
+
+
+#pragma mark CHECKSUM
+
+typedef enum {
+    CHECKSUM_CRC32,
+    CHECKSUM_CRC64,
+    CHECKSUM_SHA256
+} checksum_kind_t;
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t buf[64];
+    size_t buflen;
+} sha256_ctx;
+
+// The same as lzma_crc32 and lzma_crc64, using special instructions if the
+// CPU has them
+uint32_t checksum_crc32(const uint8_t *buf, size_t size, uint32_t crc);
+uint64_t checksum_crc64(const uint8_t *buf, size_t size, uint64_t crc);
+void sha256_init(sha256_ctx *c);
+void sha256_update(sha256_ctx *c, const uint8_t *data, size_t size);
+void sha256_final(sha256_ctx *c, uint8_t out[32]);
+
+// Which kernel is in use, such as "generic" or "pclmul"
+const char *checksum_kernel(checksum_kind_t kind);
+void checksum_hardware(bool use); // false for the portable kernels, to compare
+
+
+#pragma mark DIGEST
+
+typedef enum {
+    DIGEST_CRC32 = 1,
+    DIGEST_CRC64 = 2,
+    DIGEST_MD5 = 4,
+    DIGEST_SHA256 = 8
+} digest_type;
+
+extern unsigned gDigests; // mask of digest_type
+extern char *gDigestFile; // NULL for stderr
+
+bool digest_parse(const char *spec); // true on success
+void digest_init(void);
+void digest_update(const uint8_t *buf, size_t size);
+void digest_report(const char *name);
+
+
+#pragma mark CREATE
+
+// Write a tarball of paths on disk, reading them with several threads.
+// Member is called with each member's name, just before its headers.
+void create_tar(size_t npaths, char **paths, void (*member)(const char *name),
+    void (*write)(const void *buf, size_t size));
+
+
+#pragma mark IO
+
+typedef struct io_t io_t;
+
+typedef struct {
+    void *buf;
+    size_t size;
+    off_t offset;
+    ssize_t rd; // bytes read, short only at EOF, or -1 on error
+} io_req_t;
+
+extern io_t *gInIO; // for gInFile, once its index is read
+
+io_t *io_open(int fd); // NULL if out of memory
+void io_free(io_t *io);
+off_t io_size(io_t *io); // -1 if not seekable
+ssize_t io_pread(io_t *io, void *buf, size_t size, off_t offset);
+// Reads many ranges at once, false if any failed
+bool io_pread_many(io_t *io, io_req_t *reqs, size_t count);
+// Keep a range in memory for later reads within it, if the input is slow
+bool io_window(io_t *io, off_t offset, size_t size);
+void io_window_drop(io_t *io);
 
 
 #pragma mark INDEX
@@ -88,6 +232,32 @@ lzma_vli read_file_index(void);
 void dump_file_index(FILE *out, bool verbose);
 void free_file_index(void);
 
+// Reentrant forms of the above, reading through io. They return NULL on
+// success, or a description of the error.
+const char *index_read(io_t *io, lzma_index **indexp);
+// Sets *offsetp to the file index block's offset, zero if there isn't one
+const char *file_index_read(io_t *io, lzma_index *index,
+    file_index_t **filesp, lzma_vli *offsetp);
+void file_index_free(file_index_t *files);
+
+// Encode the body of a file index block, whose header the caller writes.
+// Output goes to out in pieces, and the block gets its sizes.
+typedef void (*file_index_out_t)(void *ctx, const uint8_t *buf, size_t size);
+const char *file_index_write(file_index_t *files, lzma_block *block,
+    file_index_out_t out, void *ctx);
+
+
+#pragma mark BLOCKS
+
+// Encode insize bytes from in. The caller sets the block's version, check
+// and filters, out must have room for lzma_block_buffer_bound(insize).
+lzma_ret encode_block(lzma_stream *strm, lzma_block *block,
+    const uint8_t *in, size_t insize, uint8_t *out, size_t *outsize);
+// Decode a whole block, header included
+lzma_ret decode_block(lzma_stream *strm, lzma_check check,
+    const uint8_t *in, size_t insize,
+    uint8_t *out, size_t outcap, size_t *outsize);
+
 
 #pragma mark QUEUE
 
@@ -98,30 +268,52 @@ struct queue_item_t {
     queue_item_t *next;
 };
 
-typedef void (*queue_free_t)(int type, void *p);
+typedef void (*queue_free_t)(void *ctx, int type, void *p);
 
 typedef struct {
     queue_item_t *first;
     queue_item_t *last;
+    queue_item_t *spare; // popped nodes, for pushes to reuse
+    size_t spares;
     
     pthread_mutex_t mutex;
     pthread_cond_t pop_cond;
+    pthread_cond_t claim_cond;
+    size_t claims; // items someone is getting ready to pop
     
     queue_free_t freer;
+    void *ctx;
+    
+    // For statistics
+    const char *wait_span; // traced when a pop waits, if set
+    size_t depth, max_depth;
+    uint64_t pushes, waits, wait_ns; // pops that had to wait
 } queue_t;
 
 
-queue_t *queue_new(queue_free_t freer);
+queue_t *queue_new(queue_free_t freer); // NULL if out of memory
+queue_t *queue_new_ctx(queue_free_t freer, void *ctx);
 void queue_free(queue_t *q);
-void queue_push(queue_t *q, int type, void *data);
+// False if we're out of memory, and nothing was pushed
+bool queue_push(queue_t *q, int type, void *data);
+// Keep room for count items at once, so pushes below that depth can't fail
+bool queue_reserve(queue_t *q, size_t count);
 int queue_pop(queue_t *q, void **datap);
+// The last pushed of the oldest's type, so items go before a later stop
+int queue_pop_newest(queue_t *q, void **datap);
+bool queue_trypop(queue_t *q, int *typep, void **datap); // false if empty
+bool queue_trypop_newest(queue_t *q, int *typep, void **datap);
+// Wait for an item nobody else has claimed, and claim it. Returns the type
+// of the oldest item. A claim doesn't reserve anything, it only counts.
+int queue_claim(queue_t *q);
+void queue_unclaim(queue_t *q);
 
 
 #pragma mark PIPELINE
 
 extern size_t gPipelineQSize;
 extern size_t gPipelineProcessMax;
-extern queue_t *gPipelineStartQ, *gPipelineSplitQ, *gPipelineMergeQ;
+extern size_t gPipelineProcessMin; // the floor, for adaptive scaling
 
 typedef enum {
     PIPELINE_ITEM,
@@ -136,19 +328,191 @@ struct pipeline_item_t {
     void *data;
 };
 
-typedef void* (*pipeline_data_create_t)(void);
+typedef struct pipeline_t pipeline_t;
+
+typedef void* (*pipeline_data_create_t)(void *ctx);
 typedef void (*pipeline_data_free_t)(void*);
-typedef void (*pipeline_split_t)(void);
-typedef void (*pipeline_process_t)(size_t);
+typedef void (*pipeline_split_t)(pipeline_t *pl);
+typedef void (*pipeline_process_t)(pipeline_t *pl, size_t thnum);
 
-void pipeline_create(
+typedef struct {
+    pipeline_t *pl;
+    size_t num;
+    bool slow; // on a slow core, taking the newest items
+    bool token; // holding a jobserver token, to work beside the first
+    pthread_t thread;
+} pipeline_thread_t;
+
+// What the command line adds to a pipeline: scaling, make's jobserver,
+// statistics and tracing. Any may be NULL, and the library uses none.
+typedef struct {
+    void (*start)(pipeline_t *pl); // before any thread starts
+    void (*stop)(pipeline_t *pl); // on the splitting thread, once it's done
+    // In each new thread, with th NULL for the splitter
+    void (*thread_start)(pipeline_t *pl, pipeline_thread_t *th);
+    void (*thread_stop)(pipeline_t *pl, pipeline_thread_t *th);
+    // Instead of pipeline_pop, for pipeline_take
+    int (*take)(pipeline_t *pl, pipeline_thread_t *th, pipeline_item_t **itemp);
+    void (*merge_wait)(pipeline_t *pl, uint64_t start); // after waiting
+} pipeline_hooks_t;
+
+struct pipeline_t {
+    queue_t *startq, *splitq, *mergeq;
+    void *ctx; // owner's state, for the split and process functions
+    const pipeline_hooks_t *hooks; // set before pipeline_start
+    
+    pipeline_data_free_t freer;
+    pipeline_split_t split;
+    pipeline_process_t process;
+    
+    size_t qsize;
+    size_t process_count, slow_count; // workers, and those on slow cores
+    pipeline_thread_t *process_threads;
+    pthread_t split_thread;
+    bool split_started;
+    
+    // Adaptive scaling: workers numbered active and up park between items
+    pthread_mutex_t park_mutex;
+    pthread_cond_t park_cond;
+    size_t active, floor;
+    uint64_t parks, unparks; // workers parked and unparked, in all
+    bool stopping;
+    pthread_t adapt_thread;
+    bool adapt_started;
+    
+    ssize_t split_seq;
+    ssize_t merge_seq;
+    pipeline_item_t *merged_items;
+};
+
+// threads is a maximum, zero for one per CPU; qsize zero for automatic.
+// NULL if we're out of memory, or create returned NULL. The queues have
+// room for every item and stop, so pushes of the pipeline's items can't fail.
+pipeline_t *pipeline_create(
     pipeline_data_create_t create,
     pipeline_data_free_t destroy,
-    pipeline_split_t split,
+    void *ctx, size_t threads, size_t qsize);
+// split may be NULL, if the owner feeds the pipeline itself
+bool pipeline_start(pipeline_t *pl, pipeline_split_t split,
     pipeline_process_t process);
-void pipeline_stop(void);
-void pipeline_destroy(void);
+bool pipeline_stop(pipeline_t *pl); // false if a thread couldn't be joined
+bool pipeline_destroy(pipeline_t *pl);
+
+void pipeline_dispatch(pipeline_t *pl, pipeline_item_t *item, queue_t *q);
+void pipeline_split(pipeline_t *pl, pipeline_item_t *item);
+// For process threads, the next item to process, or NULL to stop
+pipeline_item_t *pipeline_take(pipeline_t *pl, size_t thnum);
+// Without any hooks, returning the tag
+int pipeline_pop(pipeline_t *pl, pipeline_thread_t *th,
+    pipeline_item_t **itemp);
+pipeline_item_t *pipeline_merged(pipeline_t *pl);
+pipeline_item_t *pipeline_merged_ready(pipeline_t *pl); // NULL if not yet
+
+// The command line's hooks, with everything below
+extern const pipeline_hooks_t gPipelineHooks;
+
+
+#pragma mark ADAPTIVE SCALING
+
+extern bool gAdaptive; // park workers when the machine is busy
+
+void adapt_start(pipeline_t *pl);
+void adapt_stop(pipeline_t *pl); // unparks everyone for good
+void adapt_park(pipeline_t *pl, size_t thnum); // wait while thnum is parked
+
+
+#pragma mark JOBSERVER
+
+extern bool gJobserver; // share workers with make -j, if MAKEFLAGS says how
+
+// Whether make has a jobserver for us; call before opening any files
+bool jobserver_start(void);
+void jobserver_close(void); // stop using it
+void jobserver_finish(void); // give back every token we hold
+bool jobserver_active(void);
+bool jobserver_acquire(void); // take a token, or false if none came soon
+void jobserver_release(void);
+bool jobserver_stats(uint64_t *acquiredp, uint64_t *wait_nsp);
+
 
-void pipeline_dispatch(pipeline_item_t *item, queue_t *q);
-void pipeline_split(pipeline_item_t *item);
-pipeline_item_t *pipeline_merged();
+#pragma mark STATS
+
+extern bool gStats;
+extern unsigned gStatsInterval; // seconds between reports, zero for just one
+
+typedef enum {
+    STAGE_READ,
+    STAGE_CODE,
+    STAGE_WRITE,
+    STAGE_COUNT
+} stats_stage_t;
+
+// Reports go to stderr as JSON, one object per line. The pipeline may be NULL
+void stats_start(pipeline_t *pl, const char *op);
+void stats_finish(void);
+
+uint64_t stats_now(void); // nsec, zero unless collecting stats or a trace
+void stats_stage(stats_stage_t stage, size_t insize, size_t outsize);
+void stats_coded(size_t insize, size_t outsize, uint64_t start); // a block
+void stats_worker(size_t thnum, uint64_t start, uint64_t end); // waited
+void stats_merge_wait(uint64_t start, bool stalled);
+void stats_buffer(ssize_t size); // allocated, or freed if negative
+void stats_input(ssize_t size); // one read from the input, or failed if < 0
+void stats_output(size_t size, bool spliced); // written to the output
+
+extern bool gPerf; // add hardware event counts to the statistics
+
+// Count events for the calling thread, as part of a stage, until it stops
+void perf_thread_start(stats_stage_t stage);
+void perf_thread_stop(void);
+void perf_report(FILE *out); // a JSON object
+
+
+#pragma mark PROGRESS
+
+extern bool gProgress; // show progress as we go, not just on SIGUSR1
+
+// Report progress on SIGUSR1, and maybe continuously. Total is the number
+// of uncompressed bytes expected, and pending how many files' sizes will
+// be added to it later.
+void progress_start(const char *op, uint64_t total, size_t pending);
+void progress_expect(uint64_t size);
+void progress_finish(void);
+void progress_count(stats_stage_t stage, size_t insize, size_t outsize);
+
+
+#pragma mark TRACE
+
+extern bool gTrace;
+
+// Record a timeline of the pipeline's threads, written to path at the end
+void trace_start(const char *path);
+void trace_finish(void); // once the traced threads are done
+void trace_thread(const char *fmt, ...); // name the calling thread's lane
+// A span on the calling thread's lane, from start as given by stats_now
+// until now, about block seq or -1 for none
+void trace_span(const char *name, uint64_t start, ssize_t seq);
+void trace_span_at(const char *name, uint64_t start, uint64_t end,
+    ssize_t seq); // until end, for spans recorded earlier
+
+
+#pragma mark LIMITS
+
+typedef enum {
+    LIMIT_READ, // bytes per second
+    LIMIT_WRITE,
+    LIMIT_CPU, // cores
+    LIMIT_COUNT
+} limit_kind_t;
+
+extern bool gLimited; // whether any limit may apply
+
+bool limit_parse(limit_kind_t kind, const char *str, double *ratep);
+void limit_set(limit_kind_t kind, double rate); // zero for no limit
+// Read limits from a control file, and again when it changes or on SIGHUP
+void limit_start(const char *control);
+void limit_finish(void);
+
+// Charge an amount against a limit, waiting if it's used up
+void limit_take(limit_kind_t kind, double amount);
+void limit_cpu(void); // charge the CPU the calling thread used since last time
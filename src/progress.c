@@ -0,0 +1,197 @@
+#include "pixz.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Progress reports, either live on stderr or one line on SIGUSR1.
+ *
+ * Only the reader and writer count progress, with one relaxed atomic add per
+ * block, so workers never notice. A thread of our own does the reporting,
+ * woken through a pipe by the signal handler. */
+
+#define PROGRESS_TTY_MS 1000 // between redraws of the live display
+#define PROGRESS_LOG_MS 10000 // between lines, when stderr isn't a terminal
+
+
+#pragma mark GLOBALS
+
+bool gProgress = false;
+
+static bool gProgressOn = false;
+static const char *gProgressOp = NULL;
+static uint64_t gProgressStart = 0;
+static uint64_t gTotal = 0; // uncompressed bytes, zero if unknown
+static size_t gPending = 0; // files whose size isn't yet known
+
+static uint64_t gCounts[STAGE_COUNT][2]; // in and out, atomic
+
+static int gWakeFds[2] = { -1, -1 };
+static pthread_t gProgressThread;
+static struct sigaction gOldAction;
+static bool gLive = false; // redraw in place
+
+
+#pragma mark DECLARATIONS
+
+static void progress_signal(int sig);
+static void *progress_thread(void *data);
+static void progress_report(FILE *out, const char *end);
+static uint64_t counter(stats_stage_t stage, int which);
+static uint64_t now_ms(void);
+static void format_size(char *buf, size_t size, double bytes);
+
+
+#pragma mark PROGRESS
+
+void progress_start(const char *op, uint64_t total, size_t pending) {
+    gProgressOp = op;
+    gTotal = total;
+    gPending = pending;
+    memset(gCounts, 0, sizeof(gCounts));
+    gProgressStart = now_ms();
+    gLive = gProgress && isatty(fileno(stderr));
+
+    if (pipe(gWakeFds) == -1)
+        die("Can't create progress pipe");
+    fcntl(gWakeFds[1], F_SETFL, O_NONBLOCK); // never block in the handler
+    if (pthread_create(&gProgressThread, NULL, progress_thread, NULL))
+        die("Error starting progress thread");
+
+    struct sigaction sa = { .sa_handler = progress_signal,
+        .sa_flags = SA_RESTART };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, &gOldAction);
+    gProgressOn = true;
+}
+
+void progress_expect(uint64_t size) {
+    if (!gProgressOn)
+        return;
+    __atomic_add_fetch(&gTotal, size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&gPending, 1, __ATOMIC_RELEASE);
+}
+
+void progress_finish(void) {
+    if (!gProgressOn)
+        return;
+    sigaction(SIGUSR1, &gOldAction, NULL);
+    gProgressOn = false;
+
+    char quit = 'q';
+    if (write(gWakeFds[1], &quit, 1) != 1)
+        die("Can't stop progress thread");
+    pthread_join(gProgressThread, NULL);
+    close(gWakeFds[0]);
+    close(gWakeFds[1]);
+    gWakeFds[0] = gWakeFds[1] = -1;
+}
+
+void progress_count(stats_stage_t stage, size_t insize, size_t outsize) {
+    if (!gProgressOn)
+        return;
+    __atomic_add_fetch(&gCounts[stage][0], insize, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&gCounts[stage][1], outsize, __ATOMIC_RELAXED);
+}
+
+
+#pragma mark REPORTING
+
+static void progress_signal(int sig) {
+    int err = errno;
+    char c = 'r';
+    ssize_t wr = write(gWakeFds[1], &c, 1); // if the pipe is full, fine
+    (void)wr;
+    errno = err;
+}
+
+static void *progress_thread(void *data) {
+    int interval = gLive ? PROGRESS_TTY_MS
+        : gProgress ? PROGRESS_LOG_MS : -1;
+    uint64_t next = gProgressStart + (interval > 0 ? interval : 0);
+    while (true) {
+        int timeout = -1;
+        if (interval > 0) {
+            uint64_t now = now_ms();
+            timeout = next > now ? next - now : 0;
+        }
+
+        struct pollfd pfd = { .fd = gWakeFds[0], .events = POLLIN };
+        int ready = poll(&pfd, 1, timeout);
+        if (ready == -1 && errno != EINTR)
+            die("Error waiting for progress events");
+        if (ready > 0) {
+            char c;
+            if (read(gWakeFds[0], &c, 1) == 1 && c == 'q')
+                break;
+            progress_report(stderr, "\n"); // asked for, so keep it
+        }
+        if (interval > 0 && now_ms() >= next) {
+            progress_report(stderr, gLive ? "\r" : "\n");
+            next += interval;
+        }
+    }
+
+    if (gProgress) // leave the final state on screen
+        progress_report(stderr, "\n");
+    return NULL;
+}
+
+static void progress_report(FILE *out, const char *end) {
+    uint64_t elapsed = now_ms() - gProgressStart;
+    double secs = elapsed ? elapsed / 1000.0 : 0.001;
+    bool compress = strcmp(gProgressOp, "compress") == 0;
+
+    // Uncompressed bytes finished, and what they were coded to
+    uint64_t read = counter(STAGE_READ, 0), written = counter(STAGE_WRITE, 1);
+    uint64_t done = counter(STAGE_WRITE, 0);
+    uint64_t csize = compress ? written : read;
+    uint64_t usize = compress ? done : written;
+
+    char in[16], outs[16], rrate[16], wrate[16];
+    format_size(in, sizeof(in), read);
+    format_size(outs, sizeof(outs), written);
+    format_size(rrate, sizeof(rrate), read / secs);
+    format_size(wrate, sizeof(wrate), written / secs);
+
+    flockfile(out);
+    fprintf(out, "pixz: %s", gProgressOp);
+    uint64_t total = __atomic_load_n(&gTotal, __ATOMIC_RELAXED);
+    bool known = total
+        && __atomic_load_n(&gPending, __ATOMIC_ACQUIRE) == 0;
+    if (known)
+        fprintf(out, " %3.0f%%", done >= total ? 100.0 : 100.0 * done / total);
+    fprintf(out, ", %s in, %s out", in, outs);
+    if (usize)
+        fprintf(out, ", ratio %.3f", (double)csize / usize);
+    fprintf(out, ", read %s/s, write %s/s", rrate, wrate);
+    if (known && done && done < total) {
+        uint64_t eta = (total - done) * secs / done;
+        fprintf(out, ", ETA %ju:%02ju:%02ju", (uintmax_t)(eta / 3600),
+            (uintmax_t)(eta / 60 % 60), (uintmax_t)(eta % 60));
+    }
+    fprintf(out, "%s%s", gLive ? "\033[K" : "", end);
+    fflush(out);
+    funlockfile(out);
+}
+
+static uint64_t counter(stats_stage_t stage, int which) {
+    return __atomic_load_n(&gCounts[stage][which], __ATOMIC_RELAXED);
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void format_size(char *buf, size_t size, double bytes) {
+    const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    size_t u = 0;
+    for ( ; bytes >= 1024 && u < sizeof(units) / sizeof(*units) - 1; ++u)
+        bytes /= 1024;
+    snprintf(buf, size, u ? "%.1f %s" : "%.0f %s", bytes, units[u]);
+}
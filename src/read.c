@@ -1,7 +1,24 @@
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#if HAVE_VMSPLICE
+    #define _GNU_SOURCE 1 // for vmsplice
+    #include <sys/mman.h>
+    #include <sys/uio.h>
+#endif
+
 #include "pixz.h"
 
 #include <archive.h>
 #include <archive_entry.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && !defined(F_SETPIPE_SZ)
+    #define F_SETPIPE_SZ 1031 // without _GNU_SOURCE
+#endif
 
 
 #pragma mark DECLARE WANTED
@@ -14,16 +31,45 @@ struct wanted_t {
     size_t size;
 };
 
-static wanted_t *gWantedFiles = NULL;
-
-static bool spec_match(char *spec, char *name);
-static void wanted_files(size_t count, char **specs);
 static void wanted_free(wanted_t *w);
 
 
+#pragma mark DECLARE FILES
+
+// One input file, and what the reader learned about it
+typedef struct {
+    pixz_file_t *file;
+    bool indexed;
+    lzma_vli file_index_offset;
+    file_index_t *files;
+    wanted_t *wanted;
+    bool explicit_files;
+} read_file_t;
+
+static pixz_file_t *gFiles = NULL;
+static size_t gFileCount = 0;
+static char **gSpecs = NULL;
+static size_t gSpecCount = 0;
+static bool gVerify = false;
+
+static read_file_t *gReadFile = NULL, *gWriteFile = NULL;
+static pipeline_item_t *gNextFileItem = NULL;
+static bool gMergeDone = false;
+
+static void wanted_files(read_file_t *rf, size_t count, char **specs);
+static void start_read_file(pipeline_t *pl, pixz_file_t *file);
+static void finish_read_file(pipeline_t *pl);
+static uint64_t output_size(read_file_t *rf);
+static void write_file(void);
+static pipeline_item_t *read_merged(void);
+
+
 #pragma mark DECLARE PIPELINE
 
-typedef enum { BLOCK_SIZED, BLOCK_UNSIZED, BLOCK_CONTINUATION } block_type;
+typedef enum {
+    BLOCK_SIZED, BLOCK_UNSIZED, BLOCK_CONTINUATION,
+    BLOCK_FILE // no data, the start of a new file
+} block_type;
 
 typedef struct {
     uint8_t *input, *output;
@@ -31,15 +77,26 @@ typedef struct {
     size_t insize, outsize;
     off_t uoffset; // uncompressed offset
 	lzma_check check;
+	bool spliced; // the output pipe may still refer to output
 	
 	block_type btype;
+	read_file_t *file; // for BLOCK_FILE
 } io_block_t;
 
-static void *block_create(void);
+static pipeline_t *gPipeline = NULL;
+
+// How far to read ahead of indexed blocks, if the input is slow
+#define READ_AHEAD (16 * 1024 * 1024)
+
+static void *block_create(void *ctx);
 static void block_free(void *data);
-static void read_thread(void);
-static void read_thread_noindex(void);
-static void decode_thread(size_t thnum);
+static void read_thread(pipeline_t *pl);
+static void read_blocks(pipeline_t *pl);
+static void read_blocks_noindex(pipeline_t *pl);
+static bool block_wanted(read_file_t *rf, lzma_index_iter *iter,
+    wanted_t **wp);
+static off_t read_ahead(read_file_t *rf, lzma_index_iter iter, wanted_t *w);
+static void decode_thread(pipeline_t *pl, size_t thnum);
 
 
 #pragma mark DECLARE ARCHIVE
@@ -49,7 +106,6 @@ static off_t gArLastOffset;
 static size_t gArLastSize;
 static wanted_t *gArWanted = NULL;
 static bool gArNextItem = false;
-static bool gExplicitFiles = false;
 
 static int tar_ok(struct archive *ar, void *ref);
 static ssize_t tar_read(struct archive *ar, void *ref, const void **bufp);
@@ -57,13 +113,40 @@ static bool tar_next_block(void);
 static void tar_write_last(void);
 
 
+#pragma mark DECLARE OUTPUT
+
+/* When the output is a pipe, decoded blocks are spliced into it with
+ * vmsplice, so the pipe refers to their pages rather than a copy. The pipe
+ * may hold on to those pages long after it's been read, if the other end
+ * moves them on with splice or tee, so we never write to them again. Each
+ * block's output is a mapping of its own, and once the writer is done with
+ * a block that was spliced, the mapping is dropped and the pipe keeps the
+ * only references to its pages. The block gets new memory for its next
+ * output. Anything else, or a pipe that won't splice, gets write(). */
+
+bool gSplice = true;
+
+static int gSpliceFd = -1; // the output pipe, while we splice into it
+
+static bool write_output(io_block_t *ib, const uint8_t *buf, size_t size);
+static void write_release(pipeline_item_t *pi);
+static void splice_start(void);
+static void splice_finish(void);
+static uint8_t *output_alloc(size_t size);
+static void output_free(uint8_t *buf, size_t cap);
+
+
 #pragma mark DECLARE READ BUFFER
 
-#define STREAMSIZE (1024 * 1024)
-#define MAXSPLITSIZE ((64 * 1024 * 1024) * 2) // xz -9 blocksize * 2
+// Input without an index goes through a ring, filled with large reads, so
+// nothing is ever moved to make room. Headers are parsed where they lie, and
+// streamed blocks decoded from it, while sized blocks are copied out and the
+// rest of them read straight into place.
+#define RBUF_SIZE (1024 * 1024)
 
-static pipeline_item_t *gRbufPI = NULL;
-static io_block_t *gRbuf = NULL;
+static uint8_t *gRbuf = NULL;
+static size_t gRbufHead = 0, gRbufLen = 0; // where the data starts, and how much
+static uint8_t gRbufLine[LZMA_BLOCK_HEADER_SIZE_MAX]; // for data that wraps
 
 static void block_capacity(io_block_t *ib, size_t incap, size_t outcap);
 
@@ -71,10 +154,14 @@ typedef enum {
 	RBUF_ERR, RBUF_EOF, RBUF_PART, RBUF_FULL
 } rbuf_read_status;
 
+static ssize_t rbuf_sysread(uint8_t *buf, size_t size);
 static rbuf_read_status rbuf_read(size_t bytes);
-static bool rbuf_cycle(lzma_stream *stream, bool start, size_t skip);
+static const uint8_t *rbuf_peek(size_t bytes);
 static void rbuf_consume(size_t bytes);
-static void rbuf_dispatch(void);
+static bool rbuf_take(uint8_t *dst, size_t bytes);
+static bool rbuf_feed(lzma_stream *stream);
+static void rbuf_fed(lzma_stream *stream);
+static void rbuf_reset(void);
 
 static bool read_header(lzma_check *check);
 static bool read_block(bool force_stream, lzma_check check, off_t uoffset);
@@ -85,32 +172,64 @@ static void read_footer(void);
 
 #pragma mark DECLARE UTILS
 
-static lzma_vli gFileIndexOffset = 0;
-
 static bool taste_tar(io_block_t *ib);
 static bool taste_file_index(io_block_t *ib);
 
 
 #pragma mark MAIN
 
-void pixz_read(bool verify, size_t nspecs, char **specs) {
-    if (decode_index()) {
-	    if (verify)
-	        gFileIndexOffset = read_file_index();
-	    wanted_files(nspecs, specs);
-		gExplicitFiles = nspecs;
+void pixz_read(bool verify, size_t nfiles, pixz_file_t *files,
+        size_t nspecs, char **specs) {
+    gVerify = verify;
+    gFiles = files;
+    gFileCount = nfiles;
+    gSpecs = specs;
+    gSpecCount = nspecs;
+    
+    gPipeline = pipeline_create(block_create, block_free, NULL,
+        gPipelineProcessMax, gPipelineQSize);
+    if (gPipeline) {
+        gPipeline->hooks = &gPipelineHooks;
+        stats_start(gPipeline, "decompress");
     }
+    // Indexes tell us how big each file is, if we're writing all of it
+    progress_start("decompress", 0, nspecs ? 0 : nfiles);
+    if (!gPipeline || !pipeline_start(gPipeline, read_thread, decode_thread))
+        die("Error starting pipeline");
+    
+    // Each file's blocks follow a marker with what the reader knows
+    pipeline_item_t *pi;
+    while ((pi = gNextFileItem ? gNextFileItem
+            : gMergeDone ? NULL : pipeline_merged(gPipeline))) {
+        gNextFileItem = NULL;
+        io_block_t *ib = (io_block_t*)(pi->data);
+        if (ib->btype != BLOCK_FILE)
+            die("Block without a file");
+        gWriteFile = ib->file;
+        queue_push(gPipeline->startq, PIPELINE_ITEM, pi);
+        write_file();
+    }
+    
+    progress_finish();
+    stats_finish();
+    if (!pipeline_destroy(gPipeline))
+        die("Error joining splitter thread");
+}
+
+static void write_file(void) {
+    read_file_t *rf = gWriteFile;
+    file_open_output(rf->file);
+    gOutFile = rf->file->out;
+    splice_start();
 
 #if DEBUG
-    for (wanted_t *w = gWantedFiles; w; w = w->next)
+    for (wanted_t *w = rf->wanted; w; w = w->next)
         debug("want: %s", w->name);
 #endif
     
-    pipeline_create(block_create, block_free,
-		gIndex ? read_thread : read_thread_noindex, decode_thread);
-    if (verify && gFileIndexOffset) {
-        gArWanted = gWantedFiles;
-        wanted_t *w = gWantedFiles, *wlast = NULL;
+    if (gVerify && rf->file_index_offset) {
+        gArWanted = rf->wanted;
+        wanted_t *w = rf->wanted, *wlast = NULL;
         bool lastmulti = false;
         off_t lastoff = 0;
         
@@ -155,16 +274,16 @@ void pixz_read(bool verify, size_t nspecs, char **specs) {
             die("File %s missing in archive", w->name);
         tar_write_last(); // write whatever's left
     }
-	if (!gExplicitFiles) {
+	if (!rf->explicit_files) {
 		/* Heuristics for detecting pixz file index:
 		 *    - Input must be streaming (otherwise read_thread does this) 
 		 *    - Data must look tar-like
 		 *    - Must have all sized blocks, followed by unsized file index */
-		bool start = !gIndex && verify,
+		bool start = !rf->indexed && gVerify,
 			 tar = false, all_sized = true, skipping = false;
 		
 		pipeline_item_t *pi;
-        while ((pi = pipeline_merged())) {
+        while ((pi = read_merged())) {
             io_block_t *ib = (io_block_t*)(pi->data);
 			if (skipping && ib->btype != BLOCK_CONTINUATION) {
 				fprintf(stderr,
@@ -182,31 +301,71 @@ void pixz_read(bool verify, size_t nspecs, char **specs) {
 				all_sized = false;
 			
 			if (!skipping) {
-				if (fwrite(ib->output, ib->outsize, 1, gOutFile) != 1)
+				uint64_t wstart = stats_now();
+				probe1(write__start, pi->seq);
+				if (!write_output(ib, ib->output, ib->outsize))
 					die("Can't write block");
+				trace_span("write", wstart, pi->seq);
+				probe2(write__done, pi->seq, ib->outsize);
 			}
-            queue_push(gPipelineStartQ, PIPELINE_ITEM, pi);
+            write_release(pi);
         }
     }
     
-    pipeline_destroy();
-    wanted_free(gWantedFiles);
+    
+    // Anything left belongs to this file
+    if (gArItem)
+        write_release(gArItem);
+    if (gArLastItem)
+        write_release(gArLastItem);
+    gArItem = gArLastItem = NULL;
+    gArNextItem = false;
+    gArLastSize = 0;
+    pipeline_item_t *pi;
+    while ((pi = read_merged()))
+        queue_push(gPipeline->startq, PIPELINE_ITEM, pi);
+    
+    splice_finish();
+    file_finish(rf->file);
+    wanted_free(rf->wanted);
+    file_index_free(rf->files);
+    free(rf);
+    gWriteFile = NULL;
+}
+
+// The next block of the file being written, NULL at its end
+static pipeline_item_t *read_merged(void) {
+    if (gNextFileItem || gMergeDone)
+        return NULL;
+    pipeline_item_t *pi = pipeline_merged(gPipeline);
+    if (!pi) {
+        gMergeDone = true;
+    } else if (((io_block_t*)(pi->data))->btype == BLOCK_FILE) {
+        gNextFileItem = pi;
+        pi = NULL;
+    } else {
+        io_block_t *ib = (io_block_t*)(pi->data);
+        stats_stage(STAGE_WRITE, ib->outsize, ib->outsize);
+    }
+    return pi;
 }
 
 
 #pragma mark BLOCKS
 
-static void *block_create(void) {
+static void *block_create(void *ctx) {
     io_block_t *ib = malloc(sizeof(io_block_t));
 	ib->incap = ib->outcap = 0;
 	ib->input = ib->output = NULL;
+	ib->spliced = false;
     return ib;
 }
 
 static void block_free(void* data) {
     io_block_t *ib = (io_block_t*)data;
+    stats_buffer(-(ssize_t)(ib->incap + ib->outcap));
     free(ib->input);
-    free(ib->output);
+    output_free(ib->output, ib->outcap);
     free(ib);
 }
 
@@ -214,7 +373,7 @@ static void block_free(void* data) {
 #pragma mark SETUP
 
 static void wanted_free(wanted_t *w) {
-    for (wanted_t *w = gWantedFiles; w; ) {
+    while (w) {
         wanted_t *tmp = w->next;
         free(w);
         w = tmp;
@@ -222,7 +381,7 @@ static void wanted_free(wanted_t *w) {
 }
 
 
-static bool spec_match(char *spec, char *name) {
+bool spec_match(const char *spec, const char *name) {
     bool match = true;
     for (; *spec; ++spec, ++name) {
         if (!*name || *spec != *name) { // spec must be equal or prefix
@@ -234,11 +393,11 @@ static bool spec_match(char *spec, char *name) {
     return match && (!*name || *name == '/');
 }
 
-static void wanted_files(size_t count, char **specs) {
-    if (!gFileIndexOffset) {
+static void wanted_files(read_file_t *rf, size_t count, char **specs) {
+    rf->wanted = NULL;
+    if (!rf->file_index_offset) {
         if (count)
             die("Can't filter non-tarball");
-        gWantedFiles = NULL;
         return;
     }
     
@@ -255,7 +414,7 @@ static void wanted_files(size_t count, char **specs) {
     wanted_t *last = NULL;
     
     // Check each file in order, to see if we want it
-    for (file_index_t *f = gFileIndex; f->name; f = f->next) {
+    for (file_index_t *f = rf->files; f->name; f = f->next) {
         bool match = !count;
         for (char **spec = specs; spec < specs + count; ++spec) {
             if (spec_match(*spec, f->name)) {
@@ -273,7 +432,7 @@ static void wanted_files(size_t count, char **specs) {
             if (last) {
                 last->next = w;
             } else {
-                gWantedFiles = w;
+                rf->wanted = w;
             }
             last = w;
         }
@@ -281,6 +440,7 @@ static void wanted_files(size_t count, char **specs) {
     
     // Make sure each spec matched
     for (size_t i = 0; i < count; ++i) {
+        probe2(file__index__lookup, specs[i], matched[i]);
         if (!matched[i])
             die("\"%s\" not found in archive", *(specs + i));
     }
@@ -291,58 +451,105 @@ static void wanted_files(size_t count, char **specs) {
 
 static void block_capacity(io_block_t *ib, size_t incap, size_t outcap) {
 	if (incap > ib->incap) {
+		stats_buffer(incap - ib->incap);
 		ib->incap = incap;
 		ib->input = realloc(ib->input, incap);
 	}
 	if (outcap > ib->outcap) {
+		stats_buffer(outcap - ib->outcap);
+		output_free(ib->output, ib->outcap); // no need to keep the contents
 		ib->outcap = outcap;
-		ib->output = malloc(outcap);
+		ib->output = output_alloc(outcap);
 	}
+	if ((incap && !ib->input) || (outcap && !ib->output))
+		die("Can't allocate blocks");
 }
 
-// Ensure at least this many bytes available
-// Return 1 on success, zero on EOF, -1 on error
-static rbuf_read_status rbuf_read(size_t bytes) {
-	if (!gRbufPI) {
-        queue_pop(gPipelineStartQ, (void**)&gRbufPI);
-		gRbuf = (io_block_t*)(gRbufPI->data);
-		gRbuf->insize = gRbuf->outsize = 0;
+static ssize_t rbuf_sysread(uint8_t *buf, size_t size) {
+	ssize_t r;
+	do {
+		r = read(fileno(gInFile), buf, size);
+	} while (r == -1 && errno == EINTR);
+	if (r > 0) {
+		stats_input(r);
+		limit_take(LIMIT_READ, r);
 	}
+	return r;
+}
+
+// Ensure at least this many bytes are buffered, up to RBUF_SIZE
+static rbuf_read_status rbuf_read(size_t bytes) {
+	if (!gRbuf && !(gRbuf = malloc(RBUF_SIZE)))
+		die("Can't allocate read buffer");
+	if (!gRbufLen)
+		gRbufHead = 0; // the most room in one piece
 	
-	if (gRbuf->insize >= bytes)
-		return RBUF_FULL;
-	
-	block_capacity(gRbuf, bytes, 0);
-	size_t r = fread(gRbuf->input + gRbuf->insize, 1, bytes - gRbuf->insize,
-		gInFile);
-	gRbuf->insize += r;
-	
-	if (r)
-		return (gRbuf->insize == bytes) ? RBUF_FULL : RBUF_PART;
-	return feof(gInFile) ? RBUF_EOF : RBUF_ERR;
+	while (gRbufLen < bytes) {
+		size_t tail = (gRbufHead + gRbufLen) % RBUF_SIZE;
+		size_t room = tail < gRbufHead ? gRbufHead - tail : RBUF_SIZE - tail;
+		ssize_t r = rbuf_sysread(gRbuf + tail, room);
+		if (r == 0)
+			return gRbufLen ? RBUF_PART : RBUF_EOF;
+		if (r < 0)
+			return RBUF_ERR;
+		gRbufLen += r;
+	}
+	return RBUF_FULL;
+}
+
+// The first bytes, which must be buffered, in one piece
+static const uint8_t *rbuf_peek(size_t bytes) {
+	size_t first = RBUF_SIZE - gRbufHead;
+	if (bytes <= first)
+		return gRbuf + gRbufHead;
+	memcpy(gRbufLine, gRbuf + gRbufHead, first);
+	memcpy(gRbufLine + first, gRbuf, bytes - first);
+	return gRbufLine;
+}
+
+static void rbuf_consume(size_t bytes) {
+	gRbufHead = (gRbufHead + bytes) % RBUF_SIZE;
+	gRbufLen -= bytes;
 }
 
-static bool rbuf_cycle(lzma_stream *stream, bool start, size_t skip) {
-	if (!start) {
-		rbuf_consume(gRbuf->insize);
-		if (rbuf_read(CHUNKSIZE) < RBUF_PART)
+// Copy out what's buffered, and read the rest straight into dst
+static bool rbuf_take(uint8_t *dst, size_t bytes) {
+	size_t have = bytes < gRbufLen ? bytes : gRbufLen;
+	size_t first = RBUF_SIZE - gRbufHead;
+	if (have <= first) {
+		memcpy(dst, gRbuf + gRbufHead, have);
+	} else {
+		memcpy(dst, gRbuf + gRbufHead, first);
+		memcpy(dst + first, gRbuf, have - first);
+	}
+	rbuf_consume(have);
+	
+	for (size_t done = have; done < bytes; ) {
+		ssize_t r = rbuf_sysread(dst + done, bytes - done);
+		if (r <= 0)
 			return false;
+		done += r;
 	}
-	stream->next_in = gRbuf->input + skip;
-	stream->avail_in = gRbuf->insize - skip;
 	return true;
 }
 
-static void rbuf_consume(size_t bytes) {
-	if (bytes < gRbuf->insize)
-		memmove(gRbuf->input, gRbuf->input + bytes, gRbuf->insize - bytes);
-	gRbuf->insize -= bytes;
+// Point a stream at the buffered input, reading more if there's none
+static bool rbuf_feed(lzma_stream *stream) {
+	if (!gRbufLen && rbuf_read(1) < RBUF_PART)
+		return false;
+	size_t first = RBUF_SIZE - gRbufHead;
+	stream->next_in = gRbuf + gRbufHead;
+	stream->avail_in = gRbufLen < first ? gRbufLen : first;
+	return true;
 }
 
-static void rbuf_dispatch(void) {
-	pipeline_split(gRbufPI);
-	gRbufPI = NULL;
-	gRbuf = NULL;
+// Consume what the stream used since it was fed
+static void rbuf_fed(lzma_stream *stream) {
+	rbuf_consume(stream->next_in - (gRbuf + gRbufHead));
+}
+
+static void rbuf_reset(void) {
+	gRbufHead = gRbufLen = 0;
 }
 
 
@@ -353,7 +560,8 @@ static bool read_header(lzma_check *check) {
 		return false;
 	else if (st != RBUF_FULL)
 		die("Error reading stream header");
-	lzma_ret err = lzma_stream_header_decode(&stream_flags, gRbuf->input);
+	lzma_ret err = lzma_stream_header_decode(&stream_flags,
+		rbuf_peek(LZMA_STREAM_HEADER_SIZE));
 	if (err == LZMA_FORMAT_ERROR)
 		die("Not an XZ file");
 	else if (err != LZMA_OK)
@@ -369,30 +577,47 @@ static bool read_block(bool force_stream, lzma_check check, off_t uoffset) {
 	
 	if (rbuf_read(1) != RBUF_FULL)
 		die("Error reading block header size");
-	if (gRbuf->input[0] == 0)
+	if (*rbuf_peek(1) == 0)
 		return false;
 	
-	block.header_size = lzma_block_header_size_decode(gRbuf->input[0]);
+	block.header_size = lzma_block_header_size_decode(*rbuf_peek(1));
 	if (block.header_size > LZMA_BLOCK_HEADER_SIZE_MAX)
 		die("Block header size too large");
 	if (rbuf_read(block.header_size) != RBUF_FULL)
 		die("Error reading block header");
-	if (lzma_block_header_decode(&block, NULL, gRbuf->input) != LZMA_OK)
+	if (lzma_block_header_decode(&block, NULL,
+			rbuf_peek(block.header_size)) != LZMA_OK)
 		die("Error decoding block header");
 		
 	size_t comp = block.compressed_size, outsize = block.uncompressed_size;
 	bool sized = (comp != LZMA_VLI_UNKNOWN && outsize != LZMA_VLI_UNKNOWN);
+	if (sized && outsize == 0) { // alignment filler, nothing to decode
+		size_t total = lzma_block_total_size(&block);
+		if (total > RBUF_SIZE || rbuf_read(total) != RBUF_FULL)
+			die("Error reading block contents");
+		rbuf_consume(total);
+		return true;
+	}
     if (force_stream || !sized || outsize > MAXSPLITSIZE) {
 		read_streaming(&block, sized ? BLOCK_SIZED : BLOCK_UNSIZED, uoffset);
 	} else {
-		block_capacity(gRbuf, 0, outsize);
-		gRbuf->outsize = outsize;
-		gRbuf->check = check;
-		gRbuf->btype = BLOCK_SIZED;
-		
-		if (rbuf_read(lzma_block_total_size(&block)) != RBUF_FULL)
+		pipeline_item_t *pi;
+		queue_pop(gPipeline->startq, (void**)&pi);
+		uint64_t start = stats_now();
+		io_block_t *ib = (io_block_t*)(pi->data);
+		size_t total = lzma_block_total_size(&block);
+		block_capacity(ib, total, outsize);
+		if (!rbuf_take(ib->input, total))
 			die("Error reading block contents");
-		rbuf_dispatch();
+		ib->insize = total;
+		ib->outsize = outsize;
+		ib->check = check;
+		ib->btype = BLOCK_SIZED;
+		
+		stats_stage(STAGE_READ, total, total);
+		trace_span("read", start, gPipeline->split_seq);
+		probe2(block__read, gPipeline->split_seq, total);
+		pipeline_split(gPipeline, pi);
 	}
 	return true;
 }
@@ -401,7 +626,7 @@ static void read_streaming(lzma_block *block, block_type sized, off_t uoffset) {
     lzma_stream stream = LZMA_STREAM_INIT;
     if (lzma_block_decoder(&stream, block) != LZMA_OK)
 		die("Error initializing streaming block decode");
-	rbuf_cycle(&stream, true, block->header_size);
+	rbuf_consume(block->header_size);
 	stream.avail_out = 0;
 	
 	bool first = true;
@@ -418,27 +643,26 @@ static void read_streaming(lzma_block *block, block_type sized, off_t uoffset) {
 				ib->outsize = ib->outcap;
                 ib->uoffset = uoffset;
                 uoffset += ib->outsize;
-				pipeline_dispatch(pi, gPipelineMergeQ);
+				pipeline_dispatch(gPipeline, pi, gPipeline->mergeq);
 				first = false;
 			}
-			queue_pop(gPipelineStartQ, (void**)&pi);
+			queue_pop(gPipeline->startq, (void**)&pi);
 			ib = (io_block_t*)pi->data;
 			ib->btype = (first ? sized : BLOCK_CONTINUATION);
 			block_capacity(ib, 0, STREAMSIZE);
 			stream.next_out = ib->output;
 			stream.avail_out = ib->outcap;
 		}
-		if (stream.avail_in == 0 && !rbuf_cycle(&stream, false, 0))
+		if (!rbuf_feed(&stream))
 			die("Error reading streaming block");
-		
 		err = lzma_code(&stream, LZMA_RUN);
+		rbuf_fed(&stream);
 	}
 	
 	if (ib && stream.avail_out != ib->outcap) {
 		ib->outsize = ib->outcap - stream.avail_out;
-		pipeline_dispatch(pi, gPipelineMergeQ);
+		pipeline_dispatch(gPipeline, pi, gPipeline->mergeq);
 	}
-	rbuf_consume(gRbuf->insize - stream.avail_in);
 	lzma_end(&stream);
 }
 
@@ -447,17 +671,16 @@ static void read_index(void) {
 	lzma_index *index;
 	if (lzma_index_decoder(&stream, &index, MEMLIMIT) != LZMA_OK)
 		die("Error initializing index decoder");
-	rbuf_cycle(&stream, true, 0);
 	
 	lzma_ret err = LZMA_OK;
 	while (err != LZMA_STREAM_END) {
 		if (err != LZMA_OK)
 			die("Error decoding index");
-		if (stream.avail_in == 0 && !rbuf_cycle(&stream, false, 0))
+		if (!rbuf_feed(&stream))
 			die("Error reading index");
 		err = lzma_code(&stream, LZMA_RUN);
+		rbuf_fed(&stream);
 	}
-	rbuf_consume(gRbuf->insize - stream.avail_in);
 	lzma_end(&stream);
 }
 
@@ -465,7 +688,8 @@ static void read_footer(void) {
 	lzma_stream_flags stream_flags;
 	if (rbuf_read(LZMA_STREAM_HEADER_SIZE) != RBUF_FULL)
 		die("Error reading stream footer");
-	if (lzma_stream_footer_decode(&stream_flags, gRbuf->input) != LZMA_OK)
+	if (lzma_stream_footer_decode(&stream_flags,
+			rbuf_peek(LZMA_STREAM_HEADER_SIZE)) != LZMA_OK)
 		die("Error decoding XZ footer");
 	rbuf_consume(LZMA_STREAM_HEADER_SIZE);
 	
@@ -476,15 +700,88 @@ static void read_footer(void) {
 			return;
 		if (st != RBUF_FULL)
 			die("Footer must be multiple of four bytes");
-		if (memcmp(zeros, gRbuf->input, 4) != 0)
+		if (memcmp(zeros, rbuf_peek(4), 4) != 0)
 			return;
 		rbuf_consume(4);
 	}
 }
 
-static void read_thread_noindex(void) {
+static void read_thread(pipeline_t *pl) {
+    for (size_t i = 0; i < gFileCount; ++i) {
+        start_read_file(pl, &gFiles[i]);
+        if (gIndex)
+            read_blocks(pl);
+        else
+            read_blocks_noindex(pl);
+        finish_read_file(pl);
+    }
+    free(gRbuf);
+    gRbuf = NULL;
+    if (!pipeline_stop(pl))
+        die("Error joining processing thread");
+}
+
+static void start_read_file(pipeline_t *pl, pixz_file_t *file) {
+    file_open_input(file);
+    gInFile = file->in;
+    read_file_t *rf = malloc(sizeof(read_file_t));
+    if (!rf)
+        die("Out of memory");
+    *rf = (read_file_t){ .file = file };
+    
+    if (decode_index()) {
+        rf->indexed = true;
+        if (gVerify) {
+            rf->file_index_offset = read_file_index();
+            rf->files = gFileIndex;
+            gFileIndex = gLastFile = NULL;
+        }
+        wanted_files(rf, gSpecCount, gSpecs);
+        rf->explicit_files = gSpecCount;
+        if (!gSpecCount)
+            progress_expect(output_size(rf));
+    }
+    gReadFile = rf;
+    
+    // Tell the writer about it, ahead of its blocks
+    pipeline_item_t *pi;
+    queue_pop(pl->startq, (void**)&pi);
+    io_block_t *ib = (io_block_t*)(pi->data);
+    ib->btype = BLOCK_FILE;
+    ib->file = rf;
+    pipeline_dispatch(pl, pi, pl->mergeq);
+}
+
+static void finish_read_file(pipeline_t *pl) {
+    rbuf_reset();
+    if (gIndex)
+        lzma_index_end(gIndex, NULL);
+    gIndex = NULL;
+    io_free(gInIO);
+    gInIO = NULL;
+    fclose(gInFile);
+    gReadFile = NULL; // the writer frees it
+}
+
+// How much we'll write of an indexed file
+static uint64_t output_size(read_file_t *rf) {
+    uint64_t size = lzma_index_uncompressed_size(gIndex);
+    if (rf->file_index_offset) { // the last block, which we skip
+        lzma_index_iter iter;
+        lzma_index_iter_init(&iter, gIndex);
+        if (!lzma_index_iter_locate(&iter, size - 1))
+            size -= iter.block.uncompressed_size;
+    }
+    return size;
+}
+
+static void read_blocks_noindex(pipeline_t *pl) {
 	bool empty = true;
 	lzma_check check = LZMA_CHECK_NONE;
+#ifdef F_SETPIPE_SZ
+	// A bigger pipe, if we may, so each read gets more
+	fcntl(fileno(gInFile), F_SETPIPE_SZ, RBUF_SIZE);
+#endif
 	while (read_header(&check)) {
 		empty = false;
 		while (read_block(false, check, 0))
@@ -494,103 +791,115 @@ static void read_thread_noindex(void) {
 	}
 	if (empty)
 		die("Empty input");
-	pipeline_stop();
 }
 
-static void read_thread(void) {
-    off_t offset = ftello(gInFile);
-    wanted_t *w = gWantedFiles;
+static void read_blocks(pipeline_t *pl) {
+    read_file_t *rf = gReadFile;
+    wanted_t *w = rf->wanted;
+    off_t ahead = 0; // end of the range read ahead
     
     lzma_index_iter iter;
     lzma_index_iter_init(&iter, gIndex);
     while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
-        // Don't decode the file-index
-        off_t boffset = iter.block.compressed_file_offset;
-        size_t bsize = iter.block.total_size;
-        if (gFileIndexOffset && boffset == gFileIndexOffset)
+        if (!block_wanted(rf, &iter, &w))
             continue;
-        
-        // Do we need this block?
-        if (gWantedFiles && gExplicitFiles) {
-            off_t uend = iter.block.uncompressed_file_offset +
-                iter.block.uncompressed_size;
-            if (!w || w->start >= uend) {
-                debug("read: skip %llu", iter.block.number_in_file);
-                continue;
-            }
-            for ( ; w && w->end < uend; w = w->next) ;
-        }
         debug("read: want %llu", iter.block.number_in_file);
+        off_t boffset = iter.block.compressed_file_offset;
+        size_t bsize = iter.block.total_size;
         
-        // Seek if needed, and get the data
-        if (offset != boffset) {
-            fseeko(gInFile, boffset, SEEK_SET);
-            offset = boffset;
-        }
-		
 		if (iter.block.uncompressed_size > MAXSPLITSIZE) { // must stream
-			if (gRbuf)
-				rbuf_consume(gRbuf->insize); // clear
+            fseeko(gInFile, boffset, SEEK_SET);
+			rbuf_reset();
 			read_block(true, iter.stream.flags->check,
                 iter.block.uncompressed_file_offset);
 		} else {
+            if (boffset + (off_t)bsize > ahead)
+                ahead = read_ahead(rf, iter, w);
+            
             // Get a block to work with
             pipeline_item_t *pi;
-            queue_pop(gPipelineStartQ, (void**)&pi);
+            queue_pop(pl->startq, (void**)&pi);
+            uint64_t start = stats_now();
             io_block_t *ib = (io_block_t*)(pi->data);
             block_capacity(ib, bsize,
                 iter.block.uncompressed_size);
             
-	        ib->insize = fread(ib->input, 1, bsize, gInFile);
-	        if (ib->insize < bsize)
+	        if (io_pread(gInIO, ib->input, bsize, boffset) < (ssize_t)bsize)
 	            die("Error reading block contents");
-	        offset += bsize;
+	        ib->insize = bsize;
+	        stats_stage(STAGE_READ, bsize, bsize);
+	        trace_span("read", start, pl->split_seq);
+	        probe2(block__read, pl->split_seq, bsize);
 	        ib->uoffset = iter.block.uncompressed_file_offset;
 			ib->check = iter.stream.flags->check;
 			ib->btype = BLOCK_SIZED; // Indexed blocks always sized
 			
-	        pipeline_split(pi);
+	        pipeline_split(pl, pi);
 		}
     }
+}
+
+// Whether to decode this block, advancing *wp past the wanted ranges it ends
+static bool block_wanted(read_file_t *rf, lzma_index_iter *iter,
+        wanted_t **wp) {
+    // Don't decode the file-index
+    off_t boffset = iter->block.compressed_file_offset;
+    if (rf->file_index_offset && boffset == rf->file_index_offset)
+        return false;
+    if (iter->block.uncompressed_size == 0)
+        return false; // alignment filler
     
-    pipeline_stop();
+    // Do we need this block?
+    if (rf->wanted && rf->explicit_files) {
+        off_t uend = iter->block.uncompressed_file_offset +
+            iter->block.uncompressed_size;
+        if (!*wp || (*wp)->start >= uend) {
+            debug("read: skip %llu", iter->block.number_in_file);
+            return false;
+        }
+        for ( ; *wp && (*wp)->end < uend; *wp = (*wp)->next) ;
+    }
+    return true;
+}
+
+// Fetch the run of wanted blocks starting at iter's in one go, so a slow
+// input can read it in parallel. Returns the end of the run.
+static off_t read_ahead(read_file_t *rf, lzma_index_iter iter, wanted_t *w) {
+    off_t start = iter.block.compressed_file_offset;
+    off_t end = start + iter.block.total_size;
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+        off_t bend = iter.block.compressed_file_offset
+            + iter.block.total_size;
+        if (iter.block.uncompressed_size == 0) // filler, read through it
+            continue;
+        if (!block_wanted(rf, &iter, &w)
+                || iter.block.uncompressed_size > MAXSPLITSIZE
+                || bend - start > READ_AHEAD)
+            break;
+        end = bend;
+    }
+    io_window(gInIO, start, end - start);
+    return end;
 }
 
 #pragma mark DECODE
 
-static void decode_thread(size_t thnum) {
+static void decode_thread(pipeline_t *pl, size_t thnum) {
     lzma_stream stream = LZMA_STREAM_INIT;
-    lzma_filter filters[LZMA_FILTERS_MAX + 1];
-    lzma_block block = { .filters = filters, .check = LZMA_CHECK_NONE,
-		.version = 0 };
-    
     pipeline_item_t *pi;
     io_block_t *ib;
     
-    while (PIPELINE_STOP != queue_pop(gPipelineSplitQ, (void**)&pi)) {
+    while ((pi = pipeline_take(pl, thnum))) {
         ib = (io_block_t*)(pi->data);
-        
-        block.header_size = lzma_block_header_size_decode(*(ib->input));
-        block.check = ib->check;
-		if (lzma_block_header_decode(&block, NULL, ib->input) != LZMA_OK)
-            die("Error decoding block header");
-        if (lzma_block_decoder(&stream, &block) != LZMA_OK)
-            die("Error initializing block decode");
-        
-        stream.avail_in = ib->insize - block.header_size;
-        stream.next_in = ib->input + block.header_size;
-        stream.avail_out = ib->outcap;
-        stream.next_out = ib->output;
-        
-        lzma_ret err = LZMA_OK;
-        while (err != LZMA_STREAM_END) {
-            if (err != LZMA_OK)
-                die("Error decoding block");
-            err = lzma_code(&stream, LZMA_FINISH);
-        }
-        
-        ib->outsize = stream.next_out - ib->output;
-        queue_push(gPipelineMergeQ, PIPELINE_ITEM, pi);
+        uint64_t start = stats_now();
+        probe2(decode__start, pi->seq, ib->insize);
+        if (decode_block(&stream, ib->check, ib->input, ib->insize,
+                ib->output, ib->outcap, &ib->outsize) != LZMA_OK)
+            die("Error decoding block");
+        stats_coded(ib->insize, ib->outsize, start);
+        trace_span("decode", start, pi->seq);
+        probe3(decode__done, pi->seq, ib->insize, ib->outsize);
+        queue_push(pl->mergeq, PIPELINE_ITEM, pi);
     }
     lzma_end(&stream);
 }
@@ -603,16 +912,16 @@ static int tar_ok(struct archive *ar, void *ref) {
 }
 
 static bool tar_next_block(void) {
-    if (gArItem && !gArNextItem && gArWanted && gExplicitFiles) {
+    if (gArItem && !gArNextItem && gArWanted && gWriteFile->explicit_files) {
         io_block_t *ib = (io_block_t*)(gArItem->data);
         if (gArWanted->start < ib->uoffset + ib->outsize)
             return true; // No need
     }
     
     if (gArLastItem)
-        queue_push(gPipelineStartQ, PIPELINE_ITEM, gArLastItem);
+        write_release(gArLastItem);
     gArLastItem = gArItem;
-    gArItem = pipeline_merged();
+    gArItem = read_merged();
     gArNextItem = false;
     return gArItem;
 }
@@ -620,8 +929,12 @@ static bool tar_next_block(void) {
 static void tar_write_last(void) {
     if (gArItem) {
         io_block_t *ib = (io_block_t*)(gArItem->data);
-        if (fwrite(ib->output + gArLastOffset, gArLastSize, 1, gOutFile) != 1)
+        uint64_t start = stats_now();
+        probe1(write__start, gArItem->seq);
+        if (!write_output(ib, ib->output + gArLastOffset, gArLastSize))
 			die("Can't write previous block");
+        trace_span("write", start, gArItem->seq);
+        probe2(write__done, gArItem->seq, gArLastSize);
         gArLastSize = 0;
     }
 }
@@ -637,7 +950,7 @@ static ssize_t tar_read(struct archive *ar, void *ref, const void **bufp) {
     off_t off;
     size_t size;
     io_block_t *ib = (io_block_t*)(gArItem->data);
-    if (gWantedFiles && gExplicitFiles) {
+    if (gWriteFile->wanted && gWriteFile->explicit_files) {
         debug("tar want: %s", gArWanted->name);
         off = gArWanted->start - ib->uoffset;
         size = gArWanted->size;
@@ -665,6 +978,93 @@ static ssize_t tar_read(struct archive *ar, void *ref, const void **bufp) {
 }
 
 
+#pragma mark OUTPUT
+
+// Write part of a block's output, splicing it if we can. False on error.
+static bool write_output(io_block_t *ib, const uint8_t *buf, size_t size) {
+    limit_take(LIMIT_WRITE, size);
+    size_t done = 0;
+#if HAVE_VMSPLICE
+    while (gSpliceFd != -1 && done < size) {
+        struct iovec iov = { .iov_base = (void*)(buf + done),
+            .iov_len = size - done };
+        ssize_t n = vmsplice(gSpliceFd, &iov, 1, 0);
+        if (n > 0) {
+            ib->spliced = true;
+            done += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            gSpliceFd = -1; // write() instead, from here on
+        } else {
+            return false;
+        }
+    }
+#endif
+    if (done)
+        stats_output(done, true);
+    if (done < size) {
+        if (fwrite(buf + done, size - done, 1, gOutFile) != 1)
+            return false;
+        stats_output(size - done, false);
+    }
+    return true;
+}
+
+// Give a block back to the reader, once the writer is done with it
+static void write_release(pipeline_item_t *pi) {
+    io_block_t *ib = (io_block_t*)(pi->data);
+    if (ib->spliced) { // the pipe has its pages now
+        stats_buffer(-(ssize_t)ib->outcap);
+        output_free(ib->output, ib->outcap);
+        ib->output = NULL;
+        ib->outcap = 0;
+        ib->spliced = false;
+    }
+    queue_push(gPipeline->startq, PIPELINE_ITEM, pi);
+}
+
+static void splice_start(void) {
+    gSpliceFd = -1;
+#if HAVE_VMSPLICE
+    int fd = fileno(gOutFile);
+    struct stat st;
+    if (!gSplice || fstat(fd, &st) == -1 || !S_ISFIFO(st.st_mode))
+        return;
+    if (fflush(gOutFile) != 0)
+        die("Can't write output");
+  #ifdef F_SETPIPE_SZ
+    fcntl(fd, F_SETPIPE_SZ, RBUF_SIZE); // fewer trips to the other end
+  #endif
+    gSpliceFd = fd;
+#endif
+}
+
+static void splice_finish(void) {
+    gSpliceFd = -1;
+}
+
+// Memory for a block's output, in pages of its own if we might splice it
+static uint8_t *output_alloc(size_t size) {
+#if HAVE_VMSPLICE
+    void *buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return buf == MAP_FAILED ? NULL : buf;
+#else
+    return malloc(size);
+#endif
+}
+
+static void output_free(uint8_t *buf, size_t cap) {
+#if HAVE_VMSPLICE
+    if (buf)
+        munmap(buf, cap);
+#else
+    free(buf);
+#endif
+}
+
+
 #pragma mark UTILS
 
 static bool taste_tar(io_block_t *ib) {
@@ -0,0 +1,736 @@
+#include "pixz.h"
+#include "libpixz.h"
+
+#include <archive_entry.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define READER_CACHE_DEFAULT (256ULL * 1024 * 1024)
+#define CACHE_BUCKETS 1024
+#define TAR_BLOCK 512
+
+
+#pragma mark TYPES
+
+typedef enum {
+    CACHE_BLOCK,
+    CACHE_STOP
+} cache_msg_t;
+
+typedef struct cache_block_t cache_block_t;
+struct cache_block_t {
+    pixz_reader *reader;
+    lzma_vli number; // within the file
+    lzma_check check;
+    uint64_t uoffset, usize;
+    off_t coffset;
+    size_t csize;
+
+    bool loading;
+    lzma_ret ret;
+    uint8_t *data;
+    size_t refs;
+    cache_block_t *prev, *next; // most recently used first
+    cache_block_t *hnext; // in the same bucket
+};
+
+struct pixz_cache {
+    pthread_mutex_t mutex;
+    pthread_cond_t loaded;
+    cache_block_t *first, *last;
+    cache_block_t *buckets[CACHE_BUCKETS];
+    uint64_t size, cached, loading;
+
+    queue_t *readq;
+    pthread_t *threads;
+    size_t thread_count;
+};
+
+struct pixz_reader {
+    pixz_cache *cache;
+    bool own_cache;
+
+    io_t *io;
+    lzma_index *index;
+    uint64_t size; // uncompressed, not counting the file index
+    uint64_t biggest; // block
+
+    file_index_t *files;
+    file_index_t **entries; // named files, in archive order
+    file_index_t **sorted; // and by name, for lookup
+    size_t nentries;
+
+    // Protected by the cache's lock
+    uint64_t next_offset; // where a sequential read would continue
+    size_t pending; // blocks queued for the cache's threads
+    bool closing;
+};
+
+struct pixz_member {
+    pixz_reader *reader;
+    uint64_t offset, size;
+};
+
+typedef struct {
+    pixz_reader *reader;
+    uint64_t pos, end;
+    lzma_ret ret;
+    uint8_t buf[16 * CHUNKSIZE];
+} member_source_t;
+
+
+#pragma mark FUNCTION DECLARATIONS
+
+static lzma_ret reader_init(pixz_reader *r);
+static void *cache_thread(void *data);
+static int reader_name_cmp(const void *a, const void *b);
+static file_index_t *reader_find(pixz_reader *r, const char *path);
+
+static cache_block_t **cache_bucket(pixz_cache *c, pixz_reader *r,
+    lzma_vli number);
+static cache_block_t *cache_lookup(pixz_cache *c, pixz_reader *r,
+    lzma_vli number);
+static cache_block_t *cache_insert(pixz_cache *c, pixz_reader *r,
+    const lzma_index_iter *iter);
+static void cache_link(pixz_cache *c, cache_block_t *b);
+static void cache_unlink(pixz_cache *c, cache_block_t *b);
+static void cache_drop(pixz_cache *c, cache_block_t *b);
+static void cache_unref(pixz_cache *c, cache_block_t *b);
+static void cache_evict(pixz_cache *c);
+static void cache_loaded(pixz_cache *c, cache_block_t *b);
+static void reader_prefetch(pixz_reader *r, const lzma_index_iter *cur,
+    uint64_t end, bool sequential);
+static cache_block_t *reader_get(pixz_reader *r, const lzma_index_iter *iter);
+static void reader_decode(cache_block_t *b);
+
+static lzma_ret member_locate(pixz_reader *r, const char *path,
+    uint64_t start, uint64_t end, uint64_t *headerp, uint64_t *sizep);
+static lzma_ret member_data(pixz_reader *r, uint64_t *posp, uint64_t end);
+static bool tar_size(const uint8_t *field, uint64_t *sizep);
+static ssize_t member_source_read(struct archive *ar, void *ref,
+    const void **bufp);
+static int member_source_ok(struct archive *ar, void *ref);
+
+
+#pragma mark CACHE
+
+pixz_cache *pixz_cache_new(const pixz_options *opts) {
+    pixz_cache *c = calloc(1, sizeof(pixz_cache));
+    if (!c)
+        return NULL;
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_cond_init(&c->loaded, NULL);
+    c->size = opts->cache_size ? opts->cache_size : READER_CACHE_DEFAULT;
+
+    size_t threads = num_threads();
+    if (opts->threads && opts->threads < threads)
+        threads = opts->threads;
+    c->readq = queue_new(NULL);
+    if (c->readq && queue_reserve(c->readq, threads) // for the stops
+            && (c->threads = malloc(threads * sizeof(pthread_t)))) {
+        for (size_t i = 0; i < threads; ++i) {
+            if (pthread_create(&c->threads[i], NULL, cache_thread, c))
+                break;
+            ++c->thread_count;
+        }
+    }
+    if (!c->thread_count) {
+        pixz_cache_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+void pixz_cache_free(pixz_cache *c) {
+    if (!c)
+        return;
+    for (size_t i = 0; i < c->thread_count; ++i)
+        queue_push(c->readq, CACHE_STOP, NULL);
+    for (size_t i = 0; i < c->thread_count; ++i)
+        pthread_join(c->threads[i], NULL);
+    queue_free(c->readq);
+    free(c->threads);
+
+    while (c->first)
+        cache_drop(c, c->first);
+    pthread_mutex_destroy(&c->mutex);
+    pthread_cond_destroy(&c->loaded);
+    free(c);
+}
+
+static void *cache_thread(void *data) {
+    pixz_cache *c = (pixz_cache*)data;
+    cache_block_t *b;
+    while (queue_pop(c->readq, (void**)&b) == CACHE_BLOCK) {
+        pthread_mutex_lock(&c->mutex);
+        bool closing = b->reader->closing;
+        pthread_mutex_unlock(&c->mutex);
+
+        if (closing)
+            b->ret = LZMA_PROG_ERROR; // never mind
+        else
+            reader_decode(b);
+
+        pthread_mutex_lock(&c->mutex);
+        cache_loaded(c, b);
+        --b->reader->pending;
+        cache_unref(c, b);
+        pthread_mutex_unlock(&c->mutex);
+    }
+    return NULL;
+}
+
+// The rest of these must be called with the lock held
+
+static cache_block_t **cache_bucket(pixz_cache *c, pixz_reader *r,
+        lzma_vli number) {
+    uint64_t h = ((uintptr_t)r >> 4) ^ (number * 0x9E3779B97F4A7C15ULL);
+    return &c->buckets[(h >> 32) % CACHE_BUCKETS];
+}
+
+static cache_block_t *cache_lookup(pixz_cache *c, pixz_reader *r,
+        lzma_vli number) {
+    for (cache_block_t *b = *cache_bucket(c, r, number); b; b = b->hnext) {
+        if (b->reader == r && b->number == number)
+            return b;
+    }
+    return NULL;
+}
+
+static void cache_link(pixz_cache *c, cache_block_t *b) {
+    b->prev = NULL;
+    b->next = c->first;
+    if (c->first)
+        c->first->prev = b;
+    else
+        c->last = b;
+    c->first = b;
+}
+
+static void cache_unlink(pixz_cache *c, cache_block_t *b) {
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        c->first = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    else
+        c->last = b->prev;
+}
+
+static cache_block_t *cache_insert(pixz_cache *c, pixz_reader *r,
+        const lzma_index_iter *iter) {
+    cache_block_t *b = calloc(1, sizeof(cache_block_t));
+    if (!b)
+        return NULL;
+    b->reader = r;
+    b->number = iter->block.number_in_file;
+    b->check = iter->stream.flags->check;
+    b->uoffset = iter->block.uncompressed_file_offset;
+    b->usize = iter->block.uncompressed_size;
+    b->coffset = iter->block.compressed_file_offset;
+    b->csize = iter->block.total_size;
+    b->loading = true;
+    c->loading += b->usize;
+
+    cache_block_t **bucket = cache_bucket(c, r, b->number);
+    b->hnext = *bucket;
+    *bucket = b;
+    cache_link(c, b);
+    return b;
+}
+
+static void cache_drop(pixz_cache *c, cache_block_t *b) {
+    cache_block_t **p = cache_bucket(c, b->reader, b->number);
+    while (*p != b)
+        p = &(*p)->hnext;
+    *p = b->hnext;
+    cache_unlink(c, b);
+
+    if (b->data)
+        c->cached -= b->usize;
+    free(b->data);
+    free(b);
+}
+
+static void cache_unref(pixz_cache *c, cache_block_t *b) {
+    if (--b->refs == 0 && b->ret != LZMA_OK)
+        cache_drop(c, b); // so a later read can try again
+    cache_evict(c);
+}
+
+static void cache_evict(pixz_cache *c) {
+    for (cache_block_t *b = c->last; b && c->cached > c->size; ) {
+        cache_block_t *prev = b->prev;
+        if (!b->refs && !b->loading)
+            cache_drop(c, b);
+        b = prev;
+    }
+}
+
+static void cache_loaded(pixz_cache *c, cache_block_t *b) {
+    b->loading = false;
+    c->loading -= b->usize;
+    if (b->ret == LZMA_OK)
+        c->cached += b->usize;
+    pthread_cond_broadcast(&c->loaded);
+}
+
+// Queue the blocks after the current one for the cache's threads: those
+// that this read covers, and if it's sequential, one more for each thread.
+static void reader_prefetch(pixz_reader *r, const lzma_index_iter *cur,
+        uint64_t end, bool sequential) {
+    pixz_cache *c = r->cache;
+    lzma_index_iter iter = *cur;
+    size_t ahead = sequential ? c->thread_count : 0;
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
+        if (iter.block.uncompressed_file_offset >= r->size)
+            break;
+        if (iter.block.uncompressed_file_offset >= end && ahead-- == 0)
+            break;
+        if (cache_lookup(c, r, iter.block.number_in_file))
+            continue;
+        if (c->loading + iter.block.uncompressed_size > c->size)
+            break;
+
+        cache_block_t *b = cache_insert(c, r, &iter);
+        if (!b)
+            break;
+        b->refs = 1; // held by the cache thread
+        ++r->pending;
+        if (!queue_push(c->readq, CACHE_BLOCK, b)) {
+            // Out of memory, so it's decoded when it's wanted instead
+            --r->pending;
+            c->loading -= b->usize;
+            cache_drop(c, b);
+            break;
+        }
+    }
+}
+
+// Get a block with a reference held, decoding it in this thread unless
+// another thread already is.
+static cache_block_t *reader_get(pixz_reader *r, const lzma_index_iter *iter) {
+    pixz_cache *c = r->cache;
+    cache_block_t *b = cache_lookup(c, r, iter->block.number_in_file);
+    if (b) {
+        ++b->refs;
+        while (b->loading)
+            pthread_cond_wait(&c->loaded, &c->mutex);
+        cache_unlink(c, b);
+        cache_link(c, b);
+        return b;
+    }
+
+    if (!(b = cache_insert(c, r, iter)))
+        return NULL;
+    b->refs = 1;
+    pthread_mutex_unlock(&c->mutex);
+    reader_decode(b);
+    pthread_mutex_lock(&c->mutex);
+    cache_loaded(c, b);
+    return b;
+}
+
+// Called without the lock, only the loading thread touches the block
+static void reader_decode(cache_block_t *b) {
+    uint8_t *in = malloc(b->csize);
+    b->data = malloc(b->usize);
+
+    uint64_t start = stats_now();
+    b->ret = LZMA_OK;
+    if (!in || !b->data)
+        b->ret = LZMA_MEM_ERROR;
+    else if (io_pread(b->reader->io, in, b->csize, b->coffset)
+            != (ssize_t)b->csize)
+        b->ret = LZMA_DATA_ERROR;
+    if (b->ret == LZMA_OK) {
+        lzma_stream strm = LZMA_STREAM_INIT;
+        size_t outsize;
+        b->ret = decode_block(&strm, b->check, in, b->csize, b->data,
+            b->usize, &outsize);
+        lzma_end(&strm);
+        if (b->ret == LZMA_OK && outsize != b->usize)
+            b->ret = LZMA_DATA_ERROR;
+        if (b->ret == LZMA_OK)
+            stats_coded(b->csize, outsize, start);
+    }
+
+    free(in);
+    if (b->ret != LZMA_OK) {
+        free(b->data);
+        b->data = NULL;
+    }
+}
+
+
+#pragma mark READER
+
+lzma_ret pixz_reader_open(pixz_reader **readerp, int fd,
+        const pixz_options *opts) {
+    pixz_cache *c = pixz_cache_new(opts);
+    if (!c) {
+        *readerp = NULL;
+        return LZMA_MEM_ERROR;
+    }
+    lzma_ret ret = pixz_reader_open_cache(readerp, fd, c);
+    if (ret != LZMA_OK) {
+        pixz_cache_free(c);
+        return ret;
+    }
+
+    pixz_reader *r = *readerp;
+    r->own_cache = true;
+    if (!opts->cache_size && c->size < 2 * r->biggest)
+        c->size = 2 * r->biggest;
+    return LZMA_OK;
+}
+
+lzma_ret pixz_reader_open_cache(pixz_reader **readerp, int fd,
+        pixz_cache *cache) {
+    *readerp = NULL;
+    pixz_reader *r = calloc(1, sizeof(pixz_reader));
+    if (!r)
+        return LZMA_MEM_ERROR;
+    lzma_ret ret = (r->io = io_open(fd)) ? reader_init(r) : LZMA_MEM_ERROR;
+    if (ret != LZMA_OK) {
+        pixz_reader_close(r);
+        return ret;
+    }
+
+    // Any block must fit
+    r->cache = cache;
+    pthread_mutex_lock(&cache->mutex);
+    if (cache->size < r->biggest)
+        cache->size = r->biggest;
+    pthread_mutex_unlock(&cache->mutex);
+    *readerp = r;
+    return LZMA_OK;
+}
+
+static lzma_ret reader_init(pixz_reader *r) {
+    if (index_read(r->io, &r->index) || !r->index)
+        return LZMA_FORMAT_ERROR;
+    lzma_vli fioffset;
+    if (file_index_read(r->io, r->index, &r->files, &fioffset))
+        return LZMA_DATA_ERROR;
+    io_window_drop(r->io); // blocks are read through the cache
+
+    // Hide the file index
+    r->size = lzma_index_uncompressed_size(r->index);
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, r->index);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+        if (fioffset && iter.block.compressed_file_offset == fioffset)
+            r->size = iter.block.uncompressed_file_offset;
+        else if (iter.block.uncompressed_size > r->biggest)
+            r->biggest = iter.block.uncompressed_size;
+    }
+
+    for (file_index_t *f = r->files; f; f = f->next) {
+        if (f->name)
+            ++r->nentries;
+    }
+    if (r->nentries) {
+        size_t size = r->nentries * sizeof(file_index_t*);
+        if (!(r->entries = malloc(size)) || !(r->sorted = malloc(size)))
+            return LZMA_MEM_ERROR;
+        size_t i = 0;
+        for (file_index_t *f = r->files; f; f = f->next) {
+            if (f->name)
+                r->entries[i++] = f;
+        }
+        memcpy(r->sorted, r->entries, size);
+        qsort(r->sorted, r->nentries, sizeof(file_index_t*), reader_name_cmp);
+    }
+    return LZMA_OK;
+}
+
+void pixz_reader_close(pixz_reader *r) {
+    if (!r)
+        return;
+
+    pixz_cache *c = r->cache;
+    if (c) {
+        // Wait for our queued blocks, then forget them all
+        pthread_mutex_lock(&c->mutex);
+        r->closing = true;
+        while (r->pending)
+            pthread_cond_wait(&c->loaded, &c->mutex);
+        for (cache_block_t *b = c->first; b; ) {
+            cache_block_t *next = b->next;
+            if (b->reader == r)
+                cache_drop(c, b);
+            b = next;
+        }
+        pthread_mutex_unlock(&c->mutex);
+        if (r->own_cache)
+            pixz_cache_free(c);
+    }
+
+    if (r->index)
+        lzma_index_end(r->index, NULL);
+    io_free(r->io);
+    file_index_free(r->files);
+    free(r->entries);
+    free(r->sorted);
+    free(r);
+}
+
+uint64_t pixz_reader_size(pixz_reader *r) {
+    return r->size;
+}
+
+lzma_ret pixz_reader_read(pixz_reader *r, uint64_t offset, uint8_t *buf,
+        size_t len, size_t *readp) {
+    *readp = 0;
+    if (offset >= r->size)
+        return LZMA_OK;
+    if (len > r->size - offset)
+        len = r->size - offset;
+    uint64_t end = offset + len;
+
+    pixz_cache *c = r->cache;
+    pthread_mutex_lock(&c->mutex);
+    bool sequential = (offset == r->next_offset);
+    r->next_offset = end;
+    pthread_mutex_unlock(&c->mutex);
+
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, r->index);
+    lzma_ret ret = LZMA_OK;
+    for (bool first = true; offset < end; first = false) {
+        if (lzma_index_iter_locate(&iter, offset))
+            return LZMA_PROG_ERROR;
+
+        pthread_mutex_lock(&c->mutex);
+        if (first) // decode the rest of this read, and beyond, meanwhile
+            reader_prefetch(r, &iter, end, sequential);
+        cache_block_t *b = reader_get(r, &iter);
+        pthread_mutex_unlock(&c->mutex);
+        if (!b)
+            return LZMA_MEM_ERROR;
+
+        if ((ret = b->ret) == LZMA_OK) {
+            size_t pos = offset - b->uoffset;
+            size_t size = b->usize - pos;
+            if (size > end - offset)
+                size = end - offset;
+            memcpy(buf, b->data + pos, size);
+            buf += size;
+            offset += size;
+            *readp += size;
+        }
+
+        pthread_mutex_lock(&c->mutex);
+        cache_unref(c, b);
+        pthread_mutex_unlock(&c->mutex);
+        if (ret != LZMA_OK)
+            break;
+    }
+    return ret;
+}
+
+
+#pragma mark MEMBERS
+
+static int reader_name_cmp(const void *a, const void *b) {
+    const file_index_t *fa = *(file_index_t**)a, *fb = *(file_index_t**)b;
+    int c = strcmp(fa->name, fb->name);
+    if (c)
+        return c;
+    return (fa->offset > fb->offset) - (fa->offset < fb->offset);
+}
+
+// If a name appears more than once, the last one wins, just like tar
+static file_index_t *reader_find(pixz_reader *r, const char *path) {
+    size_t lo = 0, hi = r->nentries;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(r->sorted[mid]->name, path) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    bool found = lo > 0 && strcmp(r->sorted[lo - 1]->name, path) == 0;
+    probe2(file__index__lookup, path, found);
+    return found ? r->sorted[lo - 1] : NULL;
+}
+
+size_t pixz_reader_entries(pixz_reader *r) {
+    return r->nentries;
+}
+
+const char *pixz_reader_entry(pixz_reader *r, size_t i, uint64_t *startp,
+        uint64_t *endp) {
+    if (i >= r->nentries)
+        return NULL;
+    file_index_t *f = r->entries[i];
+    *startp = f->offset;
+    *endp = f->next ? f->next->offset : r->size;
+    return f->name;
+}
+
+lzma_ret pixz_member_open(pixz_reader *r, const char *path,
+        pixz_member **memberp) {
+    *memberp = NULL;
+    if (!r->files)
+        return LZMA_FORMAT_ERROR;
+    file_index_t *f = reader_find(r, path);
+    if (!f)
+        return LZMA_OK;
+
+    uint64_t start = f->offset, end = f->next ? f->next->offset : r->size;
+    if (start > end || end > r->size)
+        return LZMA_DATA_ERROR;
+
+    uint64_t pos, size;
+    lzma_ret ret = member_locate(r, path, start, end, &pos, &size);
+    if (ret == LZMA_OK)
+        ret = member_data(r, &pos, end);
+    if (ret != LZMA_OK)
+        return ret;
+    if (size > end - pos)
+        return LZMA_DATA_ERROR;
+
+    pixz_member *m = malloc(sizeof(pixz_member));
+    if (!m)
+        return LZMA_MEM_ERROR;
+    *m = (pixz_member){ .reader = r, .offset = pos, .size = size };
+    *memberp = m;
+    return LZMA_OK;
+}
+
+void pixz_member_close(pixz_member *m) {
+    free(m);
+}
+
+uint64_t pixz_member_size(pixz_member *m) {
+    return m->size;
+}
+
+uint64_t pixz_member_offset(pixz_member *m) {
+    return m->offset;
+}
+
+lzma_ret pixz_member_read(pixz_member *m, uint64_t offset, uint8_t *buf,
+        size_t len, size_t *readp) {
+    *readp = 0;
+    if (offset >= m->size)
+        return LZMA_OK;
+    if (len > m->size - offset)
+        len = m->size - offset;
+    return pixz_reader_read(m->reader, m->offset + offset, buf, len, readp);
+}
+
+// Let libarchive find the member's headers, and its real size
+static lzma_ret member_locate(pixz_reader *r, const char *path,
+        uint64_t start, uint64_t end, uint64_t *headerp, uint64_t *sizep) {
+    member_source_t *src = malloc(sizeof(member_source_t));
+    if (!src)
+        return LZMA_MEM_ERROR;
+    *src = (member_source_t){ .reader = r, .pos = start, .end = end,
+        .ret = LZMA_OK };
+
+    struct archive *ar = archive_read_new();
+    prevent_compression(ar);
+    archive_read_support_format_tar(ar);
+    archive_read_set_options(ar, "tar:!mac-ext"); // keep ._ files apart
+
+    lzma_ret ret = LZMA_DATA_ERROR;
+    if (archive_read_open(ar, src, member_source_ok, member_source_read,
+            member_source_ok) == ARCHIVE_OK) {
+        struct archive_entry *entry;
+        int aerr;
+        while ((aerr = archive_read_next_header(ar, &entry)) == ARCHIVE_OK
+                || aerr == ARCHIVE_WARN) {
+            if (strcmp(archive_entry_pathname(entry), path) != 0)
+                continue; // a multi-header
+#if ARCHIVE_VERSION_NUMBER >= 3000000
+            if (archive_entry_sparse_reset(entry) > 0) {
+                ret = LZMA_OPTIONS_ERROR; // data isn't contiguous
+                break;
+            }
+#endif
+            *headerp = start + archive_read_header_position(ar);
+            *sizep = archive_entry_size_is_set(entry)
+                ? archive_entry_size(entry) : 0;
+            ret = LZMA_OK;
+            break;
+        }
+    }
+    if (src->ret != LZMA_OK)
+        ret = src->ret;
+    finish_reading(ar);
+    free(src);
+    return ret;
+}
+
+// Skip extended headers to find the start of the data
+static lzma_ret member_data(pixz_reader *r, uint64_t *posp, uint64_t end) {
+    uint8_t hdr[TAR_BLOCK];
+    while (true) {
+        size_t rd;
+        if (end - *posp < TAR_BLOCK)
+            return LZMA_DATA_ERROR;
+        lzma_ret ret = pixz_reader_read(r, *posp, hdr, TAR_BLOCK, &rd);
+        if (ret != LZMA_OK)
+            return ret;
+        if (rd != TAR_BLOCK)
+            return LZMA_DATA_ERROR;
+        *posp += TAR_BLOCK;
+
+        uint8_t type = hdr[156];
+        if (type != 'x' && type != 'g' && type != 'X'
+                && type != 'L' && type != 'K')
+            return LZMA_OK;
+
+        uint64_t size;
+        if (!tar_size(hdr + 124, &size)
+                || size > end - *posp)
+            return LZMA_DATA_ERROR;
+        *posp += (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    }
+}
+
+// Octal, or base-256 for big sizes
+static bool tar_size(const uint8_t *field, uint64_t *sizep) {
+    const size_t len = 12;
+    uint64_t size = 0;
+    if (field[0] & 0x80) {
+        size = field[0] & 0x7f;
+        for (size_t i = 1; i < len; ++i) {
+            if (size >> 56)
+                return false;
+            size = (size << 8) | field[i];
+        }
+    } else {
+        size_t i = 0;
+        while (i < len && field[i] == ' ')
+            ++i;
+        for ( ; i < len && field[i] >= '0' && field[i] <= '7'; ++i)
+            size = (size << 3) | (field[i] - '0');
+    }
+    *sizep = size;
+    return true;
+}
+
+static ssize_t member_source_read(struct archive *ar, void *ref,
+        const void **bufp) {
+    member_source_t *src = (member_source_t*)ref;
+    size_t len = sizeof(src->buf), rd;
+    if (len > src->end - src->pos)
+        len = src->end - src->pos;
+    src->ret = pixz_reader_read(src->reader, src->pos, src->buf, len, &rd);
+    if (src->ret != LZMA_OK) {
+        archive_set_error(ar, EIO, "Error reading archive");
+        return -1;
+    }
+    src->pos += rd;
+    *bufp = src->buf;
+    return rd;
+}
+
+static int member_source_ok(struct archive *ar, void *ref) {
+    return ARCHIVE_OK;
+}
@@ -0,0 +1,314 @@
+#include "pixz.h"
+
+#include <errno.h>
+#include <time.h>
+
+/* Performance statistics for a pipeline run, to see which stage limits it.
+ * Listing and random access have no pipeline, so they only report what was
+ * read from the input and decoded.
+ *
+ * Everything is counted under one lock, which is only taken when stats are
+ * on, at most a few times per block. Queues count their own depths and
+ * waits under their own locks. */
+
+#define RATIO_BUCKETS 11 // tenths, then anything that grew
+#define TIME_BUCKETS 14 // powers of two of msec, then longer
+
+
+#pragma mark TYPES
+
+typedef struct {
+    uint64_t blocks, in, out;
+} stats_count_t;
+
+typedef struct {
+    uint64_t busy_ns, idle_ns, blocks;
+    uint64_t last; // when its last wait ended
+} stats_worker_t;
+
+
+#pragma mark GLOBALS
+
+bool gStats = false;
+unsigned gStatsInterval = 0;
+
+static pthread_mutex_t gStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pipeline_t *gStatsPipeline = NULL;
+static const char *gStatsOp = NULL;
+static uint64_t gStatsStart = 0;
+
+static stats_count_t gStages[STAGE_COUNT];
+static stats_worker_t *gWorkers = NULL;
+static size_t gWorkerCount = 0;
+static uint64_t gMergeWaitNs = 0, gStallNs = 0;
+static uint64_t gRatios[RATIO_BUCKETS], gTimes[TIME_BUCKETS];
+static int64_t gBuffers = 0, gBuffersPeak = 0;
+static uint64_t gInputReads = 0, gInputBytes = 0;
+static uint64_t gOutputBytes = 0, gOutputSpliced = 0;
+
+static pthread_t gReporter;
+static pthread_cond_t gReporterCond = PTHREAD_COND_INITIALIZER;
+static bool gReporterStarted = false, gReporterStop = false;
+
+
+#pragma mark DECLARATIONS
+
+static void *stats_reporter(void *data);
+static void stats_report(bool final);
+static void report_queue(FILE *out, const char *name, queue_t *q, bool comma);
+static double secs(uint64_t ns);
+
+
+#pragma mark STATS
+
+void stats_start(pipeline_t *pl, const char *op) {
+    if (!gStats)
+        return;
+    gStatsPipeline = pl;
+    gStatsOp = op;
+    gStatsStart = stats_now();
+    gWorkerCount = pl ? pl->process_count : 0;
+    perf_thread_start(STAGE_WRITE); // we're the writer
+    if (gWorkerCount
+            && !(gWorkers = calloc(gWorkerCount, sizeof(stats_worker_t))))
+        die("Out of memory");
+
+    if (gStatsInterval) {
+        if (pthread_create(&gReporter, NULL, stats_reporter, NULL))
+            die("Error starting statistics thread");
+        gReporterStarted = true;
+    }
+}
+
+void stats_finish(void) {
+    if (!gStats)
+        return;
+    if (gReporterStarted) {
+        pthread_mutex_lock(&gStatsMutex);
+        gReporterStop = true;
+        pthread_cond_signal(&gReporterCond);
+        pthread_mutex_unlock(&gStatsMutex);
+        pthread_join(gReporter, NULL);
+        gReporterStarted = false;
+    }
+    perf_thread_stop();
+    stats_report(true);
+    free(gWorkers);
+    gWorkers = NULL;
+    gWorkerCount = 0;
+    gStatsPipeline = NULL;
+}
+
+uint64_t stats_now(void) {
+    if (!gStats && !gTrace)
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_stage(stats_stage_t stage, size_t insize, size_t outsize) {
+    progress_count(stage, insize, outsize);
+    if (!gStats)
+        return;
+    pthread_mutex_lock(&gStatsMutex);
+    ++gStages[stage].blocks;
+    gStages[stage].in += insize;
+    gStages[stage].out += outsize;
+    pthread_mutex_unlock(&gStatsMutex);
+}
+
+void stats_coded(size_t insize, size_t outsize, uint64_t start) {
+    if (!gStats)
+        return;
+    uint64_t ns = stats_now() - start;
+
+    // Compressed over uncompressed, whichever way we're going
+    bool compress = strcmp(gStatsOp, "compress") == 0;
+    size_t csize = compress ? outsize : insize;
+    size_t usize = compress ? insize : outsize;
+    size_t ratio = usize ? csize * 10 / usize : 0;
+    if (ratio >= RATIO_BUCKETS)
+        ratio = RATIO_BUCKETS - 1;
+
+    size_t time = 0;
+    for (uint64_t ms = ns / 1000000; ms && time < TIME_BUCKETS - 1; ms >>= 1)
+        ++time;
+
+    pthread_mutex_lock(&gStatsMutex);
+    ++gStages[STAGE_CODE].blocks;
+    gStages[STAGE_CODE].in += insize;
+    gStages[STAGE_CODE].out += outsize;
+    ++gRatios[ratio];
+    ++gTimes[time];
+    pthread_mutex_unlock(&gStatsMutex);
+}
+
+void stats_worker(size_t thnum, uint64_t start, uint64_t end) {
+    if (!gStats || thnum >= gWorkerCount)
+        return;
+    pthread_mutex_lock(&gStatsMutex);
+    stats_worker_t *w = &gWorkers[thnum];
+    if (w->last) { // it was working since its last wait
+        w->busy_ns += start - w->last;
+        ++w->blocks;
+    }
+    w->idle_ns += end - start;
+    w->last = end;
+    pthread_mutex_unlock(&gStatsMutex);
+}
+
+void stats_merge_wait(uint64_t start, bool stalled) {
+    if (!gStats)
+        return;
+    uint64_t ns = stats_now() - start;
+    pthread_mutex_lock(&gStatsMutex);
+    gMergeWaitNs += ns;
+    if (stalled)
+        gStallNs += ns;
+    pthread_mutex_unlock(&gStatsMutex);
+}
+
+void stats_buffer(ssize_t size) {
+    if (!gStats)
+        return;
+    pthread_mutex_lock(&gStatsMutex);
+    gBuffers += size;
+    if (gBuffers > gBuffersPeak)
+        gBuffersPeak = gBuffers;
+    pthread_mutex_unlock(&gStatsMutex);
+}
+
+void stats_input(ssize_t size) {
+    if (!gStats || size < 0)
+        return;
+    pthread_mutex_lock(&gStatsMutex);
+    ++gInputReads;
+    gInputBytes += size;
+    pthread_mutex_unlock(&gStatsMutex);
+}
+
+void stats_output(size_t size, bool spliced) {
+    if (!gStats)
+        return;
+    pthread_mutex_lock(&gStatsMutex);
+    gOutputBytes += size;
+    if (spliced)
+        gOutputSpliced += size;
+    pthread_mutex_unlock(&gStatsMutex);
+}
+
+
+#pragma mark REPORT
+
+static void *stats_reporter(void *data) {
+    pthread_mutex_lock(&gStatsMutex);
+    while (!gReporterStop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += gStatsInterval;
+        int err = 0;
+        while (!gReporterStop && err != ETIMEDOUT)
+            err = pthread_cond_timedwait(&gReporterCond, &gStatsMutex, &ts);
+        if (gReporterStop)
+            break;
+        pthread_mutex_unlock(&gStatsMutex);
+        stats_report(false);
+        pthread_mutex_lock(&gStatsMutex);
+    }
+    pthread_mutex_unlock(&gStatsMutex);
+    return NULL;
+}
+
+static void stats_report(bool final) {
+    static const char *stages[STAGE_COUNT] = { "read", "code", "write" };
+    FILE *out = stderr;
+    pipeline_t *pl = gStatsPipeline;
+    uint64_t now = stats_now();
+
+    flockfile(out);
+    pthread_mutex_lock(&gStatsMutex);
+    fprintf(out, "{\"op\":\"%s\",\"final\":%s,\"elapsed\":%.6f,\"stages\":{",
+        gStatsOp, final ? "true" : "false", secs(now - gStatsStart));
+    for (size_t i = 0; i < STAGE_COUNT; ++i) {
+        fprintf(out, "%s\"%s\":{\"blocks\":%ju,\"bytes_in\":%ju,"
+            "\"bytes_out\":%ju}", i ? "," : "", stages[i],
+            (uintmax_t)gStages[i].blocks, (uintmax_t)gStages[i].in,
+            (uintmax_t)gStages[i].out);
+    }
+
+    fprintf(out, "},\"workers\":[");
+    for (size_t i = 0; i < gWorkerCount; ++i) {
+        stats_worker_t *w = &gWorkers[i];
+        fprintf(out, "%s{\"blocks\":%ju,\"busy\":%.6f,\"idle\":%.6f%s}",
+            i ? "," : "", (uintmax_t)w->blocks, secs(w->busy_ns),
+            secs(w->idle_ns), pl && pl->process_threads[i].slow
+                ? ",\"slow_core\":true" : "");
+    }
+
+    fprintf(out, "],\"writer\":{\"merge_wait\":%.6f,"
+        "\"head_of_line_stall\":%.6f},", secs(gMergeWaitNs), secs(gStallNs));
+    if (pl && pl->adapt_started) {
+        pthread_mutex_lock(&pl->park_mutex);
+        fprintf(out, "\"adaptive\":{\"active\":%zu,\"floor\":%zu,"
+            "\"ceiling\":%zu,\"parks\":%ju,\"unparks\":%ju},", pl->active,
+            pl->floor, pl->process_count, (uintmax_t)pl->parks,
+            (uintmax_t)pl->unparks);
+        pthread_mutex_unlock(&pl->park_mutex);
+    }
+    uint64_t tokens, token_wait;
+    if (jobserver_stats(&tokens, &token_wait))
+        fprintf(out, "\"jobserver\":{\"tokens\":%ju,\"token_wait\":%.6f},",
+            (uintmax_t)tokens, secs(token_wait));
+
+    fprintf(out, "\"ratio_histogram\":[");
+    for (size_t i = 0; i < RATIO_BUCKETS; ++i) {
+        if (i < RATIO_BUCKETS - 1)
+            fprintf(out, "%s{\"below\":%.1f,", i ? "," : "", (i + 1) / 10.0);
+        else
+            fprintf(out, ",{\"below\":null,");
+        fprintf(out, "\"blocks\":%ju}", (uintmax_t)gRatios[i]);
+    }
+    fprintf(out, "],\"code_time_histogram\":[");
+    for (size_t i = 0; i < TIME_BUCKETS; ++i) {
+        if (i < TIME_BUCKETS - 1)
+            fprintf(out, "%s{\"below_ms\":%u,", i ? "," : "", 1u << i);
+        else
+            fprintf(out, ",{\"below_ms\":null,");
+        fprintf(out, "\"blocks\":%ju}", (uintmax_t)gTimes[i]);
+    }
+    fprintf(out, "],\"peak_buffer_bytes\":%jd,", (intmax_t)gBuffersPeak);
+    fprintf(out, "\"input\":{\"reads\":%ju,\"bytes\":%ju},",
+        (uintmax_t)gInputReads, (uintmax_t)gInputBytes);
+    fprintf(out, "\"output\":{\"bytes\":%ju,\"spliced\":%ju},",
+        (uintmax_t)gOutputBytes, (uintmax_t)gOutputSpliced);
+    pthread_mutex_unlock(&gStatsMutex);
+
+    fprintf(out, "\"queues\":{");
+    if (pl) {
+        report_queue(out, "start", pl->startq, false);
+        report_queue(out, "split", pl->splitq, true);
+        report_queue(out, "merge", pl->mergeq, true);
+    }
+    fprintf(out, "}");
+    if (gPerf) {
+        fprintf(out, ",\"counters\":");
+        perf_report(out);
+    }
+    fprintf(out, "}\n");
+    fflush(out);
+    funlockfile(out);
+}
+
+static void report_queue(FILE *out, const char *name, queue_t *q, bool comma) {
+    pthread_mutex_lock(&q->mutex);
+    fprintf(out, "%s\"%s\":{\"depth\":%zu,\"max_depth\":%zu,\"pushes\":%ju,"
+        "\"waits\":%ju,\"wait\":%.6f}", comma ? "," : "", name, q->depth,
+        q->max_depth, (uintmax_t)q->pushes, (uintmax_t)q->waits,
+        secs(q->wait_ns));
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static double secs(uint64_t ns) {
+    return ns / 1e9;
+}
@@ -0,0 +1,566 @@
+#include "pixz.h"
+#include "libpixz.h"
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <errno.h>
+
+/* Integrity testing, for -T. The workers read and decode every block, in
+ * parallel, and throw the output away, so there's no merging or writing.
+ * Besides each block's check, we make sure of everything else the format
+ * promises:
+ *
+ * - Stream headers and footers have the right magic bytes and CRC32s, no
+ *   reserved flags, and agree with each other. The index is exactly as big
+ *   as the footer's backward size, and with its blocks fills the stream.
+ * - Each block header has the right CRC32 and no reserved bits, and any
+ *   sizes it gives match the index. Each block's data has exactly the
+ *   compressed and uncompressed sizes the index gives, and zero padding.
+ * - In tarballs, each file index entry starts with the tar headers of the
+ *   file it names, and its data ends where the next entry starts.
+ *
+ * File index entries are checked by the worker that decoded the block they
+ * start in, from its output. Those that run past the block are checked at
+ * the end, decoding what they need again. */
+
+#define TEST_READ (8 * 1024 * 1024) // most compressed data read at once
+#define TEST_DISCARD STREAMSIZE // output of a big block, decoded in pieces
+
+
+#pragma mark TYPES
+
+typedef struct {
+    uint8_t *input, *output;
+    size_t incap, outcap;
+    lzma_index_iter iter; // the block, and its stream
+} test_block_t;
+
+// Compressed data of a block, read a piece at a time
+typedef struct {
+    lzma_stream *strm;
+    test_block_t *tb;
+    off_t pos, end;
+} test_input_t;
+
+// A file index entry's span of the tarball, for libarchive
+typedef struct {
+    const uint8_t *buf; // decoded data, from bufstart to bufend
+    uint64_t bufstart, bufend;
+    pixz_reader *reader; // for the rest, or NULL if we can't yet
+    uint64_t pos, end;
+    bool outside; // needed data we don't have
+    uint8_t chunk[16 * CHUNKSIZE];
+} test_span_t;
+
+
+#pragma mark GLOBALS
+
+static pipeline_t *gTestPipeline = NULL;
+
+static file_index_t **gEntries = NULL; // in order, the last without a name
+static size_t gEntryCount = 0;
+static uint64_t gTarEnd = 0; // where the file index block starts
+
+static pthread_mutex_t gDeferMutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t *gDeferred = NULL; // entries to check at the end
+static size_t gDeferredCount = 0, gDeferredCap = 0;
+
+
+#pragma mark DECLARATIONS
+
+static void *test_block_create(void *ctx);
+static void test_block_free(void *data);
+static void test_streams(void);
+static void test_entries(void);
+static void test_thread(pipeline_t *pl, size_t thnum);
+static void test_block(lzma_stream *strm, test_block_t *tb, size_t seq);
+static lzma_ret test_decode(test_input_t *in, uint8_t *out, size_t outcap,
+    bool whole);
+static void test_diagnose(lzma_stream *strm, test_block_t *tb);
+static const char *check_name(lzma_check check);
+static void test_block_entries(test_block_t *tb, bool whole);
+static void test_defer(size_t entry);
+static bool test_entry(size_t i, test_span_t *span);
+static ssize_t test_span_read(struct archive *ar, void *ref,
+    const void **bufp);
+static int64_t test_span_skip(struct archive *ar, void *ref, int64_t request);
+
+
+#pragma mark MAIN
+
+void pixz_test(bool tar) {
+    gTestPipeline = pipeline_create(test_block_create, test_block_free, NULL,
+        gPipelineProcessMax, gPipelineQSize);
+    if (gTestPipeline) {
+        gTestPipeline->hooks = &gPipelineHooks;
+        stats_start(gTestPipeline, "test");
+    }
+    if (!decode_index())
+        die("Can't test non-seekable input");
+    test_streams();
+    if (tar && read_file_index())
+        test_entries();
+
+    if (!gTestPipeline || !pipeline_start(gTestPipeline, NULL, test_thread))
+        die("Error starting pipeline");
+
+    // The workers read for themselves, they only need to know where
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, gIndex);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+        pipeline_item_t *pi;
+        queue_pop(gTestPipeline->startq, (void**)&pi);
+        ((test_block_t*)pi->data)->iter = iter;
+        pipeline_split(gTestPipeline, pi);
+    }
+    if (!pipeline_stop(gTestPipeline))
+        die("Error joining processing thread");
+
+    // Entries whose headers or data ran past their first block
+    if (gDeferredCount) {
+        pixz_options opts;
+        pixz_options_default(&opts);
+        opts.threads = gPipelineProcessMax;
+        test_span_t *span = malloc(sizeof(test_span_t));
+        pixz_reader *reader;
+        if (!span || pixz_reader_open(&reader, fileno(gInFile), &opts)
+                != LZMA_OK)
+            die("Can't open the archive to check its file index");
+        for (size_t i = 0; i < gDeferredCount; ++i) {
+            *span = (test_span_t){ .reader = reader };
+            test_entry(gDeferred[i], span);
+        }
+        pixz_reader_close(reader);
+        free(span);
+    }
+
+    stats_finish();
+    if (!pipeline_destroy(gTestPipeline))
+        die("Error joining splitter thread");
+    free(gDeferred);
+    free(gEntries);
+    free_file_index();
+    lzma_index_end(gIndex, NULL);
+    gIndex = NULL;
+}
+
+static void *test_block_create(void *ctx) {
+    test_block_t *tb = calloc(1, sizeof(test_block_t));
+    if (!tb)
+        die("Out of memory");
+    return tb;
+}
+
+static void test_block_free(void *data) {
+    test_block_t *tb = (test_block_t*)data;
+    stats_buffer(-(ssize_t)(tb->incap + tb->outcap));
+    free(tb->input);
+    free(tb->output);
+    free(tb);
+}
+
+
+#pragma mark STRUCTURE
+
+// Footers and indexes were checked as we read them, now check the headers
+static void test_streams(void) {
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, gIndex);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_STREAM)) {
+        uintmax_t num = iter.stream.number, at = iter.stream.compressed_offset;
+        uint8_t buf[LZMA_STREAM_HEADER_SIZE];
+        lzma_stream_flags flags;
+        if (io_pread(gInIO, buf, sizeof(buf), at) != (ssize_t)sizeof(buf))
+            die("Stream %ju at %ju: error reading its header", num, at);
+        switch (lzma_stream_header_decode(&flags, buf)) {
+            case LZMA_OK: break;
+            case LZMA_FORMAT_ERROR:
+                die("Stream %ju at %ju: header has the wrong magic bytes, "
+                    "the index or backward size must be wrong", num, at);
+            case LZMA_DATA_ERROR:
+                die("Stream %ju at %ju: header CRC32 is wrong", num, at);
+            case LZMA_OPTIONS_ERROR:
+                die("Stream %ju at %ju: header has reserved or unsupported "
+                    "flags", num, at);
+            default:
+                die("Stream %ju at %ju: error decoding its header", num, at);
+        }
+        if (lzma_stream_flags_compare(&flags, iter.stream.flags) != LZMA_OK)
+            die("Stream %ju at %ju: header and footer flags differ", num, at);
+    }
+}
+
+// The file index must cover the tarball in order, from the start
+static void test_entries(void) {
+    for (file_index_t *f = gFileIndex; f; f = f->next)
+        ++gEntryCount;
+    if (!(gEntries = malloc(gEntryCount * sizeof(file_index_t*))))
+        die("Out of memory");
+    size_t i = 0;
+    for (file_index_t *f = gFileIndex; f; f = f->next)
+        gEntries[i++] = f;
+
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, gIndex);
+    lzma_index_iter_locate(&iter, lzma_index_uncompressed_size(gIndex) - 1);
+    gTarEnd = iter.block.uncompressed_file_offset;
+
+    if (gEntryCount && gEntries[0]->offset != 0)
+        die("File index starts at %ju, not at the start of the tarball",
+            (uintmax_t)gEntries[0]->offset);
+    for (i = 0; i < gEntryCount; ++i) {
+        file_index_t *f = gEntries[i];
+        const char *name = f->name ? f->name : "(end of archive)";
+        if (f->name && !f->next)
+            die("File index has no entry for the end of the archive");
+        if (f->next && f->next->offset <= f->offset)
+            die("File index entry %s at %ju isn't before the next one, at %ju",
+                name, (uintmax_t)f->offset, (uintmax_t)f->next->offset);
+        if ((uint64_t)f->offset > gTarEnd)
+            die("File index entry %s at %ju is past the end of the tarball, "
+                "at %ju", name, (uintmax_t)f->offset, (uintmax_t)gTarEnd);
+    }
+}
+
+
+#pragma mark BLOCKS
+
+static void test_thread(pipeline_t *pl, size_t thnum) {
+    lzma_stream strm = LZMA_STREAM_INIT;
+    pipeline_item_t *pi;
+    while ((pi = pipeline_take(pl, thnum))) {
+        test_block(&strm, (test_block_t*)pi->data, pi->seq);
+        queue_push(pl->startq, PIPELINE_ITEM, pi);
+    }
+    lzma_end(&strm);
+}
+
+static void test_block(lzma_stream *strm, test_block_t *tb, size_t seq) {
+    lzma_index_iter *it = &tb->iter;
+    uintmax_t num = it->block.number_in_file;
+    uintmax_t at = it->block.compressed_file_offset;
+    uint64_t usize = it->block.uncompressed_size;
+    uint64_t start = stats_now();
+    probe2(decode__start, seq, it->block.total_size);
+
+    // Keep the whole output of ordinary blocks, to check tar headers in it
+    bool whole = usize <= MAXSPLITSIZE;
+    size_t incap = it->block.total_size < TEST_READ
+        ? it->block.total_size : TEST_READ;
+    size_t outcap = whole ? usize : TEST_DISCARD;
+    if (incap > tb->incap) {
+        stats_buffer(incap - tb->incap);
+        free(tb->input);
+        tb->input = malloc(tb->incap = incap);
+    }
+    if (outcap > tb->outcap) {
+        stats_buffer(outcap - tb->outcap);
+        free(tb->output);
+        tb->output = malloc(tb->outcap = outcap);
+    }
+    if ((incap && !tb->input) || (outcap && !tb->output))
+        die("Can't allocate blocks");
+
+    // The header, which the first read includes
+    test_input_t in = { .strm = strm, .tb = tb, .pos = at,
+        .end = at + it->block.total_size };
+    if (io_pread(gInIO, tb->input, incap, at) != (ssize_t)incap)
+        die("Block %ju at %ju: error reading it", num, at);
+    in.pos += incap;
+    stats_stage(STAGE_READ, incap, incap);
+    if (tb->input[0] == 0)
+        die("Block %ju at %ju: there's no block header, the index must be "
+            "wrong", num, at);
+
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block = { .version = 0, .check = it->stream.flags->check,
+        .filters = filters };
+    block.header_size = lzma_block_header_size_decode(tb->input[0]);
+    if (block.header_size > incap)
+        die("Block %ju at %ju: header is bigger than the block", num, at);
+    switch (lzma_block_header_decode(&block, NULL, tb->input)) {
+        case LZMA_OK: break;
+        case LZMA_DATA_ERROR:
+            die("Block %ju at %ju: header CRC32 is wrong", num, at);
+        case LZMA_OPTIONS_ERROR:
+            die("Block %ju at %ju: header has reserved bits set, or filters "
+                "we don't support", num, at);
+        default:
+            die("Block %ju at %ju: error decoding its header", num, at);
+    }
+
+    // Sizes from the header must match the index
+    lzma_vli overhead = block.header_size + lzma_check_size(block.check);
+    lzma_vli csize = it->block.unpadded_size > overhead
+        ? it->block.unpadded_size - overhead : 0;
+    if (!csize)
+        die("Block %ju at %ju: index gives it %ju bytes, too few for its "
+            "header and check", num, at, (uintmax_t)it->block.unpadded_size);
+    if (block.compressed_size != LZMA_VLI_UNKNOWN
+            && block.compressed_size != csize)
+        die("Block %ju at %ju: header says %ju bytes compressed, the index "
+            "%ju", num, at, (uintmax_t)block.compressed_size, (uintmax_t)csize);
+    if (block.uncompressed_size != LZMA_VLI_UNKNOWN
+            && block.uncompressed_size != usize)
+        die("Block %ju at %ju: header says %ju bytes uncompressed, the index "
+            "%ju", num, at, (uintmax_t)block.uncompressed_size,
+            (uintmax_t)usize);
+
+    // Then the decoder holds the data to the index's sizes
+    block.compressed_size = csize;
+    block.uncompressed_size = usize;
+    lzma_ret err = lzma_block_decoder(strm, &block);
+    for (lzma_filter *f = filters; f->id != LZMA_VLI_UNKNOWN; ++f)
+        free(f->options);
+    if (err != LZMA_OK)
+        die("Block %ju at %ju: error starting to decode it", num, at);
+    strm->next_in = tb->input + block.header_size;
+    strm->avail_in = incap - block.header_size;
+    if (test_decode(&in, tb->output, outcap, whole) != LZMA_STREAM_END)
+        test_diagnose(strm, tb);
+
+    stats_coded(it->block.total_size, usize, start);
+    trace_span("decode", start, seq);
+    probe3(decode__done, seq, it->block.total_size, usize);
+    if (gEntryCount)
+        test_block_entries(tb, whole);
+}
+
+// Decode to the end, discarding output unless it's all to be kept
+static lzma_ret test_decode(test_input_t *in, uint8_t *out, size_t outcap,
+        bool whole) {
+    lzma_stream *strm = in->strm;
+    strm->next_out = out;
+    strm->avail_out = outcap;
+    while (true) {
+        if (strm->avail_in == 0 && in->pos < in->end) {
+            size_t size = in->end - in->pos < TEST_READ
+                ? in->end - in->pos : TEST_READ;
+            if (io_pread(gInIO, in->tb->input, size, in->pos)
+                    != (ssize_t)size)
+                die("Block %ju at %ju: error reading it",
+                    (uintmax_t)in->tb->iter.block.number_in_file,
+                    (uintmax_t)in->tb->iter.block.compressed_file_offset);
+            stats_stage(STAGE_READ, size, size);
+            in->pos += size;
+            strm->next_in = in->tb->input;
+            strm->avail_in = size;
+        }
+        if (strm->avail_out == 0 && !whole) {
+            strm->next_out = out;
+            strm->avail_out = outcap;
+        }
+        lzma_ret err = lzma_code(strm,
+            in->pos < in->end ? LZMA_RUN : LZMA_FINISH);
+        if (err != LZMA_OK)
+            return err;
+    }
+}
+
+// Decoding failed, so try again without the index's sizes or the check,
+// to find out why
+static void test_diagnose(lzma_stream *strm, test_block_t *tb) {
+    lzma_index_iter *it = &tb->iter;
+    uintmax_t num = it->block.number_in_file;
+    uintmax_t at = it->block.compressed_file_offset;
+    test_input_t in = { .strm = strm, .tb = tb, .pos = at,
+        .end = at + it->block.total_size };
+
+    size_t first = it->block.total_size < TEST_READ
+        ? it->block.total_size : TEST_READ;
+    if (io_pread(gInIO, tb->input, first, at) != (ssize_t)first)
+        die("Block %ju at %ju: error reading it", num, at);
+    in.pos += first;
+    strm->next_in = tb->input;
+    strm->avail_in = first;
+
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block = { .version = 1, .check = it->stream.flags->check,
+        .filters = filters };
+    block.header_size = lzma_block_header_size_decode(tb->input[0]);
+    if (lzma_block_header_decode(&block, NULL, tb->input) != LZMA_OK)
+        die("Block %ju at %ju: error decoding its header", num, at);
+    block.ignore_check = true;
+    lzma_ret err = lzma_block_decoder(strm, &block);
+    for (lzma_filter *f = filters; f->id != LZMA_VLI_UNKNOWN; ++f)
+        free(f->options);
+    if (err != LZMA_OK)
+        die("Block %ju at %ju: error starting to decode it", num, at);
+    strm->next_in += block.header_size;
+    strm->avail_in -= block.header_size;
+    err = test_decode(&in, tb->output, tb->outcap < TEST_DISCARD
+        ? tb->outcap : TEST_DISCARD, false);
+
+    lzma_vli csize = it->block.unpadded_size - block.header_size
+        - lzma_check_size(block.check);
+    if (err == LZMA_BUF_ERROR)
+        die("Block %ju at %ju: compressed data runs past where the index "
+            "says the block ends", num, at);
+    if (err != LZMA_STREAM_END)
+        die("Block %ju at %ju: compressed data is corrupt", num, at);
+    if (block.uncompressed_size != it->block.uncompressed_size)
+        die("Block %ju at %ju: decodes to %ju bytes, but the index says %ju",
+            num, at, (uintmax_t)block.uncompressed_size,
+            (uintmax_t)it->block.uncompressed_size);
+    if (block.compressed_size != csize)
+        die("Block %ju at %ju: has %ju bytes of compressed data, but the "
+            "index says %ju", num, at, (uintmax_t)block.compressed_size,
+            (uintmax_t)csize);
+    die("Block %ju at %ju: %s check doesn't match its data", num, at,
+        check_name(block.check));
+}
+
+static const char *check_name(lzma_check check) {
+    switch (check) {
+        case LZMA_CHECK_NONE: return "empty";
+        case LZMA_CHECK_CRC32: return "CRC32";
+        case LZMA_CHECK_CRC64: return "CRC64";
+        case LZMA_CHECK_SHA256: return "SHA-256";
+        default: return "unknown";
+    }
+}
+
+
+#pragma mark FILE INDEX
+
+// Check the entries that start in a block, if we can from its output
+static void test_block_entries(test_block_t *tb, bool whole) {
+    uint64_t ustart = tb->iter.block.uncompressed_file_offset;
+    uint64_t uend = ustart + tb->iter.block.uncompressed_size;
+    size_t lo = 0, hi = gEntryCount;
+    while (lo < hi) { // the first entry at ustart or later
+        size_t mid = lo + (hi - lo) / 2;
+        if ((uint64_t)gEntries[mid]->offset < ustart)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    test_span_t *span = NULL;
+    for (size_t i = lo; i < gEntryCount
+            && (uint64_t)gEntries[i]->offset < uend; ++i) {
+        if (!whole) {
+            test_defer(i);
+            continue;
+        }
+        if (!span && !(span = malloc(sizeof(test_span_t))))
+            die("Out of memory");
+        *span = (test_span_t){ .buf = tb->output, .bufstart = ustart,
+            .bufend = uend };
+        if (!test_entry(i, span))
+            test_defer(i);
+    }
+    free(span);
+}
+
+static void test_defer(size_t entry) {
+    pthread_mutex_lock(&gDeferMutex);
+    if (gDeferredCount == gDeferredCap) {
+        gDeferredCap = gDeferredCap ? gDeferredCap * 2 : 64;
+        if (!(gDeferred = realloc(gDeferred, gDeferredCap * sizeof(size_t))))
+            die("Out of memory");
+    }
+    gDeferred[gDeferredCount++] = entry;
+    pthread_mutex_unlock(&gDeferMutex);
+}
+
+// Check an entry against the tar headers in its span, which must hold any
+// multi-headers, then the headers for the file it names, then that file's
+// data, and no more. False if the span needs data we don't have.
+static bool test_entry(size_t i, test_span_t *span) {
+    file_index_t *f = gEntries[i];
+    span->pos = f->offset;
+    span->end = f->next ? (uint64_t)f->next->offset : gTarEnd;
+    uintmax_t at = f->offset;
+    const char *name = f->name ? f->name : "(end of archive)";
+    if (span->pos == span->end) { // libarchive wants something to look at
+        if (f->name)
+            die("File index has %s at %ju, but there's no tar header for it",
+                f->name, at);
+        return true;
+    }
+
+    struct archive *ar = archive_read_new();
+    prevent_compression(ar);
+    archive_read_support_format_tar(ar);
+    archive_read_set_options(ar, "tar:!mac-ext"); // keep ._ files apart
+    bool found = false;
+    if (archive_read_open2(ar, span, NULL, test_span_read, test_span_skip,
+            NULL) != ARCHIVE_OK && !span->outside)
+        die("File index entry %s at %ju: %s", name, at,
+            archive_error_string(ar));
+    while (!span->outside) {
+        struct archive_entry *entry;
+        int aerr = archive_read_next_header(ar, &entry);
+        if (span->outside)
+            break;
+        if (aerr == ARCHIVE_EOF)
+            break;
+        if (aerr != ARCHIVE_OK && aerr != ARCHIVE_WARN)
+            die("File index entry %s at %ju: %s", name, at,
+                archive_error_string(ar));
+
+        const char *path = archive_entry_pathname(entry);
+        uintmax_t pos = at + archive_read_header_position(ar);
+        if (!f->name)
+            die("Tar header for %s at %ju is after the end of the file index",
+                path, pos);
+        if (found)
+            die("Tar header for %s at %ju is missing from the file index",
+                path, pos);
+        if (!is_multi_header(path)) {
+            if (strcmp(path, f->name) != 0)
+                die("File index has %s at %ju, but the tar header there is "
+                    "for %s", f->name, at, path);
+            found = true;
+        }
+        if (archive_read_data_skip(ar) != ARCHIVE_OK && !span->outside)
+            die("File index entry %s at %ju: data runs past the next entry, "
+                "at %ju", f->name, at, (uintmax_t)span->end);
+    }
+    finish_reading(ar);
+    if (span->outside)
+        return false;
+    if (f->name && !found)
+        die("File index has %s at %ju, but there's no tar header for it",
+            f->name, at);
+    return true;
+}
+
+static ssize_t test_span_read(struct archive *ar, void *ref,
+        const void **bufp) {
+    test_span_t *span = (test_span_t*)ref;
+    if (span->pos >= span->end)
+        return 0;
+    size_t len;
+    if (span->pos >= span->bufstart && span->pos < span->bufend) {
+        uint64_t end = span->end < span->bufend ? span->end : span->bufend;
+        len = end - span->pos;
+        *bufp = span->buf + (span->pos - span->bufstart);
+    } else if (span->reader) {
+        len = sizeof(span->chunk);
+        if (len > span->end - span->pos)
+            len = span->end - span->pos;
+        if (pixz_reader_read(span->reader, span->pos, span->chunk, len, &len)
+                != LZMA_OK || len == 0) {
+            archive_set_error(ar, EIO, "Error reading archive");
+            return -1;
+        }
+        *bufp = span->chunk;
+    } else {
+        span->outside = true;
+        archive_set_error(ar, EIO, "Outside the block");
+        return -1;
+    }
+    span->pos += len;
+    return len;
+}
+
+// Skipping file data needn't decode it
+static int64_t test_span_skip(struct archive *ar, void *ref, int64_t request) {
+    test_span_t *span = (test_span_t*)ref;
+    if ((uint64_t)request > span->end - span->pos)
+        request = span->end - span->pos;
+    span->pos += request;
+    return request;
+}
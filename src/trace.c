@@ -0,0 +1,158 @@
+#include "pixz.h"
+
+#include <stdarg.h>
+#include <unistd.h>
+
+/* A timeline of what each thread did, in Chrome's trace-event format, for
+ * chrome://tracing or Perfetto.
+ *
+ * Each thread appends spans to its own buffer, so recording takes no locks.
+ * Buffers are linked into a global list when a thread first records, and
+ * never freed, so they can be written out once the threads are done. */
+
+#define TRACE_CHUNK 4096 // spans
+
+
+#pragma mark TYPES
+
+typedef struct {
+    const char *name;
+    uint64_t start, end;
+    ssize_t seq;
+} trace_span_t;
+
+typedef struct trace_chunk_t trace_chunk_t;
+struct trace_chunk_t {
+    trace_chunk_t *next;
+    size_t count;
+    trace_span_t spans[TRACE_CHUNK];
+};
+
+typedef struct trace_buf_t trace_buf_t;
+struct trace_buf_t {
+    trace_buf_t *next;
+    unsigned tid;
+    char name[32];
+    trace_chunk_t *first, *last;
+};
+
+
+#pragma mark GLOBALS
+
+bool gTrace = false;
+
+static FILE *gTraceOut = NULL;
+static uint64_t gTraceStart = 0;
+static trace_buf_t *gTraceBufs = NULL;
+static unsigned gTraceTids = 0;
+static __thread trace_buf_t *tTraceBuf = NULL;
+
+
+#pragma mark DECLARATIONS
+
+static trace_buf_t *trace_buf(void);
+static void trace_write_buf(trace_buf_t *buf, int pid, bool *comma);
+
+
+#pragma mark TRACE
+
+void trace_start(const char *path) {
+    if (!(gTraceOut = fopen(path, "w")))
+        die("Can't open trace file %s", path);
+    gTrace = true;
+    gTraceStart = stats_now();
+    trace_thread("writer"); // pipeline owners write from the main thread
+}
+
+void trace_finish(void) {
+    if (!gTrace)
+        return;
+    int pid = getpid();
+    bool comma = false;
+    fprintf(gTraceOut, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (trace_buf_t *buf = gTraceBufs; buf; buf = buf->next)
+        trace_write_buf(buf, pid, &comma);
+    fprintf(gTraceOut, "\n]}\n");
+    if (fclose(gTraceOut) != 0)
+        die("Error writing trace");
+    gTraceOut = NULL;
+    gTrace = false;
+}
+
+void trace_thread(const char *fmt, ...) {
+    if (!gTrace)
+        return;
+    trace_buf_t *buf = trace_buf();
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf->name, sizeof(buf->name), fmt, args);
+    va_end(args);
+}
+
+void trace_span(const char *name, uint64_t start, ssize_t seq) {
+    if (gTrace && start)
+        trace_span_at(name, start, stats_now(), seq);
+}
+
+void trace_span_at(const char *name, uint64_t start, uint64_t end,
+        ssize_t seq) {
+    if (!gTrace || !start)
+        return;
+    trace_buf_t *buf = trace_buf();
+    trace_chunk_t *chunk = buf->last;
+    if (!chunk || chunk->count == TRACE_CHUNK) {
+        if (!(chunk = malloc(sizeof(trace_chunk_t))))
+            die("Out of memory");
+        chunk->next = NULL;
+        chunk->count = 0;
+        if (buf->last)
+            buf->last->next = chunk;
+        else
+            buf->first = chunk;
+        buf->last = chunk;
+    }
+    chunk->spans[chunk->count++] = (trace_span_t){ .name = name,
+        .start = start, .end = end, .seq = seq };
+}
+
+// The calling thread's buffer, created on first use
+static trace_buf_t *trace_buf(void) {
+    if (tTraceBuf)
+        return tTraceBuf;
+    trace_buf_t *buf = calloc(1, sizeof(trace_buf_t));
+    if (!buf)
+        die("Out of memory");
+    buf->tid = __atomic_add_fetch(&gTraceTids, 1, __ATOMIC_RELAXED);
+    snprintf(buf->name, sizeof(buf->name), "thread %u", buf->tid);
+    buf->next = __atomic_load_n(&gTraceBufs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&gTraceBufs, &buf->next, buf, false,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ; // someone else got in first, buf->next is updated
+    return tTraceBuf = buf;
+}
+
+
+#pragma mark OUTPUT
+
+static void trace_write_buf(trace_buf_t *buf, int pid, bool *comma) {
+    FILE *out = gTraceOut;
+    fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+        "\"tid\":%u,\"args\":{\"name\":\"%s\"}}", *comma ? ",\n" : "", pid,
+        buf->tid, buf->name);
+    fprintf(out, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\","
+        "\"pid\":%d,\"tid\":%u,\"args\":{\"sort_index\":%u}}", pid, buf->tid,
+        buf->tid);
+    *comma = true;
+
+    for (trace_chunk_t *chunk = buf->first; chunk; chunk = chunk->next) {
+        for (size_t i = 0; i < chunk->count; ++i) {
+            trace_span_t *s = &chunk->spans[i];
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+                "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f", s->name, pid, buf->tid,
+                (s->start - gTraceStart) / 1e3, (s->end - s->start) / 1e3);
+            if (s->seq >= 0)
+                fprintf(out, ",\"args\":{\"block\":%zd}", s->seq);
+            fprintf(out, "}");
+        }
+    }
+}
@@ -0,0 +1,115 @@
+#include "pixz.h"
+
+/* What the command line adds to each pipeline's threads, which the library
+ * runs without.
+ *
+ * Workers may park between items for adaptive scaling, and beyond the first
+ * they run only with a token from make's jobserver, if there is one. Each
+ * thread is named for tracing and counted for stats and perf, and workers
+ * pay for their CPU time under --limit before each item. */
+
+static void workers_start(pipeline_t *pl);
+static void workers_stop(pipeline_t *pl);
+static void workers_thread_start(pipeline_t *pl, pipeline_thread_t *th);
+static void workers_thread_stop(pipeline_t *pl, pipeline_thread_t *th);
+static int workers_take(pipeline_t *pl, pipeline_thread_t *th,
+    pipeline_item_t **itemp);
+static int workers_token_pop(pipeline_t *pl, pipeline_thread_t *th,
+    pipeline_item_t **itemp);
+static void workers_merge_wait(pipeline_t *pl, uint64_t start);
+
+const pipeline_hooks_t gPipelineHooks = {
+    .start = workers_start,
+    .stop = workers_stop,
+    .thread_start = workers_thread_start,
+    .thread_stop = workers_thread_stop,
+    .take = workers_take,
+    .merge_wait = workers_merge_wait,
+};
+
+
+#pragma mark THREADS
+
+static void workers_start(pipeline_t *pl) {
+    if (pl->qsize < pl->process_count) {
+        fprintf(stderr, "Warning: queue size is less than thread count, "
+            "performance will suffer!\n");
+    }
+    adapt_start(pl); // before any worker asks whether it's parked
+}
+
+static void workers_stop(pipeline_t *pl) {
+    perf_thread_stop(); // the reader is done, before anyone reports on it
+    adapt_stop(pl);
+}
+
+static void workers_thread_start(pipeline_t *pl, pipeline_thread_t *th) {
+    if (!th) {
+        trace_thread("reader");
+        perf_thread_start(STAGE_READ); // stops in workers_stop
+        return;
+    }
+    trace_thread(th->slow ? "worker %zu (slow)" : "worker %zu", th->num);
+    perf_thread_start(STAGE_CODE);
+}
+
+static void workers_thread_stop(pipeline_t *pl, pipeline_thread_t *th) {
+    perf_thread_stop();
+}
+
+
+#pragma mark ITEMS
+
+static int workers_take(pipeline_t *pl, pipeline_thread_t *th,
+        pipeline_item_t **itemp) {
+    uint64_t start = stats_now();
+    adapt_park(pl, th->num); // parked time counts as idle
+    int tag;
+    if (th->num && (th->token || jobserver_active())) {
+        // the first worker has make's implicit slot
+        tag = workers_token_pop(pl, th, itemp);
+    } else {
+        tag = pipeline_pop(pl, th, itemp);
+    }
+    stats_worker(th->num, start, stats_now());
+    if (tag == PIPELINE_STOP) {
+        if (th->token)
+            jobserver_release();
+        th->token = false;
+    } else {
+        limit_cpu(); // pay for the last item before starting this one
+    }
+    return tag;
+}
+
+// Take an item with a token held for it. A worker waits for a token only
+// for an item nobody else has claimed, and gives the token back if the item
+// went to someone else, so no more hold tokens than there are items to work on.
+static int workers_token_pop(pipeline_t *pl, pipeline_thread_t *th,
+        pipeline_item_t **itemp) {
+    int tag;
+    while (true) {
+        if (th->token) {
+            if (th->slow ? queue_trypop_newest(pl->splitq, &tag, (void**)itemp)
+                    : queue_trypop(pl->splitq, &tag, (void**)itemp))
+                return tag;
+            jobserver_release();
+            th->token = false;
+        }
+        if (!jobserver_active()) // make went away
+            break;
+        tag = queue_claim(pl->splitq);
+        if (tag == PIPELINE_ITEM)
+            th->token = jobserver_acquire();
+        queue_unclaim(pl->splitq);
+        if (tag != PIPELINE_ITEM)
+            break; // stopping, which needs no token
+    }
+    return pipeline_pop(pl, th, itemp);
+}
+
+static void workers_merge_wait(pipeline_t *pl, uint64_t start) {
+    stats_merge_wait(start, pl->merged_items);
+    trace_span(pl->merged_items ? "head-of-line stall" : "merge wait",
+        start, pl->merge_seq);
+}
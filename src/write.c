@@ -2,25 +2,40 @@
 
 #include <archive.h>
 #include <archive_entry.h>
+#include <sys/stat.h>
 
 
 #pragma mark TYPES
 
+// One input file, and the output made from it
+typedef struct {
+    pixz_file_t *file;
+    bool tar;
+    file_index_t *files, *last_file;
+} write_file_t;
+
 typedef struct io_block_t io_block_t;
 struct io_block_t {
     lzma_block block;
     uint8_t *input, *output;
     size_t insize, outsize;
+    
+    write_file_t *file;
+    bool file_end; // the last block of its file, perhaps empty
 };
 
 
 #pragma mark GLOBALS
 
-#define LZMA_CHUNK_MAX (1 << 16)
-
 double gBlockFraction = 2.0;
+size_t gBlockAlign = 0;
 
 static bool gTar = true;
+static pipeline_t *gPipeline = NULL;
+
+static pixz_file_t *gFiles = NULL;
+static size_t gFileCount = 0;
+static write_file_t *gReadFile = NULL, *gWriteFile = NULL;
 
 static size_t gBlockInSize = 0, gBlockOutSize = 0;
 
@@ -31,22 +46,21 @@ static off_t gTotalRead = 0;
 static pipeline_item_t *gReadItem = NULL;
 static io_block_t *gReadBlock = NULL;
 static size_t gReadItemCount = 0;
+static uint64_t gReadStart = 0; // when the reader got its block
 
 static lzma_filter gFilters[LZMA_FILTERS_MAX + 1];
 
-static uint8_t gFileIndexBuf[CHUNKSIZE];
-static size_t gFileIndexBufPos = 0;
+static off_t gOutOffset = 0;
+static size_t gFillerMin = 0, gFillerMax = 0;
 
 
 #pragma mark FUNCTION DECLARATIONS
 
-static void read_thread();
+static void read_thread(pipeline_t *pl);
 
-static void encode_thread(size_t thnum);
-static void encode_uncompressible(io_block_t *ib);
-static size_t size_uncompressible(size_t insize);
+static void encode_thread(pipeline_t *pl, size_t thnum);
 
-static void *block_create();
+static void *block_create(void *ctx);
 static void block_free(void *data);
 
 typedef enum {
@@ -57,26 +71,40 @@ typedef enum {
 static void block_alloc(io_block_t *ib, block_parts parts);
 static void block_dealloc(io_block_t *ib, block_parts parts);
 
+static uint64_t input_size(void);
+static void read_file(pipeline_t *pl, pixz_file_t *file);
+static void read_input(pixz_file_t *file);
 static void add_file(off_t offset, const char *name);
+static void add_member(const char *name);
+static uint8_t *read_space(size_t *space);
+static void read_commit(size_t size);
+static void read_bytes(const void *buf, size_t size);
 
 static archive_read_callback tar_read;
 static archive_open_callback tar_ok;
 static archive_close_callback tar_ok;
 
 static void block_init(lzma_block *block, size_t insize);
+static void start_file(write_file_t *wf);
+static void finish_file(void);
 static void stream_edge(lzma_vli backward_size);
 static void write_block(pipeline_item_t *pi);
+static void write_output(const uint8_t *buf, size_t size, const char *what);
+static size_t align_gap(off_t offset, size_t min);
+static void align_output(void);
+static void write_filler(size_t size);
 static void encode_index(void);
 
 static void write_file_index(void);
-static void write_file_index_bytes(size_t size, uint8_t *buf);
-static void write_file_index_buf(lzma_action action);
+static void write_file_index_out(void *ctx, const uint8_t *buf, size_t size);
 
 
 #pragma mark FUNCTION DEFINITIONS
 
-void pixz_write(bool tar, uint32_t level) {
+void pixz_write(bool tar, uint32_t level, size_t nfiles, pixz_file_t *files) {
     gTar = tar;
+    gFiles = files;
+    gFileCount = nfiles;
     
     // xz options
     lzma_options_lzma lzma_opts;
@@ -91,38 +119,52 @@ void pixz_write(bool tar, uint32_t level) {
         die("Block size must be positive");
     gBlockOutSize = lzma_block_buffer_bound(gBlockInSize);
     
-    pipeline_create(block_create, block_free, read_thread, encode_thread);
-    debug("writer: start");
+    if (gBlockAlign) {
+        // Empty blocks fill gaps too big for header padding
+        lzma_block filler;
+        block_init(&filler, 0);
+        filler.uncompressed_size = 0;
+        filler.compressed_size = 1;
+        if (lzma_block_header_size(&filler) != LZMA_OK)
+            die("Error getting filler block header size");
+        size_t trailer = lzma_block_total_size(&filler) - filler.header_size;
+        gFillerMin = filler.header_size + trailer;
+        gFillerMax = LZMA_BLOCK_HEADER_SIZE_MAX + trailer;
+    }
     
-    // pre-block setup: header, index
-    if (!(gIndex = lzma_index_init(NULL)))
-        die("Error creating index");
-    stream_edge(LZMA_VLI_UNKNOWN);
+    gPipeline = pipeline_create(block_create, block_free, NULL,
+        gPipelineProcessMax, gPipelineQSize);
+    if (gPipeline) {
+        gPipeline->hooks = &gPipelineHooks;
+        stats_start(gPipeline, "compress");
+    }
+    progress_start("compress", input_size(), 0);
+    if (!gPipeline || !pipeline_start(gPipeline, read_thread, encode_thread))
+        die("Error starting pipeline");
+    debug("writer: start");
     
-    // write blocks
+    // write blocks, one file after another
     while (true) {
-        pipeline_item_t *pi = pipeline_merged();
+        pipeline_item_t *pi = pipeline_merged(gPipeline);
         if (!pi)
             break;
         
         debug("writer: received %zu", pi->seq);
-        write_block(pi);
-        queue_push(gPipelineStartQ, PIPELINE_ITEM, pi);
+        io_block_t *ib = (io_block_t*)(pi->data);
+        if (ib->file != gWriteFile)
+            start_file(ib->file);
+        if (ib->insize)
+            write_block(pi);
+        if (ib->file_end)
+            finish_file();
+        queue_push(gPipeline->startq, PIPELINE_ITEM, pi);
     }
     
-    // file index
-    if (gTar)
-        write_file_index();
-    free_file_index();
-    
-    // post-block cleanup: index, footer
-    encode_index();
-    stream_edge(lzma_index_size(gIndex));
-    lzma_index_end(gIndex, NULL);
-    fclose(gOutFile);
-    
     debug("writer: cleaning up reader");
-    pipeline_destroy();
+    progress_finish();
+    stats_finish();
+    if (!pipeline_destroy(gPipeline))
+        die("Error joining splitter thread");
     
     debug("exit");
 }
@@ -130,10 +172,79 @@ void pixz_write(bool tar, uint32_t level) {
 
 #pragma mark READING
 
-static void read_thread() {
+static void read_thread(pipeline_t *pl) {
     debug("reader: start");
+    for (size_t i = 0; i < gFileCount; ++i)
+        read_file(pl, &gFiles[i]);
     
-    if (gTar) {
+    // stop the other threads
+    debug("reader: cleaning up encoders");
+    if (!pipeline_stop(pl))
+        die("Error joining processing thread");
+    debug("reader: end");
+}
+
+// Total size of the inputs, or zero if we can't tell
+static uint64_t input_size(void) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < gFileCount; ++i) {
+        pixz_file_t *f = &gFiles[i];
+        struct stat st;
+        if (f->paths)
+            return 0;
+        int err = f->in ? fstat(fileno(f->in), &st)
+            : f->ipath ? stat(f->ipath, &st) : fstat(STDIN_FILENO, &st);
+        if (err == -1 || !S_ISREG(st.st_mode))
+            return 0;
+        total += st.st_size;
+    }
+    return total;
+}
+
+// Blocks from consecutive files share the pipeline, so small files are
+// encoded concurrently
+static void read_file(pipeline_t *pl, pixz_file_t *file) {
+    gReadFile = malloc(sizeof(write_file_t));
+    if (!gReadFile)
+        die("Out of memory");
+    *gReadFile = (write_file_t){ .file = file, .tar = gTar || file->paths };
+    gMultiHeader = false;
+    gTotalRead = 0;
+    
+    // We know where our own members start, no need to parse them back
+    if (file->paths)
+        create_tar(file->npaths, file->paths, add_member, read_bytes);
+    else
+        read_input(file);
+    if (gReadFile->tar)
+        add_file(gTotalRead, NULL);
+    
+    // write last block, marking the end of the file
+    if (!gReadItem) {
+        queue_pop(pl->startq, (void**)&gReadItem);
+        gReadStart = stats_now();
+        gReadBlock = (io_block_t*)(gReadItem->data);
+        gReadBlock->insize = 0;
+        gReadBlock->file = gReadFile;
+    }
+    debug("reader: handling last block %zu", gReadItemCount);
+    gReadBlock->file_end = true;
+    stats_stage(STAGE_READ, gReadBlock->insize, gReadBlock->insize);
+    trace_span("read", gReadStart, pl->split_seq);
+    probe2(block__read, pl->split_seq, gReadBlock->insize);
+    if (gReadBlock->insize)
+        pipeline_split(pl, gReadItem);
+    else // nothing to encode
+        pipeline_dispatch(pl, gReadItem, pl->mergeq);
+    gReadItem = NULL;
+    gReadFile = NULL;
+}
+
+// Read a file in, finding its tar members if it has them
+static void read_input(pixz_file_t *file) {
+    file_open_input(file);
+    gInFile = file->in;
+    if (gReadFile->tar) {
 		struct archive *ar = archive_read_new();
 	    prevent_compression(ar);
 	    archive_read_support_format_tar(ar);
@@ -144,6 +255,10 @@ static void read_thread() {
 	        int aerr = archive_read_next_header(ar, &entry);
 	        if (aerr == ARCHIVE_EOF) {
 	            break;
+	        } else if (aerr != ARCHIVE_OK && aerr != ARCHIVE_WARN
+	                && !gReadFile->files) {
+	            gReadFile->tar = false; // eg: empty input
+	            break;
 	        } else if (aerr != ARCHIVE_OK && aerr != ARCHIVE_WARN) {
 	            // Some charset translations warn spuriously
 	            fprintf(stderr, "%s\n", archive_error_string(ar));
@@ -151,14 +266,14 @@ static void read_thread() {
 	        }
         
 	        if (archive_format(ar) == ARCHIVE_FORMAT_RAW) {
-	            gTar = false;
+	            gReadFile->tar = false;
 				break;
 			}
             add_file(archive_read_header_position(ar),
                 archive_entry_pathname(entry));
 	    }
 		if (archive_read_header_position(ar) == 0)
-			gTar = false; // probably spuriously identified as tar
+			gReadFile->tar = false; // probably spuriously identified as tar
     	finish_reading(ar);
 	}
 	if (!feof(gInFile)) {
@@ -167,61 +282,77 @@ static void read_thread() {
 			; // just keep pumping
 	}
     fclose(gInFile);
-    
-	if (gTar)
-        add_file(gTotalRead, NULL);
-    
-    // write last block, if necessary
-    if (gReadItem) {
-        // if this block had only one read, and it was EOF, it's waste
-        debug("reader: handling last block %zu", gReadItemCount);
-        if (gReadBlock->insize)
-            pipeline_split(gReadItem);
-        else
-            queue_push(gPipelineStartQ, PIPELINE_ITEM, gReadItem);
-        gReadItem = NULL;
-    }
-    
-    // stop the other threads
-    debug("reader: cleaning up encoders");
-    pipeline_stop();
-    debug("reader: end");
 }
 
 static ssize_t tar_read(struct archive *ar, void *ref, const void **bufp) {
-    if (!gReadItem) {
-        queue_pop(gPipelineStartQ, (void**)&gReadItem);
-        gReadBlock = (io_block_t*)(gReadItem->data);
-        block_alloc(gReadBlock, BLOCK_IN);
-        gReadBlock->insize = 0;
-        debug("reader: reading %zu", gReadItemCount);
-    }
-    
-    size_t space = gBlockInSize - gReadBlock->insize;
+    size_t space;
+    uint8_t *buf = read_space(&space);
     if (space > CHUNKSIZE)
         space = CHUNKSIZE;    
-    uint8_t *buf = gReadBlock->input + gReadBlock->insize;
     size_t rd = fread(buf, 1, space, gInFile);
     if (ferror(gInFile))
         die("Error reading input file");
-    gReadBlock->insize += rd;
-    gTotalRead += rd;
+    stats_input(rd);
     *bufp = buf;
+    read_commit(rd);
+    return rd;
+}
+
+// Where the next input goes, in the current block
+static uint8_t *read_space(size_t *space) {
+    if (!gReadItem) {
+        queue_pop(gPipeline->startq, (void**)&gReadItem);
+        gReadStart = stats_now();
+        gReadBlock = (io_block_t*)(gReadItem->data);
+        block_alloc(gReadBlock, BLOCK_IN);
+        gReadBlock->insize = 0;
+        gReadBlock->file = gReadFile;
+        gReadBlock->file_end = false;
+        debug("reader: reading %zu", gReadItemCount);
+    }
+    *space = gBlockInSize - gReadBlock->insize;
+    return gReadBlock->input + gReadBlock->insize;
+}
+
+// Input was put in read_space, send the block off if it's full
+static void read_commit(size_t size) {
+    gReadBlock->insize += size;
+    gTotalRead += size;
+    limit_take(LIMIT_READ, size);
     
     if (gReadBlock->insize == gBlockInSize) {
         debug("reader: sending %zu", gReadItemCount);
-        pipeline_split(gReadItem);
+        stats_stage(STAGE_READ, gReadBlock->insize, gReadBlock->insize);
+        trace_span("read", gReadStart, gPipeline->split_seq);
+        probe2(block__read, gPipeline->split_seq, gReadBlock->insize);
+        pipeline_split(gPipeline, gReadItem);
         ++gReadItemCount;
         gReadItem = NULL;
     }
-    
-    return rd;
+}
+
+static void read_bytes(const void *buf, size_t size) {
+    const uint8_t *p = (const uint8_t*)buf;
+    while (size) {
+        size_t space;
+        uint8_t *dst = read_space(&space);
+        if (space > size)
+            space = size;
+        memcpy(dst, p, space);
+        read_commit(space);
+        p += space;
+        size -= space;
+    }
 }
 
 static int tar_ok(struct archive *ar, void *ref) {
     return ARCHIVE_OK;
 }
 
+static void add_member(const char *name) {
+    add_file(gTotalRead, name);
+}
+
 static void add_file(off_t offset, const char *name) {
     if (name && is_multi_header(name)) {
         if (!gMultiHeader)
@@ -236,156 +367,77 @@ static void add_file(off_t offset, const char *name) {
     f->name = name ? xstrdup(name) : NULL;
     f->next = NULL;
     
-    if (gLastFile) {
-        gLastFile->next = f;
+    if (gReadFile->last_file) {
+        gReadFile->last_file->next = f;
     } else { // new index
-        gFileIndex = f;
+        gReadFile->files = f;
     }
-    gLastFile = f;
+    gReadFile->last_file = f;
 }
 
 static void block_free(void *data) {
     io_block_t *ib = (io_block_t*)data;
-    free(ib->input);
-    free(ib->output);
+    block_dealloc(ib, BLOCK_ALL);
     free(ib);
 }
 
-static void *block_create() {
+static void *block_create(void *ctx) {
     io_block_t *ib = malloc(sizeof(io_block_t));
     ib->input = ib->output = NULL;
     return ib;
 }
 
 static void block_alloc(io_block_t *ib, block_parts parts) {
-    if ((parts & BLOCK_IN) && !ib->input)
+    if ((parts & BLOCK_IN) && !ib->input) {
         ib->input = malloc(gBlockInSize);
-    if ((parts & BLOCK_IN) && !ib->output)
+        stats_buffer(gBlockInSize);
+    }
+    if ((parts & BLOCK_IN) && !ib->output) {
         ib->output = malloc(gBlockOutSize);
+        stats_buffer(gBlockOutSize);
+    }
     if (!ib->input || !ib->output)
         die("Can't allocate blocks");
 }
 
 static void block_dealloc(io_block_t *ib, block_parts parts) {
-    if (parts & BLOCK_IN) {
+    if ((parts & BLOCK_IN) && ib->input) {
 		free(ib->input);
 		ib->input = NULL;
+		stats_buffer(-(ssize_t)gBlockInSize);
 	}
-    if (parts & BLOCK_OUT) {
+    if ((parts & BLOCK_OUT) && ib->output) {
 		free(ib->output);
 		ib->output = NULL;
+		stats_buffer(-(ssize_t)gBlockOutSize);
 	}
 }
 
 
 #pragma mark ENCODING
 
-static size_t size_uncompressible(size_t insize) {
-    size_t chunks = insize / LZMA_CHUNK_MAX;
-    if (insize % LZMA_CHUNK_MAX)
-        ++chunks;
-    // Per chunk (control code + 2-byte size), one byte for EOF
-    size_t data_size = insize + chunks * 3 + 1;
-    if (data_size % 4)
-        data_size += 4 - data_size % 4; // Padding
-    return data_size;
-}
-
-static void encode_uncompressible(io_block_t *ib) {
-    // See http://en.wikipedia.org/wiki/Lzma#LZMA2_format
-    const uint8_t control_uncomp = 1;
-    const uint8_t control_end = 0;
-
-    uint8_t *output_start = ib->output + ib->block.header_size;
-    uint8_t *output = output_start;
-    uint8_t *input = ib->input;
-    size_t remain = ib->insize;
-
-    while (remain) {
-        size_t size = remain;
-        if (size > LZMA_CHUNK_MAX)
-            size = LZMA_CHUNK_MAX;
-
-        // control byte for uncompressed block
-        *output++ = control_uncomp;
-
-        // 16-bit big endian (size - 1)
-        uint16_t size_write = size - 1;
-        *output++ = (size_write >> 8);
-        *output++ = (size_write & 0xFF);
-
-        // actual chunk data
-        memcpy(output, input, size);
-
-        remain -= size;
-        output += size;
-        input += size;
-    }
-    // control byte for end of block
-    *output++ = control_end;
-
-    ib->block.compressed_size = output - output_start;
-    ib->block.uncompressed_size = ib->insize;
-
-    // padding
-    while ((output - output_start) % 4)
-        *output++ = 0;
-
-    // checksum (little endian)
-    if (ib->block.check != LZMA_CHECK_CRC32)
-        die("pixz only supports CRC-32 checksums");
-    uint32_t check = lzma_crc32(ib->input, ib->insize, 0);
-    *output++ = check & 0xFF;
-    *output++ = (check >> 8) & 0xFF;
-    *output++ = (check >> 16) & 0xFF;
-    *output++ = (check >> 24);
-}
-
-static void encode_thread(size_t thnum) {
+static void encode_thread(pipeline_t *pl, size_t thnum) {
     lzma_stream stream = LZMA_STREAM_INIT;    
-    while (true) {
-        pipeline_item_t *pi;
-        int msg = queue_pop(gPipelineSplitQ, (void**)&pi);
-        if (msg == PIPELINE_STOP)
-            break;
-        
+    pipeline_item_t *pi;
+    while ((pi = pipeline_take(pl, thnum))) {
         debug("encoder %zu: received %zu", thnum, pi->seq);
         io_block_t *ib = (io_block_t*)(pi->data);
         
 		block_alloc(ib, BLOCK_OUT);
-        block_init(&ib->block, ib->insize);
-        size_t header_size = ib->block.header_size;
-        size_t uncompressible_size = size_uncompressible(ib->insize) +
-            lzma_check_size(ib->block.check);
-		        
-        if (lzma_block_encoder(&stream, &ib->block) != LZMA_OK)
-            die("Error creating block encoder");
-        stream.next_in = ib->input;
-        stream.avail_in = ib->insize;
-        stream.next_out = ib->output + header_size;
-        stream.avail_out = uncompressible_size;
-        
-        ib->block.uncompressed_size = LZMA_VLI_UNKNOWN; // for encoder to change
-        lzma_ret err = LZMA_OK;
-        while (err == LZMA_OK) {
-            err = lzma_code(&stream, LZMA_FINISH);
-        }
-        if (err == LZMA_BUF_ERROR) {
-            debug("encoder: uncompressible %zu", pi->seq);
-            encode_uncompressible(ib);
-            ib->outsize = header_size + uncompressible_size;
-        } else if (err == LZMA_STREAM_END) {
-            ib->outsize = stream.next_out - ib->output;
-        } else {
+        ib->block = (lzma_block){ .version = 0, .check = CHECK,
+            .filters = gFilters };
+        uint64_t start = stats_now();
+        probe2(encode__start, pi->seq, ib->insize);
+        if (encode_block(&stream, &ib->block, ib->input, ib->insize,
+                ib->output, &ib->outsize) != LZMA_OK)
             die("Error encoding block");
-        }
+        stats_coded(ib->insize, ib->outsize, start);
+        trace_span("encode", start, pi->seq);
+        probe3(encode__done, pi->seq, ib->insize, ib->outsize);
         block_dealloc(ib, BLOCK_IN);
         
-        if (lzma_block_header_encode(&ib->block, ib->output) != LZMA_OK)
-            die("Error encoding block header");
-        
 		debug("encoder %zu: sending %zu", thnum, pi->seq);
-        queue_push(gPipelineMergeQ, PIPELINE_ITEM, pi);
+        queue_push(pl->mergeq, PIPELINE_ITEM, pi);
     }
     
     lzma_end(&stream);
@@ -405,6 +457,40 @@ static void block_init(lzma_block *block, size_t insize) {
         die("Error getting block header size");
 }
 
+static void start_file(write_file_t *wf) {
+    gWriteFile = wf;
+    file_open_output(wf->file);
+    gOutFile = wf->file->out;
+    gOutOffset = 0;
+    digest_init();
+    
+    // pre-block setup: header, index
+    if (!(gIndex = lzma_index_init(NULL)))
+        die("Error creating index");
+    stream_edge(LZMA_VLI_UNKNOWN);
+}
+
+static void finish_file(void) {
+    // file index
+    if (gWriteFile->tar) {
+        align_output();
+        write_file_index();
+    }
+    file_index_free(gWriteFile->files);
+    
+    // post-block cleanup: index, footer
+    encode_index();
+    stream_edge(lzma_index_size(gIndex));
+    lzma_index_end(gIndex, NULL);
+    gIndex = NULL;
+    
+    pixz_file_t *file = gWriteFile->file;
+    file_finish(file);
+    digest_report(file->opath ? file->opath : "-");
+    free(gWriteFile);
+    gWriteFile = NULL;
+}
+
 static void stream_edge(lzma_vli backward_size) {
     lzma_stream_flags flags = { .version = 0, .check = CHECK,
         .backward_size = backward_size };
@@ -417,23 +503,33 @@ static void stream_edge(lzma_vli backward_size) {
     if ((*encoder)(&flags, buf) != LZMA_OK)
         die("Error encoding stream edge");
     
-    if (fwrite(buf, LZMA_STREAM_HEADER_SIZE, 1, gOutFile) != 1)
-        die("Error writing stream edge");
+    write_output(buf, LZMA_STREAM_HEADER_SIZE, "stream edge");
 }
 
 static void write_block(pipeline_item_t *pi) {
     debug("writer: writing %zu", pi->seq);
     io_block_t *ib = (io_block_t*)(pi->data);
+    uint64_t start = stats_now();
+    probe1(write__start, pi->seq);
     
-    // Does it make sense to chunk this?
-    size_t written = 0;
-    while (ib->outsize > written) {
-        size_t size = ib->outsize - written;
-        if (size > CHUNKSIZE)
-            size = CHUNKSIZE;
-        if (fwrite(ib->output + written, size, 1, gOutFile) != 1)
-            die("Error writing block data");
-        written += size;
+    if (gBlockAlign) {
+        // Start aligned, and use header padding so the next block can too
+        align_output();
+        size_t header_size = ib->block.header_size;
+        size_t pad = align_gap(gOutOffset + ib->outsize, 0);
+        if (pad && header_size + pad <= LZMA_BLOCK_HEADER_SIZE_MAX) {
+            ib->block.header_size += pad;
+            uint8_t hdrbuf[ib->block.header_size];
+            if (lzma_block_header_encode(&ib->block, hdrbuf) != LZMA_OK)
+                die("Error encoding padded block header");
+            write_output(hdrbuf, ib->block.header_size, "block header");
+            write_output(ib->output + header_size, ib->outsize - header_size,
+                "block data");
+        } else {
+            write_output(ib->output, ib->outsize, "block data");
+        }
+    } else {
+        write_output(ib->output, ib->outsize, "block data");
     }
     
     if (lzma_index_append(gIndex, NULL,
@@ -441,10 +537,68 @@ static void write_block(pipeline_item_t *pi) {
             ib->block.uncompressed_size) != LZMA_OK)
         die("Error adding to index");
 
+    stats_stage(STAGE_WRITE, ib->insize, ib->outsize);
+    trace_span("write", start, pi->seq);
+    probe2(write__done, pi->seq, ib->outsize);
     block_dealloc(ib, BLOCK_ALL);
     debug("writer: writing %zu complete", pi->seq);
 }
 
+static void write_output(const uint8_t *buf, size_t size, const char *what) {
+    limit_take(LIMIT_WRITE, size);
+    if (fwrite(buf, size, 1, gOutFile) != 1)
+        die("Error writing %s", what);
+    stats_output(size, false);
+    // Digest exactly what goes out, so nobody has to read it back
+    digest_update(buf, size);
+    gOutOffset += size;
+}
+
+// Bytes to add at offset to reach alignment, in a chunk of at least min
+static size_t align_gap(off_t offset, size_t min) {
+    size_t gap = (gBlockAlign - offset % gBlockAlign) % gBlockAlign;
+    if (gap)
+        while (gap < min)
+            gap += gBlockAlign;
+    return gap;
+}
+
+static void align_output(void) {
+    if (!gBlockAlign)
+        return;
+    
+    size_t gap = align_gap(gOutOffset, gFillerMin);
+    while (gap) {
+        size_t size = gap > gFillerMax ? gFillerMax : gap;
+        if (gap - size && gap - size < gFillerMin)
+            size = gap - gFillerMin; // leave enough for one more filler
+        write_filler(size);
+        gap -= size;
+    }
+}
+
+static void write_filler(size_t size) {
+    // An empty block: padded header, empty LZMA2 data, block padding, check
+    lzma_block block;
+    block_init(&block, 0);
+    block.uncompressed_size = 0;
+    block.compressed_size = 1;
+    if (lzma_block_header_size(&block) != LZMA_OK)
+        die("Error getting filler block header size");
+    size_t trailer = lzma_block_total_size(&block) - block.header_size;
+    block.header_size = size - trailer;
+    
+    uint8_t buf[size];
+    if (lzma_block_header_encode(&block, buf) != LZMA_OK)
+        die("Error encoding filler block header");
+    memset(buf + block.header_size, 0, trailer); // CRC32 of nothing is zero
+    write_output(buf, size, "filler block");
+    
+    if (lzma_index_append(gIndex, NULL, lzma_block_unpadded_size(&block),
+            block.uncompressed_size) != LZMA_OK)
+        die("Error adding filler to index");
+}
+
 static void encode_index(void) {
     if (lzma_index_encoder(&gStream, gIndex) != LZMA_OK)
         die("Error creating index encoder");
@@ -456,10 +610,8 @@ static void encode_index(void) {
         err = lzma_code(&gStream, LZMA_RUN);
         if (err != LZMA_OK && err != LZMA_STREAM_END)
             die("Error encoding index");
-        if (gStream.avail_out != CHUNKSIZE) {
-            if (fwrite(obuf, CHUNKSIZE - gStream.avail_out, 1, gOutFile) != 1)
-                die("Error writing index data");
-        }
+        if (gStream.avail_out != CHUNKSIZE)
+            write_output(obuf, CHUNKSIZE - gStream.avail_out, "index data");
     }
     lzma_end(&gStream);
 }
@@ -470,64 +622,18 @@ static void write_file_index(void) {
     uint8_t hdrbuf[block.header_size];
     if (lzma_block_header_encode(&block, hdrbuf) != LZMA_OK)
         die("Error encoding file index header");
-    if (fwrite(hdrbuf, block.header_size, 1, gOutFile) != 1)
-        die("Error writing file index header");
+    write_output(hdrbuf, block.header_size, "file index header");
     
-    if (lzma_block_encoder(&gStream, &block) != LZMA_OK)
-        die("Error creating file index encoder");
-    
-    uint8_t offbuf[sizeof(uint64_t)];
-    xle64enc(offbuf, PIXZ_INDEX_MAGIC);
-    write_file_index_bytes(sizeof(offbuf), offbuf);
-    for (file_index_t *f = gFileIndex; f != NULL; f = f->next) {
-        char *name = f->name ? f->name : "";
-        size_t len = strlen(name);
-        write_file_index_bytes(len + 1, (uint8_t*)name);
-        xle64enc(offbuf, f->offset);
-        write_file_index_bytes(sizeof(offbuf), offbuf);
-    }
-    write_file_index_buf(LZMA_FINISH);
+    const char *err = file_index_write(gWriteFile->files, &block,
+        write_file_index_out, NULL);
+    if (err)
+        die("%s", err);
 
     if (lzma_index_append(gIndex, NULL, lzma_block_unpadded_size(&block),
             block.uncompressed_size) != LZMA_OK)
         die("Error adding file-index to index");
-    lzma_end(&gStream);
 }
 
-static void write_file_index_bytes(size_t size, uint8_t *buf) {
-    size_t bufpos = 0;
-    while (bufpos < size) {
-        size_t len = size - bufpos;
-        size_t space = CHUNKSIZE - gFileIndexBufPos;
-        if (len > space)
-            len = space;
-        memcpy(gFileIndexBuf + gFileIndexBufPos, buf + bufpos, len);
-        gFileIndexBufPos += len;
-        bufpos += len;
-        
-        if (gFileIndexBufPos == CHUNKSIZE) {
-            write_file_index_buf(LZMA_RUN);
-            gFileIndexBufPos = 0;
-        }
-    }
-}
-
-static void write_file_index_buf(lzma_action action) {
-    uint8_t obuf[CHUNKSIZE];
-    gStream.avail_in = gFileIndexBufPos;
-    gStream.next_in = gFileIndexBuf;
-    lzma_ret err = LZMA_OK;
-    while (err != LZMA_STREAM_END && (action == LZMA_FINISH || gStream.avail_in)) {
-        gStream.avail_out = CHUNKSIZE;
-        gStream.next_out = obuf;
-        err = lzma_code(&gStream, action);
-        if (err != LZMA_OK && err != LZMA_STREAM_END)
-            die("Error encoding file index");
-        if (gStream.avail_out != CHUNKSIZE) {
-            if (fwrite(obuf, CHUNKSIZE - gStream.avail_out, 1, gOutFile) != 1)
-                die("Error writing file index");
-        }
-    }
-    
-    gFileIndexBufPos = 0;
+static void write_file_index_out(void *ctx, const uint8_t *buf, size_t size) {
+    write_output(buf, size, "file index");
 }
@@ -0,0 +1,28 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0).in
+PROC=$(basename $0).proc
+trap "rm -rf $INPUT $INPUT.xz $INPUT.out $INPUT.stats $PROC" EXIT
+
+seq 1 200000 > $INPUT # about 1.2 MiB
+
+# Round trips, whatever the system looks like
+$PIXZ -t -1 -f 0.1 -p 1:4 < $INPUT > $INPUT.xz || exit 1
+$PIXZ -d --adaptive < $INPUT.xz | cmp $INPUT - || exit 1
+
+# Bad floors are refused
+! $PIXZ -p 4:2 < $INPUT > /dev/null 2>&1 || exit 1
+! $PIXZ -p 0:2 < $INPUT > /dev/null 2>&1 || exit 1
+! $PIXZ -l --no-daemon --adaptive < $INPUT.xz > /dev/null 2>&1 || exit 1
+
+# An overloaded system parks workers down to the floor, which needs two CPUs
+[ $(getconf _NPROCESSORS_ONLN) -ge 2 ] || exit 0
+mkdir -p $PROC
+echo "64.00 64.00 64.00 65/300 1234" > $PROC/loadavg
+PIXZ_PROC=$PROC $PIXZ -d -p 1:2 --stats --max-read-rate 10K < $INPUT.xz \
+  > $INPUT.out 2> $INPUT.stats || exit 1
+cmp $INPUT $INPUT.out || exit 1
+grep -q '"adaptive":{"active":1,"floor":1,"ceiling":2,"parks":1,' \
+  $INPUT.stats || exit 1
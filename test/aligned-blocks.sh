@@ -0,0 +1,20 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0).input
+COMPRESSED=$INPUT.xz
+UNCOMPRESSED=$INPUT.extracted
+trap "rm -f $INPUT $COMPRESSED $UNCOMPRESSED" EXIT
+
+for i in $(seq 1 2000); do cat $0; done > $INPUT
+
+$PIXZ -0 -f 0.25 --align 4096 $INPUT $COMPRESSED || exit 1
+$PIXZ -d $COMPRESSED $UNCOMPRESSED || exit 1
+cmp $INPUT $UNCOMPRESSED || exit 1
+
+if which xz &> /dev/null ; then
+  xz -t $COMPRESSED || exit 1
+  # every non-empty block starts on the boundary
+  xz --robot -lvv $COMPRESSED | awk -F'\t' '$1 == "block" && $8 != 0 && $5 % 4096 { exit 1 }' || exit 1
+fi
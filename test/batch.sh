@@ -0,0 +1,26 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+DIR=$(basename $0).dir
+trap "rm -rf $DIR $DIR.orig" EXIT
+
+mkdir -p $DIR/sub || exit 1
+for i in $(seq 1 30); do seq 1 $((i * 1000)) > $DIR/small$i; done
+: > $DIR/empty
+head -c 500000 /dev/urandom > $DIR/random
+seq 1 100000 > $DIR/sub/text
+tar -cf $DIR/archive.tar -C $DIR sub || exit 1
+cp -r $DIR $DIR.orig || exit 1
+
+# Inputs on the command line, and on stdin
+$PIXZ -0 -f 0.1 -p 4 --batch $DIR/small* $DIR/empty || exit 1
+find $DIR -name random -o -name '*.tar' | $PIXZ -0 -f 0.1 -p 4 --batch \
+  || exit 1
+[ -e $DIR/random ] && exit 1
+[ -e $DIR/archive.tpxz ] || exit 1
+$PIXZ -l --no-daemon $DIR/archive.tpxz | grep -q sub/text || exit 1
+
+$PIXZ -d -p 4 --batch $DIR/*.xz $DIR/*.tpxz || exit 1
+rm -r $DIR/sub $DIR.orig/sub
+diff -r $DIR $DIR.orig || exit 1
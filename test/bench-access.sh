@@ -0,0 +1,135 @@
+#!/bin/bash
+
+# Random-access latency benchmark, run by `make bench-access`. Each request is
+# a separate pixz, timed from start to exit, with caches cold or warm.
+# Settings come from the environment, with defaults:
+#   BENCH_MEMBERS   1000000, files in the generated tarball
+#   BENCH_FRACTION  0.125 1 4, the -f values, for archives of varied block size
+#   BENCH_LEVEL     6
+#   BENCH_OPS       list extract extract-many member range
+#   BENCH_CACHE     cold warm
+#   BENCH_REPEAT    20, requests for each op, on random members or offsets
+#   BENCH_MANY      100, members for extract-many
+#   BENCH_RANGE     64K, bytes for range
+#   BENCH_SEED      1
+#   BENCH_CSV       bench-access.csv, where results go
+#   BENCH_DIR       bench.dir, where archives are kept between runs
+#
+# Cold runs drop the archive from the page cache first, which needs no
+# privileges, but only affects pages nobody else has dirty or locked.
+
+PIXZ=${PIXZ:-../src/pixz}
+UTIL=${BENCH_UTIL:-./bench-util}
+MEMBERS=${BENCH_MEMBERS:-1000000}
+FRACTIONS=${BENCH_FRACTION:-0.125 1 4}
+LEVEL=${BENCH_LEVEL:-6}
+OPS=${BENCH_OPS:-list extract extract-many member range}
+CACHES=${BENCH_CACHE:-cold warm}
+REPEAT=${BENCH_REPEAT:-20}
+MANY=${BENCH_MANY:-100}
+RANGE=${BENCH_RANGE:-64K}
+SEED=${BENCH_SEED:-1}
+CSV=${BENCH_CSV:-bench-access.csv}
+DIR=${BENCH_DIR:-bench.dir}
+
+WORK=$DIR/access
+trap "rm -rf $WORK" EXIT
+mkdir -p $DIR $WORK || exit 1
+
+
+# Archives are rebuilt only if their settings change
+make_archive() {
+  local f=$1 tarball=$DIR/members-$MEMBERS-$SEED.tar
+  local file=$DIR/members-$MEMBERS-$SEED-$LEVEL-f$f.tpxz
+  if [ ! -e $tarball ]; then
+    $UTIL tar $MEMBERS $SEED > $tarball.tmp || exit 1
+    mv $tarball.tmp $tarball
+  fi
+  if [ ! -e $file ]; then
+    $PIXZ -$LEVEL -f $f < $tarball > $file.tmp || exit 1
+    mv $file.tmp $file
+  fi
+  echo $file
+}
+
+# Pick n of the archive's members, at random
+pick() {
+  awk -v n=$1 -v seed=$2 'BEGIN { srand(seed) }
+    { name[NR] = $0 }
+    END { for (i = 0; i < n; ++i) print name[int(rand() * NR) + 1] }' \
+    $WORK/members
+}
+
+# The arguments for one request
+request() {
+  local op=$1 i=$2
+  case $op in
+    list) echo -l ;;
+    extract) echo -x $(pick 1 $i) ;;
+    extract-many) echo -x $(pick $MANY $i) ;;
+    member) echo --member $(pick 1 $i) ;;
+    range) awk -v seed=$i -v size=$USIZE -v len=$RANGE_BYTES 'BEGIN {
+        srand(seed); printf "--range %d:%d\n", rand() * (size - len), len }' ;;
+  esac
+}
+
+# Time one request, printing seconds and the bytes it read and decoded
+timed() {
+  local archive=$1 cache=$2
+  shift 2
+  if [ $cache = cold ]; then
+    $UTIL evict $archive || exit 1
+  else
+    $PIXZ --no-daemon "$@" < $archive > /dev/null || exit 1
+  fi
+
+  local t
+  t=$($UTIL run $archive $WORK/out $PIXZ --no-daemon --stats "$@" \
+    2> $WORK/stats.json) || { echo "Failed: $*" >&2; exit 1; }
+  local read=$(grep -o '"input":{"reads":[0-9]*,"bytes":[0-9]*' \
+    $WORK/stats.json | grep -o '[0-9]*$')
+  local decoded=$(grep -o '"code":{[^}]*' $WORK/stats.json \
+    | grep -o '[0-9]*$')
+  echo ${t% *} ${read:-0} ${decoded:-0}
+}
+
+# Run an op's requests, then record their latencies
+bench() {
+  local archive=$1 f=$2 op=$3 cache=$4
+  : > $WORK/times
+  for i in $(seq 1 $REPEAT); do
+    timed $archive $cache $(request $op $((SEED * 100000 + i))) \
+      >> $WORK/times || exit 1
+  done
+
+  sort -n $WORK/times | awk -v f=$f -v op=$op -v cache=$cache \
+      -v members=$MEMBERS -v size=$(wc -c < $archive) '
+    { t[NR] = $1 * 1000; sum += t[NR]; rd += $2; dec += $3 }
+    END {
+      p50 = t[int((NR * 50 + 99) / 100)]
+      p99 = t[int((NR * 99 + 99) / 100)]
+      printf "%s,%s,%s,%s,%s,%d,%.3f,%.3f,%.3f,%d,%d\n", members, f, size,
+        op, cache, NR, p50, p99, sum / NR, rd / NR, dec / NR
+    }' | tee -a $CSV | awk -F, '{ printf "f%-6s %-12s %-4s" \
+      "  p50 %9.1f ms  p99 %9.1f ms  mean %9.1f ms" \
+      "  read %10.0f KiB  decoded %10.0f KiB\n", \
+      $2, $4, $5, $7, $8, $9, ($10 / 1024), ($11 / 1024) }'
+}
+
+RANGE_BYTES=$(awk -v s=$RANGE 'BEGIN {
+  n = s + 0; u = substr(s, length(s))
+  print n * (u == "G" ? 2^30 : u == "M" ? 2^20 : u == "K" ? 2^10 : 1) }')
+
+echo "members,fraction,archive_size,op,cache,requests,p50_ms,p99_ms," \
+  "mean_ms,bytes_read,bytes_decoded" | tr -d ' ' > $CSV
+for f in $FRACTIONS; do
+  archive=$(make_archive $f) || exit 1
+  $PIXZ --no-daemon -l < $archive > $WORK/members || exit 1
+  USIZE=$(wc -c < $DIR/members-$MEMBERS-$SEED.tar)
+  echo "$MEMBERS members, -$LEVEL -f $f: $(wc -c < $archive) bytes"
+  for op in $OPS; do
+    for cache in $CACHES; do
+      bench $archive $f $op $cache
+    done
+  done
+done
@@ -0,0 +1,302 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Helpers for bench.sh and bench-access.sh, which have no portable way to do
+// these themselves:
+//     bench-util gen KIND SIZE [SEED]   reproducible data to stdout, KIND is
+//                                       text, binary, random or zeros
+//     bench-util tar COUNT [SEED]       a tarball of COUNT small text files
+//                                       to stdout
+//     bench-util run IN OUT CMD...      run CMD from IN to OUT, and print
+//                                       its wall time and peak RSS in KiB
+//     bench-util evict FILE             drop FILE from the page cache
+
+#define BUFSIZE (64 * 1024)
+#define WORDS 4096
+
+static uint64_t gState;
+
+static void die(const char *msg) {
+    fprintf(stderr, "bench-util: %s\n", msg);
+    exit(1);
+}
+
+// xorshift64*, the same everywhere for a seed
+static uint64_t rnd(void) {
+    gState ^= gState >> 12;
+    gState ^= gState << 25;
+    gState ^= gState >> 27;
+    return gState * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t n = strtoull(s, &end, 10);
+    switch (*end) {
+        case 'G': n <<= 10; // fall through
+        case 'M': n <<= 10; // fall through
+        case 'K': n <<= 10; ++end; break;
+    }
+    if (*end || end == s)
+        die("bad size");
+    return n;
+}
+
+
+#pragma mark GENERATORS
+
+typedef size_t (*gen_t)(uint8_t *buf, size_t size);
+
+static char gWords[WORDS][12];
+
+static void make_words(void) {
+    static const char *syllables[] = { "an", "ber", "co", "de", "en", "fi",
+        "ga", "ho", "in", "jo", "ka", "le", "mo", "ne", "or", "pa", "qui",
+        "re", "st", "th", "u", "ve", "wa", "xe", "ya", "zo", "the", "ing" };
+    size_t n = sizeof(syllables) / sizeof(*syllables);
+    for (size_t i = 0; i < WORDS; ++i) {
+        size_t parts = 1 + rnd() % 3;
+        gWords[i][0] = '\0';
+        for (size_t p = 0; p < parts; ++p)
+            strcat(gWords[i], syllables[rnd() % n]);
+    }
+}
+
+// Words with a skewed frequency, in sentences and lines
+static size_t gen_text(uint8_t *buf, size_t size) {
+    size_t len = 0;
+    while (len + 64 < size) {
+        double u = (rnd() >> 11) / 9007199254740992.0;
+        const char *w = gWords[(size_t)(WORDS * u * u * u)];
+        size_t wl = strlen(w);
+        memcpy(buf + len, w, wl);
+        len += wl;
+        uint64_t r = rnd() % 100;
+        if (r < 3)
+            len += sprintf((char*)buf + len, " %u", (unsigned)(rnd() % 10000));
+        buf[len++] = r < 8 ? '.' : r < 12 ? ',' : ' ';
+        if (r < 8 && rnd() % 4 == 0)
+            buf[len++] = '\n';
+    }
+    return len;
+}
+
+// Something like machine code: common opcodes, small immediates, and
+// addresses that are near each other, with the odd string table
+static size_t gen_binary(uint8_t *buf, size_t size) {
+    static const uint8_t ops[] = { 0x48, 0x89, 0x8b, 0xe8, 0xc3, 0x0f, 0x83,
+        0x85, 0x74, 0x75, 0xff, 0x31, 0x41, 0x4c, 0x8d, 0x66 };
+    static uint32_t addr = 0x400000;
+    size_t len = 0;
+    while (len + 64 < size) {
+        uint64_t r = rnd();
+        if (r % 50 == 0) { // strings
+            size_t n = 1 + rnd() % 4;
+            for (size_t i = 0; i < n; ++i) {
+                const char *w = gWords[rnd() % WORDS];
+                size_t wl = strlen(w) + 1;
+                memcpy(buf + len, w, wl);
+                len += wl;
+            }
+            continue;
+        }
+        buf[len++] = ops[r % sizeof(ops)];
+        buf[len++] = ops[(r >> 8) % sizeof(ops)];
+        switch ((r >> 16) % 4) {
+            case 0: // immediate
+                buf[len++] = (r >> 24) % 16;
+                break;
+            case 1: // address
+                addr += (r >> 24) % 256;
+                memcpy(buf + len, &addr, 4);
+                len += 4;
+                break;
+            default:
+                break;
+        }
+    }
+    return len;
+}
+
+static size_t gen_random(uint8_t *buf, size_t size) {
+    size_t len = 0;
+    for ( ; len + 8 <= size; len += 8) {
+        uint64_t r = rnd();
+        memcpy(buf + len, &r, 8);
+    }
+    return len;
+}
+
+static size_t gen_zeros(uint8_t *buf, size_t size) {
+    memset(buf, 0, size);
+    return size;
+}
+
+static int gen(const char *kind, uint64_t size, uint64_t seed) {
+    gState = seed * 0x9E3779B97F4A7C15ULL + 1;
+    make_words();
+    gen_t g = !strcmp(kind, "text") ? gen_text
+        : !strcmp(kind, "binary") ? gen_binary
+        : !strcmp(kind, "random") ? gen_random
+        : !strcmp(kind, "zeros") ? gen_zeros : NULL;
+    if (!g)
+        die("unknown kind of data");
+
+    static uint8_t buf[BUFSIZE];
+    while (size) {
+        size_t len = g(buf, BUFSIZE);
+        if (len > size)
+            len = size;
+        if (fwrite(buf, len, 1, stdout) != 1)
+            die("write error");
+        size -= len;
+    }
+    return 0;
+}
+
+
+#pragma mark TARBALLS
+
+#define TAR_BLOCK 512
+#define TAR_DIRSIZE 1000 // files per directory
+
+static void tar_octal(char *field, size_t size, uint64_t value) {
+    snprintf(field, size, "%0*llo", (int)size - 1, (unsigned long long)value);
+}
+
+static void tar_write(const void *buf, size_t size) {
+    if (size && fwrite(buf, size, 1, stdout) != 1)
+        die("write error");
+}
+
+// A ustar header, then the data padded to a whole block
+static void tar_member(const char *name, const uint8_t *data, size_t size) {
+    char hdr[TAR_BLOCK];
+    memset(hdr, 0, sizeof(hdr));
+    snprintf(hdr, 100, "%s", name);
+    tar_octal(hdr + 100, 8, 0644);
+    tar_octal(hdr + 108, 8, 0);
+    tar_octal(hdr + 116, 8, 0);
+    tar_octal(hdr + 124, 12, size);
+    tar_octal(hdr + 136, 12, 0);
+    hdr[156] = '0';
+    memcpy(hdr + 257, "ustar", 6);
+    memcpy(hdr + 263, "00", 2);
+
+    memset(hdr + 148, ' ', 8);
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(hdr); ++i)
+        sum += (uint8_t)hdr[i];
+    snprintf(hdr + 148, 8, "%06o", sum);
+
+    static const char zeros[TAR_BLOCK];
+    tar_write(hdr, sizeof(hdr));
+    tar_write(data, size);
+    tar_write(zeros, (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+}
+
+// Mostly small files, as in a source tree, with the odd bigger one
+static int tar(uint64_t count, uint64_t seed) {
+    gState = seed * 0x9E3779B97F4A7C15ULL + 1;
+    make_words();
+
+    static uint8_t buf[BUFSIZE + 128]; // text may run a little over
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t r = rnd();
+        size_t size = (64 + r % 64) << (r >> 8) % 6; // 64 bytes to 4 KiB
+        if ((r >> 16) % 100 == 0)
+            size <<= 4;
+        size_t len = 0;
+        while (len < size)
+            len += gen_text(buf + len, size - len + 64);
+        char name[64];
+        snprintf(name, sizeof(name), "d%05llu/f%07llu.txt",
+            (unsigned long long)(i / TAR_DIRSIZE), (unsigned long long)i);
+        tar_member(name, buf, size);
+    }
+
+    static const char end[2 * TAR_BLOCK];
+    tar_write(end, sizeof(end));
+    return 0;
+}
+
+
+#pragma mark RUN
+
+static int run(const char *in, const char *out, char **argv) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == -1)
+        die("can't fork");
+    if (pid == 0) {
+        int ifd = open(in, O_RDONLY);
+        int ofd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (ifd == -1 || ofd == -1 || dup2(ifd, 0) == -1
+                || dup2(ofd, 1) == -1)
+            die(strerror(errno));
+        close(ifd);
+        close(ofd);
+        execvp(argv[0], argv);
+        die(strerror(errno));
+    }
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) == -1)
+        die("can't wait");
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        die("command failed");
+
+    double secs = (end.tv_sec - start.tv_sec)
+        + (end.tv_nsec - start.tv_nsec) / 1e9;
+#ifdef __APPLE__
+    long rss = ru.ru_maxrss / 1024; // bytes there
+#else
+    long rss = ru.ru_maxrss;
+#endif
+    printf("%.6f %ld\n", secs, rss);
+    return 0;
+}
+
+static int evict(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        die(strerror(errno));
+#ifdef POSIX_FADV_DONTNEED
+    // Only clean pages go, so make sure there are no dirty ones
+    fdatasync(fd);
+    int err = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    if (err)
+        die(strerror(err));
+#endif
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 4 && !strcmp(argv[1], "gen"))
+        return gen(argv[2], parse_size(argv[3]),
+            argc > 4 ? strtoull(argv[4], NULL, 10) : 1);
+    if (argc >= 3 && !strcmp(argv[1], "tar"))
+        return tar(strtoull(argv[2], NULL, 10),
+            argc > 3 ? strtoull(argv[3], NULL, 10) : 1);
+    if (argc >= 5 && !strcmp(argv[1], "run"))
+        return run(argv[2], argv[3], argv + 4);
+    if (argc == 3 && !strcmp(argv[1], "evict"))
+        return evict(argv[2]);
+    die("usage: bench-util gen KIND SIZE [SEED] | tar COUNT [SEED]"
+        " | run IN OUT CMD... | evict FILE");
+    return 1;
+}
@@ -0,0 +1,158 @@
+#!/bin/bash
+
+# Throughput benchmark, run by `make bench`. Settings come from the
+# environment, with defaults:
+#   BENCH_CORPORA   text binary random zeros tarball
+#   BENCH_SIZE      16M, for each corpus
+#   BENCH_LEVELS    0 6 9
+#   BENCH_THREADS   1 0, where 0 means one per CPU
+#   BENCH_QSIZE     pixz's default, or a list of -q values
+#   BENCH_FRACTION  pixz's default, or a list of -f values
+#   BENCH_XZ        set to 1 to also time xz -T0
+#   BENCH_CSV       bench.csv, where results go
+#   BENCH_JSON      if set, also write results there as JSON
+#   BENCH_BASELINE  a CSV from an earlier run, to compare against
+#   BENCH_TOLERANCE 10, the percent slowdown counted as a regression
+#   BENCH_DIR       bench.dir, where corpora are kept between runs
+
+PIXZ=${PIXZ:-../src/pixz}
+UTIL=${BENCH_UTIL:-./bench-util}
+CORPORA=${BENCH_CORPORA:-text binary random zeros tarball}
+SIZE=${BENCH_SIZE:-16M}
+LEVELS=${BENCH_LEVELS:-0 6 9}
+THREADS=${BENCH_THREADS:-1 0}
+QSIZES=${BENCH_QSIZE:--}
+FRACTIONS=${BENCH_FRACTION:--}
+CSV=${BENCH_CSV:-bench.csv}
+TOLERANCE=${BENCH_TOLERANCE:-10}
+DIR=${BENCH_DIR:-bench.dir}
+
+WORK=$DIR/work
+trap "rm -rf $WORK" EXIT
+mkdir -p $DIR $WORK || exit 1
+
+
+bytes() {
+  local n=${1%[KMG]}
+  case $1 in
+    *G) echo $((n << 30)) ;;
+    *M) echo $((n << 20)) ;;
+    *K) echo $((n << 10)) ;;
+    *) echo $n ;;
+  esac
+}
+
+# Corpora are rebuilt only if the size changes
+make_corpus() {
+  local name=$1 file=$DIR/$1-$SIZE
+  if [ -e $file ]; then
+    echo $file
+    return
+  fi
+  if [ $name = tarball ]; then
+    # Many small files, mostly text, of a spread of sizes
+    local tree=$WORK/tree i=0 total=0 limit=$(bytes $SIZE)
+    mkdir -p $tree/files || exit 1
+    while [ $total -lt $limit ]; do
+      local kind=text size=$(( 100 << (i % 8) ))
+      [ $((i % 5)) = 0 ] && kind=binary
+      $UTIL gen $kind $size $i > $tree/files/$(printf %06d $i) || exit 1
+      total=$(( total + size + 512 ))
+      i=$((i + 1))
+    done
+    tar --sort=name --mtime=@0 --owner=0 --group=0 --numeric-owner \
+        -cf $file.tmp -C $tree files 2>/dev/null \
+      || tar -cf $file.tmp -C $tree files || exit 1
+    rm -rf $tree
+  else
+    $UTIL gen $name $SIZE > $file.tmp || exit 1
+  fi
+  mv $file.tmp $file
+  echo $file
+}
+
+# Time a command, printing seconds and peak RSS
+timed() {
+  $UTIL run "$@" || { echo "Failed: ${*:3}" >&2; exit 1; }
+}
+
+record() {
+  echo "$*" | tr ' ' , >> $CSV
+  echo "$*" | awk '{ printf "%-5s %-8s -%-2s p%-3s q%-3s f%-5s ratio %.3f" \
+    "  compress %8.1f MB/s  decompress %8.1f MB/s  rss %7d KiB\n", \
+    $1, $2, $3, $4, $5, $6, $9, $10, $11, ($12 > $13 ? $12 : $13) }'
+}
+
+# Compress and decompress a corpus, then record it
+bench() {
+  local tool=$1 corpus=$2 file=$3 level=$4 threads=$5 q=$6 f=$7
+  shift 7
+  local c d ctime crss dtime drss
+  c=$(timed $file $WORK/out.xz "$@" -$level) || exit 1
+  if [ $tool = xz ]; then
+    d=$(timed $WORK/out.xz $WORK/out xz -d -T0 -c) || exit 1
+  else
+    d=$(timed $WORK/out.xz $WORK/out $PIXZ -d -p $threads) || exit 1
+  fi
+  read ctime crss <<< "$c"
+  read dtime drss <<< "$d"
+  cmp -s $file $WORK/out || { echo "Round trip failed: $*" >&2; exit 1; }
+
+  local size=$(wc -c < $file) csize=$(wc -c < $WORK/out.xz)
+  record $tool $corpus $level $threads $q $f $size $csize $(awk \
+    -v s=$size -v c=$csize -v ct=$ctime -v dt=$dtime 'BEGIN {
+      printf "%.4f %.2f %.2f", c / s, s / ct / 1e6, s / dt / 1e6 }') \
+    $crss $drss
+}
+
+echo "tool,corpus,level,threads,qsize,fraction,size,compressed,ratio," \
+  "compress_mbps,decompress_mbps,compress_rss_kb,decompress_rss_kb" \
+  | tr -d ' ' > $CSV
+for corpus in $CORPORA; do
+  file=$(make_corpus $corpus) || exit 1
+  for level in $LEVELS; do
+    for threads in $THREADS; do
+      for q in $QSIZES; do
+        for f in $FRACTIONS; do
+          args="-t -p $threads"
+          [ $corpus = tarball ] && args="-p $threads"
+          [ $q != - ] && args="$args -q $q"
+          [ $f != - ] && args="$args -f $f"
+          bench pixz $corpus $file $level $threads $q $f $PIXZ $args
+        done
+      done
+    done
+    if [ "$BENCH_XZ" = 1 ] && which xz &> /dev/null; then
+      bench xz $corpus $file $level 0 - - xz -T0 -c
+    fi
+  done
+done
+
+if [ -n "$BENCH_JSON" ]; then
+  awk -F, 'NR == 1 { split($0, keys); next }
+    { printf "%s{", (NR > 2 ? ",\n" : "[\n")
+      for (i = 1; i <= NF; ++i)
+        printf "%s\"%s\":%s", (i > 1 ? "," : ""), keys[i],
+          ($i ~ /^[0-9.]+$/ ? $i : "\"" $i "\"")
+      printf "}" }
+    END { print "\n]" }' $CSV > $BENCH_JSON
+fi
+
+# Compare with the baseline, matching rows on everything but the results
+if [ -n "$BENCH_BASELINE" ]; then
+  echo
+  echo "Compared to $BENCH_BASELINE:"
+  awk -F, -v tol=$TOLERANCE '
+    FNR == 1 { next }
+    { key = $1 "," $2 "," $3 "," $4 "," $5 "," $6 }
+    NR == FNR { c[key] = $10; d[key] = $11; next }
+    key in c {
+      dc = ($10 - c[key]) / c[key] * 100
+      dd = ($11 - d[key]) / d[key] * 100
+      slow = dc < -tol || dd < -tol
+      bad += slow
+      printf "%-40s compress %+6.1f%%  decompress %+6.1f%%%s\n", key, dc, dd,
+        slow ? "  REGRESSION" : ""
+    }
+    END { exit (bad > 0) }' $BENCH_BASELINE $CSV || exit 1
+fi
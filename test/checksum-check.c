@@ -0,0 +1,105 @@
+#include "pixz.h"
+
+// Compare the checksum kernels the CPU has against the portable ones, for
+// lengths and alignments around each kernel's edges, and SHA-256 against
+// known digests.
+
+#define MAX_SIZE 4500
+#define RUNS 2000
+
+static uint64_t gRandom = 88172645463325252ULL;
+
+static uint64_t rnd(void) {
+    gRandom ^= gRandom << 13;
+    gRandom ^= gRandom >> 7;
+    gRandom ^= gRandom << 17;
+    return gRandom;
+}
+
+static void sha256_hex(const uint8_t *data, size_t size, size_t chunk,
+        char out[65]) {
+    sha256_ctx c;
+    uint8_t raw[32];
+    sha256_init(&c);
+    for (size_t done = 0; done < size; done += chunk)
+        sha256_update(&c, data + done, size - done < chunk ? size - done : chunk);
+    sha256_final(&c, raw);
+    for (int i = 0; i < 32; ++i)
+        sprintf(out + 2 * i, "%02x", raw[i]);
+}
+
+static void check_sha256(const char *input, size_t repeat, const char *want) {
+    size_t len = strlen(input), size = len * repeat;
+    uint8_t *data = malloc(size + 1);
+    for (size_t i = 0; i < repeat; ++i)
+        memcpy(data + i * len, input, len);
+    static const size_t chunks[] = { 1, 63, 64, 1000, SIZE_MAX };
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(*chunks); ++i) {
+        char got[65];
+        sha256_hex(data, size, chunks[i], got);
+        if (strcmp(got, want) != 0)
+            die("SHA-256 of \"%s\" x %zu was %s, not %s", input, repeat, got,
+                want);
+    }
+    free(data);
+}
+
+int main(void) {
+    for (int hw = 1; hw >= 0; --hw) {
+        checksum_hardware(hw);
+        printf("crc32 %s, crc64 %s, sha256 %s\n",
+            checksum_kernel(CHECKSUM_CRC32), checksum_kernel(CHECKSUM_CRC64),
+            checksum_kernel(CHECKSUM_SHA256));
+        check_sha256("", 1, "e3b0c44298fc1c149afbf4c8996fb924"
+            "27ae41e4649b934ca495991b7852b855");
+        check_sha256("abc", 1, "ba7816bf8f01cfea414140de5dae2223"
+            "b00361a396177a9cb410ff61f20015ad");
+        check_sha256("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+            1, "248d6a61d20638b8e5c026930c3e6039"
+            "a33ce45964ff2167f6ecedd419db06c1");
+        check_sha256("a", 1000000, "cdc76e5c9914fb9281a1c7e284d73e67"
+            "f1809a48a497200e046d39ccc7112cd0");
+    }
+
+    // The first kernels are what checksum_crc* use, the second liblzma's
+    uint8_t *data = malloc(MAX_SIZE + 16);
+    for (size_t i = 0; i < MAX_SIZE + 16; ++i)
+        data[i] = rnd();
+    checksum_hardware(true);
+    for (size_t run = 0; run < RUNS; ++run) {
+        size_t size = run < 300 ? run : rnd() % MAX_SIZE;
+        size_t align = rnd() % 16;
+        uint32_t seed32 = run % 3 ? (uint32_t)rnd() : 0;
+        uint64_t seed64 = run % 3 ? rnd() : 0;
+        const uint8_t *buf = data + align;
+
+        uint32_t c32 = checksum_crc32(buf, size, seed32);
+        uint64_t c64 = checksum_crc64(buf, size, seed64);
+        if (c32 != lzma_crc32(buf, size, seed32))
+            die("CRC32 of %zu bytes at +%zu differs", size, align);
+        if (c64 != lzma_crc64(buf, size, seed64))
+            die("CRC64 of %zu bytes at +%zu differs", size, align);
+
+        // In two parts, as digests do
+        size_t split = size ? rnd() % size : 0;
+        c32 = checksum_crc32(buf + split, size - split,
+            checksum_crc32(buf, split, seed32));
+        if (c32 != lzma_crc32(buf, size, seed32))
+            die("CRC32 of %zu bytes split at %zu differs", size, split);
+        c64 = checksum_crc64(buf + split, size - split,
+            checksum_crc64(buf, split, seed64));
+        if (c64 != lzma_crc64(buf, size, seed64))
+            die("CRC64 of %zu bytes split at %zu differs", size, split);
+
+        // SHA-256 from both kernels
+        char hw[65], sw[65];
+        sha256_hex(buf, size, size / 3 + 1, hw);
+        checksum_hardware(false);
+        sha256_hex(buf, size, size / 5 + 1, sw);
+        checksum_hardware(true);
+        if (strcmp(hw, sw) != 0)
+            die("SHA-256 of %zu bytes at +%zu differs", size, align);
+    }
+    free(data);
+    return 0;
+}
@@ -0,0 +1,15 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+INPUT=$0
+
+COMPRESSED=$(basename $0).xz
+DIGESTS=$(basename $0).digests
+trap "rm -f $COMPRESSED $DIGESTS" EXIT
+
+$PIXZ --digest md5,sha256,crc32 --digest-file $DIGESTS $INPUT $COMPRESSED || exit 1
+
+[[ $(grep '^SHA256' $DIGESTS | sed 's/.* = //') = $(sha256sum < $COMPRESSED | cut -d' ' -f1) ]] || exit 1
+[[ $(grep '^MD5' $DIGESTS | sed 's/.* = //') = $(md5sum < $COMPRESSED | cut -d' ' -f1) ]] || exit 1
+[[ $(grep -c . $DIGESTS) = 3 ]] || exit 1
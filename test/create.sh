@@ -0,0 +1,30 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+DIR=$(basename $0).dir
+trap "rm -rf $DIR $DIR.*" EXIT
+
+mkdir -p $DIR/sub/deeper || exit 1
+head -c 3000000 /dev/urandom > $DIR/big # several chunks
+seq 1 100000 > $DIR/text
+: > $DIR/empty
+ln -s text $DIR/symlink
+ln $DIR/text $DIR/sub/hardlink
+long=$DIR/sub/$(printf 'long-name-%.0s' $(seq 1 15))
+echo long > $long
+for i in $(seq 1 200); do echo $i > $DIR/sub/deeper/file$i; done
+
+$PIXZ -0 -f 0.25 --create $DIR -o $DIR.tpxz || exit 1
+
+# The tarball holds everything
+mkdir $DIR.out
+$PIXZ -d < $DIR.tpxz | tar -x -C $DIR.out || exit 1
+diff -r $DIR $DIR.out/$DIR || exit 1
+[ -L $DIR.out/$DIR/symlink ] || exit 1
+
+# The file index is what indexing the tarball would give, and works
+$PIXZ -d < $DIR.tpxz | $PIXZ -0 -f 0.25 > $DIR.reindexed || exit 1
+cmp <($PIXZ -l --no-daemon $DIR.tpxz) \
+  <($PIXZ -l --no-daemon $DIR.reindexed) || exit 1
+$PIXZ --no-daemon -x $long < $DIR.tpxz | tar -xO | cmp - $long || exit 1
@@ -0,0 +1,68 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+DIR=$(basename $0).dir
+TARBALL=$DIR.tar
+COMPRESSED=$TARBALL.xz
+SOCKET=$PWD/$DIR.run/pixz.sock
+trap 'kill $DAEMON 2>/dev/null; wait; rm -rf $DIR $TARBALL $COMPRESSED $DIR.*' EXIT
+
+# The socket has to be somewhere only we can get at
+mkdir -p $DIR.run && chmod 755 $DIR.run || exit 1
+$PIXZ --daemon --socket $SOCKET 2> /dev/null && exit 1
+chmod 700 $DIR.run || exit 1
+
+mkdir -p $DIR/sub || exit 1
+seq 1 100000 > $DIR/text
+head -c 200000 /dev/urandom > $DIR/sub/random
+echo small > $DIR/small
+tar -cf $TARBALL $DIR || exit 1
+$PIXZ -0 -f 0.25 $TARBALL $COMPRESSED || exit 1
+
+$PIXZ --daemon -v --socket $SOCKET 2> $DIR.log &
+DAEMON=$!
+for i in $(seq 1 50); do
+  [ -S $SOCKET ] && break
+  sleep 0.1
+done
+
+# Each request must give the same results with and without the daemon
+check() {
+  $PIXZ --socket $SOCKET "$@" < $COMPRESSED > $DIR.daemon || exit 1
+  $PIXZ --no-daemon "$@" < $COMPRESSED > $DIR.local || exit 1
+  cmp $DIR.daemon $DIR.local || exit 1
+}
+check -l
+check -x
+check -x $DIR/sub $DIR/small
+check --range 1000:100000
+check --member $DIR/sub/random
+cmp $DIR.daemon $DIR/sub/random || exit 1
+$PIXZ --socket $SOCKET --member $DIR/missing < $COMPRESSED && exit 1
+[ $(grep -c '^pixz: .* ok$' $DIR.log) = 5 ] || exit 1
+
+# Nor will clients hand their files to a socket someone else could have made
+chmod 755 $DIR.run || exit 1
+$PIXZ --socket $SOCKET --member $DIR/small < $COMPRESSED | cmp - $DIR/small \
+  || exit 1
+chmod 700 $DIR.run || exit 1
+[ $(grep -c '^pixz: .* ok$' $DIR.log) = 5 ] || exit 1
+
+# Clients asking at once for an archive that isn't open yet all get it
+cp $COMPRESSED $DIR.copy || exit 1
+CLIENTS=
+for i in 1 2 3 4; do
+  $PIXZ --socket $SOCKET --member $DIR/sub/random < $DIR.copy > $DIR.out$i &
+  CLIENTS="$CLIENTS $!"
+done
+wait $CLIENTS || exit 1
+for i in 1 2 3 4; do cmp $DIR.out$i $DIR/sub/random || exit 1; done
+[ $(grep -c '^pixz: .* ok$' $DIR.log) = 9 ] || exit 1
+
+# Without a daemon, pixz does the work itself
+kill $DAEMON
+wait
+[ -e $SOCKET ] && exit 1
+$PIXZ --socket $SOCKET --member $DIR/small < $COMPRESSED | cmp - $DIR/small \
+  || exit 1
@@ -0,0 +1,29 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0).in
+SYS=$(basename $0).sys
+trap "rm -rf $INPUT $INPUT.xz $INPUT.stats $SYS" EXIT
+
+# Fake a hybrid CPU, with the first half of the cores twice as fast
+cpus=$(getconf _NPROCESSORS_ONLN)
+[ $cpus -ge 2 ] || exit 0
+for i in $(seq 0 $((cpus - 1))); do
+  mkdir -p $SYS/devices/system/cpu/cpu$i
+  echo $(( i < (cpus + 1) / 2 ? 1024 : 512 )) \
+    > $SYS/devices/system/cpu/cpu$i/cpu_capacity
+done
+
+seq 1 500000 > $INPUT
+PIXZ_SYS=$SYS $PIXZ -t -1 -f 0.1 --stats < $INPUT > $INPUT.xz \
+  2> $INPUT.stats || exit 1
+grep -q '"slow_core":true' $INPUT.stats || exit 1
+PIXZ_SYS=$SYS $PIXZ -d --stats < $INPUT.xz 2> $INPUT.stats \
+  | cmp $INPUT - || exit 1
+grep -q '"slow_core":true' $INPUT.stats || exit 1
+
+# Cores that are all alike are left alone
+$PIXZ -t -1 -f 0.1 --stats < $INPUT 2>&1 > /dev/null \
+  | grep -q '"slow_core"' && exit 1
+exit 0
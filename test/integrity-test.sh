@@ -0,0 +1,54 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0).in
+DIR=$(basename $0).dir
+trap "rm -rf $INPUT $INPUT.* $DIR" EXIT
+
+# Change one byte at an offset, into a copy
+corrupt() {
+  cp $1 $INPUT.bad
+  printf '\x55' | dd of=$INPUT.bad bs=1 seek=$2 conv=notrunc 2> /dev/null
+  cmp -s $1 $INPUT.bad && printf '\xaa' \
+    | dd of=$INPUT.bad bs=1 seek=$2 conv=notrunc 2> /dev/null
+}
+
+# A tarball with small files, and a big one spanning blocks
+mkdir -p $DIR || exit 1
+for i in $(seq 1 50); do seq 1 $((i * 100)) > $DIR/f$i; done
+seq 1 1000000 > $DIR/big
+tar -cf $INPUT.tar $DIR || exit 1
+$PIXZ -1 -f 0.1 -p 4 < $INPUT.tar > $INPUT.tpxz || exit 1
+$PIXZ -T -p 4 $INPUT.tpxz || exit 1
+$PIXZ -T --stats $INPUT.tpxz 2> $INPUT.json || exit 1
+grep -q '"op":"test","final":true' $INPUT.json || exit 1
+
+# Plain files, xz's own output, and concatenated streams
+seq 1 500000 > $INPUT
+$PIXZ -1 -f 0.1 < $INPUT > $INPUT.xz || exit 1
+$PIXZ -T $INPUT.xz || exit 1
+if which xz > /dev/null 2>&1; then
+  xz -1 -k -c $INPUT > $INPUT.xz2 || exit 1
+  $PIXZ -T $INPUT.xz2 || exit 1
+fi
+cat $INPUT.xz $INPUT.xz > $INPUT.cat
+$PIXZ -T $INPUT.cat || exit 1
+
+# Damage anywhere is found, and said where
+size=$(wc -c < $INPUT.tpxz)
+corrupt $INPUT.tpxz $((size / 2))
+$PIXZ -T $INPUT.bad 2> $INPUT.err && exit 1
+grep -q '^Block [0-9]* at [0-9]*:' $INPUT.err || exit 1
+corrupt $INPUT.tpxz 7
+$PIXZ -T $INPUT.bad 2> $INPUT.err && exit 1
+grep -q 'header CRC32 is wrong' $INPUT.err || exit 1
+corrupt $INPUT.tpxz $((size - 3))
+$PIXZ -T $INPUT.bad 2> $INPUT.err && exit 1
+grep -q 'Stream footer' $INPUT.err || exit 1
+head -c $((size - 100)) $INPUT.tpxz > $INPUT.bad
+$PIXZ -T $INPUT.bad 2> /dev/null && exit 1
+
+# We need to seek, so pipes are refused
+cat $INPUT.tpxz | $PIXZ -T 2> /dev/null && exit 1
+exit 0
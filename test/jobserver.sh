@@ -0,0 +1,73 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0).in
+FIFO=$PWD/$(basename $0).fifo
+trap "rm -f $INPUT $INPUT.* $FIFO" EXIT
+
+# A jobserver of our own, with two tokens to share
+mkfifo $FIFO || exit 1
+exec 3<> $FIFO
+printf '++' >&3
+# Every token must be back in the pool, and no more
+tokens_back() {
+  read -r -N 2 -t 5 -u 3 tokens && [ "$tokens" = "++" ] || exit 1
+  read -r -N 1 -t 0.2 -u 3 extra && exit 1
+  printf '++' >&3
+}
+
+seq 1 500000 > $INPUT
+export MAKEFLAGS="-j3 --jobserver-auth=fifo:$FIFO"
+$PIXZ -1 -f 0.1 --stats < $INPUT > $INPUT.xz 2> $INPUT.json || exit 1
+tokens_back
+$PIXZ -d < $INPUT.xz | cmp $INPUT - || exit 1
+tokens_back
+
+# Inherited descriptors work too, and closed ones are ignored
+MAKEFLAGS="-j3 --jobserver-auth=3,3" $PIXZ -d < $INPUT.xz | cmp $INPUT - \
+  || exit 1
+tokens_back
+MAKEFLAGS="-j3 --jobserver-fds=8,9" $PIXZ -d < $INPUT.xz | cmp $INPUT - \
+  || exit 1
+# Even when they're the numbers our own input and output files will get
+MAKEFLAGS="-j3 --jobserver-auth=3,4" $PIXZ -1 -f 0.1 --stats $INPUT \
+  $INPUT.out 3>&- 4>&- 2> $INPUT.stats || exit 1
+grep -q '"jobserver"' $INPUT.stats && exit 1
+$PIXZ -d < $INPUT.out | cmp $INPUT - || exit 1
+# And files that make passed down are no jobserver either
+MAKEFLAGS="-j3 --jobserver-auth=5,5" $PIXZ -d --stats < $INPUT.xz \
+  5< $INPUT 2> $INPUT.stats | cmp $INPUT - || exit 1
+grep -q '"jobserver"' $INPUT.stats && exit 1
+
+# Errors give the tokens back too
+head -c 100000 $INPUT.xz > $INPUT.bad
+$PIXZ -d < $INPUT.bad > /dev/null 2>&1 && exit 1
+tokens_back
+
+# With no tokens to spare, the first worker does it all
+read -r -N 2 -t 5 -u 3 tokens || exit 1
+$PIXZ -d < $INPUT.xz | cmp $INPUT - || exit 1
+printf '++' >&3
+$PIXZ -d --no-jobserver --stats < $INPUT.xz 2>&1 > /dev/null \
+  | grep -q '"jobserver"' && exit 1
+
+# Only with a second CPU is there a worker that needs a token
+[ $(getconf _NPROCESSORS_ONLN) -ge 2 ] || exit 0
+grep -q '"jobserver":{"tokens":[1-9]' $INPUT.json || exit 1
+
+# Workers with nothing to do hold no tokens, even while input trickles in
+printf '+' >&3
+BLOCK=104857 # from -1 -f 0.1
+for i in $(seq 0 9); do
+  tail -c +$((i * BLOCK + 1)) $INPUT | head -c $BLOCK
+  sleep 0.4
+done | $PIXZ -1 -f 0.1 > $INPUT.slow &
+sleep 2.1
+read -r -N 3 -t 0.3 -u 3 tokens || exit 1
+printf '+++' >&3
+wait $! || exit 1
+head -c $((10 * BLOCK)) $INPUT | cmp - <($PIXZ -d < $INPUT.slow) || exit 1
+read -r -N 1 -t 5 -u 3 tokens || exit 1 # back to two
+tokens_back
+exit 0
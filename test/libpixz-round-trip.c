@@ -0,0 +1,112 @@
+#include "libpixz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INSIZE (3 * 1024 * 1024 + 17)
+
+static void fail(const char *msg, lzma_ret ret) {
+    fprintf(stderr, "%s: %d\n", msg, (int)ret);
+    exit(1);
+}
+
+// Run a whole buffer through a stream, with awkward buffer sizes
+static size_t run(pixz_stream *strm, const uint8_t *in, size_t insize,
+        uint8_t *out, size_t outcap) {
+    size_t inpos = 0, outpos = 0, step = 1;
+    lzma_ret ret = LZMA_OK;
+    while (ret != LZMA_STREAM_END) {
+        step = (step * 7 + 3) % 70001 + 1;
+        size_t in_chunk = insize - inpos < step ? insize - inpos : step;
+        size_t out_chunk = outcap - outpos < step / 2 + 1
+            ? outcap - outpos : step / 2 + 1;
+        strm->next_in = in + inpos;
+        strm->avail_in = in_chunk;
+        strm->next_out = out + outpos;
+        strm->avail_out = out_chunk;
+
+        ret = pixz_code(strm, inpos + in_chunk == insize
+            ? LZMA_FINISH : LZMA_RUN);
+        if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+            fail("Error coding", ret);
+        inpos += in_chunk - strm->avail_in;
+        outpos += out_chunk - strm->avail_out;
+        if (outpos == outcap && ret != LZMA_STREAM_END)
+            fail("Output too big", ret);
+    }
+    return outpos;
+}
+
+int main(void) {
+    // Compressible, but not trivially so
+    uint8_t *input = malloc(INSIZE);
+    uint32_t seed = 1;
+    for (size_t i = 0; i < INSIZE; ++i) {
+        seed = seed * 1103515245 + 12345;
+        input[i] = (i % 4096 < 2048) ? "pixz"[i % 4] : (seed >> 16) & 0xFF;
+    }
+
+    pixz_options opts;
+    pixz_options_default(&opts);
+    opts.threads = 4;
+    opts.preset = 1;
+    opts.block_fraction = 0.25;
+
+    size_t cap = INSIZE * 2;
+    uint8_t *comp = malloc(cap), *output = malloc(cap);
+
+    // Compress in parallel
+    pixz_stream strm = PIXZ_STREAM_INIT;
+    lzma_ret ret = pixz_encoder(&strm, &opts);
+    if (ret != LZMA_OK)
+        fail("Error creating encoder", ret);
+    size_t compsize = run(&strm, input, INSIZE, comp, cap);
+    pixz_end(&strm);
+
+    // liblzma must agree that it's a valid .xz file
+    uint64_t memlimit = UINT64_MAX;
+    size_t inpos = 0, outpos = 0;
+    ret = lzma_stream_buffer_decode(&memlimit, 0, NULL, comp, &inpos,
+        compsize, output, &outpos, cap);
+    if (ret != LZMA_OK || outpos != INSIZE || memcmp(input, output, INSIZE))
+        fail("liblzma can't decode pixz output", ret);
+
+    // Decompress in parallel
+    ret = pixz_decoder(&strm, &opts);
+    if (ret != LZMA_OK)
+        fail("Error creating decoder", ret);
+    if (run(&strm, comp, compsize, output, cap) != INSIZE
+            || memcmp(input, output, INSIZE))
+        fail("Round trip mismatch", LZMA_OK);
+
+    // A stream from liblzma has unsized blocks, decoded in this thread
+    compsize = 0;
+    ret = lzma_easy_buffer_encode(1, LZMA_CHECK_CRC64, NULL, input, INSIZE,
+        comp, &compsize, cap);
+    if (ret != LZMA_OK)
+        fail("Error encoding with liblzma", ret);
+    ret = pixz_decoder(&strm, &opts);
+    if (ret != LZMA_OK)
+        fail("Error creating decoder", ret);
+    if (run(&strm, comp, compsize, output, cap) != INSIZE
+            || memcmp(input, output, INSIZE))
+        fail("Mismatch decoding liblzma output", LZMA_OK);
+
+    // Truncated input is an error
+    ret = pixz_decoder(&strm, &opts);
+    if (ret != LZMA_OK)
+        fail("Error creating decoder", ret);
+    strm.next_in = comp;
+    strm.avail_in = compsize - 1;
+    strm.next_out = output;
+    strm.avail_out = cap;
+    if (pixz_code(&strm, LZMA_FINISH) != LZMA_DATA_ERROR)
+        fail("Truncated input not detected", LZMA_OK);
+    pixz_end(&strm);
+
+    free(input);
+    free(comp);
+    free(output);
+    return 0;
+}
@@ -0,0 +1,41 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0).in
+trap "rm -f $INPUT $INPUT.xz $INPUT.out $INPUT.limits" EXIT
+
+msecs() {
+  echo $(( $(date +%s%N) / 1000000 ))
+}
+
+seq 1 200000 > $INPUT # about 1.2 MiB
+
+# Reading at 400K/s takes at least two seconds, less the burst allowance
+start=$(msecs)
+$PIXZ -t -1 --max-read-rate 400K < $INPUT > $INPUT.xz || exit 1
+[ $(( $(msecs) - start )) -ge 2500 ] || exit 1
+
+start=$(msecs)
+$PIXZ -d --max-write-rate 400K < $INPUT.xz > $INPUT.out || exit 1
+[ $(( $(msecs) - start )) -ge 2500 ] || exit 1
+cmp $INPUT $INPUT.out || exit 1
+
+$PIXZ -t -1 -f 0.1 --max-cpu 0.5 < $INPUT > $INPUT.xz || exit 1
+$PIXZ -d < $INPUT.xz | cmp $INPUT - || exit 1
+
+# A slow limit from the control file, lifted while running
+echo "read-rate 50K" > $INPUT.limits
+start=$(msecs)
+$PIXZ -t -1 --limits $INPUT.limits < $INPUT > $INPUT.xz &
+pid=$!
+sleep 1
+echo "read-rate 0" > $INPUT.limits
+kill -HUP $pid
+wait $pid || exit 1
+[ $(( $(msecs) - start )) -lt 10000 ] || exit 1
+$PIXZ -d < $INPUT.xz | cmp $INPUT - || exit 1
+
+# Bad settings are refused
+! $PIXZ --max-cpu lots < $INPUT > /dev/null 2>&1 || exit 1
+! $PIXZ --limits /nonexistent < $INPUT > /dev/null 2>&1 || exit 1
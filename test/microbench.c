@@ -0,0 +1,473 @@
+#include "pixz.h"
+
+#include <math.h>
+#include <time.h>
+
+// Microbenchmarks for the pipeline's primitives, the file index codec and
+// the checksum kernels, run by `make check-bench`. Each one runs a primitive alone, and keeps the
+// best of several runs. Settings come from the environment, with defaults:
+//     BENCH_REPEAT      3, runs of each benchmark
+//     BENCH_ITEMS       1000000, items through the queue and reorder buffer
+//     BENCH_NAMES       1000000 10000000, sizes of the file index
+//     BENCH_LEVEL       1, preset used to compress the file index
+//     BENCH_CHECKSUM    64, MiB checksummed by each kernel
+//     BENCH_CSV         check-bench.csv, where results go
+//     BENCH_BASELINE    a CSV from an earlier run, to compare against
+//     BENCH_TOLERANCE   10, the percent slowdown counted as a regression
+
+#define QUEUE_DATA 1
+#define QUEUE_DONE 2
+
+typedef double (*bench_t)(size_t setting, size_t *opsp);
+
+typedef struct {
+    const char *name;
+    const char *setting;
+    double rate; // ops per second
+} result_t;
+
+static size_t gRepeat, gItems, gChecksumSize;
+static uint32_t gLevel;
+static uint64_t gRandom = 88172645463325252ULL;
+static result_t *gResults = NULL;
+static size_t gResultCount = 0;
+
+
+#pragma mark UTILS
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t rnd(void) {
+    gRandom ^= gRandom << 13;
+    gRandom ^= gRandom >> 7;
+    gRandom ^= gRandom << 17;
+    return gRandom;
+}
+
+static size_t env_size(const char *name, size_t def) {
+    const char *v = getenv(name);
+    return v && *v ? strtoull(v, NULL, 10) : def;
+}
+
+static void record(const char *name, const char *setting, size_t ops,
+        double secs, FILE *csv) {
+    double rate = ops / secs;
+    printf("%-18s %-14s %12zu ops %9.3f s %14.0f ops/s\n", name, setting,
+        ops, secs, rate);
+    fflush(stdout);
+    fprintf(csv, "%s,%s,%zu,%.6f,%.0f\n", name, setting, ops, secs, rate);
+
+    if (!(gResults = realloc(gResults, (gResultCount + 1) * sizeof(result_t))))
+        die("Out of memory");
+    gResults[gResultCount++] = (result_t){ .name = xstrdup(name),
+        .setting = xstrdup(setting), .rate = rate };
+}
+
+// The best of several runs, since anything else only adds noise
+static void run(const char *name, const char *setting, bench_t bench,
+        size_t arg, FILE *csv) {
+    double best = INFINITY;
+    size_t ops = 0;
+    for (size_t i = 0; i < gRepeat; ++i) {
+        double secs = bench(arg, &ops);
+        if (secs < best)
+            best = secs;
+    }
+    record(name, setting, ops, best, csv);
+}
+
+
+#pragma mark QUEUE
+
+typedef struct {
+    queue_t *q;
+    size_t count;
+} queue_arg_t;
+
+static void *queue_producer(void *data) {
+    queue_arg_t *a = (queue_arg_t*)data;
+    for (size_t i = 0; i < a->count; ++i)
+        queue_push(a->q, QUEUE_DATA, NULL);
+    return NULL;
+}
+
+static void *queue_consumer(void *data) {
+    queue_arg_t *a = (queue_arg_t*)data;
+    void *p;
+    while (queue_pop(a->q, &p) == QUEUE_DATA)
+        ++a->count;
+    return NULL;
+}
+
+// Producers and consumers, packed as producers * 100 + consumers
+static double bench_queue(size_t setting, size_t *opsp) {
+    size_t np = setting / 100, nc = setting % 100;
+    queue_t *q = queue_new(NULL);
+    pthread_t threads[np + nc];
+    queue_arg_t args[np + nc];
+
+    double start = now();
+    for (size_t i = 0; i < np + nc; ++i) {
+        args[i] = (queue_arg_t){ .q = q,
+            .count = i < np ? gItems / np + (i < gItems % np) : 0 };
+        if (pthread_create(&threads[i], NULL,
+                i < np ? queue_producer : queue_consumer, &args[i]))
+            die("Can't create thread");
+    }
+    for (size_t i = 0; i < np; ++i)
+        pthread_join(threads[i], NULL);
+    for (size_t i = 0; i < nc; ++i)
+        queue_push(q, QUEUE_DONE, NULL);
+    size_t popped = 0;
+    for (size_t i = np; i < np + nc; ++i) {
+        pthread_join(threads[i], NULL);
+        popped += args[i].count;
+    }
+    double secs = now() - start;
+
+    if (popped != gItems)
+        die("Queue lost items");
+    queue_free(q);
+    *opsp = gItems;
+    return secs;
+}
+
+
+#pragma mark REORDER
+
+static void *null_create(void *ctx) {
+    return NULL;
+}
+
+static void null_free(void *data) { }
+
+// Items arrive in windows, either shuffled or with each window's first item
+// last, the writer's worst case. Packed as window * 2 + stalled
+static double bench_reorder(size_t setting, size_t *opsp) {
+    size_t window = setting / 2;
+    bool stalled = setting % 2;
+    pipeline_item_t *items = malloc(gItems * sizeof(pipeline_item_t));
+    size_t *order = malloc(gItems * sizeof(size_t));
+    if (!items || !order)
+        die("Out of memory");
+    for (size_t i = 0; i < gItems; ++i) {
+        items[i] = (pipeline_item_t){ .seq = i };
+        order[i] = i;
+    }
+    for (size_t w = 0; w < gItems; w += window) {
+        size_t n = gItems - w < window ? gItems - w : window;
+        if (stalled) {
+            for (size_t i = 0; i + 1 < n; ++i)
+                order[w + i] = w + i + 1;
+            order[w + n - 1] = w;
+        } else {
+            for (size_t i = n - 1; i > 0; --i) {
+                size_t j = rnd() % (i + 1);
+                size_t t = order[w + i];
+                order[w + i] = order[w + j];
+                order[w + j] = t;
+            }
+        }
+    }
+
+    // Everything is queued first, so only the merging is timed
+    pipeline_t *pl = pipeline_create(null_create, null_free, NULL, 1, 1);
+    if (!pl)
+        die("Can't create pipeline");
+    for (size_t i = 0; i < gItems; ++i)
+        queue_push(pl->mergeq, PIPELINE_ITEM, &items[order[i]]);
+    queue_push(pl->mergeq, PIPELINE_STOP, NULL);
+
+    double start = now();
+    pipeline_item_t *item;
+    size_t next = 0;
+    while ((item = pipeline_merged(pl))) {
+        if (item->seq != next++)
+            die("Items merged out of order");
+    }
+    double secs = now() - start;
+
+    if (next != gItems)
+        die("Reorder buffer lost items");
+    pipeline_destroy(pl);
+    free(order);
+    free(items);
+    *opsp = gItems;
+    return secs;
+}
+
+
+#pragma mark FILE INDEX
+
+static FILE *gIndexFile = NULL;
+
+// Paths like a big source tree's
+static file_index_t *make_names(size_t count) {
+    file_index_t *first = NULL, **last = &first;
+    off_t offset = 0;
+    for (size_t i = 0; i < count; ++i) {
+        file_index_t *f = malloc(sizeof(file_index_t));
+        char name[64];
+        snprintf(name, sizeof(name), "src/d%04zu/s%03zu/file-%08zu.c",
+            i / 100000, i / 1000 % 100, i);
+        f->name = xstrdup(name);
+        f->offset = offset;
+        f->next = NULL;
+        offset += 512 * (2 + rnd() % 16);
+        *last = f;
+        last = &f->next;
+    }
+    return first;
+}
+
+static void index_out(void *ctx, const uint8_t *buf, size_t size) {
+    if (fwrite(buf, size, 1, (FILE*)ctx) != 1)
+        die("Error writing file index");
+}
+
+// A whole .xz stream holding just the file index, for decoding
+static double encode_file(file_index_t *files, FILE *out) {
+    lzma_options_lzma opts;
+    if (lzma_lzma_preset(&opts, gLevel))
+        die("Bad preset");
+    lzma_filter filters[] = { { .id = LZMA_FILTER_LZMA2, .options = &opts },
+        { .id = LZMA_VLI_UNKNOWN } };
+    lzma_stream_flags flags = { .version = 0, .check = LZMA_CHECK_CRC32 };
+    lzma_block block = { .version = 0, .check = flags.check,
+        .filters = filters, .compressed_size = LZMA_VLI_UNKNOWN,
+        .uncompressed_size = LZMA_VLI_UNKNOWN };
+
+    uint8_t buf[LZMA_BLOCK_HEADER_SIZE_MAX];
+    if (lzma_stream_header_encode(&flags, buf) != LZMA_OK)
+        die("Error encoding stream header");
+    index_out(out, buf, LZMA_STREAM_HEADER_SIZE);
+    if (lzma_block_header_size(&block) != LZMA_OK
+            || lzma_block_header_encode(&block, buf) != LZMA_OK)
+        die("Error encoding block header");
+    index_out(out, buf, block.header_size);
+
+    double start = now();
+    const char *err = file_index_write(files, &block, index_out, out);
+    double secs = now() - start;
+    if (err)
+        die("%s", err);
+
+    lzma_index *index = lzma_index_init(NULL);
+    if (!index || lzma_index_append(index, NULL,
+            lzma_block_unpadded_size(&block), block.uncompressed_size))
+        die("Error creating index");
+    lzma_stream strm = LZMA_STREAM_INIT;
+    if (lzma_index_encoder(&strm, index) != LZMA_OK)
+        die("Error encoding index");
+    lzma_ret ret = LZMA_OK;
+    while (ret == LZMA_OK) {
+        uint8_t obuf[CHUNKSIZE];
+        strm.next_out = obuf;
+        strm.avail_out = sizeof(obuf);
+        ret = lzma_code(&strm, LZMA_RUN);
+        if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+            die("Error encoding index");
+        index_out(out, obuf, sizeof(obuf) - strm.avail_out);
+    }
+    lzma_end(&strm);
+
+    flags.backward_size = lzma_index_size(index);
+    if (lzma_stream_footer_encode(&flags, buf) != LZMA_OK)
+        die("Error encoding stream footer");
+    index_out(out, buf, LZMA_STREAM_HEADER_SIZE);
+    lzma_index_end(index, NULL);
+    if (fflush(out))
+        die("Error writing file index");
+    return secs;
+}
+
+static double bench_index_encode(size_t count, size_t *opsp) {
+    file_index_t *files = make_names(count);
+    if (gIndexFile)
+        fclose(gIndexFile);
+    if (!(gIndexFile = tmpfile()))
+        die("Can't create temporary file");
+    double secs = encode_file(files, gIndexFile);
+    file_index_free(files);
+    *opsp = count;
+    return secs;
+}
+
+// Reads what the last encode wrote
+static double bench_index_decode(size_t count, size_t *opsp) {
+    io_t *io = io_open(fileno(gIndexFile));
+    lzma_index *index;
+    const char *err;
+    if (!io)
+        die("Out of memory");
+    if ((err = index_read(io, &index)))
+        die("%s", err);
+
+    file_index_t *files;
+    lzma_vli offset;
+    double start = now();
+    err = file_index_read(io, index, &files, &offset);
+    double secs = now() - start;
+    if (err)
+        die("%s", err);
+
+    size_t found = 0;
+    for (file_index_t *f = files; f; f = f->next)
+        ++found;
+    if (found != count)
+        die("Decoded %zu names, not %zu", found, count);
+    file_index_free(files);
+    lzma_index_end(index, NULL);
+    io_free(io);
+    *opsp = count;
+    return secs;
+}
+
+
+#pragma mark CHECKSUMS
+
+static double bench_checksum(size_t kind, size_t *opsp) {
+    static uint8_t *data = NULL;
+    if (!data) {
+        if (!(data = malloc(gChecksumSize)))
+            die("Out of memory");
+        for (size_t i = 0; i < gChecksumSize; ++i)
+            data[i] = rnd();
+    }
+
+    volatile uint64_t sink; // so the work isn't optimized away
+    double start = now();
+    switch (kind) {
+        case CHECKSUM_CRC32:
+            sink = checksum_crc32(data, gChecksumSize, 0);
+            break;
+        case CHECKSUM_CRC64:
+            sink = checksum_crc64(data, gChecksumSize, 0);
+            break;
+        case CHECKSUM_SHA256: {
+            sha256_ctx c;
+            uint8_t out[32];
+            sha256_init(&c);
+            sha256_update(&c, data, gChecksumSize);
+            sha256_final(&c, out);
+            sink = out[0];
+            break;
+        }
+    }
+    (void)sink;
+    *opsp = gChecksumSize;
+    return now() - start;
+}
+
+
+#pragma mark MAIN
+
+// Compare with the baseline, matching rows on benchmark and setting
+static bool compare(const char *path, double tolerance) {
+    FILE *in = fopen(path, "r");
+    if (!in)
+        die("Can't open baseline %s", path);
+    printf("\nCompared to %s:\n", path);
+    bool ok = true;
+    char line[256], name[64], setting[64];
+    double rate;
+    while (fgets(line, sizeof(line), in)) {
+        if (sscanf(line, "%63[^,],%63[^,],%*[^,],%*[^,],%lf", name, setting,
+                &rate) != 3)
+            continue; // the header
+        for (size_t i = 0; i < gResultCount; ++i) {
+            result_t *r = &gResults[i];
+            if (strcmp(r->name, name) || strcmp(r->setting, setting))
+                continue;
+            double change = (r->rate - rate) / rate * 100;
+            bool slow = change < -tolerance;
+            ok = ok && !slow;
+            printf("%-18s %-14s %+6.1f%%%s\n", name, setting, change,
+                slow ? "  REGRESSION" : "");
+        }
+    }
+    fclose(in);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    gRepeat = env_size("BENCH_REPEAT", 3);
+    gItems = env_size("BENCH_ITEMS", 1000000);
+    gLevel = env_size("BENCH_LEVEL", 1);
+    gChecksumSize = env_size("BENCH_CHECKSUM", 64) << 20;
+    const char *names = getenv("BENCH_NAMES");
+    const char *path = getenv("BENCH_CSV");
+    if (!names || !*names)
+        names = "1000000 10000000";
+    if (!path || !*path)
+        path = "check-bench.csv";
+    if (!gRepeat || !gItems)
+        die("BENCH_REPEAT and BENCH_ITEMS must be positive");
+
+    FILE *csv = fopen(path, "w");
+    if (!csv)
+        die("Can't open %s", path);
+    fprintf(csv, "benchmark,setting,ops,seconds,ops_per_sec\n");
+
+    static const size_t queues[][2] = { { 1, 1 }, { 1, 4 }, { 4, 1 },
+        { 4, 4 }, { 16, 16 } };
+    for (size_t i = 0; i < sizeof(queues) / sizeof(*queues); ++i) {
+        char setting[32];
+        snprintf(setting, sizeof(setting), "%zup-%zuc", queues[i][0],
+            queues[i][1]);
+        run("queue", setting, bench_queue, queues[i][0] * 100 + queues[i][1],
+            csv);
+    }
+
+    static const size_t windows[] = { 1, 16, 256 };
+    for (size_t i = 0; i < sizeof(windows) / sizeof(*windows); ++i) {
+        char setting[32];
+        snprintf(setting, sizeof(setting), "shuffled-%zu", windows[i]);
+        run("reorder", setting, bench_reorder, windows[i] * 2, csv);
+        if (windows[i] == 1)
+            continue;
+        snprintf(setting, sizeof(setting), "stalled-%zu", windows[i]);
+        run("reorder", setting, bench_reorder, windows[i] * 2 + 1, csv);
+    }
+
+    for (const char *p = names; *p; ) {
+        char *end;
+        size_t count = strtoull(p, &end, 10);
+        if (end == p)
+            die("Bad BENCH_NAMES");
+        char setting[32];
+        snprintf(setting, sizeof(setting), "%zu", count);
+        run("file-index-encode", setting, bench_index_encode, count, csv);
+        run("file-index-decode", setting, bench_index_decode, count, csv);
+        for (p = end; *p == ' '; ++p)
+            ;
+    }
+
+    // Bytes per second, with whichever kernels the CPU has, then without
+    static const char *sums[] = { "crc32", "crc64", "sha256" };
+    for (size_t i = 0; gChecksumSize && i < sizeof(sums) / sizeof(*sums); ++i) {
+        checksum_hardware(true);
+        const char *kernel = checksum_kernel(i);
+        run(sums[i], kernel, bench_checksum, i, csv);
+        checksum_hardware(false);
+        if (strcmp(kernel, checksum_kernel(i)) != 0)
+            run(sums[i], checksum_kernel(i), bench_checksum, i, csv);
+    }
+    checksum_hardware(true);
+    if (gIndexFile)
+        fclose(gIndexFile);
+    if (fclose(csv))
+        die("Error writing %s", path);
+
+    const char *baseline = getenv("BENCH_BASELINE");
+    if (baseline && *baseline) {
+        const char *tol = getenv("BENCH_TOLERANCE");
+        if (!compare(baseline, tol && *tol ? atof(tol) : 10))
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+#!/bin/bash
+
+# The training run for `make pgo`: what pixz usually does, with an
+# instrumented build, so the compiler knows which paths are hot. Each part
+# checks its output, since a profile of failures is no use.
+
+PIXZ=${PIXZ:-../src/pixz}
+UTIL=${BENCH_UTIL:-./bench-util}
+DIR=${PGO_DIR:-pgo.dir}
+
+trap "rm -rf $DIR" EXIT
+mkdir -p $DIR || exit 1
+
+round_trip() {
+  local name=$1
+  shift
+  $PIXZ "$@" < $DIR/$name > $DIR/$name.xz || exit 1
+  $PIXZ -d < $DIR/$name.xz > $DIR/$name.out || exit 1
+  cmp -s $DIR/$name $DIR/$name.out || { echo "Round trip failed" >&2; exit 1; }
+}
+
+$UTIL gen text 24M 1 > $DIR/text || exit 1
+$UTIL gen binary 8M 2 > $DIR/binary || exit 1
+$UTIL gen random 4M 3 > $DIR/random || exit 1
+$UTIL tar 20000 4 > $DIR/tarball || exit 1
+
+# Compression at the usual levels, of plain files and tarballs
+round_trip text -t
+round_trip text -t -1
+round_trip binary -t
+round_trip random -t -0
+round_trip tarball
+round_trip tarball -9 -f 0.5
+
+# Listing and random access, through the file index
+archive=$DIR/tarball.xz
+$PIXZ -l --no-daemon < $archive > $DIR/members || exit 1
+[ $(wc -l < $DIR/members) -eq 20000 ] || exit 1
+$PIXZ -t -l < $archive > /dev/null || exit 1
+members=$(awk 'NR % 997 == 1' $DIR/members)
+$PIXZ --no-daemon -x $members < $archive | tar t > /dev/null || exit 1
+for m in $(echo "$members" | head -5); do
+  $PIXZ --no-daemon --member $m < $archive > /dev/null || exit 1
+done
+$PIXZ --no-daemon --range 1000000:100000 < $archive > /dev/null || exit 1
+
+# Streaming, where the index can't be read first, as pixz will mention
+cat $DIR/text.xz | $PIXZ -d 2> /dev/null | cmp -s - $DIR/text || exit 1
+cat $archive | $PIXZ -d > /dev/null 2>&1 || exit 1
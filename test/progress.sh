@@ -0,0 +1,29 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0).in
+trap "rm -f $INPUT $INPUT.fifo $INPUT.xz $INPUT.out $INPUT.err" EXIT
+
+# Hold the input open, so pixz is still running when we ask for a report
+mkfifo $INPUT.fifo || exit 1
+$PIXZ -t -1 < $INPUT.fifo > $INPUT.xz 2> $INPUT.err &
+pid=$!
+exec 3> $INPUT.fifo
+seq 1 200000 > $INPUT
+cat $INPUT >&3 # once pixz has taken this, it's ready for signals
+for i in $(seq 1 50); do
+  grep -q "pixz: compress" $INPUT.err && break
+  kill -USR1 $pid
+  sleep 0.1
+done
+exec 3>&-
+wait $pid || exit 1
+grep -q "^pixz: compress, .* in, .* out.*read .*/s, write .*/s" $INPUT.err \
+  || exit 1
+$PIXZ -d < $INPUT.xz | cmp - $INPUT || exit 1
+
+# With a seekable input, the index gives the size and so the progress
+$PIXZ -d --progress -i $INPUT.xz -o $INPUT.out 2> $INPUT.err || exit 1
+cmp $INPUT $INPUT.out || exit 1
+grep -q "^pixz: decompress [0-9]*%, .* in, .* out" $INPUT.err || exit 1
@@ -0,0 +1,26 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+DIR=$(basename $0).dir
+TARBALL=$DIR.tar
+COMPRESSED=$TARBALL.xz
+trap "rm -rf $DIR $TARBALL $COMPRESSED" EXIT
+
+mkdir -p $DIR/sub || exit 1
+for i in $(seq 1 300); do cat $0; done > $DIR/text
+head -c 300000 /dev/urandom > $DIR/random
+: > $DIR/empty
+long=$DIR/sub/$(printf 'long-name-%.0s' $(seq 1 12))
+seq 1 20000 > $long
+tar -cf $TARBALL $DIR || exit 1
+
+$PIXZ -0 -f 0.25 $TARBALL $COMPRESSED || exit 1
+./reader-check $COMPRESSED $TARBALL \
+  $DIR/text $DIR/text $DIR/random $DIR/random $DIR/empty $DIR/empty \
+  $long $long || exit 1
+
+# Aligned archives have filler blocks
+$PIXZ -0 -f 0.25 --align 4096 $TARBALL $COMPRESSED.aligned || exit 1
+mv $COMPRESSED.aligned $COMPRESSED
+./reader-check $COMPRESSED $TARBALL $DIR/text $DIR/text || exit 1
@@ -0,0 +1,151 @@
+#include "libpixz.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Compare libpixz's random access against the uncompressed data:
+//     reader-check ARCHIVE PLAIN [MEMBER FILE]...
+
+#define READERS 4
+#define RANDOM_READS 300
+
+static uint8_t *gPlain;
+static size_t gPlainSize;
+
+static void fail(const char *msg, lzma_ret ret) {
+    fprintf(stderr, "%s: %d\n", msg, (int)ret);
+    exit(1);
+}
+
+static uint8_t *slurp(const char *path, size_t *sizep) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        fail(path, LZMA_OK);
+    fseek(f, 0, SEEK_END);
+    *sizep = ftell(f);
+    rewind(f);
+    uint8_t *buf = malloc(*sizep + 1);
+    if (fread(buf, 1, *sizep, f) != *sizep)
+        fail("Error reading file", LZMA_OK);
+    fclose(f);
+    return buf;
+}
+
+static void check_read(pixz_reader *r, uint64_t offset, size_t len,
+        uint8_t *buf) {
+    size_t rd, want = offset >= gPlainSize ? 0
+        : (gPlainSize - offset < len ? gPlainSize - offset : len);
+    lzma_ret ret = pixz_reader_read(r, offset, buf, len, &rd);
+    if (ret != LZMA_OK)
+        fail("Error reading", ret);
+    if (rd != want || memcmp(buf, gPlain + offset, rd))
+        fail("Read mismatch", LZMA_OK);
+}
+
+static void *random_reads(void *data) {
+    pixz_reader *r = data;
+    uint8_t *buf = malloc(300000);
+    unsigned seed = (unsigned)(uintptr_t)&buf;
+    for (int i = 0; i < RANDOM_READS; ++i) {
+        uint64_t offset = (uint64_t)rand_r(&seed) % (gPlainSize + 1000);
+        check_read(r, offset, rand_r(&seed) % 300000, buf);
+    }
+    free(buf);
+    return NULL;
+}
+
+static void check_member(pixz_reader *r, const char *name, const char *path) {
+    size_t size;
+    uint8_t *want = slurp(path, &size);
+    pixz_member *m;
+    lzma_ret ret = pixz_member_open(r, name, &m);
+    if (ret != LZMA_OK || !m)
+        fail("Error opening member", ret);
+    if (pixz_member_size(m) != size)
+        fail("Member size mismatch", LZMA_OK);
+
+    uint8_t *got = malloc(size + 1);
+    size_t pos = 0, rd;
+    for (size_t step = 1; pos <= size; pos += rd, step = step * 5 + 3) {
+        ret = pixz_member_read(m, pos, got + pos, step % 100000 + 1, &rd);
+        if (ret != LZMA_OK)
+            fail("Error reading member", ret);
+        if (rd == 0)
+            break;
+    }
+    if (pos != size || memcmp(got, want, size))
+        fail("Member mismatch", LZMA_OK);
+
+    pixz_member_close(m);
+    free(got);
+    free(want);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3 || argc % 2 == 0)
+        fail("Usage: reader-check ARCHIVE PLAIN [MEMBER FILE]...", LZMA_OK);
+    gPlain = slurp(argv[2], &gPlainSize);
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1)
+        fail(argv[1], LZMA_OK);
+
+    pixz_options opts;
+    pixz_options_default(&opts);
+    for (int pass = 0; pass < 2; ++pass) {
+        // The second pass has a cache too small to hold more than a block
+        opts.threads = pass ? 2 : 4;
+        opts.cache_size = pass ? 1 : 0;
+
+        pixz_reader *r;
+        lzma_ret ret = pixz_reader_open(&r, fd, &opts);
+        if (ret != LZMA_OK)
+            fail("Error opening reader", ret);
+        if (pixz_reader_size(r) != gPlainSize)
+            fail("Size mismatch", LZMA_OK);
+
+        // Sequential, with readahead
+        uint8_t *buf = malloc(10007);
+        for (uint64_t off = 0; off < gPlainSize + 10007; off += 10007)
+            check_read(r, off, 10007, buf);
+        free(buf);
+
+        pthread_t threads[READERS];
+        for (int i = 0; i < READERS; ++i)
+            pthread_create(&threads[i], NULL, random_reads, r);
+        for (int i = 0; i < READERS; ++i)
+            pthread_join(threads[i], NULL);
+
+        for (int i = 3; i < argc; i += 2)
+            check_member(r, argv[i], argv[i + 1]);
+        pixz_member *m;
+        if (pixz_member_open(r, "no/such/member", &m) != LZMA_OK || m)
+            fail("Found a missing member", LZMA_OK);
+
+        pixz_reader_close(r);
+    }
+
+    // Two readers sharing a small cache
+    opts.cache_size = 1;
+    pixz_cache *cache = pixz_cache_new(&opts);
+    pixz_reader *shared[2];
+    pthread_t threads[2];
+    for (int i = 0; i < 2; ++i) {
+        lzma_ret ret = pixz_reader_open_cache(&shared[i], fd, cache);
+        if (ret != LZMA_OK)
+            fail("Error opening shared reader", ret);
+        pthread_create(&threads[i], NULL, random_reads, shared[i]);
+    }
+    for (int i = 0; i < 2; ++i) {
+        pthread_join(threads[i], NULL);
+        pixz_reader_close(shared[i]);
+    }
+    pixz_cache_free(cache);
+
+    close(fd);
+    free(gPlain);
+    return 0;
+}
@@ -0,0 +1,46 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+DIR=$(basename $0).dir
+TARBALL=$DIR.tar
+COMPRESSED=$TARBALL.xz
+trap "rm -rf $DIR $TARBALL $COMPRESSED $DIR.out $DIR.stats" EXIT
+
+mkdir -p $DIR || exit 1
+for i in $(seq 1 40); do
+  head -c 100000 /dev/urandom > $DIR/random$i
+  seq 1 20000 > $DIR/seq$i
+done
+tar -cf $TARBALL $DIR || exit 1
+$PIXZ -0 -f 0.1 $TARBALL $COMPRESSED || exit 1
+
+# Every read takes 50ms, and there are hundreds of blocks, so each command
+# should need only a handful of reads
+export PIXZ_IO_LATENCY=50
+reads() {
+  local n
+  n=$(grep -o '"input":{"reads":[0-9]*' $DIR.stats | tail -1 | grep -o '[0-9]*$')
+  if [ -z "$n" ] || [ $n -gt 20 ]; then
+    echo "Reads weren't coalesced for $1: ${n:-no} reads" >&2
+    exit 1
+  fi
+}
+
+$PIXZ --stats -d -i $COMPRESSED -o $DIR.out 2> $DIR.stats || exit 1
+cmp $DIR.out $TARBALL || exit 1
+reads -d
+
+$PIXZ -l --no-daemon $COMPRESSED | grep -q $DIR/seq40 || exit 1
+$PIXZ --stats --no-daemon -x $DIR/random7 $DIR/seq30 -i $COMPRESSED \
+  2> $DIR.stats | tar -xO $DIR/random7 | cmp - $DIR/random7 || exit 1
+reads -x
+
+# Random access, through libpixz
+$PIXZ --stats --no-daemon --member $DIR/seq1 < $COMPRESSED 2> $DIR.stats \
+  | cmp - $DIR/seq1 || exit 1
+reads --member
+$PIXZ --stats --no-daemon --range 1000000:300000 < $COMPRESSED > $DIR.out \
+  2> $DIR.stats || exit 1
+tail -c +1000001 $TARBALL | head -c 300000 | cmp - $DIR.out || exit 1
+reads --range
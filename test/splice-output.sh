@@ -0,0 +1,60 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0).in
+DIR=$(basename $0).dir
+trap "rm -rf $INPUT $INPUT.* $DIR" EXIT
+
+seq 1 1000000 > $INPUT
+size=$(wc -c < $INPUT)
+$PIXZ -1 -f 0.1 < $INPUT > $INPUT.xz || exit 1
+
+# Decompressing into a pipe splices, where the system has vmsplice
+$PIXZ -d --stats < $INPUT.xz 2> $INPUT.json | cmp $INPUT - || exit 1
+grep -q "\"output\":{\"bytes\":$size," $INPUT.json || exit 1
+if [ "$(uname)" = Linux ]; then
+  grep -q "\"spliced\":$size}" $INPUT.json || exit 1
+fi
+
+# A slow reader must still see each block as it was, not a later one
+$PIXZ -d < $INPUT.xz | (sleep 1; cat) | cmp $INPUT - || exit 1
+cat $INPUT.xz | $PIXZ -d 2> /dev/null | (sleep 1; cat) | cmp $INPUT - \
+  || exit 1
+
+# Nor one that passes the pages on with splice(2), still holding them
+if python3 -c 'import os; os.splice' 2> /dev/null; then
+  cat $INPUT.xz | $PIXZ -d 2> /dev/null | python3 -c '
+import fcntl, os
+try:
+    fcntl.fcntl(1, fcntl.F_SETPIPE_SZ, 1 << 20)
+except (AttributeError, OSError):
+    pass
+while os.splice(0, 1, 1 << 16):
+    pass' | (sleep 1; cat) | cmp $INPUT - || exit 1
+fi
+
+# Files, and --no-splice, are written as usual
+$PIXZ -d --stats < $INPUT.xz > $INPUT.out 2> $INPUT.json || exit 1
+cmp $INPUT $INPUT.out || exit 1
+grep -q '"spliced":0}' $INPUT.json || exit 1
+$PIXZ -d --stats --no-splice < $INPUT.xz 2> $INPUT.json | cmp $INPUT - \
+  || exit 1
+grep -q '"spliced":0}' $INPUT.json || exit 1
+
+# Tarballs are written a piece at a time, whole or extracting from them
+mkdir -p $DIR || exit 1
+seq 1 200000 > $DIR/a
+seq 1 300000 | tac > $DIR/b
+seq 1 100 > $DIR/c
+tar -cf $INPUT.tar $DIR || exit 1
+$PIXZ -1 -f 0.1 < $INPUT.tar > $INPUT.tpxz || exit 1
+$PIXZ -d < $INPUT.tpxz | (sleep 1; cat) | cmp $INPUT.tar - || exit 1
+$PIXZ --no-daemon -x $DIR/b $DIR/c < $INPUT.tpxz | (sleep 1; tar -xO) \
+  > $INPUT.out || exit 1
+cat $DIR/b $DIR/c | cmp $INPUT.out - || exit 1
+
+# A reader that goes away early doesn't leave us waiting
+timeout 60 $PIXZ -d < $INPUT.xz 2> /dev/null | head -c 1000 > /dev/null
+[ ${PIPESTATUS[0]} -ne 124 ] || exit 1
+exit 0
@@ -0,0 +1,29 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0).in
+trap "rm -f $INPUT $INPUT.xz $INPUT.out $INPUT.json" EXIT
+
+seq 1 300000 > $INPUT
+size=$(wc -c < $INPUT)
+
+$PIXZ -1 -f 0.1 -p 4 --stats < $INPUT > $INPUT.xz 2> $INPUT.json || exit 1
+[ $(wc -l < $INPUT.json) -eq 1 ] || exit 1
+grep -q '"op":"compress","final":true' $INPUT.json || exit 1
+grep -q "\"read\":{\"blocks\":[0-9]*,\"bytes_in\":$size," $INPUT.json || exit 1
+grep -q '"head_of_line_stall":' $INPUT.json || exit 1
+
+$PIXZ -d --stats < $INPUT.xz > $INPUT.out 2> $INPUT.json || exit 1
+cmp $INPUT $INPUT.out || exit 1
+grep -q '"op":"decompress","final":true' $INPUT.json || exit 1
+grep -q "\"write\":{\"blocks\":[0-9]*,\"bytes_in\":$size," $INPUT.json || exit 1
+
+# Hardware counters may well be unavailable, but the report must still hold
+$PIXZ -1 -f 0.1 --counters < $INPUT > $INPUT.xz 2> $INPUT.json || exit 1
+grep -q '"counters":{"read":{"cpu_time":' $INPUT.json || exit 1
+
+# Listing has no pipeline, but still counts what it read
+$PIXZ -l --no-daemon --stats < $INPUT.xz > /dev/null 2> $INPUT.json || exit 1
+grep -q '"op":"list".*"input":{"reads":[1-9][0-9]*,"bytes":[1-9]' \
+  $INPUT.json || exit 1
@@ -0,0 +1,29 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0).in
+trap "rm -f $INPUT $INPUT.* " EXIT
+
+# Decompressing from a pipe, which can't use the index, of streams with
+# blocks smaller and larger than what's read at once
+seq 1 300 > $INPUT.small
+seq 1 400000 > $INPUT.large
+$PIXZ -t < $INPUT.small > $INPUT.small.xz || exit 1
+$PIXZ -t -1 -f 0.05 < $INPUT.large > $INPUT.large.xz || exit 1
+cat $INPUT.large $INPUT.small $INPUT.small $INPUT.large > $INPUT
+
+cat $INPUT.large.xz $INPUT.small.xz $INPUT.small.xz $INPUT.large.xz \
+  | $PIXZ -d 2> /dev/null | cmp $INPUT - || exit 1
+
+# Blocks without sizes, as xz writes them, and padding between streams
+if which xz &> /dev/null; then
+  xz -c < $INPUT.large > $INPUT.unsized.xz || exit 1
+  cat $INPUT.large $INPUT.small > $INPUT
+  (cat $INPUT.unsized.xz; printf '\0\0\0\0\0\0\0\0'; cat $INPUT.small.xz) \
+    | $PIXZ -d 2> /dev/null | cmp $INPUT - || exit 1
+fi
+
+# Truncated input is an error
+head -c 20000 $INPUT.large.xz | $PIXZ -d > /dev/null 2>&1 && exit 1
+exit 0
@@ -0,0 +1,19 @@
+#!/bin/bash
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0).in
+trap "rm -f $INPUT $INPUT.xz $INPUT.out $INPUT.json" EXIT
+
+seq 1 300000 > $INPUT
+
+$PIXZ -1 -f 0.1 -p 4 --trace $INPUT.json < $INPUT > $INPUT.xz || exit 1
+for span in read encode write; do
+  grep -q "\"name\":\"$span\",\"ph\":\"X\"" $INPUT.json || exit 1
+done
+grep -q '"args":{"name":"worker 0"}' $INPUT.json || exit 1
+tail -n 1 $INPUT.json | grep -q '^]}$' || exit 1
+
+$PIXZ -d --trace $INPUT.json < $INPUT.xz > $INPUT.out || exit 1
+cmp $INPUT $INPUT.out || exit 1
+grep -q '"name":"decode","ph":"X"' $INPUT.json || exit 1